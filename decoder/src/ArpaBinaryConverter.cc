@@ -0,0 +1,698 @@
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <unistd.h>
+
+#include "ArpaBinaryConverter.hh"
+#include "ArpaReader.hh"
+#include "Endian.hh"
+#include "TreeGram.hh"
+#include "misc/str.hh"
+
+// The input is read and given to the workers in blocks of this size.
+static const size_t block_size = 4 << 20;
+
+// Nodes are written in batches of this size.
+static const size_t node_batch_size = 1 << 16;
+
+static bool
+gram_less(const int *a, const int *b, int order)
+{
+  for (int i = 0; i < order; i++) {
+    if (a[i] != b[i])
+      return a[i] < b[i];
+  }
+  return false;
+}
+
+static bool
+is_space(char c)
+{
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static const char*
+skip_space(const char *p, const char *end)
+{
+  while (p < end && is_space(*p))
+    p++;
+  return p;
+}
+
+void
+ArpaBinaryConverter::GramBuffer::clear()
+{
+  std::vector<int>().swap(words);
+  std::vector<float>().swap(log_probs);
+  std::vector<float>().swap(back_offs);
+}
+
+void
+ArpaBinaryConverter::GramBuffer::sort()
+{
+  struct Less {
+    const int *words;
+    int order;
+    bool operator()(unsigned int a, unsigned int b) const {
+      return gram_less(words + (size_t)a * order,
+                       words + (size_t)b * order, order);
+    }
+  };
+
+  size_t size = num_grams();
+  std::vector<unsigned int> indices(size);
+  for (size_t i = 0; i < size; i++)
+    indices[i] = i;
+  Less less = { words.data(), order };
+  std::sort(indices.begin(), indices.end(), less);
+
+  std::vector<int> sorted_words(words.size());
+  std::vector<float> sorted_log_probs(size);
+  std::vector<float> sorted_back_offs(size);
+  for (size_t i = 0; i < size; i++) {
+    std::copy(words.begin() + (size_t)indices[i] * order,
+              words.begin() + (size_t)(indices[i] + 1) * order,
+              sorted_words.begin() + i * order);
+    sorted_log_probs[i] = log_probs[indices[i]];
+    sorted_back_offs[i] = back_offs[indices[i]];
+  }
+  words.swap(sorted_words);
+  log_probs.swap(sorted_log_probs);
+  back_offs.swap(sorted_back_offs);
+}
+
+/// Reads the sorted runs and buffers of one order in parallel, and returns
+/// the grams in sorted order.
+class ArpaBinaryConverter::GramStream {
+public:
+  GramStream(int order, const std::vector<FILE*> &runs,
+             const std::vector<const GramBuffer*> &buffers,
+             const Vocabulary &vocabulary)
+    : m_order(order), m_vocabulary(vocabulary), m_gram(order),
+      m_has_gram(false)
+  {
+    for (int i = 0; i < (int)runs.size(); i++) {
+      if (fseek(runs[i], 0, SEEK_SET) != 0)
+        throw Error("ArpaBinaryConverter: seek failed in a temporary file");
+      m_sources.push_back(Source(runs[i], NULL, order));
+    }
+    for (int i = 0; i < (int)buffers.size(); i++)
+      m_sources.push_back(Source(NULL, buffers[i], order));
+    for (int i = 0; i < (int)m_sources.size(); i++)
+      if (advance(m_sources[i]))
+        m_heap.push_back(i);
+    std::make_heap(m_heap.begin(), m_heap.end(), Greater(this));
+  }
+
+  /// \brief Moves to the next gram. Returns false at the end.
+  bool next()
+  {
+    if (m_heap.empty())
+      return false;
+    std::pop_heap(m_heap.begin(), m_heap.end(), Greater(this));
+    Source &source = m_sources[m_heap.back()];
+    if (m_has_gram &&
+        !gram_less(&m_gram[0], &source.words[0], m_order))
+    {
+      std::string gram;
+      for (int i = 0; i < m_order; i++)
+        gram += " " + m_vocabulary.word(source.words[i]);
+      throw Error("ArpaBinaryConverter: duplicate gram:" + gram);
+    }
+    m_gram.swap(source.words);
+    m_has_gram = true;
+    log_prob = source.log_prob;
+    back_off = source.back_off;
+    source.words.resize(m_order);
+    if (advance(source))
+      std::push_heap(m_heap.begin(), m_heap.end(), Greater(this));
+    else
+      m_heap.pop_back();
+    return true;
+  }
+
+  const int *gram() const { return &m_gram[0]; }
+  float log_prob;
+  float back_off;
+
+private:
+  struct Source {
+    Source(FILE *file, const GramBuffer *buffer, int order)
+      : file(file), buffer(buffer), pos(0), words(order) { }
+    FILE *file;
+    const GramBuffer *buffer;
+    size_t pos;
+    std::vector<int> words;
+    float log_prob;
+    float back_off;
+  };
+
+  struct Greater {
+    Greater(GramStream *stream) : stream(stream) { }
+    bool operator()(int a, int b) const {
+      return gram_less(&stream->m_sources[b].words[0],
+                       &stream->m_sources[a].words[0], stream->m_order);
+    }
+    GramStream *stream;
+  };
+
+  bool advance(Source &source)
+  {
+    if (source.buffer) {
+      const GramBuffer &buffer = *source.buffer;
+      if (source.pos >= buffer.num_grams())
+        return false;
+      std::copy(buffer.words.begin() + source.pos * m_order,
+                buffer.words.begin() + (source.pos + 1) * m_order,
+                source.words.begin());
+      source.log_prob = buffer.log_probs[source.pos];
+      source.back_off = buffer.back_offs[source.pos];
+      source.pos++;
+      return true;
+    }
+
+    if (fread(&source.words[0], sizeof(int), m_order, source.file) !=
+        (size_t)m_order)
+    {
+      if (ferror(source.file))
+        throw Error("ArpaBinaryConverter: read error in a temporary file");
+      return false;
+    }
+    if (fread(&source.log_prob, sizeof(float), 1, source.file) != 1 ||
+        fread(&source.back_off, sizeof(float), 1, source.file) != 1)
+      throw Error("ArpaBinaryConverter: truncated temporary file");
+    return true;
+  }
+
+  int m_order;
+  const Vocabulary &m_vocabulary;
+  std::vector<Source> m_sources;
+  std::vector<int> m_heap; //!< Sources that have a gram, smallest first.
+  std::vector<int> m_gram;
+  bool m_has_gram;
+};
+
+ArpaBinaryConverter::ArpaBinaryConverter()
+  : m_num_threads(1),
+    m_memory_budget((size_t)1 << 30),
+    m_temp_dir("/tmp"),
+    m_interpolated(false),
+    m_next_order(2),
+    m_input_done(false)
+{
+}
+
+ArpaBinaryConverter::~ArpaBinaryConverter()
+{
+  close_runs();
+}
+
+void
+ArpaBinaryConverter::convert(FILE *in, FILE *out)
+{
+  if (m_num_threads < 1)
+    throw Error("ArpaBinaryConverter: invalid number of threads");
+
+  m_vocabulary.reset();
+  m_word_indices.clear();
+  close_runs();
+  try {
+    read_unigrams(in);
+    read_higher_orders(in);
+    write_binary(out);
+  }
+  catch (...) {
+    close_runs();
+    throw;
+  }
+  close_runs();
+  m_buffers.clear();
+}
+
+void
+ArpaBinaryConverter::read_unigrams(FILE *in)
+{
+  ArpaReader reader(&m_vocabulary);
+  std::string line;
+  reader.read_header(in, m_interpolated, line);
+  m_counts = reader.counts;
+  if (m_counts.empty())
+    throw Error("ArpaBinaryConverter: no gram counts in the header");
+
+  // The default OOV unigram is the same as in TreeGram::reserve_nodes().
+  m_unigram_log_probs.assign(1, -99);
+  m_unigram_back_offs.assign(1, 0);
+  bool oov_read = false;
+  std::vector<int> gram;
+  float log_prob, back_off;
+  for (int i = 0; i < m_counts[0]; i++) {
+    int num_words = m_vocabulary.num_words();
+    if (!reader.next_gram(in, line, gram, log_prob, back_off))
+      throw Error("ArpaBinaryConverter: unexpected end of unigrams");
+    int word = gram[0];
+    if (word == 0 && !oov_read)
+      oov_read = true;
+    else if (word != num_words)
+      throw Error("ArpaBinaryConverter: duplicate unigram " +
+                  m_vocabulary.word(word));
+    m_unigram_log_probs.resize(m_vocabulary.num_words());
+    m_unigram_back_offs.resize(m_vocabulary.num_words());
+    m_unigram_log_probs[word] = log_prob;
+    m_unigram_back_offs[word] = back_off;
+  }
+
+  for (int i = 0; i < m_vocabulary.num_words(); i++)
+    m_word_indices[m_vocabulary.word(i)] = i;
+}
+
+void
+ArpaBinaryConverter::read_higher_orders(FILE *in)
+{
+  int max_order = m_counts.size();
+  m_next_order = 2;
+  m_runs.assign(max_order + 1, std::vector<FILE*>());
+  m_buffers.assign(m_num_threads, std::vector<GramBuffer>());
+  m_thread_counts.assign(m_num_threads, std::vector<long>(max_order + 1, 0));
+  m_queue.clear();
+  m_input_done = false;
+  m_error.clear();
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < m_num_threads; t++)
+    threads.push_back(std::thread(&ArpaBinaryConverter::worker, this, t));
+
+  // The blocks end at line boundaries.  The rest of the last line is
+  // carried over to the next block.
+  try {
+    std::vector<char> buffer(block_size);
+    std::string carry;
+    int order = 0;
+    bool end = false;
+    while (!end) {
+      size_t bytes = fread(&buffer[0], 1, block_size, in);
+      if (bytes == 0) {
+        if (ferror(in))
+          throw Error("ArpaBinaryConverter: read error");
+        end = split_blocks(carry, order);
+        break;
+      }
+      std::string text;
+      text.swap(carry);
+      text.append(&buffer[0], bytes);
+      size_t last = text.rfind('\n');
+      if (last == std::string::npos) {
+        carry.swap(text);
+        continue;
+      }
+      carry.assign(text, last + 1, std::string::npos);
+      text.resize(last + 1);
+      end = split_blocks(text, order);
+    }
+    if (!end)
+      throw Error("ArpaBinaryConverter: unexpected end of file, "
+                  "\\end\\ expected");
+  }
+  catch (std::exception &e) {
+    set_error(e.what());
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_input_done = true;
+    m_queue_changed.notify_all();
+  }
+  for (int t = 0; t < m_num_threads; t++)
+    threads[t].join();
+  if (!m_error.empty())
+    throw Error(m_error);
+
+  for (int order = 2; order <= max_order; order++) {
+    long count = 0;
+    for (int t = 0; t < m_num_threads; t++)
+      count += m_thread_counts[t][order];
+    if (count != m_counts[order - 1])
+      throw Error(str::fmt(256, "ArpaBinaryConverter: the header has %d "
+                           "%d-grams, but %ld were read", m_counts[order - 1],
+                           order, count));
+  }
+}
+
+bool
+ArpaBinaryConverter::split_blocks(const std::string &text, int &order)
+{
+  // Only the section headers start with a backslash.
+  size_t start = 0;
+  size_t pos = (!text.empty() && text[0] == '\\') ? 0 : text.find("\n\\");
+  while (pos != std::string::npos) {
+    if (text[pos] == '\n')
+      pos++;
+    add_block(order, text.data() + start, text.data() + pos);
+
+    size_t line_end = text.find('\n', pos);
+    if (line_end == std::string::npos)
+      line_end = text.size();
+    std::string line(text, pos, line_end - pos);
+    str::clean(line, " \t\r\n");
+    if (line == "\\end\\") {
+      if (m_next_order != (int)m_counts.size() + 1)
+        throw Error(str::fmt(256, "ArpaBinaryConverter: \\end\\ found "
+                             "before %d-grams", m_next_order));
+      return true;
+    }
+    int section_order = 0;
+    if (sscanf(line.c_str(), "\\%d-grams:", &section_order) != 1 ||
+        section_order != m_next_order ||
+        section_order > (int)m_counts.size())
+      throw Error("ArpaBinaryConverter: unexpected section header " + line);
+    order = section_order;
+    m_next_order++;
+
+    start = std::min(line_end + 1, text.size());
+    pos = text.find("\n\\", line_end);
+  }
+  add_block(order, text.data() + start, text.data() + text.size());
+  return false;
+}
+
+void
+ArpaBinaryConverter::add_block(int order, const char *begin, const char *end)
+{
+  if (skip_space(begin, end) == end)
+    return;
+  if (order < 2)
+    throw Error("ArpaBinaryConverter: unexpected line after the unigrams: " +
+                std::string(begin, std::find(begin, end, '\n')));
+
+  std::unique_lock<std::mutex> lock(m_mutex);
+  while ((int)m_queue.size() >= 2 * m_num_threads && m_error.empty())
+    m_queue_changed.wait(lock);
+  if (!m_error.empty())
+    throw Error(m_error);
+  m_queue.push_back(Block());
+  m_queue.back().order = order;
+  m_queue.back().text.assign(begin, end);
+  m_queue_changed.notify_all();
+}
+
+void
+ArpaBinaryConverter::worker(int thread)
+{
+  int max_order = m_counts.size();
+  std::vector<GramBuffer> buffers(max_order + 1);
+  for (int order = 0; order <= max_order; order++)
+    buffers[order].order = order;
+
+  try {
+    while (true) {
+      Block block;
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (m_queue.empty() && !m_input_done && m_error.empty())
+          m_queue_changed.wait(lock);
+        if (!m_error.empty() || m_queue.empty())
+          break;
+        block.order = m_queue.front().order;
+        block.text.swap(m_queue.front().text);
+        m_queue.pop_front();
+        m_queue_changed.notify_all();
+      }
+
+      m_thread_counts[thread][block.order] +=
+        parse_block(block, buffers[block.order]);
+
+      size_t bytes = 0;
+      for (int order = 2; order <= max_order; order++)
+        bytes += buffers[order].bytes();
+      if (bytes > m_memory_budget / m_num_threads)
+        spill(buffers);
+    }
+
+    // The rest is kept in memory.
+    for (int order = 2; order <= max_order; order++)
+      buffers[order].sort();
+  }
+  catch (std::exception &e) {
+    set_error(e.what());
+  }
+  m_buffers[thread].swap(buffers);
+}
+
+long
+ArpaBinaryConverter::parse_block(const Block &block, GramBuffer &buffer)
+{
+  int order = block.order;
+  const char *p = block.text.c_str();
+  const char *end = p + block.text.size();
+  std::string word;
+  long count = 0;
+
+  while (p < end) {
+    const char *line_end = (const char*)memchr(p, '\n', end - p);
+    if (line_end == NULL)
+      line_end = end;
+    const char *q = skip_space(p, line_end);
+    if (q == line_end) {
+      p = line_end + 1;
+      continue;
+    }
+
+    // Log-probability, the words and the possible back-off weight
+    bool ok = true;
+    char *number_end;
+    float log_prob = strtod(q, &number_end);
+    ok = number_end != q;
+    q = number_end;
+    for (int i = 0; ok && i < order; i++) {
+      q = skip_space(q, line_end);
+      const char *word_begin = q;
+      while (q < line_end && !is_space(*q))
+        q++;
+      if (q == word_begin) {
+        ok = false;
+        break;
+      }
+      word.assign(word_begin, q);
+      std::unordered_map<std::string, int>::const_iterator it =
+        m_word_indices.find(word);
+      if (it == m_word_indices.end())
+        throw Error("ArpaBinaryConverter: word " + word +
+                    " is not in the unigrams");
+      buffer.words.push_back(it->second);
+    }
+    float back_off = 0;
+    q = skip_space(q, line_end);
+    if (ok && q < line_end) {
+      back_off = strtod(q, &number_end);
+      ok = number_end != q;
+      q = skip_space(number_end, line_end);
+    }
+    if (!ok || q < line_end)
+      throw Error(str::fmt(256, "ArpaBinaryConverter: invalid %d-gram line: ",
+                           order) + std::string(p, line_end));
+
+    buffer.log_probs.push_back(log_prob);
+    buffer.back_offs.push_back(back_off);
+    count++;
+    p = line_end + 1;
+  }
+  return count;
+}
+
+void
+ArpaBinaryConverter::spill(std::vector<GramBuffer> &buffers)
+{
+  for (int order = 2; order < (int)buffers.size(); order++) {
+    GramBuffer &buffer = buffers[order];
+    if (buffer.num_grams() == 0)
+      continue;
+    buffer.sort();
+
+    // The file is removed immediately, and disappears when it is closed.
+    std::string name = m_temp_dir + "/arpa2binXXXXXX";
+    std::vector<char> path(name.begin(), name.end());
+    path.push_back('\0');
+    int fd = mkstemp(&path[0]);
+    if (fd < 0)
+      throw Error("ArpaBinaryConverter: could not create a temporary file "
+                  "in " + m_temp_dir);
+    unlink(&path[0]);
+    FILE *file = fdopen(fd, "w+b");
+    if (file == NULL) {
+      close(fd);
+      throw Error("ArpaBinaryConverter: fdopen failed");
+    }
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_runs[order].push_back(file);
+    }
+
+    for (size_t i = 0; i < buffer.num_grams(); i++) {
+      fwrite(&buffer.words[i * order], sizeof(int), order, file);
+      fwrite(&buffer.log_probs[i], sizeof(float), 1, file);
+      fwrite(&buffer.back_offs[i], sizeof(float), 1, file);
+    }
+    if (fflush(file) != 0 || ferror(file))
+      throw Error("ArpaBinaryConverter: write error in a temporary file in " +
+                  m_temp_dir);
+    buffer.clear();
+  }
+}
+
+void
+ArpaBinaryConverter::write_binary(FILE *out)
+{
+  // Empty highest orders are not included in a TreeGram.
+  int max_order = m_counts.size();
+  while (max_order > 1 && m_counts[max_order - 1] == 0)
+    max_order--;
+  std::vector<long> counts(max_order);
+  std::vector<long> order_start(max_order + 2, 0);
+  counts[0] = m_vocabulary.num_words();
+  for (int order = 2; order <= max_order; order++)
+    counts[order - 1] = m_counts[order - 1];
+  for (int order = 1; order <= max_order; order++)
+    order_start[order + 1] = order_start[order] + counts[order - 1];
+  long num_nodes = order_start[max_order + 1];
+
+  std::vector<std::vector<const GramBuffer*> > buffers(max_order + 1);
+  for (int order = 2; order <= max_order; order++)
+    for (int t = 0; t < m_num_threads; t++)
+      buffers[order].push_back(&m_buffers[t][order]);
+
+  // TreeGram adds a sentinel node after the last node, if the child range
+  // of the previous node ends at the last node.  That can only happen when
+  // there is a single highest order gram, whose prefix is the last gram of
+  // the previous order.
+  bool sentinel = false;
+  if (max_order > 1 && counts[max_order - 1] == 1) {
+    GramStream last(max_order, m_runs[max_order], buffers[max_order],
+                    m_vocabulary);
+    last.next();
+    std::vector<int> prefix(last.gram(), last.gram() + max_order - 1);
+    if (max_order == 2)
+      sentinel = prefix[0] == m_vocabulary.num_words() - 1;
+    else {
+      GramStream parents(max_order - 1, m_runs[max_order - 1],
+                         buffers[max_order - 1], m_vocabulary);
+      std::vector<int> last_parent;
+      while (parents.next())
+        last_parent.assign(parents.gram(), parents.gram() + max_order - 1);
+      sentinel = last_parent == prefix;
+    }
+  }
+  if (sentinel)
+    num_nodes++;
+  if (num_nodes > INT_MAX)
+    throw Error("ArpaBinaryConverter: too many nodes for the binary format");
+
+  // The header is the same as in TreeGram::write().
+  fputs("cis-binlm2\n", out);
+  fputs(m_interpolated ? "interpolated\n" : "backoff\n", out);
+  fprintf(out, "%d\n", m_vocabulary.num_words());
+  for (int i = 0; i < m_vocabulary.num_words(); i++)
+    fprintf(out, "%s\n", m_vocabulary.word(i).c_str());
+  fprintf(out, "%d %ld\n", max_order, num_nodes);
+  for (int order = 1; order <= max_order; order++)
+    fprintf(out, "%ld\n", counts[order - 1]);
+
+  // The child range of a node ends where the range of the next node
+  // starts.  A node without children gets the end of the previous range,
+  // if the previous node has children.
+  std::vector<TreeGram::Node> nodes;
+  nodes.reserve(node_batch_size);
+  bool previous_has_children = false;
+  std::vector<int> unigram(1);
+  for (int order = 1; order <= max_order; order++) {
+    std::unique_ptr<GramStream> grams;
+    std::unique_ptr<GramStream> children;
+    if (order > 1)
+      grams.reset(new GramStream(order, m_runs[order], buffers[order],
+                                 m_vocabulary));
+    if (order < max_order)
+      children.reset(new GramStream(order + 1, m_runs[order + 1],
+                                    buffers[order + 1], m_vocabulary));
+    bool has_child = children && children->next();
+    long child_pos = order_start[order + 1];
+
+    for (long i = 0; i < counts[order - 1]; i++) {
+      const int *gram;
+      TreeGram::Node node;
+      if (order == 1) {
+        unigram[0] = i;
+        gram = &unigram[0];
+        node.log_prob = m_unigram_log_probs[i];
+        node.back_off = m_unigram_back_offs[i];
+      }
+      else {
+        grams->next();
+        gram = grams->gram();
+        node.log_prob = grams->log_prob;
+        node.back_off = grams->back_off;
+      }
+      node.word = gram[order - 1];
+
+      // A child before its parent has no parent.
+      long num_children = 0;
+      if (has_child && gram_less(children->gram(), gram, order))
+        break;
+      while (has_child && !gram_less(gram, children->gram(), order)) {
+        num_children++;
+        has_child = children->next();
+      }
+      if (num_children > 0 || previous_has_children)
+        node.child_index = child_pos;
+      child_pos += num_children;
+      previous_has_children = num_children > 0;
+
+      nodes.push_back(node);
+      if (nodes.size() == node_batch_size) {
+        if (Endian::big)
+          Endian::convert_buffer(&nodes[0], nodes.size() * 4, 4);
+        fwrite(&nodes[0], sizeof(TreeGram::Node), nodes.size(), out);
+        nodes.clear();
+      }
+    }
+
+    if (has_child) {
+      std::string gram;
+      for (int i = 0; i <= order; i++)
+        gram += " " + m_vocabulary.word(children->gram()[i]);
+      throw Error("ArpaBinaryConverter: prefix not found for" + gram);
+    }
+    fprintf(stderr, "ArpaBinaryConverter: wrote %ld %d-grams from %d runs\n",
+            counts[order - 1], order, (int)m_runs[order].size());
+  }
+
+  if (sentinel)
+    nodes.push_back(TreeGram::Node());
+  if (!nodes.empty()) {
+    if (Endian::big)
+      Endian::convert_buffer(&nodes[0], nodes.size() * 4, 4);
+    fwrite(&nodes[0], sizeof(TreeGram::Node), nodes.size(), out);
+  }
+  if (fflush(out) != 0 || ferror(out))
+    throw Error(std::string("ArpaBinaryConverter: write error: ") +
+                strerror(errno));
+}
+
+void
+ArpaBinaryConverter::set_error(const std::string &message)
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+  if (m_error.empty())
+    m_error = message;
+  m_queue_changed.notify_all();
+}
+
+void
+ArpaBinaryConverter::close_runs()
+{
+  for (int order = 0; order < (int)m_runs.size(); order++)
+    for (int i = 0; i < (int)m_runs[order].size(); i++)
+      fclose(m_runs[order][i]);
+  m_runs.clear();
+}
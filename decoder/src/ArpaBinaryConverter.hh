@@ -0,0 +1,113 @@
+#ifndef ARPABINARYCONVERTER_HH
+#define ARPABINARYCONVERTER_HH
+
+#include <cstdio>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Vocabulary.hh"
+
+/// \brief Converts an ARPA language model to the binary TreeGram format
+/// without building the model in memory.
+///
+/// The unigrams define the vocabulary and are read first. The higher orders
+/// are read in large blocks that are parsed by worker threads. Each worker
+/// collects the grams it has parsed, and when its share of the memory budget
+/// is exceeded, sorts them and writes them to temporary files as sorted runs.
+/// Finally the runs and the grams left in memory are merged order by order,
+/// and the nodes are written directly in the layout of TreeGram::write(),
+/// so the result is identical to reading the ARPA file to a TreeGram and
+/// writing it in binary.
+///
+/// All the words of the higher orders must be defined in the unigrams.
+///
+class ArpaBinaryConverter {
+public:
+  struct Error : public std::runtime_error {
+    Error(const std::string &message) : std::runtime_error(message) { }
+  };
+
+  ArpaBinaryConverter();
+  ~ArpaBinaryConverter();
+
+  /// \brief Sets the number of threads that parse and sort the grams.
+  void set_num_threads(int num_threads) { m_num_threads = num_threads; }
+
+  /// \brief Sets the number of bytes that the parsed grams may take in
+  /// memory before they are written to temporary files.
+  void set_memory_budget(size_t bytes) { m_memory_budget = bytes; }
+
+  /// \brief Sets the directory of the temporary files.
+  void set_temp_dir(const std::string &dir) { m_temp_dir = dir; }
+
+  /// \brief Reads an ARPA model from \a in and writes the binary model to
+  /// \a out.
+  ///
+  /// \exception Error If the ARPA file is invalid or an I/O error occurs.
+  ///
+  void convert(FILE *in, FILE *out);
+
+private:
+  /// \brief Grams of one order stored as flat arrays.
+  struct GramBuffer {
+    GramBuffer() : order(0) { }
+    size_t num_grams() const { return log_probs.size(); }
+    size_t bytes() const { return num_grams() * (order + 3) * sizeof(int); }
+    void clear();
+    void sort();
+
+    int order;
+    std::vector<int> words; //!< The words of each gram in sequence.
+    std::vector<float> log_probs;
+    std::vector<float> back_offs;
+  };
+
+  /// \brief A block of ARPA lines of one order.
+  struct Block {
+    int order;
+    std::string text;
+  };
+
+  /// \brief Merges the sorted runs and buffers of one order.
+  class GramStream;
+
+  void read_unigrams(FILE *in);
+  void read_higher_orders(FILE *in);
+  bool split_blocks(const std::string &text, int &order);
+  void add_block(int order, const char *begin, const char *end);
+  void worker(int thread);
+  long parse_block(const Block &block, GramBuffer &buffer);
+  void spill(std::vector<GramBuffer> &buffers);
+  void write_binary(FILE *out);
+  void set_error(const std::string &message);
+  void close_runs();
+
+  int m_num_threads;
+  size_t m_memory_budget;
+  std::string m_temp_dir;
+
+  bool m_interpolated;
+  std::vector<int> m_counts; //!< Gram counts of the header.
+  int m_next_order; //!< The order of the next section header.
+  Vocabulary m_vocabulary;
+  std::unordered_map<std::string, int> m_word_indices;
+  std::vector<float> m_unigram_log_probs; //!< Indexed by the word.
+  std::vector<float> m_unigram_back_offs;
+
+  std::vector<std::vector<FILE*> > m_runs; //!< Sorted runs of each order.
+  std::vector<std::vector<GramBuffer> > m_buffers; //!< Sorted grams of each thread.
+  std::vector<std::vector<long> > m_thread_counts; //!< Grams parsed by each thread.
+
+  std::mutex m_mutex;
+  std::condition_variable m_queue_changed;
+  std::deque<Block> m_queue;
+  bool m_input_done;
+  std::string m_error; //!< The first error of the threads.
+};
+
+#endif /* ARPABINARYCONVERTER_HH */
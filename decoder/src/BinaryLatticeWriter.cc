@@ -0,0 +1,79 @@
+#include <string.h>
+
+#include "BinaryLatticeWriter.hh"
+
+BinaryLatticeWriter::BinaryLatticeWriter(FILE *file, float lm_scale,
+                                         float insertion_penalty)
+  : m_file(file), m_node_label(-1), m_num_words(0)
+{
+  fwrite("\x89LATBIN\n", 1, 8, m_file);
+  put_float(lm_scale);
+  put_float(insertion_penalty);
+}
+
+void
+BinaryLatticeWriter::node(int label, int frame)
+{
+  put_varint(NODE);
+  put_varint(label - m_node_label);
+  put_zigzag(frame);
+  m_node_label = label;
+}
+
+void
+BinaryLatticeWriter::arc(int source_label, int symbol, const std::string &word,
+                         float am_log_prob, float lm_log_prob)
+{
+  int word_number = 0;
+  if (symbol >= 0) {
+    if (symbol >= (int)m_word_numbers.size())
+      m_word_numbers.resize(symbol + 1, 0);
+    if (m_word_numbers[symbol] == 0) {
+      put_varint(WORD);
+      put_varint(word.size());
+      fwrite(word.data(), 1, word.size(), m_file);
+      m_word_numbers[symbol] = ++m_num_words;
+    }
+    word_number = m_word_numbers[symbol];
+  }
+
+  put_varint(ARC);
+  put_zigzag(m_node_label - source_label);
+  put_varint(word_number);
+  put_float(am_log_prob);
+  put_float(lm_log_prob);
+}
+
+void
+BinaryLatticeWriter::finish(int start_label, int end_label)
+{
+  put_varint(END);
+  put_varint(start_label);
+  put_varint(end_label);
+  if (ferror(m_file))
+    throw WriteError("BinaryLatticeWriter::finish(): write failed");
+}
+
+void
+BinaryLatticeWriter::put_varint(unsigned int value)
+{
+  unsigned char buf[5];
+  int length = 0;
+  while (value >= 0x80) {
+    buf[length++] = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  buf[length++] = value;
+  fwrite(buf, 1, length, m_file);
+}
+
+void
+BinaryLatticeWriter::put_float(float value)
+{
+  unsigned int bits;
+  memcpy(&bits, &value, 4);
+  unsigned char buf[4] = {
+    (unsigned char)bits, (unsigned char)(bits >> 8),
+    (unsigned char)(bits >> 16), (unsigned char)(bits >> 24) };
+  fwrite(buf, 1, 4, m_file);
+}
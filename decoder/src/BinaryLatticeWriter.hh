@@ -0,0 +1,74 @@
+#ifndef BINARYLATTICEWRITER_HH
+#define BINARYLATTICEWRITER_HH
+
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/// \brief Writes a word graph in a compact binary lattice format, in one pass
+/// over the nodes.
+///
+/// The format contains the same information as the SLF files written by
+/// TokenPassSearch::write_word_graph(). The file starts with the 8 bytes
+/// "\x89LATBIN\n" followed by the LM scale and the word insertion penalty, and
+/// then a sequence of records. Each record starts with a varint type:
+///
+/// - 1 (word): varint length and the characters of the next word in the
+///   string table. The words are numbered from 0 in the order of definition,
+///   and are defined before they are used.
+/// - 2 (node): varint difference of the node label to the previous node label
+///   (the first one to -1), and zigzag varint frame. The labels increase.
+/// - 3 (arc): an arc ending in the previous node. Zigzag varint difference of
+///   the target label to the source label, varint word number plus one (0 for
+///   !NULL), and the acoustic and LM log probabilities.
+/// - 0 (end): varint start and end node labels. Ends the lattice.
+///
+/// Varints are unsigned integers in groups of 7 bits, least significant group
+/// first, with the high bit set in all but the last byte. Zigzag varints map
+/// signed integers to unsigned as 0, -1, 1, -2, ... Floats are 32-bit IEEE
+/// in little-endian byte order. The arcs may refer to source nodes that come
+/// later in the file.
+///
+class BinaryLatticeWriter {
+public:
+  struct WriteError : public std::runtime_error {
+    WriteError(const std::string & message)
+      : std::runtime_error(message) { }
+  };
+
+  /// \brief Writes the header.
+  BinaryLatticeWriter(FILE *file, float lm_scale, float insertion_penalty);
+
+  /// \brief Writes a node. The labels must increase.
+  void node(int label, int frame);
+
+  /// \brief Writes an arc ending in the previous node.
+  ///
+  /// \param symbol Symbol index of the word in the caller's vocabulary, or -1
+  /// for !NULL. The \a word string is written only when the symbol is used
+  /// the first time.
+  ///
+  void arc(int source_label, int symbol, const std::string &word,
+           float am_log_prob, float lm_log_prob);
+
+  /// \brief Writes the end record.
+  ///
+  /// \exception WriteError If writing the file failed.
+  ///
+  void finish(int start_label, int end_label);
+
+private:
+  enum { END = 0, WORD = 1, NODE = 2, ARC = 3 };
+
+  void put_varint(unsigned int value);
+  void put_zigzag(int value) { put_varint(((unsigned int)value << 1) ^ (unsigned int)(value >> 31)); }
+  void put_float(float value);
+
+  FILE *m_file;
+  int m_node_label; //!< The label of the previous node.
+  int m_num_words; //!< Words in the string table.
+  std::vector<int> m_word_numbers; //!< Word number + 1 of each symbol, 0 if undefined.
+};
+
+#endif /* BINARYLATTICEWRITER_HH */
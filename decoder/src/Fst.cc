@@ -2,25 +2,101 @@
 #include "misc/str.hh"
 
 #include <cstdlib>
+#include <cstring>
+#ifndef _MSC_VER
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 #define strtof strtod
 
-Fst::Fst(): initial_node_idx(-1) {
+namespace {
+  const char binary_magic[8] = {'F', 'S', 'T', 'B', 'I', 'N', '1', '\n'};
+
+  // Header of the binary format. The header is followed by the arrays
+  //   int arc_offsets[num_nodes+1]
+  //   int emission_pdf_idxs[num_nodes]
+  //   char end_nodes[num_nodes], padded to a multiple of 4 bytes
+  //   Fst::Arc arcs[num_arcs]
+  //   char symbols[symbol_bytes], null terminated strings
+  // in native byte order, so that the file can be mapped to memory as such.
+  // byte_order_mark is 1 when read with the same byte order.
+  struct BinaryHeader {
+    char magic[8];
+    int byte_order_mark;
+    int num_nodes;
+    int num_arcs;
+    int initial_node_idx;
+    int num_symbols;
+    int symbol_bytes;
+  };
+
+  size_t padded_size(size_t bytes) { return (bytes + 3) & ~(size_t)3; }
 }
 
-void Fst::read(std::string &fname) {
-  std::string line;
+Fst::Fst(): initial_node_idx(-1), m_num_nodes(0), m_num_arcs(0), m_mapped(nullptr), m_mapped_size(0) {
+  set_arrays();
+}
+
+Fst::~Fst() {
+  clear();
+}
+
+void Fst::clear() {
+#ifndef _MSC_VER
+  if (m_mapped) munmap(m_mapped, m_mapped_size);
+#endif
+  m_mapped = nullptr;
+  m_mapped_size = 0;
+  m_file_data.clear();
+  m_arc_offset_data.assign(1, 0);
+  m_emission_pdf_idx_data.clear();
+  m_end_node_data.clear();
+  m_arc_data.clear();
+  symbols.clear();
+  symbol_map.clear();
+  initial_node_idx = -1;
+  m_num_nodes = 0;
+  m_num_arcs = 0;
+}
+
+void Fst::set_arrays() {
+  m_arc_offsets = &m_arc_offset_data[0];
+  m_emission_pdf_idxs = m_emission_pdf_idx_data.data();
+  m_end_nodes = m_end_node_data.data();
+  m_arcs = m_arc_data.data();
+}
 
-  FILE *ifh = fopen(fname.c_str(), "r");
+void Fst::read(const std::string &fname) {
+  FILE *ifh = fopen(fname.c_str(), "rb");
   if (ifh==nullptr) {
     perror("Error");
     exit(-1); // FIXME: we should use exceptions
   }
 
+  clear();
+  char magic[sizeof(binary_magic)];
+  if (fread(magic, sizeof(magic), 1, ifh) == 1 &&
+      memcmp(magic, binary_magic, sizeof(magic)) == 0) {
+    read_binary(ifh, fname);
+  } else {
+    rewind(ifh);
+    read_text(ifh);
+  }
+  fclose(ifh);
+}
+
+void Fst::read_text(FILE *ifh) {
+  std::string line;
+
   str::read_line(line, ifh, true);
   if (line != "#FSTBasic MaxPlus") {
     fprintf(stderr, "Unknown header '%s'.\n", line.c_str());
     throw ReadError();
   }
+
+  // Arcs in the order of the file, sorted by source node at the end
+  std::vector<Arc> arcs;
+  std::vector<int> &pdf_idxs = m_emission_pdf_idx_data;
   std::vector<std::string> fields;
   while (str::read_line(line, ifh, true)) {
     fields = str::split(line, " ", true);
@@ -31,8 +107,13 @@ void Fst::read(std::string &fname) {
 
     // Resize nodes to the size of the first mentioned node
     auto first_node_idx = atoi(fields[1].c_str());
-    if (nodes.size() <= first_node_idx) {
-      nodes.resize(first_node_idx+1);
+    if (first_node_idx < 0) {
+      fprintf(stderr, "Negative node index '%s'.\n", line.c_str());
+      throw ReadError();
+    }
+    if (pdf_idxs.size() <= static_cast<size_t>(first_node_idx)) {
+      pdf_idxs.resize(first_node_idx+1, -1);
+      m_end_node_data.resize(first_node_idx+1, 0);
     }
 
     if (fields[0]=="I") {
@@ -45,49 +126,52 @@ void Fst::read(std::string &fname) {
     }
 
     if (fields[0]=="F") {
-      nodes[first_node_idx].end_node = true;
+      m_end_node_data[first_node_idx] = 1;
       if (fields.size()>2) {
         fprintf(stderr, "Too many fields for F: '%s'.\n", line.c_str());
         throw ReadError();
       }
       continue;
     }
-    
+
     if (fields[0]=="T") {
       if (fields.size()<3 || fields.size()>6) {
         fprintf(stderr, "Weird number of fields for T: '%s'.\n", line.c_str());
         throw ReadError();
       }
-      
+
       auto second_node_idx = atoi(fields[2].c_str());
-      if (nodes.size() <= second_node_idx) {
-        nodes.resize(second_node_idx+1);
+      if (second_node_idx < 0) {
+        fprintf(stderr, "Negative node index '%s'.\n", line.c_str());
+        throw ReadError();
+      }
+      if (pdf_idxs.size() <= static_cast<size_t>(second_node_idx)) {
+        pdf_idxs.resize(second_node_idx+1, -1);
+        m_end_node_data.resize(second_node_idx+1, 0);
       }
 
-      auto aidx=arcs.size();
-      arcs.resize(aidx+1);
-      Arc &a = arcs[aidx];
+      arcs.resize(arcs.size()+1);
+      Arc &a = arcs.back();
       a.source = first_node_idx;
       a.target = second_node_idx;
 
       if (fields.size()>=5) {
         if (fields[4] != ",") {
-          a.emit_symbol = fields[4];
+          a.emit_symbol = insert_symbol(fields[4]);
         }
       }
 
       if (fields.size()>=6) {
         a.transition_logprob = strtof(fields[5].c_str(), nullptr);
       }
-      nodes[first_node_idx].arcidxs.push_back(aidx);
 
       // Move emission pdf indices from arcs to nodes
       auto emission_pdf_idx = atoi(fields[3].c_str());
-      if (nodes[second_node_idx].emission_pdf_idx==-1) {
-        nodes[second_node_idx].emission_pdf_idx = emission_pdf_idx;
-      } else if (nodes[second_node_idx].emission_pdf_idx != emission_pdf_idx) {
+      if (pdf_idxs[second_node_idx]==-1) {
+        pdf_idxs[second_node_idx] = emission_pdf_idx;
+      } else if (pdf_idxs[second_node_idx] != emission_pdf_idx) {
         fprintf(stderr, "Conflicting emission_pdf_indices for node %d: %d != %d.\n",
-                second_node_idx, nodes[second_node_idx].emission_pdf_idx, emission_pdf_idx);
+                second_node_idx, pdf_idxs[second_node_idx], emission_pdf_idx);
         throw ReadError();
       }
 
@@ -96,8 +180,169 @@ void Fst::read(std::string &fname) {
       fprintf(stderr, "Weird type indicator: '%s'.\n", fields[0].c_str());
       throw ReadError();
     }
-    
+
+  }
+
+  // Sort the arcs by source node, keeping the order of the file within a node
+  m_num_nodes = pdf_idxs.size();
+  m_num_arcs = arcs.size();
+  m_arc_offset_data.assign(m_num_nodes+1, 0);
+  for (const auto &a: arcs) {
+    m_arc_offset_data[a.source+1]++;
+  }
+  for (int i=0; i<m_num_nodes; i++) {
+    m_arc_offset_data[i+1] += m_arc_offset_data[i];
+  }
+  std::vector<int> next_arc_idx(m_arc_offset_data.begin(), m_arc_offset_data.end()-1);
+  m_arc_data.resize(m_num_arcs);
+  for (const auto &a: arcs) {
+    m_arc_data[next_arc_idx[a.source]++] = a;
+  }
+  set_arrays();
+}
+
+void Fst::read_binary(FILE *ifh, const std::string &fname) {
+  BinaryHeader header;
+  rewind(ifh);
+  if (fread(&header, sizeof(header), 1, ifh) != 1) {
+    fprintf(stderr, "Truncated binary fst header in %s.\n", fname.c_str());
+    throw ReadError();
+  }
+  if (header.byte_order_mark != 1) {
+    fprintf(stderr, "Binary fst %s was written with a different byte order.\n", fname.c_str());
+    throw ReadError();
+  }
+  if (header.num_nodes < 0 || header.num_arcs < 0 || header.num_symbols < 0 ||
+      header.symbol_bytes < 0 || header.initial_node_idx >= header.num_nodes) {
+    fprintf(stderr, "Invalid binary fst header in %s.\n", fname.c_str());
+    throw ReadError();
+  }
+
+  size_t offsets_pos = sizeof(BinaryHeader);
+  size_t pdfs_pos = offsets_pos + (header.num_nodes+1)*sizeof(int);
+  size_t end_nodes_pos = pdfs_pos + header.num_nodes*sizeof(int);
+  size_t arcs_pos = end_nodes_pos + padded_size(header.num_nodes);
+  size_t symbols_pos = arcs_pos + header.num_arcs*sizeof(Arc);
+  size_t file_size = symbols_pos + header.symbol_bytes;
+
+  const char *data = nullptr;
+#ifndef _MSC_VER
+  struct stat st;
+  if (fstat(fileno(ifh), &st) == 0 && (size_t)st.st_size == file_size) {
+    void *mapped = mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fileno(ifh), 0);
+    if (mapped != MAP_FAILED) {
+      m_mapped = mapped;
+      m_mapped_size = file_size;
+      data = static_cast<const char*>(mapped);
+    }
+  }
+#endif
+  if (data == nullptr) {
+    m_file_data.resize(file_size);
+    rewind(ifh);
+    if (fread(m_file_data.data(), 1, file_size, ifh) != file_size || fgetc(ifh) != EOF) {
+      fprintf(stderr, "Binary fst %s has wrong size.\n", fname.c_str());
+      throw ReadError();
+    }
+    data = m_file_data.data();
+  }
+
+  m_num_nodes = header.num_nodes;
+  m_num_arcs = header.num_arcs;
+  initial_node_idx = header.initial_node_idx;
+  m_arc_offsets = reinterpret_cast<const int*>(data + offsets_pos);
+  m_emission_pdf_idxs = reinterpret_cast<const int*>(data + pdfs_pos);
+  m_end_nodes = data + end_nodes_pos;
+  m_arcs = reinterpret_cast<const Arc*>(data + arcs_pos);
+  if (m_arc_offsets[0] != 0 || m_arc_offsets[m_num_nodes] != m_num_arcs) {
+    fprintf(stderr, "Invalid arc offsets in binary fst %s.\n", fname.c_str());
+    throw ReadError();
+  }
+
+  // The arrays are used without bounds checks in the search, so a corrupt
+  // file is rejected here instead of being read out of bounds later
+  for (int i=0; i<m_num_nodes; i++) {
+    if (m_arc_offsets[i+1] < m_arc_offsets[i]) {
+      fprintf(stderr, "Decreasing arc offsets for node %d in binary fst %s.\n", i, fname.c_str());
+      throw ReadError();
+    }
+  }
+  for (int i=0; i<m_num_nodes; i++) {
+    for (int j=m_arc_offsets[i]; j<m_arc_offsets[i+1]; j++) {
+      const Arc &a = m_arcs[j];
+      if (a.source != i || a.target < 0 || a.target >= m_num_nodes ||
+          a.emit_symbol < -1 || a.emit_symbol >= header.num_symbols) {
+        fprintf(stderr, "Invalid arc %d in binary fst %s.\n", j, fname.c_str());
+        throw ReadError();
+      }
+    }
+  }
+
+  // The symbol table is small compared to the network, so it is copied
+  const char *symbol = data + symbols_pos;
+  const char *symbols_end = symbol + header.symbol_bytes;
+  symbols.reserve(header.num_symbols);
+  for (int i=0; i<header.num_symbols; i++) {
+    const char *end = static_cast<const char*>(memchr(symbol, 0, symbols_end-symbol));
+    if (end == nullptr) {
+      fprintf(stderr, "Truncated symbol table in binary fst %s.\n", fname.c_str());
+      throw ReadError();
+    }
+    insert_symbol(std::string(symbol, end));
+    symbol = end+1;
+  }
+}
+
+void Fst::write_binary(const std::string &fname) const {
+  FILE *ofh = fopen(fname.c_str(), "wb");
+  if (ofh==nullptr) {
+    perror("Error");
+    throw WriteError();
   }
-  fclose(ifh);
 
+  std::string symbol_data;
+  for (const auto &s: symbols) {
+    symbol_data.append(s.c_str(), s.size()+1);
+  }
+
+  BinaryHeader header;
+  memcpy(header.magic, binary_magic, sizeof(binary_magic));
+  header.byte_order_mark = 1;
+  header.num_nodes = m_num_nodes;
+  header.num_arcs = m_num_arcs;
+  header.initial_node_idx = initial_node_idx;
+  header.num_symbols = symbols.size();
+  header.symbol_bytes = symbol_data.size();
+
+  const char padding[4] = {0, 0, 0, 0};
+  size_t end_node_padding = padded_size(m_num_nodes) - m_num_nodes;
+  bool ok = fwrite(&header, sizeof(header), 1, ofh) == 1 &&
+    fwrite(m_arc_offsets, sizeof(int), m_num_nodes+1, ofh) == (size_t)m_num_nodes+1 &&
+    fwrite(m_emission_pdf_idxs, sizeof(int), m_num_nodes, ofh) == (size_t)m_num_nodes &&
+    fwrite(m_end_nodes, 1, m_num_nodes, ofh) == (size_t)m_num_nodes &&
+    fwrite(padding, 1, end_node_padding, ofh) == end_node_padding &&
+    fwrite(m_arcs, sizeof(Arc), m_num_arcs, ofh) == (size_t)m_num_arcs &&
+    fwrite(symbol_data.data(), 1, symbol_data.size(), ofh) == symbol_data.size();
+  if (fclose(ofh) != 0 || !ok) {
+    fprintf(stderr, "Error writing %s.\n", fname.c_str());
+    throw WriteError();
+  }
+}
+
+int Fst::insert_symbol(const std::string &symbol) {
+  auto it = symbol_map.find(symbol);
+  if (it != symbol_map.end()) return it->second;
+  int symbol_idx = symbols.size();
+  symbols.push_back(symbol);
+  symbol_map[symbol] = symbol_idx;
+  return symbol_idx;
+}
+
+std::string Fst::symbol_string(const std::vector<int> &symbol_idxs) const {
+  std::string s;
+  for (const auto idx: symbol_idxs) {
+    if (s.size()) s += " ";
+    s += symbols[idx];
+  }
+  return s;
 }
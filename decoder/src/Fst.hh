@@ -1,14 +1,20 @@
 #ifndef FST_HH
 #define FST_HH
-/* 
-   Simple class to handle mitfst (http://people.csail.mit.edu/ilh/fst/) format networks. 
+/*
+   Simple class to handle mitfst (http://people.csail.mit.edu/ilh/fst/) format networks.
    AT&T fst toolkit and openfst have very similar formats, so this may work directly or
    with small adjustments with thosenetworks.
+
+   The network can also be read from a compiled binary file (see write_binary()), which
+   is mapped to memory directly instead of parsed. The arcs are stored sorted by the
+   source node, and the arcs leaving node i are arcs_begin(i)...arcs_end(i).
 */
 
+#include <cstdio>
 #include <vector>
 #include <string>
 #include <sstream>
+#include <unordered_map>
 
 class Fst {
 public:
@@ -17,39 +23,84 @@ public:
       return "Fst: read error"; }
   };
 
+  struct WriteError : public std::exception {
+    virtual const char *what() const throw() {
+      return "Fst: write error"; }
+  };
+
+  // Stored as such in the binary file, so this must not contain pointers
   struct Arc {
+    Arc() : source(-1), target(-1), transition_logprob(0.0f), emit_symbol(-1) {}
     int source;
     int target;
     float transition_logprob;
-    std::string emit_symbol;
+    int emit_symbol; // Index to Fst::symbols, -1 if the arc emits nothing
 
-    inline std::string str() {
+    inline std::string str() const {
       std::ostringstream os;
       os << "Arc " << source << " -> " << target << " (" << transition_logprob << "): " << emit_symbol;
       return os.str();
     }
   };
-    
-  struct Node {
-    Node() : emission_pdf_idx(-1), end_node(false) {}
-    int emission_pdf_idx;
-    std::vector<int> arcidxs;
-    bool end_node;
-
-    inline std::string str() {
-      std::ostringstream os;
-      os << "Node " << emission_pdf_idx << " (" << arcidxs.size() << ")";
-      return os.str();
-    }
-  };
 
   Fst();
-  void read(std::string &);
+  ~Fst();
+
+  // Reads either the text or the binary format, detected from the header
+  void read(const std::string &);
   inline void read(const char *s) {std::string ss(s); read(ss);}
+  void write_binary(const std::string &fname) const;
+
+  // Returns the index of the output symbol, adding it to the table if needed
+  int insert_symbol(const std::string &symbol);
+  // Output symbols separated by spaces
+  std::string symbol_string(const std::vector<int> &symbol_idxs) const;
+
+  int num_nodes() const { return m_num_nodes; }
+  int num_arcs() const { return m_num_arcs; }
+  int emission_pdf_idx(int node_idx) const { return m_emission_pdf_idxs[node_idx]; }
+  bool end_node(int node_idx) const { return m_end_nodes[node_idx] != 0; }
+  const Arc *arcs_begin(int node_idx) const { return m_arcs + m_arc_offsets[node_idx]; }
+  const Arc *arcs_end(int node_idx) const { return m_arcs + m_arc_offsets[node_idx+1]; }
+  const Arc &arc(int arc_idx) const { return m_arcs[arc_idx]; }
+
+  inline std::string node_str(int node_idx) const {
+    std::ostringstream os;
+    os << "Node " << emission_pdf_idx(node_idx) << " (" << arcs_end(node_idx)-arcs_begin(node_idx) << ")";
+    return os.str();
+  }
+
   int initial_node_idx;
-  std::vector<Node> nodes;
-  std::vector<Arc> arcs;
+  std::vector<std::string> symbols;
+  std::unordered_map<std::string, int> symbol_map;
+
+private:
+  Fst(const Fst &);
+  Fst &operator=(const Fst &);
+
+  void read_text(FILE *ifh);
+  void read_binary(FILE *ifh, const std::string &fname);
+  void set_arrays();
+  void clear();
+
+  int m_num_nodes;
+  int m_num_arcs;
+
+  // The arrays used by the search. They point either to the vectors below (text format)
+  // or to the mapped binary file.
+  const int *m_arc_offsets; // m_num_nodes+1 elements
+  const int *m_emission_pdf_idxs;
+  const char *m_end_nodes;
+  const Arc *m_arcs;
+
+  std::vector<int> m_arc_offset_data;
+  std::vector<int> m_emission_pdf_idx_data;
+  std::vector<char> m_end_node_data;
+  std::vector<Arc> m_arc_data;
+
+  void *m_mapped; // The binary file, if mapped to memory
+  size_t m_mapped_size;
+  std::vector<char> m_file_data; // The binary file, if mapping is not available
 };
 
 #endif
-
@@ -41,6 +41,7 @@ FstAcoustics::hmm_read(const char *file)
 void FstAcoustics::lna_open(const char *file, int size)
 {
   m_lna_reader.open_file(file, size);
+  m_frame = 0;
   m_acoustics = &m_lna_reader;
 }
 
@@ -48,6 +49,7 @@ void FstAcoustics::lna_open(const char *file, int size)
 void FstAcoustics::lna_open_fd(const int fd, int size)
 {
   m_lna_reader.open_fd(fd, size);
+  m_frame = 0;
   m_acoustics = &m_lna_reader;
 }
 
@@ -11,31 +11,32 @@ void FstConfidence::grammar_token_and_best_acu_confidence(float *gt_conf, float
   bool reject_same_prefix=false;
 
   float best_final_token_logprob;
-  std::vector<std::string> best_final_token_symbols;
-  for (const auto t: this->m_new_tokens) {
-    if (this->m_fst.nodes[t.node_idx].end_node) {
+  const FstWordHistory *best_final_token_words = nullptr;
+  for (const auto &t: this->m_new_tokens) {
+    if (this->m_fst.end_node(t.node_idx)) {
       best_final_token_logprob = t.logprob;
-      best_final_token_symbols = t.unemitted_words;
-      //fprintf(stderr, "Best %s\n", t.str().c_str());
+      best_final_token_words = t.words;
+      //fprintf(stderr, "Best %s\n", t.str(this->m_fst).c_str());
       break;
     }
   }
+  int best_final_token_num_words = best_final_token_words? best_final_token_words->length: 0;
 
   *ba_conf = 1.5f- 0.25f*(-best_final_token_logprob + m_best_acu_score)/m_cur_frame;
   //*ba_conf = m_best_acu_score/best_final_token_logprob;
 
-  if (best_final_token_symbols.size()==0) {
+  if (best_final_token_num_words==0) {
     fprintf(stderr, "Emptiness\n");
     *gt_conf = -9999999.9f;
     return;
   }
 
   float best_different_hypo_logprob=-9999999.9f;
-  for (const auto t:this->m_new_tokens) {
-    //fprintf(stderr, "Tokening %s\n", t.str().c_str());
-    if (check_only_final_nodes && this->m_fst.nodes[t.node_idx].end_node == false) continue;
+  for (const auto &t:this->m_new_tokens) {
+    //fprintf(stderr, "Tokening %s\n", t.str(this->m_fst).c_str());
+    if (check_only_final_nodes && !this->m_fst.end_node(t.node_idx)) continue;
 
-    if (t.unemitted_words.size() > best_final_token_symbols.size()) {
+    if (t.num_words() > best_final_token_num_words) {
       //fprintf(stderr, "size\n");
       best_different_hypo_logprob = t.logprob;
       break;
@@ -43,19 +44,17 @@ void FstConfidence::grammar_token_and_best_acu_confidence(float *gt_conf, float
 
     // Check for the same prefix
     if (reject_same_prefix) {
-      for (auto i=0; i<t.unemitted_words.size(); ++i) {
-        if (t.unemitted_words[i] != best_final_token_symbols[i]) {
-          best_different_hypo_logprob = t.logprob;
-          //fprintf(stderr,"Diff hypo: ");
-          //for (const auto w: t.unemitted_words) {
-          //  fprintf(stderr, " %s", w.c_str());
-          //}
-          //fprintf(stderr, "\n");
-          goto out;
-        }
+      const FstWordHistory *best_prefix = best_final_token_words;
+      while (best_prefix && best_prefix->length > t.num_words()) {
+        best_prefix = best_prefix->previous;
+      }
+      if (!FstWordHistory::equal(t.words, best_prefix)) {
+        best_different_hypo_logprob = t.logprob;
+        //fprintf(stderr,"Diff hypo: %s\n", t.str(this->m_fst).c_str());
+        goto out;
       }
     } else {
-      if (t.unemitted_words != best_final_token_symbols) {
+      if (!FstWordHistory::equal(t.words, best_final_token_words)) {
         best_different_hypo_logprob = t.logprob;
         goto out;
       }
@@ -15,23 +15,87 @@ final.fst: The fst that the search uses
 
 #include "FstAcoustics.hh"
 #include "Fst.hh"
+#include "history.hh"
+#include "WordGraph.hh"
+#include "BinaryLatticeWriter.hh"
+
+#include <stdexcept>
 
 typedef std::string bytestype;
 
+/* A word emitted by a search token. The words of a hypothesis form a chain from the
+   last word to the first, and the tokens that have emitted the same words share the chain,
+   so copying a token only copies a pointer. */
+struct FstWordHistory {
+  FstWordHistory(int symbol, FstWordHistory *previous);
+  ~FstWordHistory() { if (graph) graph->unlink(graph_node); }
+
+  // Links the word graph node where this word starts
+  void set_graph_node(WordGraph *g, int node) { graph = g; graph_node = node; graph->link(node); }
+
+  // Symbol indices (see Fst::symbols) from the first word to the last
+  static void get_symbols(const FstWordHistory *words, std::vector<int> &symbols);
+  // True if the chains emit the same symbols
+  static bool equal(const FstWordHistory *a, const FstWordHistory *b);
+  // Total order for sets of chains, compares the last words first
+  struct Less {
+    bool operator()(const FstWordHistory *a, const FstWordHistory *b) const;
+  };
+
+  // Hash of the chain that has \a symbol appended to a chain with \a hash
+  static unsigned int extend_hash(unsigned int hash, int symbol) {
+    return hash * 2654435761u + symbol + 1;
+  }
+
+  int symbol;
+  int length; // Number of words in the chain
+  unsigned int hash; // Hash of the symbols, 0 for the empty chain
+  FstWordHistory *previous;
+  int reference_count;
+
+  // Only used when generating a word graph
+  WordGraph *graph;
+  int graph_node; // The word graph node where this word starts
+  float am_logprob; // Acoustic log probability of the path when the word starts
+  float transition_logprob; // Transition log probability of the path when the word starts
+};
+
 struct FstToken {
-  FstToken(): logprob(0.0f), node_idx(-1), state_dur(0) {};
+  FstToken(): logprob(0.0f), transition_logprob(0.0f), node_idx(-1), state_dur(0), words(nullptr) {};
+  FstToken(const FstToken &t): logprob(t.logprob), transition_logprob(t.transition_logprob),
+                               node_idx(t.node_idx), state_dur(t.state_dur),
+                               words(t.words) { if (words) hist::link(words); }
+  FstToken(FstToken &&t): logprob(t.logprob), transition_logprob(t.transition_logprob),
+                          node_idx(t.node_idx), state_dur(t.state_dur),
+                          words(t.words) { t.words = nullptr; }
+  ~FstToken() { if (words) hist::unlink(words); }
+  FstToken &operator=(FstToken t);
+
+  void emit(int symbol);
+  int num_words() const { return words? words->length: 0; }
+
   float logprob;
-  std::vector<std::string> unemitted_words;
+  float transition_logprob; // The part of logprob from the (scaled) arc weights
   int node_idx;
   int state_dur;
+  FstWordHistory *words; // The last emitted word, nullptr if nothing emitted
   
-  std::string str() const;
+  std::string str(const Fst &fst) const;
 };
 
 template <typename T>
 class FstSearch_base {
   friend class FstConfidenceWithPhoneLoop;
 public:
+  struct WordGraphNotGenerated: public std::runtime_error {
+    WordGraphNotGenerated():
+      std::runtime_error("Word graph was requested but it has not been generated.") {}
+  };
+
+  struct IOError: public std::runtime_error {
+    IOError(const std::string &message): std::runtime_error(message) {}
+  };
+
   FstSearch_base(const char *search_fst_name, FstAcoustics *fst_acu = nullptr);
   FstSearch_base(const char *search_fst_fname, const char *hmm_path, const char *dur_path);
   ~FstSearch_base();
@@ -54,16 +118,46 @@ public:
   void set_token_limit(int t) {m_token_limit=t;}
   void set_transition_scale(float t) {m_transition_scale=t;}
   void set_acoustics(FstAcoustics *fsta) {m_fst_acoustics = fsta;}
+  // Recombine the tokens with the same node and words already during propagation, and
+  // select the best tokens without sorting all of them. Without this, all expansions are
+  // sorted and recombined after propagation.
+  void set_hashed_recombination(bool h) {
+    m_hashed_recombination = h;
+    m_recombination_table.resize(h? 1024: 0);
+    clear_recombination_table();
+  }
 
   float get_duration_scale() {return m_duration_scale;}
   float get_beam() {return m_beam;}
   int get_token_limit() {return m_token_limit;}
   float get_transition_scale() {return m_transition_scale;}
-  
+  bool get_hashed_recombination() {return m_hashed_recombination;}
+
+  // Generate a word graph of the hypotheses during decoding. Set before init_search().
+  void set_generate_word_graph(bool g) {m_generate_word_graph = g;}
+  bool get_generate_word_graph() {return m_generate_word_graph;}
+  void set_use_word_pair_approximation(bool w) {m_use_word_pair_approximation = w;}
+
+  // Writes the word graph in the Standard Lattice Format, like
+  // TokenPassSearch::write_word_graph(). The arcs are labelled with the output symbols of
+  // the network. The acoustic weight includes the duration model and the language model
+  // weight is the sum of the arc weights of the network, which are divided by the
+  // transition scale written as lmscale. The graph ends at the final tokens, or at the
+  // best token if no token is in a final node.
+  void write_word_graph(const std::string &file_name);
+  void write_word_graph(FILE *file);
+  // The same word graph in the binary format of BinaryLatticeWriter
+  void write_binary_word_graph(const std::string &file_name);
+  void write_binary_word_graph(FILE *file);
+
   int verbose;
 
 protected:
   void propagate_tokens();
+
+  // Before the tokens, so that the tokens can release their nodes when destroyed
+  WordGraph word_graph;
+
   std::vector<T> m_new_tokens;
 
   float m_duration_scale;
@@ -71,6 +165,10 @@ protected:
   int m_token_limit;
   float m_transition_scale;
   bool m_one_token_per_node;
+  bool m_hashed_recombination;
+  bool m_generate_word_graph;
+  bool m_use_word_pair_approximation;
+  int m_frame;
 
   Fst m_fst;
   FstAcoustics *m_fst_acoustics;
@@ -79,8 +177,46 @@ protected:
   std::vector<T> m_active_tokens;
   std::vector<int> m_node_best_token;
 
+  // Hashed recombination: an open addressing table of new tokens, keyed by the node and
+  // the words of the token. The size is a power of two.
+  struct RecombinationSlot {
+    unsigned int hash;
+    int token_idx; // -1 for an empty slot
+  };
+  std::vector<RecombinationSlot> m_recombination_table;
+
+  // The word graph nodes created in the current frame for each symbol
+  struct WordGraphInfo {
+    struct Item {
+      int fst_node_idx;
+      int graph_node_idx;
+    };
+    WordGraphInfo() : frame(-1) {}
+    int frame;
+    std::vector<Item> items;
+  };
+  std::vector<WordGraphInfo> m_recent_word_graph_info;
+
 private:
-  float propagate_token(T &, float beam_prune_threshold=-999999999.0f);
+  // Updates best_logprob, the best new token so far, which is used for beam pruning
+  void propagate_token(const T &, float &best_logprob);
+  // The key of a token that has emitted \a symbol (or nothing if negative) after \a words
+  static unsigned int recombination_hash(int node_idx, const FstWordHistory *words, int symbol);
+  // Returns the slot of the new token with the key, or the empty slot for it
+  int find_recombination_slot(unsigned int hash, int node_idx, const FstWordHistory *words,
+                              int symbol) const;
+  void grow_recombination_table();
+  void clear_recombination_table();
+  void select_best_tokens(float best_logprob);
+  void sort_and_recombine_tokens();
+
+  // Called when the token has moved from \a source and emitted a word. Ends the previous
+  // word of the token in a word graph node.
+  void build_word_graph(const T &source, T &token);
+  // Returns the node where \a symbol ends in the current frame, creating it if needed
+  int word_graph_node(int symbol, int fst_node_idx);
+  // Ends the final tokens at a new linked node, and marks the nodes reachable from it
+  int finish_word_graph();
 };
 
 typedef FstSearch_base<FstToken> FstSearch;
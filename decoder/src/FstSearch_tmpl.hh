@@ -2,15 +2,64 @@
 #include "OneFrameAcoustics.hh"
 
 #include <algorithm>
+#include <map>
 #include <set>
 
-inline std::string FstToken::str() const {
-  std::ostringstream os;
-  os << "Token " << node_idx << " " << logprob << " dur " << state_dur << " '";
-  for (const auto s: unemitted_words) {
-    os << " " << s;
+inline FstWordHistory::FstWordHistory(int symbol, FstWordHistory *previous):
+  symbol(symbol), length(previous? previous->length+1: 1),
+  hash(extend_hash(previous? previous->hash: 0, symbol)), previous(previous), reference_count(0),
+  graph(nullptr), graph_node(-1), am_logprob(0.0f), transition_logprob(0.0f)
+{
+  if (previous) hist::link(previous);
+}
+
+inline void FstWordHistory::get_symbols(const FstWordHistory *words, std::vector<int> &symbols) {
+  symbols.resize(words? words->length: 0);
+  for (auto it = symbols.rbegin(); words; words = words->previous) {
+    *it++ = words->symbol;
+  }
+}
+
+inline bool FstWordHistory::equal(const FstWordHistory *a, const FstWordHistory *b) {
+  if ((a? a->length: 0) != (b? b->length: 0)) return false;
+  // Chains of the same length end at the same time
+  for (; a != b; a = a->previous, b = b->previous) {
+    if (a->symbol != b->symbol) return false;
+  }
+  return true;
+}
+
+inline bool FstWordHistory::Less::operator()(const FstWordHistory *a, const FstWordHistory *b) const {
+  for (; a != b; a = a->previous, b = b->previous) {
+    if (a == nullptr) return true;
+    if (b == nullptr) return false;
+    if (a->symbol != b->symbol) return a->symbol < b->symbol;
   }
-  os << " '";
+  return false;
+}
+
+inline FstToken &FstToken::operator=(FstToken t) {
+  logprob = t.logprob;
+  transition_logprob = t.transition_logprob;
+  node_idx = t.node_idx;
+  state_dur = t.state_dur;
+  std::swap(words, t.words);
+  return *this;
+}
+
+inline void FstToken::emit(int symbol) {
+  FstWordHistory *w = new FstWordHistory(symbol, words);
+  hist::link(w);
+  if (words) hist::unlink(words);
+  words = w;
+}
+
+inline std::string FstToken::str(const Fst &fst) const {
+  std::ostringstream os;
+  std::vector<int> symbols;
+  FstWordHistory::get_symbols(words, symbols);
+  os << "Token " << node_idx << " " << logprob << " dur " << state_dur << " '"
+     << fst.symbol_string(symbols) << "'";
   return os.str();
 }
 
@@ -19,10 +68,11 @@ template <typename T>
 FstSearch_base<T>::FstSearch_base(const char * search_fst_fname, FstAcoustics *fst_acu):
   verbose(0), m_fst_acoustics(fst_acu), m_delete_acoustics(false), 
   m_duration_scale(3.0f), m_beam(2600.0f), m_token_limit(5000), m_transition_scale(1.0f), 
-  m_one_token_per_node(false)
+  m_one_token_per_node(false), m_hashed_recombination(false), m_generate_word_graph(false),
+  m_use_word_pair_approximation(false), m_frame(0)
 {
   m_fst.read(search_fst_fname);
-  if (m_one_token_per_node) m_node_best_token.resize(m_fst.nodes.size());
+  if (m_one_token_per_node) m_node_best_token.resize(m_fst.num_nodes());
 }
 
 // Constructor, if acoustics created here
@@ -30,10 +80,11 @@ template <typename T>
 FstSearch_base<T>::FstSearch_base(const char * search_fst_fname, const char * hmm_path, const char * dur_path):
   m_fst_acoustics(new FstAcoustics(hmm_path, dur_path)), m_delete_acoustics(true), 
   m_duration_scale(3.0f), m_beam(2600.0f), m_token_limit(5000), m_transition_scale(1.0f), 
-  m_one_token_per_node(false)
+  m_one_token_per_node(false), m_hashed_recombination(false), m_generate_word_graph(false),
+  m_use_word_pair_approximation(false), m_frame(0)
 {
   m_fst.read(search_fst_fname);
-  if (m_one_token_per_node) m_node_best_token.resize(m_fst.nodes.size());
+  if (m_one_token_per_node) m_node_best_token.resize(m_fst.num_nodes());
 }
 
 template <typename T>
@@ -44,10 +95,20 @@ FstSearch_base<T>::~FstSearch_base() {
 template <typename T>
 void FstSearch_base<T>::init_search() {
   //if (verbose) fprintf(stderr, "Init search\n");
+  m_active_tokens.clear();
+  m_new_tokens.clear();
   m_new_tokens.resize(1);
   T &t=m_new_tokens[0];
   t.node_idx = m_fst.initial_node_idx;
   if (m_one_token_per_node) std::fill(m_node_best_token.begin(), m_node_best_token.end(), -1);
+  m_frame = 0;
+
+  word_graph.reset();
+  if (m_generate_word_graph) {
+    // The start node, where the first words start
+    word_graph.link(word_graph.add_node(-1, -1, m_fst.initial_node_idx, 0));
+    m_recent_word_graph_info.assign(m_fst.symbols.size(), WordGraphInfo());
+  }
 }
 
 template <typename T>
@@ -58,14 +119,23 @@ void FstSearch_base<T>::propagate_tokens() {
   // Clean up the buffers that will hold the new values
   m_new_tokens.clear();
 
+  // The active tokens are sorted, so the running best gets close to the final best early
   float best_logprob=-999999999.0f;
-  for (auto t: m_active_tokens) {
-    float blp = propagate_token(t, best_logprob-m_beam);
-    if (best_logprob<blp) {
-      best_logprob = blp;
-    }
+  for (const auto &t: m_active_tokens) {
+    propagate_token(t, best_logprob);
   }
-  
+
+  if (m_hashed_recombination) {
+    clear_recombination_table();
+    select_best_tokens(best_logprob);
+  } else {
+    sort_and_recombine_tokens();
+  }
+  m_frame++;
+}
+
+template <typename T>
+void FstSearch_base<T>::sort_and_recombine_tokens() {
   // sort and prune
   std::sort(m_new_tokens.begin(), m_new_tokens.end(),
             [](T const & a, T const &b){return a.logprob > b.logprob;});
@@ -86,17 +156,15 @@ void FstSearch_base<T>::propagate_tokens() {
     int num_accepted_tokens=0;
     auto orig_tokens(std::move(m_new_tokens));
     m_new_tokens.clear();
-    //std::map<int, std::unordered_set<std::vector<std::string > > > histmap; // no hash function for type
-    std::map<int, std::set<std::vector<std::string > > > histmap;
-    for (auto t: orig_tokens) {
+    std::map<int, std::set<const FstWordHistory *, FstWordHistory::Less> > histmap;
+    for (auto &t: orig_tokens) {
       //fprintf(stderr, "Is there already?");
       auto &valset = histmap[t.node_idx];
-      if (valset.find(t.unemitted_words) !=valset.end() ) {
+      if (!valset.insert(t.words).second) {
         //fprintf(stderr, " Yes!\n");
         continue;
       }
       //fprintf(stderr, " Nope!\n");
-      valset.insert(t.unemitted_words);
       m_new_tokens.push_back(std::move(t));
       if (num_accepted_tokens>= m_token_limit) break;
       num_accepted_tokens++;
@@ -104,7 +172,7 @@ void FstSearch_base<T>::propagate_tokens() {
   }
   
   int beam_prune_idx = 1;
-  best_logprob = m_new_tokens[0].logprob;
+  float best_logprob = m_new_tokens[0].logprob;
   while (beam_prune_idx < m_new_tokens.size() && m_new_tokens[beam_prune_idx].logprob > best_logprob-m_beam) {
     beam_prune_idx++;
   }
@@ -112,6 +180,23 @@ void FstSearch_base<T>::propagate_tokens() {
   //fprintf(stderr, "size after beam %ld\n", m_new_tokens.size());
 }
 
+template <typename T>
+void FstSearch_base<T>::select_best_tokens(float best_logprob) {
+  // The tokens are already recombined, so only the beam and the token limit are applied.
+  // Selecting the best tokens before sorting them keeps the cost linear in the number of
+  // new tokens, apart from sorting the tokens that are kept.
+  float threshold = best_logprob - m_beam;
+  m_new_tokens.erase(std::remove_if(m_new_tokens.begin(), m_new_tokens.end(),
+                                    [threshold](T const &t){return t.logprob <= threshold;}),
+                     m_new_tokens.end());
+  auto cmp = [](T const & a, T const &b){return a.logprob > b.logprob;};
+  if (m_token_limit > 0 && m_new_tokens.size() > m_token_limit) {
+    std::nth_element(m_new_tokens.begin(), m_new_tokens.begin()+m_token_limit, m_new_tokens.end(), cmp);
+    m_new_tokens.resize(m_token_limit);
+  }
+  std::sort(m_new_tokens.begin(), m_new_tokens.end(), cmp);
+}
+
 template <typename T>
 void FstSearch_base<T>::run() {
   while (m_fst_acoustics->next_frame()) {
@@ -127,9 +212,9 @@ template <typename T>
 bytestype FstSearch_base<T>::tokens_at_final_states() {
   std::ostringstream os;
   os << "Tokens at final nodes:" << std::endl;
-  for (const auto t: m_new_tokens) {
-    if (m_fst.nodes[t.node_idx].end_node) {
-      os << "  " << t.str() << std::endl;
+  for (const auto &t: m_new_tokens) {
+    if (m_fst.end_node(t.node_idx)) {
+      os << "  " << t.str(m_fst) << std::endl;
     }
   }
   return os.str();
@@ -140,8 +225,8 @@ bytestype FstSearch_base<T>::best_tokens(int n) {
   std::ostringstream os;
   os << "Best tokens:" << std::endl;
   int c=0;
-  for (const auto t: m_new_tokens) {
-    os << "  " << t.str() << std::endl;
+  for (const auto &t: m_new_tokens) {
+    os << "  " << t.str(m_fst) << std::endl;
     if (c++>n) break;
   }
   return os.str();
@@ -149,17 +234,14 @@ bytestype FstSearch_base<T>::best_tokens(int n) {
 
 template <typename T>
 bytestype FstSearch_base<T>::get_result_and_logprob(float &logprob) {
-  for (const auto t: m_new_tokens) {
-    if (!m_fst.nodes[t.node_idx].end_node) {
+  for (const auto &t: m_new_tokens) {
+    if (!m_fst.end_node(t.node_idx)) {
       continue;
     }
     logprob = t.logprob;
-    std::ostringstream os;
-    for (const auto w: t.unemitted_words) {
-      os << w << " ";
-    }
-    std::string retval(os.str()); // The best hypo at a final node
-    return retval.substr(0, retval.size()-1); // Remove the trailing space
+    std::vector<int> symbols;
+    FstWordHistory::get_symbols(t.words, symbols);
+    return m_fst.symbol_string(symbols); // The best hypo at a final node
   }
   // FIXME: We should throw an exception if we end up here !!!!
   logprob=-1.0f;
@@ -168,74 +250,336 @@ bytestype FstSearch_base<T>::get_result_and_logprob(float &logprob) {
 
 template <typename T>
 float FstSearch_base<T>::get_best_final_token_logprob() {
-  for (const auto t: m_new_tokens) {
-    if (!m_fst.nodes[t.node_idx].end_node) continue;
+  for (const auto &t: m_new_tokens) {
+    if (!m_fst.end_node(t.node_idx)) continue;
     return t.logprob;
   }
   return -9999999.9f;
 }
 
 template <typename T>
-float FstSearch_base<T>::propagate_token( T &t, float beam_prune_threshold) {
-  float best_logprob=-999999999.0f;
-  Fst::Node n = m_fst.nodes[t.node_idx];
-  //fprintf(stderr, "Propagate token at node %d\n", t.node_idx);
-  //fprintf(stderr, " num arcs %ld\n", n.arcidxs.size());
-  for (const auto arcidx: n.arcidxs) {
-    auto arc = m_fst.arcs[arcidx];
-    auto node = m_fst.nodes[arc.target];
-    //fprintf(stderr, "%s\n", arc.str().c_str());
-    //fprintf(stderr, "%s\n", node.str().c_str());
+unsigned int FstSearch_base<T>::recombination_hash(int node_idx, const FstWordHistory *words, int symbol) {
+  unsigned int hash = words? words->hash: 0;
+  if (symbol >= 0) hash = FstWordHistory::extend_hash(hash, symbol);
+  hash = FstWordHistory::extend_hash(hash, node_idx);
+  // Mix the high bits to the low bits used for the table index
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bu;
+  hash ^= hash >> 13;
+  return hash;
+}
 
-    // Is this necessary, do objects have a default copy constructor?
-    T updated_token(t);
-    
-    //Token updated_token;
-    //updated_token.logprob = t.logprob;
-    //updated_token.state_dur = t.state_dur;
-    //updated_token.unemitted_words = t.unemitted_words;
+template <typename T>
+int FstSearch_base<T>::find_recombination_slot(unsigned int hash, int node_idx,
+                                               const FstWordHistory *words, int symbol) const {
+  size_t mask = m_recombination_table.size()-1;
+  for (size_t i = hash & mask; ; i = (i+1) & mask) {
+    const RecombinationSlot &slot = m_recombination_table[i];
+    if (slot.token_idx == -1) return i;
+    if (slot.hash != hash) continue;
+    const T &t = m_new_tokens[slot.token_idx];
+    if (t.node_idx != node_idx) continue;
+    if (symbol < 0) {
+      if (FstWordHistory::equal(t.words, words)) return i;
+    } else if (t.words && t.words->symbol == symbol && FstWordHistory::equal(t.words->previous, words)) {
+      return i;
+    }
+  }
+}
 
-    updated_token.node_idx = arc.target;
+template <typename T>
+void FstSearch_base<T>::grow_recombination_table() {
+  std::vector<RecombinationSlot> old_table(m_recombination_table.size()*2);
+  old_table.swap(m_recombination_table);
+  clear_recombination_table();
+  size_t mask = m_recombination_table.size()-1;
+  for (const auto &slot: old_table) {
+    if (slot.token_idx == -1) continue;
+    size_t i = slot.hash & mask;
+    while (m_recombination_table[i].token_idx != -1) i = (i+1) & mask;
+    m_recombination_table[i] = slot;
+  }
+}
 
-    int source_emission_pdf_idx = m_fst.nodes[arc.source].emission_pdf_idx;
+template <typename T>
+void FstSearch_base<T>::clear_recombination_table() {
+  RecombinationSlot empty = {0, -1};
+  std::fill(m_recombination_table.begin(), m_recombination_table.end(), empty);
+}
+
+template <typename T>
+void FstSearch_base<T>::propagate_token(const T &t, float &best_logprob) {
+  //fprintf(stderr, "Propagate token at node %d\n", t.node_idx);
+  //fprintf(stderr, " num arcs %ld\n", m_fst.arcs_end(t.node_idx)-m_fst.arcs_begin(t.node_idx));
+  int source_emission_pdf_idx = m_fst.emission_pdf_idx(t.node_idx);
+  for (const Fst::Arc *arcp = m_fst.arcs_begin(t.node_idx); arcp != m_fst.arcs_end(t.node_idx); ++arcp) {
+    const Fst::Arc &arc = *arcp;
+    int target_emission_pdf_idx = m_fst.emission_pdf_idx(arc.target);
+    //fprintf(stderr, "%s\n", arc.str().c_str());
+    //fprintf(stderr, "%s\n", m_fst.node_str(arc.target).c_str());
+
+    // Score the arc before copying the token, so that pruned arcs cost nothing
+    float logprob = t.logprob;
+    int state_dur = t.state_dur;
     //fprintf(stderr, "Add trans logprob %.5f\n", arc.transition_logprob);
-    updated_token.logprob += m_transition_scale * arc.transition_logprob;
-    if (node.emission_pdf_idx >= 0) {
-      //fprintf(stderr, "Emit logprob %.5f\n", m_acoustics->log_prob(node.emission_pdf_idx));
-      updated_token.logprob += m_fst_acoustics->log_prob(node.emission_pdf_idx);  
+    float transition_logprob = m_transition_scale * arc.transition_logprob;
+    logprob += transition_logprob;
+    if (target_emission_pdf_idx >= 0) {
+      //fprintf(stderr, "Emit logprob %.5f\n", m_acoustics->log_prob(target_emission_pdf_idx));
+      logprob += m_fst_acoustics->log_prob(target_emission_pdf_idx);
     }
     if (arc.target != arc.source) {
       if (source_emission_pdf_idx >=0) {
-        //fprintf(stderr, "Adding dur logprob %d -> %d (%d)\n", arc.source, arc.target, updated_token.state_dur);
+        //fprintf(stderr, "Adding dur logprob %d -> %d (%d)\n", arc.source, arc.target, state_dur);
         // Add the duration from prev state at state change boundary
-        updated_token.logprob += m_duration_scale * 
-          m_fst_acoustics->duration_logprob(source_emission_pdf_idx, updated_token.state_dur);
-        updated_token.state_dur = 1;
+        logprob += m_duration_scale *
+          m_fst_acoustics->duration_logprob(source_emission_pdf_idx, state_dur);
+        state_dur = 1;
       } //else fprintf(stderr, "Skip duration model.\n");
     } else {
       //fprintf(stderr, "Increasing state dur %d\n", arc.source);
-      updated_token.state_dur +=1;
-    }
-    if (arc.emit_symbol.size()) {
-      updated_token.unemitted_words.push_back(arc.emit_symbol);
-    }
-    //fprintf(stderr, "m_nbt size %ld, idx %d\n", m_node_best_token.size(), updated_token.node_idx);
-    //fprintf(stderr, "%d\n", m_node_best_token[updated_token.node_idx]);
-    int best_token_idx = m_one_token_per_node? m_node_best_token[updated_token.node_idx] : -1;
-    T *best_token = best_token_idx == -1 ? nullptr : &(m_new_tokens[best_token_idx]);
-    if (updated_token.logprob > beam_prune_threshold && // Do approximate beam pruning here, exact later
-        ( best_token_idx ==-1 || updated_token.logprob > best_token->logprob)) {
-      if (m_one_token_per_node) {
-        m_node_best_token[updated_token.node_idx] = m_new_tokens.size();
-      }
-      //fprintf(stderr, "Accepted token %s\n", updated_token.str().c_str());
-      if (best_logprob < updated_token.logprob) {
-        best_logprob = updated_token.logprob;
+      state_dur +=1;
+    }
+
+    // Do approximate beam pruning against the best token so far, exact later
+    if (logprob <= best_logprob - m_beam) continue;
+
+    int old_token_idx = -1;
+    unsigned int hash = 0;
+    int slot_idx = -1;
+    if (m_hashed_recombination) {
+      // Keep the table at most half full
+      if (2*(m_new_tokens.size()+1) > m_recombination_table.size()) grow_recombination_table();
+      hash = recombination_hash(arc.target, t.words, arc.emit_symbol);
+      slot_idx = find_recombination_slot(hash, arc.target, t.words, arc.emit_symbol);
+      old_token_idx = m_recombination_table[slot_idx].token_idx;
+    } else if (m_one_token_per_node) {
+      //fprintf(stderr, "m_nbt size %ld, idx %d\n", m_node_best_token.size(), arc.target);
+      old_token_idx = m_node_best_token[arc.target];
+    }
+    if (old_token_idx != -1 && logprob <= m_new_tokens[old_token_idx].logprob) continue;
+
+    T updated_token(t);
+    updated_token.logprob = logprob;
+    updated_token.transition_logprob += transition_logprob;
+    updated_token.node_idx = arc.target;
+    updated_token.state_dur = state_dur;
+    if (arc.emit_symbol >= 0) {
+      updated_token.emit(arc.emit_symbol);
+      if (m_generate_word_graph) build_word_graph(t, updated_token);
+    }
+    //fprintf(stderr, "Accepted token %s\n", updated_token.str(m_fst).c_str());
+    if (best_logprob < logprob) {
+      best_logprob = logprob;
+    }
+
+    if (m_hashed_recombination) {
+      if (old_token_idx != -1) {
+        // Same node and words, replace the worse token
+        m_new_tokens[old_token_idx] = std::move(updated_token);
+        continue;
       }
-      m_new_tokens.push_back(std::move(updated_token));
+      m_recombination_table[slot_idx].hash = hash;
+      m_recombination_table[slot_idx].token_idx = m_new_tokens.size();
+    } else if (m_one_token_per_node) {
+      m_node_best_token[arc.target] = m_new_tokens.size();
+    }
+    m_new_tokens.push_back(std::move(updated_token));
+  }
+}
+
+template <typename T>
+int FstSearch_base<T>::word_graph_node(int symbol, int fst_node_idx) {
+  WordGraphInfo &info = m_recent_word_graph_info[symbol];
+  if (info.frame != m_frame) {
+    info.items.clear();
+    info.frame = m_frame;
+  }
+  for (const auto &item: info.items) {
+    // The node may have been released (and reused) if its tokens were pruned
+    const WordGraph::Node &node = word_graph.nodes[item.graph_node_idx];
+    if (item.fst_node_idx == fst_node_idx && node.reference_count > 0 &&
+        node.frame == m_frame && node.symbol == symbol && node.lex_node_id == fst_node_idx) {
+      return item.graph_node_idx;
+    }
+  }
+  typename WordGraphInfo::Item item;
+  item.fst_node_idx = fst_node_idx;
+  item.graph_node_idx = word_graph.add_node(m_frame, symbol, fst_node_idx);
+  info.items.push_back(item);
+  return item.graph_node_idx;
+}
+
+template <typename T>
+void FstSearch_base<T>::build_word_graph(const T &source, T &token) {
+  // The new word starts, and the previous word ends, before the emitting arc, so that the
+  // arc weight and the acoustics of this frame belong to the new word
+  FstWordHistory *words = token.words;
+  FstWordHistory *previous = words->previous;
+  int node = 0; // The first word starts from the start node, at the beginning
+  if (previous) {
+    words->am_logprob = source.logprob - source.transition_logprob;
+    words->transition_logprob = source.transition_logprob;
+    node = word_graph_node(previous->symbol, token.node_idx);
+    word_graph.add_arc(previous->graph_node, node,
+                       words->am_logprob - previous->am_logprob,
+                       words->transition_logprob - previous->transition_logprob,
+                       m_use_word_pair_approximation);
+  }
+  words->set_graph_node(&word_graph, node);
+}
+
+template <typename T>
+void FstSearch_base<T>::write_word_graph(const std::string &file_name) {
+  if (!m_generate_word_graph) {
+    throw WordGraphNotGenerated();
+  }
+
+  FILE *file = fopen(file_name.c_str(), "w");
+  if (!file) {
+    throw IOError("Could not open word graph file for writing.");
+  }
+  write_word_graph(file);
+  fclose(file);
+}
+
+template <typename T>
+int FstSearch_base<T>::finish_word_graph() {
+  // End the last words of the final tokens at a null node
+  bool final_tokens = false;
+  for (const auto &t: m_new_tokens) {
+    if (m_fst.end_node(t.node_idx)) {
+      final_tokens = true;
+      break;
+    }
+  }
+  int end_node = word_graph.add_node(m_frame, -1, -1);
+  word_graph.link(end_node);
+  for (const auto &t: m_new_tokens) {
+    if (final_tokens && !m_fst.end_node(t.node_idx)) continue;
+    float am_logprob = t.logprob - t.transition_logprob;
+    float transition_logprob = t.transition_logprob;
+    int node = 0;
+    if (t.words) {
+      node = word_graph_node(t.words->symbol, t.node_idx);
+      word_graph.add_arc(t.words->graph_node, node,
+                         am_logprob - t.words->am_logprob,
+                         transition_logprob - t.words->transition_logprob,
+                         m_use_word_pair_approximation);
+      am_logprob = transition_logprob = 0.0f;
+    }
+    word_graph.add_arc(node, end_node, am_logprob, transition_logprob, false);
+    if (!final_tokens) break; // Only the best token
+  }
+
+  word_graph.reset_reachability();
+  word_graph.mark_reachable_nodes(end_node);
+  return end_node;
+}
+
+template <typename T>
+void FstSearch_base<T>::write_word_graph(FILE *file) {
+  if (!m_generate_word_graph) {
+    throw WordGraphNotGenerated();
+  }
+
+  int end_node = finish_word_graph();
+
+  // Count reachable nodes and arcs
+  int nodes = 0;
+  int arcs = 0;
+  for (int n = 0; n < word_graph.nodes.size(); n++) {
+    const WordGraph::Node &node = word_graph.nodes[n];
+    if (!node.reachable) continue;
+    nodes++;
+    for (int a = node.first_arc; a >= 0; a = word_graph.arcs[a].sibling_arc) {
+      arcs++;
     }
   }
-  return best_logprob;
+
+  fprintf(file, "VERSION=1.1\n"
+          "base=10\n"
+          "dir=f\n"
+          "lmscale=%f wdpenalty=%f\n"
+          "N=%d\tL=%d\n"
+          "start=0 end=%d\n", m_transition_scale, 0.0f, nodes, arcs, end_node);
+
+  for (int n = 0; n < word_graph.nodes.size(); n++) {
+    const WordGraph::Node &node = word_graph.nodes[n];
+    if (!node.reachable) continue;
+    fprintf(file, "I=%d\tt=%d\n", n, node.frame);
+  }
+
+  int arc_count = 0;
+  for (int n = 0; n < word_graph.nodes.size(); n++) {
+    const WordGraph::Node &node = word_graph.nodes[n];
+    if (!node.reachable) continue;
+
+    std::string word("!NULL");
+    if (node.symbol >= 0) {
+      word = m_fst.symbols[node.symbol];
+      if (word == "<s>" || word == "</s>")
+        word = "!NULL";
+    }
+    for (int a = node.first_arc; a >= 0; a = word_graph.arcs[a].sibling_arc) {
+      const WordGraph::Arc &arc = word_graph.arcs[a];
+      float lm_log_prob = m_transition_scale != 0.0f? arc.lm_weight / m_transition_scale: 0.0f;
+      fprintf(file, "J=%d\tS=%d\tE=%d\tW=%s\tv=0\ta=%e\tl=%e\n",
+              arc_count++, arc.source_node_id, n, word.c_str(),
+              arc.am_weight, lm_log_prob);
+    }
+  }
+
+  // Release the end node, so that the graph can be written again after more frames
+  word_graph.unlink(end_node);
+}
+
+template <typename T>
+void FstSearch_base<T>::write_binary_word_graph(const std::string &file_name) {
+  if (!m_generate_word_graph) {
+    throw WordGraphNotGenerated();
+  }
+
+  FILE *file = fopen(file_name.c_str(), "wb");
+  if (!file) {
+    throw IOError("Could not open word graph file for writing.");
+  }
+  try {
+    write_binary_word_graph(file);
+  } catch (BinaryLatticeWriter::WriteError &) {
+    fclose(file);
+    throw IOError("Could not write word graph file.");
+  }
+  if (fclose(file) != 0) {
+    throw IOError("Could not write word graph file.");
+  }
 }
 
+template <typename T>
+void FstSearch_base<T>::write_binary_word_graph(FILE *file) {
+  if (!m_generate_word_graph) {
+    throw WordGraphNotGenerated();
+  }
 
+  int end_node = finish_word_graph();
+  BinaryLatticeWriter writer(file, m_transition_scale, 0.0f);
+  const std::string null_word("!NULL");
+  for (int n = 0; n < word_graph.nodes.size(); n++) {
+    const WordGraph::Node &node = word_graph.nodes[n];
+    if (!node.reachable) continue;
+    writer.node(n, node.frame);
+
+    int symbol = node.symbol;
+    const std::string &word = symbol >= 0? m_fst.symbols[symbol]: null_word;
+    if (word == "<s>" || word == "</s>")
+      symbol = -1;
+    for (int a = node.first_arc; a >= 0; a = word_graph.arcs[a].sibling_arc) {
+      const WordGraph::Arc &arc = word_graph.arcs[a];
+      float lm_log_prob = m_transition_scale != 0.0f? arc.lm_weight / m_transition_scale: 0.0f;
+      writer.arc(arc.source_node_id, symbol, word, arc.am_weight, lm_log_prob);
+    }
+  }
+  writer.finish(0, end_node);
+
+  word_graph.unlink(end_node);
+}
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include "io.hh"
 #include "def.hh"
 #include "TreeGramArpaReader.hh"
@@ -109,3 +110,91 @@ void InterTreeGram::fetch_bigram_list(int prev_word_id,
     *it = safelogprob(*it);
   }
 }
+
+void InterTreeGram::merge(TreeGram *result) {
+  int num_models = m_models.size();
+  int num_nodes = 0;
+  for (int i=0; i<num_models; i++) {
+    if (m_models[i]->get_type() == TreeGram::INTERPOLATED)
+      m_models[i]->convert_to_backoff();
+    for (int o=1; o<=m_models[i]->order(); o++)
+      num_nodes += m_models[i]->gram_count(o);
+  }
+
+  copy_vocab_to(*result);
+  result->set_type(TreeGram::BACKOFF);
+  result->reserve_nodes(num_nodes);
+
+  // Every model has a unigram for each word of the common vocabulary
+  TreeGram::Gram gram(1);
+  for (int w=0; w<num_words(); w++) {
+    gram[0] = w;
+    result->add_gram(gram, log_prob(gram), 0);
+  }
+
+  // Higher orders are merged from the models, whose iterators visit the
+  // grams of an order in sorted order.  The back-off weight of a context
+  // is computed once all its children have been added.  It only depends
+  // on the lower orders of the result, which are complete by then.
+  std::vector<TreeGram::Iterator> iters(num_models);
+  std::vector<TreeGram::Gram> grams(num_models);
+  std::vector<bool> valid(num_models);
+  TreeGram::Gram context, suffix;
+  double prob_sum = 0, lower_prob_sum = 0;
+  for (int order=2; order<=m_order; order++) {
+    for (int i=0; i<num_models; i++) {
+      valid[i] = false;
+      if (m_models[i]->order() < order)
+        continue;
+      iters[i].reset(m_models[i]);
+      grams[i].resize(order);
+      valid[i] = iters[i].next_order(order);
+      for (int o=1; valid[i] && o<=order; o++)
+        grams[i][o-1] = iters[i].node(o).word;
+    }
+
+    context.clear();
+    while (1) {
+      int first = -1;
+      for (int i=0; i<num_models; i++) {
+        if (valid[i] && (first < 0 || grams[i] < grams[first]))
+          first = i;
+      }
+
+      // Set the back-off weight of the previous context when it changes
+      bool context_changed = first < 0 || context.empty() ||
+        !std::equal(context.begin(), context.end(), grams[first].begin());
+      if (!context.empty() && context_changed) {
+        double numerator = 1.0 - prob_sum;
+        double denominator = 1.0 - lower_prob_sum;
+        float back_off = MINLOGPROB;
+        if (numerator > 0 && denominator > 0)
+          back_off = log10(numerator / denominator);
+        result->iterator(context).node().back_off = back_off;
+      }
+      if (first < 0)
+        break;
+
+      gram = grams[first];
+      if (context_changed) {
+        context.assign(gram.begin(), gram.end() - 1);
+        prob_sum = lower_prob_sum = 0;
+      }
+
+      float lp = log_prob(gram);
+      result->add_gram(gram, lp, 0);
+      prob_sum += pow(10, lp);
+      suffix.assign(gram.begin() + 1, gram.end());
+      lower_prob_sum += pow(10, result->log_prob_bo(suffix));
+
+      for (int i=0; i<num_models; i++) {
+        if (!valid[i] || grams[i] != gram)
+          continue;
+        valid[i] = iters[i].next_order(order);
+        for (int o=1; valid[i] && o<=order; o++)
+          grams[i][o-1] = iters[i].node(o).word;
+      }
+    }
+  }
+  result->finalize();
+}
@@ -34,6 +34,21 @@ public:
 
   void test_write(std::string fname, int idx);
 
+  /// \brief Merges the models statically into a single back-off model.
+  ///
+  /// The result contains the union of the n-grams of the models. The
+  /// probability of each n-gram is the interpolated probability given by
+  /// log_prob(), and the back-off weights are renormalized so that the
+  /// probabilities of each context sum to one. Querying the result thus
+  /// gives the interpolated probability of every n-gram in the union with
+  /// a single lookup. Interpolated models are converted to back-off models
+  /// first.
+  ///
+  /// \param result An empty model that will receive the vocabulary and the
+  /// n-grams.
+  ///
+  void merge(TreeGram *result);
+
 private:
   std::vector<TreeGram *> m_models;
   std::vector<float> m_coeffs;
@@ -0,0 +1,241 @@
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <thread>
+
+#include "LMScorer.hh"
+#include "misc/str.hh"
+
+void
+LMScoreStatistics::reset()
+{
+  num_sentences = 0;
+  num_words = 0;
+  num_oovs = 0;
+  num_sentence_ends = 0;
+  log_prob = 0;
+  seconds = 0;
+}
+
+void
+LMScoreStatistics::add(const LMScoreStatistics &other)
+{
+  num_sentences += other.num_sentences;
+  num_words += other.num_words;
+  num_oovs += other.num_oovs;
+  num_sentence_ends += other.num_sentence_ends;
+  log_prob += other.log_prob;
+  seconds += other.seconds;
+}
+
+double
+LMScoreStatistics::perplexity() const
+{
+  long count = num_words - num_oovs + num_sentence_ends;
+  if (count == 0)
+    return 0;
+  return pow(10, -log_prob / count);
+}
+
+double
+LMScoreStatistics::perplexity_without_ends() const
+{
+  long count = num_words - num_oovs;
+  if (count == 0)
+    return 0;
+  return pow(10, -log_prob / count);
+}
+
+void
+LMScoreStatistics::write(FILE *file) const
+{
+  fprintf(file, "%ld sentences, %ld words, %ld OOVs\n",
+          num_sentences, num_words, num_oovs);
+  fprintf(file, "logprob= %g ppl= %g ppl1= %g\n",
+          log_prob, perplexity(), perplexity_without_ends());
+  if (seconds > 0)
+    fprintf(file, "%.2f seconds, %.0f words per second\n",
+            seconds, num_words / seconds);
+}
+
+LMScorer::LMScorer(TreeGram *lm)
+  : m_tree_gram(lm),
+    m_fsa_lm(NULL),
+    m_num_threads(1),
+    m_batch_size(1000),
+    m_empty_state(-1)
+{
+  if (lm->get_type() == TreeGram::INTERPOLATED)
+    lm->convert_to_backoff();
+  if (!lm->has_back_off_links())
+    lm->compute_back_off_links();
+  set_sentence_words("<s>", "</s>");
+}
+
+LMScorer::LMScorer(const fsalm::LM *lm)
+  : m_tree_gram(NULL),
+    m_fsa_lm(lm),
+    m_num_threads(1),
+    m_batch_size(1000),
+    m_start_word(lm->start_str),
+    m_end_word(lm->end_str),
+    m_start_index(lm->start_symbol()),
+    m_end_index(lm->end_symbol()),
+    m_initial_state(lm->initial_node_id()),
+    m_empty_state(lm->empty_node_id())
+{
+}
+
+void
+LMScorer::set_sentence_words(const std::string &start, const std::string &end)
+{
+  if (m_fsa_lm)
+    throw Error("LMScorer::set_sentence_words(): the sentence words of an "
+                "fsalm::LM are defined by the model");
+  m_start_word = start;
+  m_end_word = end;
+  m_start_index = word_index(start);
+  m_end_index = word_index(end);
+  m_initial_state = -1;
+  if (m_start_index >= 0)
+    m_initial_state = m_tree_gram->walk(-1, m_start_index);
+}
+
+int // private
+LMScorer::word_index(const std::string &word) const
+{
+  if (m_fsa_lm)
+    return m_fsa_lm->symbol_map().index_nothrow(word);
+  int index = m_tree_gram->word_index(word);
+  return index > 0 ? index : -1;
+}
+
+int // private
+LMScorer::walk(int state, int word, float *log_prob) const
+{
+  if (m_fsa_lm)
+    return m_fsa_lm->walk(state, word, log_prob);
+  return m_tree_gram->walk(state, word, log_prob);
+}
+
+double
+LMScorer::score_sentence(const std::string &line, LMScoreStatistics &stats,
+                         std::string *word_out) const
+{
+  std::vector<std::string> words = str::split(line, " \t\r\n", true);
+  if (words.empty())
+    return 0;
+  int begin = 0;
+  int end = words.size();
+  if (begin < end && words[begin] == m_start_word)
+    begin++;
+  if (begin < end && words[end - 1] == m_end_word)
+    end--;
+
+  double sentence_log_prob = 0;
+  int state = m_initial_state;
+  for (int i = begin; i < end; i++) {
+    stats.num_words++;
+    int word = word_index(words[i]);
+    float log_prob = 0;
+    if (word < 0) {
+      stats.num_oovs++;
+      state = m_empty_state;
+    }
+    else {
+      state = walk(state, word, &log_prob);
+      sentence_log_prob += log_prob;
+    }
+    if (word_out) {
+      word_out->append(words[i]);
+      word_out->append(str::fmt(64, " %g\n",
+                                word < 0 ? 0 : pow(10, log_prob)));
+    }
+  }
+
+  if (m_end_index >= 0) {
+    float log_prob = 0;
+    walk(state, m_end_index, &log_prob);
+    sentence_log_prob += log_prob;
+    stats.num_sentence_ends++;
+    if (word_out) {
+      word_out->append(m_end_word);
+      word_out->append(str::fmt(64, " %g\n", pow(10, log_prob)));
+    }
+  }
+
+  stats.num_sentences++;
+  stats.log_prob += sentence_log_prob;
+  return sentence_log_prob;
+}
+
+void // private
+LMScorer::score_lines(const std::vector<std::string> &lines, int begin,
+                      int end, LMScoreStatistics *stats,
+                      std::string *word_out) const
+{
+  for (int i = begin; i < end; i++)
+    score_sentence(lines[i], *stats, word_out);
+}
+
+LMScoreStatistics
+LMScorer::score(FILE *in, FILE *word_out)
+{
+  if (m_num_threads < 1 || m_batch_size < 1)
+    throw Error("LMScorer::score(): invalid number of threads or batch size");
+
+  std::chrono::steady_clock::time_point start_time =
+    std::chrono::steady_clock::now();
+  LMScoreStatistics total;
+  std::vector<LMScoreStatistics> stats(m_num_threads);
+  std::vector<std::string> outputs(m_num_threads);
+  std::vector<std::string> lines;
+  size_t max_lines = (size_t)m_batch_size * m_num_threads;
+  std::string line;
+  bool end_of_file = false;
+
+  while (!end_of_file) {
+    lines.clear();
+    while (lines.size() < max_lines) {
+      if (!str::read_line(line, in, true)) {
+        end_of_file = true;
+        break;
+      }
+      lines.push_back(line);
+    }
+    if (ferror(in))
+      throw Error("LMScorer::score(): read error");
+
+    // The lines are divided in contiguous ranges, so that the word output
+    // can be written in the order of the text.
+    int num_lines = lines.size();
+    if (m_num_threads == 1 || num_lines < m_num_threads)
+      score_lines(lines, 0, num_lines, &stats[0],
+                  word_out ? &outputs[0] : NULL);
+    else {
+      std::vector<std::thread> threads;
+      for (int t = 0; t < m_num_threads; t++) {
+        int begin = (long)num_lines * t / m_num_threads;
+        int end = (long)num_lines * (t + 1) / m_num_threads;
+        threads.push_back(std::thread(&LMScorer::score_lines, this,
+                                      std::cref(lines), begin, end, &stats[t],
+                                      word_out ? &outputs[t] : NULL));
+      }
+      for (int t = 0; t < m_num_threads; t++)
+        threads[t].join();
+    }
+
+    for (int t = 0; t < m_num_threads; t++) {
+      total.add(stats[t]);
+      stats[t].reset();
+      if (word_out) {
+        fputs(outputs[t].c_str(), word_out);
+        outputs[t].clear();
+      }
+    }
+  }
+
+  total.seconds = std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start_time).count();
+  return total;
+}
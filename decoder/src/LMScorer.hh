@@ -0,0 +1,115 @@
+#ifndef LMSCORER_HH
+#define LMSCORER_HH
+
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "TreeGram.hh"
+#include "fsalm/LM.hh"
+
+/// \brief Statistics of scoring text with a language model.
+struct LMScoreStatistics {
+  LMScoreStatistics() { reset(); }
+  void reset();
+  void add(const LMScoreStatistics &other);
+
+  /// \brief Perplexity over the words and the sentence ends.
+  double perplexity() const;
+
+  /// \brief Perplexity over the words only, as ppl1 of SRILM.
+  double perplexity_without_ends() const;
+
+  /// \brief Writes the statistics in a human-readable form.
+  void write(FILE *file) const;
+
+  long num_sentences;
+  long num_words; //!< Words excluding sentence start and end, including OOVs.
+  long num_oovs;
+  long num_sentence_ends; //!< Sentence ends that were scored.
+  double log_prob; //!< Log10 probability of the words and sentence ends.
+  double seconds; //!< Wall time used for scoring.
+};
+
+/// \brief Computes the probability of text one sentence per line with a
+/// TreeGram or an fsalm::LM in several threads.
+///
+/// The text is read in batches, and the lines of a batch are divided
+/// between the threads. The model is shared by the threads and not modified
+/// while scoring. Each sentence is scored by walking the context state of
+/// the model word by word, so every word takes a single lookup from the
+/// previous state instead of a lookup of the whole n-gram.
+///
+/// The sentence start is the context of the first word, and the sentence
+/// end is scored if the model has it. Explicit sentence start and end words
+/// at the ends of a line are ignored. OOV words are not scored, and the next
+/// word is scored without context.
+///
+class LMScorer {
+public:
+  struct Error : public std::runtime_error {
+    Error(const std::string &message) : std::runtime_error(message) { }
+  };
+
+  /// \brief Scores with a TreeGram.
+  ///
+  /// Computes the back-off links of the model if needed. Interpolated
+  /// models are converted to back-off models first.
+  ///
+  LMScorer(TreeGram *lm);
+
+  /// \brief Scores with an fsalm::LM.
+  LMScorer(const fsalm::LM *lm);
+
+  void set_num_threads(int num_threads) { m_num_threads = num_threads; }
+
+  /// \brief Sets the number of lines scored by each thread at a time.
+  void set_batch_size(int lines) { m_batch_size = lines; }
+
+  /// \brief Sets the names of the sentence start and end words of a
+  /// TreeGram. The defaults are "<s>" and "</s>".
+  void set_sentence_words(const std::string &start, const std::string &end);
+
+  /// \brief Scores the lines of \a in.
+  ///
+  /// \param word_out If not NULL, each scored word and its probability are
+  /// written to the file in the order of the text.
+  /// \return The statistics of the text.
+  ///
+  LMScoreStatistics score(FILE *in, FILE *word_out = NULL);
+
+  /// \brief Scores a single sentence and adds it to \a stats.
+  ///
+  /// Can be called from several threads at the same time.
+  ///
+  /// \param word_out If not NULL, the words and probabilities are appended.
+  /// \return The log10 probability of the sentence.
+  ///
+  double score_sentence(const std::string &line, LMScoreStatistics &stats,
+                        std::string *word_out = NULL) const;
+
+private:
+  /// \brief Returns the index of \a word in the model, or -1 for OOV.
+  int word_index(const std::string &word) const;
+
+  /// \brief Walks from \a state through \a word and adds the log
+  /// probability to \a log_prob.
+  int walk(int state, int word, float *log_prob) const;
+
+  void score_lines(const std::vector<std::string> &lines, int begin, int end,
+                   LMScoreStatistics *stats, std::string *word_out) const;
+
+  TreeGram *m_tree_gram;
+  const fsalm::LM *m_fsa_lm;
+  int m_num_threads;
+  int m_batch_size;
+  std::string m_start_word;
+  std::string m_end_word;
+  int m_start_index; //!< Index of the sentence start, -1 if not in the model.
+  int m_end_index; //!< Index of the sentence end, -1 if not in the model.
+  int m_initial_state; //!< State after the sentence start.
+  int m_empty_state; //!< State without context.
+};
+
+#endif /* LMSCORER_HH */
@@ -0,0 +1,112 @@
+#include "SearchStatistics.hh"
+
+void
+FrameStatistics::reset(int frame_arg)
+{
+  frame = frame_arg;
+  new_tokens = 0;
+  word_end_tokens = 0;
+  word_end_tokens_after_beam = 0;
+  tokens_before_beam = 0;
+  tokens_after_beam = 0;
+  active_tokens = 0;
+  words = 0;
+  lm_queries = 0;
+  lm_cache_hits = 0;
+  rescoring_cache_hits = 0;
+  lookahead_queries = 0;
+  lookahead_cache_hits = 0;
+  beam = 0;
+  best_log_prob = 0;
+  acoustics_time = 0;
+  propagate_time = 0;
+  prune_time = 0;
+}
+
+void
+SearchStatistics::finish_frame(int next_frame)
+{
+  if (m_enabled)
+    m_frames.push_back(m_current);
+  m_current.reset(next_frame);
+}
+
+FrameStatistics
+SearchStatistics::total() const
+{
+  FrameStatistics sum;
+  sum.reset(m_frames.size());
+  for (size_t i = 0; i < m_frames.size(); i++) {
+    const FrameStatistics & f = m_frames[i];
+    sum.new_tokens += f.new_tokens;
+    sum.word_end_tokens += f.word_end_tokens;
+    sum.word_end_tokens_after_beam += f.word_end_tokens_after_beam;
+    sum.tokens_before_beam += f.tokens_before_beam;
+    sum.tokens_after_beam += f.tokens_after_beam;
+    sum.active_tokens += f.active_tokens;
+    sum.words += f.words;
+    sum.lm_queries += f.lm_queries;
+    sum.lm_cache_hits += f.lm_cache_hits;
+    sum.rescoring_cache_hits += f.rescoring_cache_hits;
+    sum.lookahead_queries += f.lookahead_queries;
+    sum.lookahead_cache_hits += f.lookahead_cache_hits;
+    sum.beam = f.beam;
+    sum.best_log_prob = f.best_log_prob;
+    sum.acoustics_time += f.acoustics_time;
+    sum.propagate_time += f.propagate_time;
+    sum.prune_time += f.prune_time;
+  }
+  return sum;
+}
+
+// The fields in the order they are written.
+#define FRAME_STATISTICS_INT_FIELDS(F) \
+  F(frame) F(new_tokens) F(word_end_tokens) F(word_end_tokens_after_beam) \
+  F(tokens_before_beam) F(tokens_after_beam) F(active_tokens) F(words) \
+  F(lm_queries) F(lm_cache_hits) F(rescoring_cache_hits) \
+  F(lookahead_queries) F(lookahead_cache_hits)
+#define FRAME_STATISTICS_FLOAT_FIELDS(F) \
+  F(beam) F(best_log_prob) F(acoustics_time) F(propagate_time) F(prune_time)
+
+void
+SearchStatistics::write_json(FILE *file) const
+{
+  fputs("[\n", file);
+  for (size_t i = 0; i < m_frames.size(); i++) {
+    const FrameStatistics & f = m_frames[i];
+    const char *separator = "  {";
+#define WRITE_INT(name) \
+    fprintf(file, "%s\"" #name "\": %d", separator, f.name); separator = ", ";
+#define WRITE_FLOAT(name) \
+    fprintf(file, "%s\"" #name "\": %.6g", separator, (double)f.name); separator = ", ";
+    FRAME_STATISTICS_INT_FIELDS(WRITE_INT)
+    FRAME_STATISTICS_FLOAT_FIELDS(WRITE_FLOAT)
+#undef WRITE_INT
+#undef WRITE_FLOAT
+    fputs(i + 1 < m_frames.size() ? "},\n" : "}\n", file);
+  }
+  fputs("]\n", file);
+}
+
+void
+SearchStatistics::write_csv(FILE *file) const
+{
+  const char *separator = "";
+#define WRITE_NAME(name) fprintf(file, "%s" #name, separator); separator = ",";
+  FRAME_STATISTICS_INT_FIELDS(WRITE_NAME)
+  FRAME_STATISTICS_FLOAT_FIELDS(WRITE_NAME)
+#undef WRITE_NAME
+  fputs("\n", file);
+
+  for (size_t i = 0; i < m_frames.size(); i++) {
+    const FrameStatistics & f = m_frames[i];
+    separator = "";
+#define WRITE_INT(name) fprintf(file, "%s%d", separator, f.name); separator = ",";
+#define WRITE_FLOAT(name) fprintf(file, "%s%.6g", separator, (double)f.name); separator = ",";
+    FRAME_STATISTICS_INT_FIELDS(WRITE_INT)
+    FRAME_STATISTICS_FLOAT_FIELDS(WRITE_FLOAT)
+#undef WRITE_INT
+#undef WRITE_FLOAT
+    fputs("\n", file);
+  }
+}
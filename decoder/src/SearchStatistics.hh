@@ -0,0 +1,85 @@
+#ifndef SEARCHSTATISTICS_HH
+#define SEARCHSTATISTICS_HH
+
+#include <cstdio>
+#include <vector>
+
+/// \brief Token counts, cache usage and timing of one decoded frame.
+///
+/// The token counts follow the order of the pruning steps in
+/// TokenPassSearch::prune_tokens(). The times are wall clock seconds, and are
+/// only measured when the statistics are enabled. Acoustic likelihoods are
+/// evaluated lazily while tokens are propagated, so acoustics_time covers
+/// only reading or computing the frame (Acoustics::go_to()).
+///
+struct FrameStatistics {
+  FrameStatistics() { reset(-1); }
+  void reset(int frame_arg);
+
+  int frame;
+
+  int new_tokens; //!< Tokens created in other than word end nodes.
+  int word_end_tokens; //!< Tokens created in word end nodes.
+  int word_end_tokens_after_beam; //!< Word end tokens inside the word end beam.
+  int tokens_before_beam; //!< Tokens before the global beam.
+  int tokens_after_beam; //!< Tokens inside the global beam.
+  int active_tokens; //!< Tokens left after the token limit.
+  int words; //!< Words appended to LM histories.
+
+  int lm_queries; //!< N-gram scores needed at word ends.
+  int lm_cache_hits; //!< N-gram scores found from the LM score cache.
+  int rescoring_cache_hits; //!< Rescoring LM scores found from the cache.
+  int lookahead_queries; //!< LM lookahead scores needed in the lexicon nodes.
+  int lookahead_cache_hits; //!< Lookahead scores found from node buffers.
+
+  float beam; //!< Global beam after pruning (may be tightened by the limit).
+  float best_log_prob; //!< Best token score before pruning.
+
+  double acoustics_time;
+  double propagate_time;
+  double prune_time;
+};
+
+/// \brief Collects FrameStatistics of every frame since the last reset.
+///
+/// The counters of the current frame are always updated by the search, since
+/// it costs only a few increments. Storing the frames and measuring the time
+/// is enabled with set_enabled().
+///
+class SearchStatistics {
+public:
+  SearchStatistics() : m_enabled(false) { }
+
+  void set_enabled(bool enabled) { m_enabled = enabled; }
+  bool enabled() const { return m_enabled; }
+
+  /// \brief Removes the stored frames.
+  void clear() { m_frames.clear(); }
+
+  /// \brief Counters of the frame being decoded.
+  FrameStatistics & current() { return m_current; }
+
+  /// \brief Stores the counters of the current frame if enabled, and starts
+  /// counting \a next_frame.
+  void finish_frame(int next_frame);
+
+  size_t num_frames() const { return m_frames.size(); }
+  const FrameStatistics & frame(size_t index) const { return m_frames.at(index); }
+
+  /// \brief Sums of the stored frames (beam and best_log_prob are taken from
+  /// the last frame).
+  FrameStatistics total() const;
+
+  /// \brief Writes the stored frames as a JSON array of objects.
+  void write_json(FILE *file) const;
+
+  /// \brief Writes the stored frames as CSV with a header line.
+  void write_csv(FILE *file) const;
+
+private:
+  bool m_enabled;
+  FrameStatistics m_current;
+  std::vector<FrameStatistics> m_frames;
+};
+
+#endif
@@ -46,7 +46,13 @@ TPLexPrefixTree::TPLexPrefixTree(std::map<std::string,int> &hmm_map,
     m_lm_lookahead(0),
     m_silence_is_word(true),
     m_hmm_map(hmm_map),
-    m_hmms(hmms)
+    m_hmms(hmms),
+    m_dynamic_vocabulary(false),
+    m_first_dynamic_node(-1),
+    m_batch_first_node(-1),
+    m_static_words(0),
+    m_batch_words(0),
+    m_static_lm_buf_count(0)
 {
   initialize_nodes();
   m_lm_buf_count = 0;
@@ -66,6 +72,15 @@ struct delete_node
   }
 };
 
+struct node_id_less
+{
+  bool operator()(const TPLexPrefixTree::Node *a,
+                  const TPLexPrefixTree::Node *b) const
+  {
+    return a->node_id < b->node_id;
+  }
+};
+
 TPLexPrefixTree::~TPLexPrefixTree()
 {
   for_each(m_nodes.begin(), m_nodes.end(), delete_node());
@@ -104,6 +119,17 @@ void TPLexPrefixTree::initialize_lex_tree(void)
   free_cross_word_network_connection_points();
   m_silence_arcs.clear();
 
+  m_first_dynamic_node = -1;
+  m_batch_first_node = -1;
+  m_unpruned_arcs.clear();
+  m_bypassed_words.clear();
+  m_node_snapshots.clear();
+  m_batch_nodes.clear();
+  m_fan_out_flags.clear();
+  m_batch_connection_words.clear();
+  m_batch_single_hmm_words.clear();
+  m_changed_nodes.clear();
+
   if (m_cross_word_triphones)
     create_cross_word_network();
 }
@@ -312,7 +338,7 @@ void TPLexPrefixTree::add_word(std::vector<Hmm*> &hmm_list, int word_id, double
     }
   }
 
-  m_words = word_id + 1;
+  m_words = max(m_words, word_id + 1);
 }
 
 
@@ -486,7 +512,12 @@ void TPLexPrefixTree::finish_tree(void)
     fprintf(stderr, "Prefix tree: %d nodes, %d arcs\n", nodes, arcs);
   }
 
-  free_cross_word_network_connection_points();
+  // With dynamic vocabulary, the fan-in and fan-out nodes are kept for
+  // linking the words added later. The connection points are linked already.
+  if (m_dynamic_vocabulary)
+    m_fan_in_connection_nodes.clear();
+  else
+    free_cross_word_network_connection_points();
   debug_prune_dead_ends(m_root_node);
 
   // fprintf(stderr, "WARNING: silence loop not added\n");
@@ -512,6 +543,7 @@ void TPLexPrefixTree::post_process_lex_branch(Node *node,
   // Skip nodes without branches
   for (;;)
   {
+    touch_node(node);
     if (node->word_id != -1)
     {
       // Final node
@@ -527,6 +559,8 @@ void TPLexPrefixTree::post_process_lex_branch(Node *node,
           if (node->arcs.size() == 1 && prev_nodes.back()->arcs.size() == 2)
           {
             // Final node was a NULL node, we don't need it anymore
+            if (m_dynamic_vocabulary)
+              save_bypassed_word(prev_nodes.back(), node);
             if (prev_nodes.back()->arcs[0].next != prev_nodes.back())
             {
               prev_nodes.back()->arcs[0].next = node->arcs[0].next;
@@ -628,6 +662,7 @@ TPLexPrefixTree::post_process_fan_triphone(Node *node,
     return true;
   }
 
+  touch_node(node);
   out_trans_count = 0;
   for (i = 0; i < node->arcs.size(); i++) {
     if (node->arcs[i].next != node) // Skip self transitions
@@ -637,6 +672,8 @@ TPLexPrefixTree::post_process_fan_triphone(Node *node,
     }
   }
   if (out_trans_count == 0) {
+    if (m_dynamic_vocabulary)
+      save_unpruned_arcs(node);
     node->arcs.clear();
     return false; // No transitions, remove the node.
   }
@@ -661,6 +698,8 @@ TPLexPrefixTree::post_process_fan_triphone(Node *node,
       else
       {
         // Node was removed
+        if (m_dynamic_vocabulary)
+          save_unpruned_arcs(node);
         arc_it = node->arcs.erase(arc_it);
       }
     }
@@ -669,6 +708,8 @@ TPLexPrefixTree::post_process_fan_triphone(Node *node,
   }
   if (arc_count == 0) {
     // There's no transitions out from this node, remove it.
+    if (m_dynamic_vocabulary)
+      save_unpruned_arcs(node);
     node->arcs.clear();
     return false;
   }
@@ -684,9 +725,597 @@ TPLexPrefixTree::post_process_fan_triphone(Node *node,
   return true;
 }
 
+bool TPLexPrefixTree::is_lex_branch_end(Node *node)
+{
+  Node *real_next = NULL;
+  int out_trans_count = 0;
+  for (size_t i = 0; i < node->arcs.size(); i++) {
+    if (node->arcs[i].next != node) {
+      real_next = node->arcs[i].next;
+      if (++out_trans_count > 1)
+        return true;
+    }
+  }
+  return m_cross_word_triphones && real_next != NULL &&
+    (real_next->flags & NODE_FAN_IN_CONNECTION);
+}
+
+void TPLexPrefixTree::add_dynamic_word(std::vector<Hmm*> &hmm_list,
+                                       int word_id, double prob)
+{
+  if (!m_dynamic_vocabulary)
+    throw logic_error("TPLexPrefixTree::add_dynamic_word: dynamic vocabulary "
+                      "not enabled before reading the lexicon");
+  if (hmm_list.empty())
+    return;
+  if (hmm_list.size() == 1 &&
+      (hmm_list[0]->label == "_" || hmm_list[0]->label == "__"))
+    throw invalid_argument("TPLexPrefixTree::add_dynamic_word: silence");
+  if (safe_log(prob) <= -99)
+    return;
+
+  if (m_batch_first_node < 0)
+    begin_dynamic_words();
+
+  // Follow the states of the word as far as they exist in the tree, like
+  // expand_lexical_tree() does. The last triphone is in the cross word
+  // network. The arcs that post_process_lex_branch() redirected to the
+  // fan-out network are skipped.
+  size_t tree_hmms = hmm_list.size();
+  if (m_cross_word_triphones && hmm_list.back()->label.size() == 5)
+    tree_hmms--;
+  node_vector path;
+  int connection = -1; // Index of the first state of the second triphone
+  Node *node = m_root_node;
+  for (size_t i = 0; i < tree_hmms && node != NULL; i++) {
+    Hmm *hmm = hmm_list[i];
+    for (size_t s = 2; s < hmm->states.size() && node != NULL; s++) {
+      Node *next = NULL;
+      for (size_t a = 0; a < node->arcs.size() && next == NULL; a++) {
+        Node *target = node->arcs[a].next;
+        if (target->state != NULL && !(target->flags & NODE_FAN_OUT) &&
+            target->state->model == hmm->state(s).model)
+          next = target;
+      }
+      if (next != NULL && next != node) {
+        if (i == 1 && s == 2)
+          connection = path.size();
+        path.push_back(next);
+      }
+      node = next;
+    }
+  }
+
+  // The branches that post_process_lex_branch() started on the path. The
+  // word leaves the tree on the last one.
+  Node *last = path.empty() ? m_root_node : path.back();
+  std::vector<bool> branch_start(path.size(), false);
+  size_t branch = 0;
+  for (size_t p = 0; p < path.size(); p++) {
+    branch_start[p] = p == 0 || is_lex_branch_end(path[p - 1]);
+    if (branch_start[p])
+      branch = p;
+  }
+  bool word_branch = !path.empty() && path[branch]->state != NULL &&
+    path[branch]->word_id != -1;
+  bool last_branch_end = path.empty() || is_lex_branch_end(last);
+
+  // If the second triphone becomes a connection point of the cross word
+  // network, the branch that contains it is split there.
+  bool new_connection = m_cross_word_triphones && hmm_list.size() > 2 &&
+    hmm_list[0]->label.size() == 5 && connection >= 0 &&
+    !(path[connection]->flags & NODE_FAN_IN_CONNECTION);
+  int split = -1;
+  if (new_connection && !branch_start[connection])
+    split = connection;
+
+  touch_node(last);
+  for (size_t p = 0; p < path.size(); p++)
+    touch_node(path[p]);
+
+  // The new branches that split an old one start with the lookahead list of
+  // the old branch.
+  node_vector new_branches;
+  if (!word_branch && !last_branch_end) {
+    for (size_t a = 0; a < last->arcs.size(); a++) {
+      if (last->arcs[a].next != last) {
+        new_branches.push_back(last->arcs[a].next);
+        break;
+      }
+    }
+    if (m_lm_lookahead && !new_branches.empty()) {
+      touch_node(new_branches.back());
+      new_branches.back()->possible_word_id_list =
+        path[branch]->possible_word_id_list;
+    }
+  }
+  if (split >= 0 && (!word_branch || split < (int)branch)) {
+    size_t p = split - 1;
+    while (!branch_start[p])
+      p--;
+    new_branches.push_back(path[split]);
+    if (m_lm_lookahead)
+      path[split]->possible_word_id_list = path[p]->possible_word_id_list;
+  }
+
+  if (word_branch)
+    restore_lex_branch(path[branch]);
+
+  size_t last_arcs = last->arcs.size();
+  int first_node = m_nodes.size();
+  add_word(hmm_list, word_id, prob);
+  if (!m_cross_word_triphones) {
+    // Make the tree re-entrant like finish_tree().
+    for (size_t i = first_node; i < m_nodes.size(); i++) {
+      for (size_t j = 0; j < m_nodes[i]->arcs.size(); j++) {
+        if (m_nodes[i]->arcs[j].next == m_end_node)
+          m_nodes[i]->arcs[j].next = m_root_node;
+      }
+    }
+  }
+
+  // Process the changed branch again, and add the word to the lookahead
+  // lists of the branches before it.
+  std::vector<int> words;
+  if (word_branch) {
+    post_process_lex_branch(path[branch], &words);
+  }
+  else {
+    for (size_t a = last_arcs; a < last->arcs.size(); a++)
+      post_process_lex_branch(last->arcs[a].next, &words);
+  }
+  if (m_lm_lookahead) {
+    size_t end = word_branch ? branch : path.size();
+    for (size_t p = 0; p < end; p++) {
+      if (branch_start[p] || (int)p == split)
+        path[p]->possible_word_id_list.push_back(word_id);
+    }
+    for (size_t i = 0; i < new_branches.size(); i++) {
+      if (new_branches[i]->possible_word_id_list.size() > 0)
+        m_lm_buf_count++;
+    }
+  }
+
+  // Remember the words linked from the cross word network, see add_word().
+  // If an old node became a connection point, the old words after it are
+  // linked too.
+  if (m_cross_word_triphones && hmm_list[0]->label.size() == 5) {
+    const std::string &label = hmm_list[0]->label;
+    if (hmm_list.size() == 1) {
+      m_batch_single_hmm_words[label.substr(2, 1)].push_back(word_id);
+    }
+    else if (hmm_list.size() > 2 || hmm_list[1]->label.size() == 5) {
+      std::vector<int> &connection_words =
+        m_batch_connection_words[label.substr(2, 1) + label.substr(4, 1)];
+      connection_words.push_back(word_id);
+      if (new_connection) {
+        Node *connection_node = path[connection];
+        if (connection_node->word_id != -1)
+          connection_words.push_back(connection_node->word_id);
+        else
+          connection_words.insert(
+            connection_words.end(),
+            connection_node->possible_word_id_list.begin(),
+            connection_node->possible_word_id_list.end());
+      }
+    }
+  }
+}
+
+void TPLexPrefixTree::finish_dynamic_words()
+{
+  if (m_batch_first_node < 0)
+    return;
+
+  for (size_t i = 0; i < m_fan_out_flags.size(); i++)
+    m_fan_out_flags[i].first->flags = m_fan_out_flags[i].second;
+  m_fan_out_flags.clear();
+
+  if (m_cross_word_triphones)
+  {
+    // Link the new fan-out triphones and the new connection points, like
+    // finish_tree().
+    string_to_nodes_map::const_iterator fan_out_it =
+      m_fan_out_last_nodes.begin();
+    while (fan_out_it != m_fan_out_last_nodes.end()) {
+      const node_vector & nlist = fan_out_it->second;
+      for (size_t i = 0; i < nlist.size(); i++) {
+        if (nlist[i]->node_id >= m_batch_first_node)
+          link_fan_out_node_to_fan_in(nlist[i], fan_out_it->first);
+      }
+      ++fan_out_it;
+    }
+
+    link_fan_in_nodes();
+    m_fan_in_connection_nodes.clear();
+  }
+
+  for (size_t i = 0; i < m_silence_arcs.size(); i++) {
+    m_silence_arcs[i].node->arcs[m_silence_arcs[i].arc_index].next
+      = m_silence_node;
+  }
+  m_silence_arcs.clear();
+
+  // The nodes that were pruned before are pruned again from their current
+  // arcs.
+  node_vector pruned;
+  std::map<Node*, std::vector<Arc> >::iterator arcs_it =
+    m_unpruned_arcs.begin();
+  for (; arcs_it != m_unpruned_arcs.end(); ++arcs_it) {
+    arcs_it->second = arcs_it->first->arcs;
+    pruned.push_back(arcs_it->first);
+  }
+
+  if (m_cross_word_triphones) {
+    if (m_lm_lookahead)
+      add_dynamic_words_to_fan_in();
+    prune_dynamic_fan_in(pruned);
+  }
+
+  prune_dynamic_dead_ends(node_vector(m_batch_nodes.begin(),
+                                      m_batch_nodes.end()));
+
+  m_changed_nodes.insert(m_changed_nodes.end(), m_batch_nodes.begin(),
+                         m_batch_nodes.end());
+  m_changed_nodes.insert(m_changed_nodes.end(),
+                         m_nodes.begin() + m_batch_first_node, m_nodes.end());
+  if (m_verbose > 1)
+    fprintf(stderr, "Added %d nodes to the prefix tree\n",
+            (int)m_nodes.size() - m_batch_first_node);
+
+  m_batch_nodes.clear();
+  m_batch_connection_words.clear();
+  m_batch_single_hmm_words.clear();
+  m_batch_first_node = -1;
+}
+
+void TPLexPrefixTree::remove_dynamic_words()
+{
+  finish_dynamic_words();
+  if (m_first_dynamic_node < 0)
+    return;
+
+  node_vector changed;
+  for (size_t i = 0; i < m_changed_nodes.size(); i++) {
+    if (m_changed_nodes[i]->node_id < m_first_dynamic_node)
+      changed.push_back(m_changed_nodes[i]);
+  }
+
+  std::map<Node*, NodeSnapshot>::const_iterator it = m_node_snapshots.begin();
+  for (; it != m_node_snapshots.end(); ++it) {
+    Node *node = it->first;
+    const NodeSnapshot &snapshot = it->second;
+    node->word_id = snapshot.word_id;
+    node->flags = snapshot.flags;
+    node->arcs = snapshot.arcs;
+    node->possible_word_id_list.resize(snapshot.list_size);
+    if (snapshot.pruned)
+      m_unpruned_arcs[node] = snapshot.unpruned_arcs;
+    else
+      m_unpruned_arcs.erase(node);
+    if (snapshot.bypassed)
+      m_bypassed_words[node] = snapshot.bypassed_word;
+    else
+      m_bypassed_words.erase(node);
+    changed.push_back(node);
+  }
+  m_node_snapshots.clear();
+  m_changed_nodes.swap(changed);
+
+  // Forget the new nodes.
+  std::map<Node*, std::vector<Arc> >::iterator arcs_it =
+    m_unpruned_arcs.begin();
+  while (arcs_it != m_unpruned_arcs.end()) {
+    if (arcs_it->first->node_id >= m_first_dynamic_node)
+      m_unpruned_arcs.erase(arcs_it++);
+    else
+      ++arcs_it;
+  }
+  std::map<Node*, BypassedWord>::iterator bypassed_it =
+    m_bypassed_words.begin();
+  while (bypassed_it != m_bypassed_words.end()) {
+    if (bypassed_it->first->node_id >= m_first_dynamic_node)
+      m_bypassed_words.erase(bypassed_it++);
+    else
+      ++bypassed_it;
+  }
+
+  // The new nodes are at the end of the lists of the cross word network.
+  string_to_nodes_map *fan_maps[] = { &m_fan_out_entry_nodes,
+                                      &m_fan_out_last_nodes,
+                                      &m_fan_in_entry_nodes,
+                                      &m_fan_in_last_nodes };
+  for (size_t m = 0; m < sizeof(fan_maps) / sizeof(fan_maps[0]); m++) {
+    string_to_nodes_map::iterator fan_it = fan_maps[m]->begin();
+    while (fan_it != fan_maps[m]->end()) {
+      node_vector &nlist = fan_it->second;
+      while (!nlist.empty() && nlist.back()->node_id >= m_first_dynamic_node)
+        nlist.pop_back();
+      if (nlist.empty())
+        fan_maps[m]->erase(fan_it++);
+      else
+        ++fan_it;
+    }
+  }
+
+  for_each(m_nodes.begin() + m_first_dynamic_node, m_nodes.end(),
+           delete_node());
+  m_nodes.resize(m_first_dynamic_node);
+  m_words = m_static_words;
+  m_lm_buf_count = m_static_lm_buf_count;
+  m_first_dynamic_node = -1;
+}
+
+void TPLexPrefixTree::begin_dynamic_words()
+{
+  if (m_first_dynamic_node < 0) {
+    m_first_dynamic_node = m_nodes.size();
+    m_static_words = m_words;
+    m_static_lm_buf_count = m_lm_buf_count;
+  }
+  m_batch_first_node = m_nodes.size();
+  m_batch_words = m_words;
+
+  // get_fan_out_last_node() resets the flags of the nodes it returns.
+  string_to_nodes_map::const_iterator it = m_fan_out_last_nodes.begin();
+  for (; it != m_fan_out_last_nodes.end(); ++it) {
+    for (size_t i = 0; i < it->second.size(); i++) {
+      Node *node = it->second[i];
+      m_fan_out_flags.push_back(std::make_pair(node, node->flags));
+    }
+  }
+
+  std::map<Node*, std::vector<Arc> >::const_iterator arcs_it =
+    m_unpruned_arcs.begin();
+  for (; arcs_it != m_unpruned_arcs.end(); ++arcs_it) {
+    touch_node(arcs_it->first);
+    arcs_it->first->arcs = arcs_it->second;
+  }
+}
+
+void TPLexPrefixTree::restore_lex_branch(Node *node)
+{
+  Node *word_node = node;
+  for (;;) {
+    if (word_node != node) {
+      touch_node(word_node);
+      word_node->flags &= ~(NODE_AFTER_WORD_ID|NODE_USE_WORD_END_BEAM);
+    }
+    std::map<Node*, BypassedWord>::iterator it =
+      m_bypassed_words.find(word_node);
+    if (it != m_bypassed_words.end()) {
+      Arc &arc = word_node->arcs[it->second.arc_index];
+      arc.next = it->second.word_node;
+      arc.log_prob = it->second.log_prob;
+      word_node = it->second.word_node;
+      m_bypassed_words.erase(it);
+      break;
+    }
+    Node *next = NULL;
+    for (size_t i = 0; i < word_node->arcs.size() && next == NULL; i++) {
+      if (word_node->arcs[i].next != word_node)
+        next = word_node->arcs[i].next;
+    }
+    assert(next != NULL);
+    word_node = next;
+    if (word_node->state == NULL)
+      break;
+  }
+  touch_node(word_node);
+  word_node->word_id = node->word_id;
+  word_node->flags &= ~NODE_AFTER_WORD_ID;
+  node->word_id = -1;
+}
+
+void TPLexPrefixTree::save_bypassed_word(Node *node, Node *word_node)
+{
+  BypassedWord bypassed;
+  bypassed.word_node = word_node;
+  bypassed.arc_index = (node->arcs[0].next != node ? 0 : 1);
+  bypassed.log_prob = node->arcs[bypassed.arc_index].log_prob;
+  m_bypassed_words[node] = bypassed;
+}
+
+void TPLexPrefixTree::save_unpruned_arcs(Node *node)
+{
+  touch_node(node);
+  m_unpruned_arcs.insert(std::make_pair(node, node->arcs));
+}
+
+void TPLexPrefixTree::touch_node(Node *node)
+{
+  if (m_batch_first_node < 0 || node->node_id >= m_batch_first_node)
+    return;
+  if (!m_batch_nodes.insert(node).second)
+    return;
+  if (node->node_id >= m_first_dynamic_node ||
+      m_node_snapshots.find(node) != m_node_snapshots.end())
+    return;
+
+  NodeSnapshot &snapshot = m_node_snapshots[node];
+  snapshot.word_id = node->word_id;
+  snapshot.flags = node->flags;
+  snapshot.arcs = node->arcs;
+  snapshot.list_size = node->possible_word_id_list.size();
+  std::map<Node*, std::vector<Arc> >::const_iterator arcs_it =
+    m_unpruned_arcs.find(node);
+  snapshot.pruned = arcs_it != m_unpruned_arcs.end();
+  if (snapshot.pruned)
+    snapshot.unpruned_arcs = arcs_it->second;
+  std::map<Node*, BypassedWord>::const_iterator bypassed_it =
+    m_bypassed_words.find(node);
+  snapshot.bypassed = bypassed_it != m_bypassed_words.end();
+  if (snapshot.bypassed)
+    snapshot.bypassed_word = bypassed_it->second;
+}
+
+void TPLexPrefixTree::add_dynamic_words_to_fan_in()
+{
+  // The fan-in last nodes that were linked to the new words, and the central
+  // phonemes of their keys.
+  std::map<Node*, std::vector<int> > last_words;
+  std::set<std::string> centers;
+  std::map<std::string, std::vector<int> >::const_iterator words_it;
+  string_to_nodes_map::const_iterator it;
+  for (words_it = m_batch_connection_words.begin();
+       words_it != m_batch_connection_words.end(); ++words_it) {
+    it = m_fan_in_last_nodes.find(words_it->first);
+    if (it == m_fan_in_last_nodes.end())
+      continue;
+    for (size_t i = 0; i < it->second.size(); i++) {
+      std::vector<int> &words = last_words[it->second[i]];
+      words.insert(words.end(), words_it->second.begin(),
+                   words_it->second.end());
+    }
+    centers.insert(words_it->first.substr(0, 1));
+  }
+  for (words_it = m_batch_single_hmm_words.begin();
+       words_it != m_batch_single_hmm_words.end(); ++words_it) {
+    for (it = m_fan_in_last_nodes.begin(); it != m_fan_in_last_nodes.end();
+         ++it) {
+      if (it->first.compare(0, 1, words_it->first) != 0)
+        continue;
+      for (size_t i = 0; i < it->second.size(); i++) {
+        std::vector<int> &words = last_words[it->second[i]];
+        words.insert(words.end(), words_it->second.begin(),
+                     words_it->second.end());
+      }
+    }
+    centers.insert(words_it->first);
+  }
+
+  std::map<Node*, std::vector<int> > new_words;
+  node_vector unlisted;
+  for (it = m_fan_in_entry_nodes.begin(); it != m_fan_in_entry_nodes.end();
+       ++it) {
+    if (it->first.size() < 2 ||
+        centers.find(it->first.substr(1, 1)) == centers.end())
+      continue;
+    for (size_t i = 0; i < it->second.size(); i++)
+      add_dynamic_words_to_fan_in_node(it->second[i], last_words, new_words,
+                                       unlisted);
+  }
+
+  // The children come before their parents, so the lists of the children
+  // are ready when they are copied.
+  for (size_t i = 0; i < unlisted.size(); i++)
+    post_process_fan_triphone(unlisted[i], NULL, true);
+}
+
+const std::vector<int> &
+TPLexPrefixTree::add_dynamic_words_to_fan_in_node(
+  Node *node, const std::map<Node*, std::vector<int> > &last_words,
+  std::map<Node*, std::vector<int> > &new_words, node_vector &unlisted)
+{
+  std::map<Node*, std::vector<int> >::iterator it = new_words.find(node);
+  if (it != new_words.end())
+    return it->second;
+
+  std::vector<int> words;
+  std::map<Node*, std::vector<int> >::const_iterator last_it =
+    last_words.find(node);
+  if (last_it != last_words.end())
+    words = last_it->second;
+  int out_trans_count = 0;
+  for (size_t i = 0; i < node->arcs.size(); i++) {
+    Node *next = node->arcs[i].next;
+    if (next == node)
+      continue;
+    out_trans_count++;
+    if (next->flags & NODE_FAN_IN) {
+      const std::vector<int> &next_words =
+        add_dynamic_words_to_fan_in_node(next, last_words, new_words,
+                                         unlisted);
+      words.insert(words.end(), next_words.begin(), next_words.end());
+    }
+  }
+  std::sort(words.begin(), words.end());
+  words.erase(std::unique(words.begin(), words.end()), words.end());
+
+  if (!words.empty()) {
+    std::vector<int> &list = node->possible_word_id_list;
+    if (!list.empty()) {
+      touch_node(node);
+      for (size_t i = 0; i < words.size(); i++) {
+        if (words[i] >= m_batch_words ||
+            find(list.begin(), list.end(), words[i]) == list.end())
+          list.push_back(words[i]);
+      }
+    }
+    else if (out_trans_count > 1 || (node->flags & NODE_FAN_IN_FIRST)) {
+      unlisted.push_back(node);
+    }
+  }
+
+  std::vector<int> &result = new_words[node];
+  result.swap(words);
+  return result;
+}
+
+void TPLexPrefixTree::prune_dynamic_fan_in(const node_vector &nodes)
+{
+  std::map<Node*, bool> alive;
+  for (size_t i = 0; i < nodes.size(); i++) {
+    Node *node = nodes[i];
+    if (!(node->flags & NODE_FAN_IN))
+      continue;
+    if (!is_fan_in_node_alive(node, alive)) {
+      node->arcs.clear();
+      continue;
+    }
+    std::vector<Arc>::iterator arc_it = node->arcs.begin();
+    while (arc_it != node->arcs.end()) {
+      Node *next = arc_it->next;
+      if (next != node && (next->flags & NODE_FAN_IN) &&
+          !is_fan_in_node_alive(next, alive))
+        arc_it = node->arcs.erase(arc_it);
+      else
+        ++arc_it;
+    }
+  }
+}
+
+bool TPLexPrefixTree::is_fan_in_node_alive(Node *node,
+                                           std::map<Node*, bool> &alive)
+{
+  std::map<Node*, bool>::const_iterator it = alive.find(node);
+  if (it != alive.end())
+    return it->second;
+
+  bool result = false;
+  for (size_t i = 0; i < node->arcs.size() && !result; i++) {
+    Node *next = node->arcs[i].next;
+    if (next != node && (!(next->flags & NODE_FAN_IN) ||
+                         is_fan_in_node_alive(next, alive)))
+      result = true;
+  }
+  alive[node] = result;
+  return result;
+}
+
+void TPLexPrefixTree::prune_dynamic_dead_ends(node_vector nodes)
+{
+  // debug_prune_dead_ends() visits only the nodes not yet marked. The nodes
+  // that were reached from the root before are visited again.
+  std::sort(nodes.begin(), nodes.end(), node_id_less());
+  std::vector<bool> reached(nodes.size());
+  for (size_t i = 0; i < nodes.size(); i++) {
+    reached[i] = (nodes[i]->flags & NODE_DEBUG_PRUNED) != 0;
+    nodes[i]->flags &= ~NODE_DEBUG_PRUNED;
+  }
+  for (size_t i = 0; i < nodes.size(); i++) {
+    if (reached[i] && !(nodes[i]->flags & NODE_DEBUG_PRUNED))
+      debug_prune_dead_ends(nodes[i]);
+  }
+}
+
 void TPLexPrefixTree::set_sentence_boundary(int sentence_start_id,
                                             int sentence_end_id)
 {
+  if (m_first_dynamic_node >= 0)
+    throw logic_error("TPLexPrefixTree::set_sentence_boundary: "
+                      "words added to the lexicon");
+
   // Add nodes containing the sentence start and end word ids
   TPLexPrefixTree::Node * sentence_end_node = new Node(sentence_end_id);
   sentence_end_node->node_id = m_nodes.size();
@@ -953,7 +1582,14 @@ TPLexPrefixTree::add_single_hmm_word_for_cross_word_modeling(
       //   2013-02-28 / SE
       for (i = 0; i < nlist.size(); i++) {
         temp_arc.log_prob = get_out_transition_log_prob(nlist[i]) + word_log_prob;
-        nlist[i]->arcs.push_back(temp_arc);
+        // Keep the links to the second triphones of the words last, as if
+        // they were created after adding all the words.
+        std::vector<Arc> &arcs = nlist[i]->arcs;
+        size_t pos = arcs.size();
+        while (pos > 0 && (arcs[pos - 1].next->flags & NODE_FAN_IN_CONNECTION))
+          pos--;
+        touch_node(nlist[i]);
+        arcs.insert(arcs.begin() + pos, temp_arc);
       }
 
       if (right == "_")
@@ -1031,6 +1667,7 @@ void TPLexPrefixTree::create_lex_tree_links_from_fan_in(Node *fan_in_node,
           // Link
           temp_arc.next = it->second[j];
           temp_arc.log_prob = get_out_transition_log_prob(fan_in_node);
+          touch_node(fan_in_node);
           fan_in_node->arcs.push_back(temp_arc);
         }
       }
@@ -1253,6 +1890,10 @@ float TPLexPrefixTree::get_out_transition_log_prob(Node *node)
 
 void TPLexPrefixTree::prune_lookahead_buffers(int min_delta, int max_depth)
 {
+  if (m_dynamic_vocabulary)
+    throw logic_error("TPLexPrefixTree::prune_lookahead_buffers: "
+                      "dynamic vocabulary");
+
   if (m_verbose > 1)
     printf("LM lookahead buffers before pruning: %d\n", m_lm_buf_count);
   m_lm_buf_count = 0;
@@ -1311,6 +1952,27 @@ void TPLexPrefixTree::set_lm_lookahead_cache_sizes(int cache_size)
       m_nodes[i]->lm_lookahead_buffer.set_max_items(cache_size);
 }
 
+void TPLexPrefixTree::set_possible_lookahead_ids(
+  const std::vector<int> &lookahead_ids)
+{
+  set_possible_lookahead_ids(lookahead_ids, m_nodes);
+}
+
+void TPLexPrefixTree::set_possible_lookahead_ids(
+  const std::vector<int> &lookahead_ids, const node_vector &nodes)
+{
+  for (size_t i = 0; i < nodes.size(); i++) {
+    Node *node = nodes[i];
+    std::vector<int> &ids = node->possible_lookahead_id_list;
+    ids.clear();
+    for (int j = 0; j < node->possible_word_id_list.size(); j++)
+      ids.push_back(lookahead_ids.at(node->possible_word_id_list[j]));
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    std::vector<int>(ids).swap(ids);
+  }
+}
+
 void TPLexPrefixTree::clear_node_token_lists(void)
 {
   for (int i = 0; i < m_nodes.size(); i++) {
@@ -1359,19 +2021,25 @@ void TPLexPrefixTree::print_lookahead_info(int node, const Vocabulary &voc)
 
 void TPLexPrefixTree::debug_prune_dead_ends(Node *node)
 {
+  touch_node(node);
   for (int i = 0; i < node->arcs.size(); i++) {
     node->flags |= NODE_DEBUG_PRUNED;
     Node *target = node->arcs[i].next;
     if (!(target->flags & NODE_DEBUG_PRUNED))
       debug_prune_dead_ends(target);
     if (target->arcs.empty()) {
+      if (m_dynamic_vocabulary)
+        save_unpruned_arcs(node);
       node->arcs[i] = node->arcs.back();
       node->arcs.pop_back();
       i--;
     }
   }
-  if (node->arcs.size() == 1 && node->arcs[0].next == node)
+  if (node->arcs.size() == 1 && node->arcs[0].next == node) {
+    if (m_dynamic_vocabulary)
+      save_unpruned_arcs(node);
     node->arcs.clear();
+  }
 
   /*if (node->arcs.empty() && !(node->flags & NODE_FINAL))
     fprintf(stderr, "debug_prune_dead_ends: pruned node %d\n", node->node_id);*/
@@ -3,6 +3,7 @@
 
 #include <cstddef>  // NULL
 #include <vector>
+#include <set>
 #include <cassert>
 #include <cmath>
 
@@ -107,6 +108,11 @@ public:
     unsigned short flags;
 
     std::vector<int> possible_word_id_list;
+
+    /// Lookahead LM IDs of possible_word_id_list without duplicates, when
+    /// the lookahead is computed in class space.
+    std::vector<int> possible_lookahead_id_list;
+
     SimpleHashCache<float> lm_lookahead_buffer;
   };
 
@@ -190,12 +196,87 @@ public:
   void add_word(std::vector<Hmm*> &hmm_list, int word_id, double prob);
 
   void finish_tree(void);
-  
+
+  /// \brief Allows adding words to a finished tree.
+  ///
+  /// Has to be set before reading the lexicon. The connection points of the
+  /// cross word network are then kept after finish_tree(), and the arcs that
+  /// it prunes are recorded, so that the words added later can be linked
+  /// like the words of the lexicon.
+  ///
+  void set_dynamic_vocabulary(bool dynamic) { m_dynamic_vocabulary = dynamic; }
+
+  /// \brief Adds a word to a finished tree.
+  ///
+  /// The path of the word is followed from the root node as far as it is
+  /// shared with the tree. Where the word leaves the shared prefix, the word
+  /// identity that finish_tree() moved towards the root on that branch is
+  /// moved back, the new states are added, and the branch is processed
+  /// again. The word is added to the lookahead lists along the shared prefix.
+  /// The result is the same as adding the word last before finish_tree().
+  /// This assumes that the shared prefix is a single path of nodes, which
+  /// holds for left-to-right HMMs without skips.
+  ///
+  /// The cross word network is updated in finish_dynamic_words(). The network
+  /// may not contain tokens, so words can be added only between utterances.
+  ///
+  /// \exception logic_error If set_dynamic_vocabulary() was not enabled.
+  /// \exception invalid_argument If the pronunciation is a silence model.
+  ///
+  void add_dynamic_word(std::vector<Hmm*> &hmm_list, int word_id, double prob);
+
+  /// \brief Links the words given to add_dynamic_word() to the cross word
+  /// network.
+  ///
+  /// The new fan-out triphones are linked to the fan-in, and the fan-in to
+  /// the second triphones of the new words. The new words are added to the
+  /// lookahead lists of the fan-in nodes that lead to them. The nodes that
+  /// finish_tree() pruned are then pruned again, so that the nodes the new
+  /// words made reachable are kept.
+  ///
+  void finish_dynamic_words();
+
+  /// \brief Removes all the words added with add_dynamic_word() since the
+  /// lexicon was read.
+  ///
+  /// The nodes that were changed are restored, and the new nodes deleted.
+  ///
+  void remove_dynamic_words();
+
+  /// \brief Returns the nodes whose lookahead lists may have changed when
+  /// words were added or removed after the last clear_changed_nodes().
+  ///
+  const node_vector &changed_nodes() const { return m_changed_nodes; }
+  void clear_changed_nodes() { m_changed_nodes.clear(); }
+
+  /// \brief Removes lookahead lists that differ little from the lists
+  /// closer to the root.
+  ///
+  /// \exception logic_error With a dynamic vocabulary, since the lists of
+  /// the added words could not be pruned in the same way.
+  ///
   void prune_lookahead_buffers(int min_delta, int max_depth);
   void set_lm_lookahead_cache_sizes(int cache_size);
 
+  /// \brief Fills the possible_lookahead_id_list of each node.
+  ///
+  /// \param lookahead_ids The lookahead LM ID of each word ID.
+  ///
+  void set_possible_lookahead_ids(const std::vector<int> &lookahead_ids);
+
+  /// \brief Fills the possible_lookahead_id_list of the given nodes.
+  ///
+  void set_possible_lookahead_ids(const std::vector<int> &lookahead_ids,
+                                  const node_vector &nodes);
+
   void set_word_boundary_id(int id) { m_word_boundary_id = id; }
   void set_optional_short_silence(bool state) { m_optional_short_silence = state; }
+
+  /// \brief Adds the sentence end node after the silence.
+  ///
+  /// \exception logic_error If words have been added with
+  /// add_dynamic_word(), since removing them would remove the node.
+  ///
   void set_sentence_boundary(int sentence_start_id, int sentence_end_id);
 
   void clear_node_token_lists(void);
@@ -335,6 +416,74 @@ private:
   void prune_lm_la_buffer(int delta_thr, int depth_thr,
                           Node *node, int last_size, int cur_depth);
 
+  /// \brief Returns true if post_process_lex_branch() ends a branch at
+  /// \a node, that is, the children of the node start branches of their own.
+  ///
+  bool is_lex_branch_end(Node *node);
+
+  /// \brief Starts a batch of words to add to a finished tree.
+  ///
+  /// Links again the arcs that were pruned, so that the tree can be extended
+  /// like before finish_tree().
+  ///
+  void begin_dynamic_words();
+
+  /// \brief Moves the word identity from the first node of a branch back to
+  /// the word end, undoing post_process_lex_branch().
+  ///
+  /// \param node A node that post_process_lex_branch() gave a word identity.
+  ///
+  void restore_lex_branch(Node *node);
+
+  /// \brief Stores the arc that post_process_lex_branch() made to skip a word
+  /// end node, so that restore_lex_branch() can link the node again.
+  ///
+  void save_bypassed_word(Node *node, Node *word_node);
+
+  /// \brief Stores the arcs of a node before they are pruned.
+  ///
+  void save_unpruned_arcs(Node *node);
+
+  /// \brief Records a node that is changed by adding words.
+  ///
+  /// The first time an old node is changed, it is copied so that
+  /// remove_dynamic_words() can restore it. Does nothing for the nodes of
+  /// the current batch, or if no words are being added.
+  ///
+  void touch_node(Node *node);
+
+  /// \brief Adds the new words to the lookahead lists of the fan-in nodes.
+  ///
+  /// The lists that already exist are extended. The nodes that had no list
+  /// are processed again with post_process_fan_triphone().
+  ///
+  void add_dynamic_words_to_fan_in();
+
+  /// \brief Finds the new words that can be reached from a fan-in node, and
+  /// adds them to the lookahead list of the node.
+  ///
+  /// \param last_words The new words linked to each fan-in last node.
+  /// \param new_words The new words reachable from each visited node.
+  /// \param unlisted The nodes that need a new lookahead list.
+  /// \return The new words reachable from \a node.
+  ///
+  const std::vector<int> &add_dynamic_words_to_fan_in_node(
+    Node *node, const std::map<Node*, std::vector<int> > &last_words,
+    std::map<Node*, std::vector<int> > &new_words, node_vector &unlisted);
+
+  /// \brief Prunes the given fan-in nodes like post_process_fan_triphone().
+  ///
+  void prune_dynamic_fan_in(const node_vector &nodes);
+
+  /// \brief Returns true if a word can be reached from a fan-in node.
+  ///
+  bool is_fan_in_node_alive(Node *node, std::map<Node*, bool> &alive);
+
+  /// \brief Prunes the given nodes like debug_prune_dead_ends() from the
+  /// root, together with the nodes that become reachable from them.
+  ///
+  void prune_dynamic_dead_ends(node_vector nodes);
+
 private:
   int m_words; // Largest word_id in the nodes plus one
   Node *m_root_node;
@@ -365,6 +514,57 @@ private:
   string_to_nodes_map m_fan_in_last_nodes;
   string_to_nodes_map m_fan_in_connection_nodes;
   std::vector<NodeArcId> m_silence_arcs;
+
+  /// \brief A word end node that post_process_lex_branch() skipped.
+  struct BypassedWord {
+    Node *word_node;
+    int arc_index; // The arc that led to the word end node
+    float log_prob; // The log probability of the arc before skipping
+  };
+
+  /// \brief The state of an old node before words were added.
+  struct NodeSnapshot {
+    int word_id;
+    unsigned short flags;
+    std::vector<Arc> arcs;
+    int list_size;
+    bool pruned;
+    std::vector<Arc> unpruned_arcs;
+    bool bypassed;
+    BypassedWord bypassed_word;
+  };
+
+  bool m_dynamic_vocabulary;
+  int m_first_dynamic_node; // node_id of the first added node, or -1
+  int m_batch_first_node; // node_id of the first node of the batch, or -1
+  int m_static_words; // m_words before adding words
+  int m_batch_words; // m_words before the batch
+  int m_static_lm_buf_count; // m_lm_buf_count before adding words
+
+  /// The arcs of the nodes before they were pruned (only with dynamic
+  /// vocabulary).
+  std::map<Node*, std::vector<Arc> > m_unpruned_arcs;
+
+  /// The word end nodes skipped by post_process_lex_branch(), by the node
+  /// before them (only with dynamic vocabulary).
+  std::map<Node*, BypassedWord> m_bypassed_words;
+
+  /// The old nodes changed since words were added.
+  std::map<Node*, NodeSnapshot> m_node_snapshots;
+
+  /// The nodes before the batch that have been changed in the batch.
+  std::set<Node*> m_batch_nodes;
+
+  /// Flags of the fan-out last nodes at the start of the batch. The last
+  /// nodes may be shared with the new fan-out triphones, which resets them.
+  std::vector<std::pair<Node*, unsigned short> > m_fan_out_flags;
+
+  /// The words of the batch that are linked to the fan-in, by the key of the
+  /// connection points, and the one phoneme words by the central phoneme.
+  std::map<std::string, std::vector<int> > m_batch_connection_words;
+  std::map<std::string, std::vector<int> > m_batch_single_hmm_words;
+
+  node_vector m_changed_nodes;
 };
 
 #endif /* TPLEXPREFIXTREE_HH */
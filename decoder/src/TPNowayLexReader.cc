@@ -70,14 +70,34 @@ TPNowayLexReader::get_until(FILE *file, std::string &str, const char *delims)
 
 void
 TPNowayLexReader::read(FILE *file, const std::string &word_boundary)
+{
+  m_vocabulary.reset();
+  m_lexicon.initialize_lex_tree();
+  read_words(file, word_boundary, false);
+  m_lexicon.finish_tree();
+}
+
+void
+TPNowayLexReader::add_words(FILE *file)
+{
+  try {
+    read_words(file, "", true);
+  }
+  catch (...) {
+    m_lexicon.finish_dynamic_words();
+    throw;
+  }
+  m_lexicon.finish_dynamic_words();
+}
+
+void
+TPNowayLexReader::read_words(FILE *file, const std::string &word_boundary,
+                             bool dynamic)
 {
   int word_id;
   vector<Hmm*> hmm_list;
   m_word.reserve(128); // The size is not necessary, just for efficiency
 
-  m_vocabulary.reset();
-  m_lexicon.initialize_lex_tree();
-
   while (1) {
     // Read first word
     skip_while(file, " \t\n");
@@ -147,6 +167,20 @@ TPNowayLexReader::read(FILE *file, const std::string &word_boundary)
     if (unknown_phonemes) // Don't add word if it contains unknown HMMs
       continue;
 
+    if (dynamic) {
+      if (hmm_list.size() == 0)
+        continue;
+      if (hmm_list.size() == 1 &&
+          (hmm_list[0]->label == "_" || hmm_list[0]->label == "__")) {
+        fprintf(stderr, "TPNowayLexReader::add_words(): silence word '%s' "
+                "can not be added\n", m_word.c_str());
+        continue;
+      }
+      m_lexicon.add_dynamic_word(hmm_list, m_vocabulary.add_word(m_word),
+                                 prob);
+      continue;
+    }
+
     // Add word to lexicon
 
     // FIXME! Deal with duplicate word ends?
@@ -164,5 +198,4 @@ TPNowayLexReader::read(FILE *file, const std::string &word_boundary)
     if (hmm_list.size() > 0)
       m_lexicon.add_word(hmm_list, word_id, prob);
   }
-  m_lexicon.finish_tree();
 }
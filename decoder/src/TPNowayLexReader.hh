@@ -34,6 +34,13 @@ public:
   ///
   void read(FILE *file, const std::string &word_boundary);
 
+  /// \brief Reads more words in the same format, and adds them to the
+  /// finished lexicon (see TPLexPrefixTree::add_dynamic_word()).
+  ///
+  /// Silence words can not be added, and they are skipped.
+  ///
+  void add_words(FILE *file);
+
   void skip_while(FILE *file, const char *chars);
   void get_until(FILE *file, std::string &str, const char *delims);
 
@@ -68,6 +75,11 @@ public:
   };
 
 protected:
+  /// \brief Reads the words of the file, and adds them to the lexicon with
+  /// either TPLexPrefixTree::add_word() or add_dynamic_word().
+  ///
+  void read_words(FILE *file, const std::string &word_boundary, bool dynamic);
+
   /// Mapping from phones (triphones) to HMM indices.
   std::map<std::string,int> &m_hmm_map;
 
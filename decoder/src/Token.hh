@@ -60,6 +60,8 @@ public:
   float total_log_prob;
   LMHistory *lm_history;
   int lm_hist_code; // Hash code for word history (up to LM order)
+  int lm_state; // Context state in the n-gram model (see TreeGram::walk())
+  int rescoring_lm_state; // Context state in the rescoring model
   int fsa_lm_node;
   int recent_word_graph_node;
   WordHistory *word_history;
@@ -76,6 +78,10 @@ public:
   unsigned char depth;
   unsigned char dur;
 
+  // Position in the TokenList that holds copies of the fields used in
+  // pruning (total_log_prob, node, lm_hist_code and lm_state).
+  int list_index;
+
   Token():
     node(nullptr),
     next_node_token(nullptr),
@@ -86,6 +92,8 @@ public:
     total_log_prob(0.0f),
     lm_history(nullptr),
     lm_hist_code(0),
+    lm_state(-1),
+    rescoring_lm_state(-1),
     fsa_lm_node(0),
     recent_word_graph_node(0),
     word_history(nullptr),
@@ -93,7 +101,8 @@ public:
     word_count(0),
     state_history(nullptr),
     depth(0),
-    dur(0)
+    dur(0),
+    list_index(-1)
   {}
 
   /// \brief Writes the state history into a vector.
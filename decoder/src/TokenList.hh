@@ -0,0 +1,164 @@
+#ifndef TOKENLIST_HH
+#define TOKENLIST_HH
+
+#include <cassert>
+#include <algorithm>
+#include <vector>
+
+#include "Token.hh"
+
+/// \brief A list of tokens, with the fields used by pruning and recombination
+/// stored in parallel arrays.
+///
+/// The Token objects hold all the information of a search path, most of which
+/// (histories, word graph and bookkeeping fields) is needed only when a token
+/// is propagated. Beam and histogram pruning only need the total log
+/// probability of each token, and recombination only needs the LM history
+/// hash codes of the tokens in a node. TokenList keeps copies of these hot
+/// fields in contiguous arrays next to the token pointers, so that pruning
+/// scans a dense float array and recombination follows an index chain instead
+/// of dereferencing every token.
+///
+/// Each token knows its position in the list it was last added to
+/// (Token::list_index). When the hot fields of a token change, the copies
+/// have to be refreshed by calling update().
+///
+class TokenList {
+public:
+  typedef std::vector<Token *>::const_iterator const_iterator;
+
+  size_t size() const { return m_tokens.size(); }
+  bool empty() const { return m_tokens.empty(); }
+  void reserve(size_t size);
+  void clear();
+  void swap(TokenList & other);
+
+  Token * operator[](size_t index) const { return m_tokens[index]; }
+  const_iterator begin() const { return m_tokens.begin(); }
+  const_iterator end() const { return m_tokens.end(); }
+
+  /// \brief Returns the total log probabilities of the tokens as a dense
+  /// array of size() elements.
+  const float * scores() const { return m_scores.data(); }
+  float score(size_t index) const { return m_scores[index]; }
+  int node_id(size_t index) const { return m_node_ids[index]; }
+  int lm_hist_code(size_t index) const { return m_lm_hist_codes[index]; }
+  int lm_state(size_t index) const { return m_lm_states[index]; }
+
+  /// \brief Returns the index of the next token in the same node, or -1.
+  ///
+  /// The chain mirrors Token::next_node_token at the time the token was
+  /// added with push_back(Token*). Tokens copied from another list are not
+  /// chained.
+  int next_in_node(size_t index) const { return m_next_in_node[index]; }
+
+  /// \brief Appends a token and copies its hot fields.
+  void push_back(Token * token);
+
+  /// \brief Appends the token at position \a index of \a other, copying the
+  /// hot fields from \a other instead of the token.
+  void push_back(const TokenList & other, size_t index);
+
+  /// \brief Refreshes the copies of the hot fields of \a token, which has to
+  /// be in this list.
+  void update(const Token * token);
+
+  /// \brief Sorts the tokens and rebuilds the hot fields in the new order.
+  template <typename Compare>
+  void sort(Compare compare);
+
+private:
+  void set(size_t index, const Token * token);
+
+  std::vector<Token *> m_tokens;
+  std::vector<float> m_scores;
+  std::vector<int> m_node_ids;
+  std::vector<int> m_lm_hist_codes;
+  std::vector<int> m_lm_states;
+  std::vector<int> m_next_in_node;
+};
+
+inline void TokenList::reserve(size_t size)
+{
+  m_tokens.reserve(size);
+  m_scores.reserve(size);
+  m_node_ids.reserve(size);
+  m_lm_hist_codes.reserve(size);
+  m_lm_states.reserve(size);
+  m_next_in_node.reserve(size);
+}
+
+inline void TokenList::clear()
+{
+  m_tokens.clear();
+  m_scores.clear();
+  m_node_ids.clear();
+  m_lm_hist_codes.clear();
+  m_lm_states.clear();
+  m_next_in_node.clear();
+}
+
+inline void TokenList::swap(TokenList & other)
+{
+  m_tokens.swap(other.m_tokens);
+  m_scores.swap(other.m_scores);
+  m_node_ids.swap(other.m_node_ids);
+  m_lm_hist_codes.swap(other.m_lm_hist_codes);
+  m_lm_states.swap(other.m_lm_states);
+  m_next_in_node.swap(other.m_next_in_node);
+}
+
+inline void TokenList::push_back(Token * token)
+{
+  token->list_index = m_tokens.size();
+  m_tokens.push_back(token);
+  m_scores.push_back(token->total_log_prob);
+  m_node_ids.push_back(token->node != nullptr ? token->node->node_id : -1);
+  m_lm_hist_codes.push_back(token->lm_hist_code);
+  m_lm_states.push_back(token->lm_state);
+  m_next_in_node.push_back(token->next_node_token != nullptr ?
+                           token->next_node_token->list_index : -1);
+}
+
+inline void TokenList::push_back(const TokenList & other, size_t index)
+{
+  Token * token = other.m_tokens[index];
+  token->list_index = m_tokens.size();
+  m_tokens.push_back(token);
+  m_scores.push_back(other.m_scores[index]);
+  m_node_ids.push_back(other.m_node_ids[index]);
+  m_lm_hist_codes.push_back(other.m_lm_hist_codes[index]);
+  m_lm_states.push_back(other.m_lm_states[index]);
+  m_next_in_node.push_back(-1);
+}
+
+inline void TokenList::update(const Token * token)
+{
+  assert(token->list_index >= 0 &&
+         static_cast<size_t>(token->list_index) < m_tokens.size());
+  assert(m_tokens[token->list_index] == token);
+  set(token->list_index, token);
+}
+
+inline void TokenList::set(size_t index, const Token * token)
+{
+  m_scores[index] = token->total_log_prob;
+  m_node_ids[index] = token->node != nullptr ? token->node->node_id : -1;
+  m_lm_hist_codes[index] = token->lm_hist_code;
+  m_lm_states[index] = token->lm_state;
+}
+
+template <typename Compare>
+void TokenList::sort(Compare compare)
+{
+  std::sort(m_tokens.begin(), m_tokens.end(), compare);
+  for (size_t i = 0; i < m_tokens.size(); i++) {
+    m_next_in_node[i] = -1;
+    if (m_tokens[i] == nullptr)
+      continue;
+    m_tokens[i]->list_index = i;
+    set(i, m_tokens[i]);
+  }
+}
+
+#endif
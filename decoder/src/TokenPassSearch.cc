@@ -7,10 +7,10 @@
 #include <iostream>
 #include <string>
 #include <cctype>
+#include <chrono>
 
 #include "TokenPassSearch.hh"
 
-#define NUM_HISTOGRAM_BINS 100
 #define TOKEN_RESERVE_BLOCK 1024
 
 #define DEFAULT_MAX_LOOKAHEAD_SCORE_LIST_SIZE 512
@@ -19,6 +19,8 @@
 
 #define DEFAULT_MAX_LM_CACHE_SIZE 15000
 
+#define DEFAULT_RESCORING_CACHE_SIZE 65536
+
 #define MAX_TREE_DEPTH 60
 
 #define MAX_STATE_DURATION 80
@@ -34,6 +36,17 @@
 
 using namespace std;
 
+typedef std::chrono::steady_clock StatisticsClock;
+
+// Returns the seconds since \a start and moves \a start to the current time.
+static double elapsed_seconds(StatisticsClock::time_point &start)
+{
+  StatisticsClock::time_point now = StatisticsClock::now();
+  double seconds = std::chrono::duration<double>(now - start).count();
+  start = now;
+  return seconds;
+}
+
 TokenPassSearch::TokenPassSearch(TPLexPrefixTree &lex, Vocabulary &vocab,
                                  Acoustics *acoustics) :
   m_lexicon(lex),
@@ -42,15 +55,23 @@ TokenPassSearch::TokenPassSearch(TPLexPrefixTree &lex, Vocabulary &vocab,
   m_word_classes(NULL),
 #endif
   m_acoustics(acoustics),
+  m_pruning_record(NULL),
   m_end_frame(-1),
   m_frame(0),
   m_best_log_prob(0),
   m_worst_log_prob(0),
   m_best_we_log_prob(0),
   m_best_final_token(NULL),
+  m_best_token(NULL),
+  m_partial_result_max_latency(0),
+  m_stable_history(NULL),
+  m_num_forced_stable_words(0),
   m_ngram(NULL),
   m_fsa_lm(NULL),
+  m_tree_gram(NULL),
+  m_class_based_lm(false),
   m_lookahead_ngram(NULL),
+  m_rescoring_ngram(NULL),
   m_print_probs(0),
   m_print_text_result(0),
   m_print_state_segmentation(false),
@@ -93,13 +114,10 @@ TokenPassSearch::TokenPassSearch(TPLexPrefixTree &lex, Vocabulary &vocab,
 #ifdef ENABLE_MULTIWORD_SUPPORT
   m_split_multiwords = false;
 #endif
+  set_rescoring_cache_size(DEFAULT_RESCORING_CACHE_SIZE);
 }
 
 TokenPassSearch::~TokenPassSearch() {
-  for (std::vector<LMHistory *>::iterator it=m_lmhist_dealloc_table.begin();
-       it!=m_lmhist_dealloc_table.end();++it) {
-    delete[] *it;
-  }
   for (std::vector<Token *>::iterator it=m_token_dealloc_table.begin();
        it!=m_token_dealloc_table.end();++it) {
     delete[] *it;
@@ -149,15 +167,27 @@ void TokenPassSearch::reset_search(int start_frame)
   m_frame = start_frame;
   m_end_frame = -1;
   m_best_final_token = NULL;
+  m_statistics.clear();
+  m_statistics.current().reset(start_frame);
 
-  // Clear existing tokens and create a new token to the root
-  for (int i = 0; i < m_active_token_list.size(); i++) {
-    if (m_active_token_list[i] != NULL)
-      release_token(m_active_token_list[i]);
+  // Clear existing tokens and create a new token to the root. The history
+  // structures of the previous utterance are released all at once, without
+  // following the reference counts.
+  for (auto token : m_active_token_list) {
+    if (token == NULL)
+      continue;
+    if (token->recent_word_graph_node >= 0)
+      word_graph.unlink(token->recent_word_graph_node);
+    token->recent_word_graph_node = -1;
+    m_token_pool.push_back(token);
   }
   m_active_token_list.clear();
+  m_lmh_pool.reset();
+  m_word_history_pool.reset();
+  m_state_history_pool.reset();
 
   m_lexicon.clear_node_token_lists();
+  m_active_node_list.clear();
 
   t = acquire_token();
   t->node = m_lexicon.start_node();
@@ -166,11 +196,12 @@ void TokenPassSearch::reset_search(int start_frame)
   t->lm_log_prob = 0;
   t->cur_am_log_prob = 0;
   t->cur_lm_log_prob = 0;
+  t->total_log_prob = 0;
   t->lm_history = acquire_lmhist(&m_null_word, NULL);
   hist::link(t->lm_history);
 
   if (m_generate_word_graph) {
-    t->word_history = new Token::WordHistory(-1, -1, NULL);
+    t->word_history = m_word_history_pool.acquire(-1, -1, nullptr);
     t->word_history->lex_node_id = t->node->node_id;
     hist::link(t->word_history);
 
@@ -183,6 +214,8 @@ void TokenPassSearch::reset_search(int start_frame)
   }
 
   t->lm_hist_code = 0;
+  t->lm_state = -1;
+  t->rescoring_lm_state = -1;
   t->dur = 0;
   t->word_start_frame = -1;
 
@@ -196,6 +229,10 @@ void TokenPassSearch::reset_search(int start_frame)
     hist::unlink(t->lm_history, &m_lmh_pool);
     t->lm_history = sentence_start;
     hist::link(t->lm_history);
+    if (m_tree_gram)
+      t->lm_state = sentence_start_lm_state();
+    if (m_rescoring_ngram)
+      t->rescoring_lm_state = sentence_start_rescoring_state();
   }
 
 #ifdef PRUNING_MEASUREMENT
@@ -225,7 +262,7 @@ void TokenPassSearch::reset_search(int start_frame)
   t->word_count = 0;
 
   if (m_keep_state_segmentation) {
-    t->state_history = new Token::StateHistory(0, 0, NULL);
+    t->state_history = m_state_history_pool.acquire(0, 0, nullptr);
     hist::link(t->state_history);
   }
   else {
@@ -233,6 +270,10 @@ void TokenPassSearch::reset_search(int start_frame)
   }
 
   m_active_token_list.push_back(t);
+  m_best_token = t;
+  m_stable_history = t->lm_history;
+  m_num_forced_stable_words = 0;
+  m_partial_unstable_words.clear();
 
   if (lm_lookahead_score_list.get_num_items() > 0) {
     // Delete the LM lookahead cache
@@ -244,6 +285,12 @@ void TokenPassSearch::reset_search(int start_frame)
   if (!m_lm_lookahead_initialized && (m_lm_lookahead > 0)) {
     lm_lookahead_score_list.set_max_items(m_max_lookahead_score_list_size);
     m_lexicon.set_lm_lookahead_cache_sizes(m_max_node_lookahead_buffer_size);
+    if (m_class_based_lm) {
+      vector<int> lookahead_ids(m_word_repository.size());
+      for (int i = 0; i < m_word_repository.size(); i++)
+        lookahead_ids[i] = m_word_repository[i].lookahead_lm_id();
+      m_lexicon.set_possible_lookahead_ids(lookahead_ids);
+    }
     m_lm_lookahead_initialized = true;
   }
 
@@ -280,6 +327,13 @@ TokenPassSearch::run(void)
 
   if (m_verbose > 1)
     printf("run() in frame %d\n", m_frame);
+
+  FrameStatistics &stats = m_statistics.current();
+  bool timed = m_statistics.enabled();
+  StatisticsClock::time_point start;
+  if (timed)
+    start = StatisticsClock::now();
+
   if ((m_end_frame != -1 && m_frame >= m_end_frame) ||
       !m_acoustics->go_to(m_frame))
   {
@@ -289,14 +343,23 @@ TokenPassSearch::run(void)
     if (m_print_text_result)
       print_lm_history(stdout, true);
 
+    if (m_partial_result_callback)
+      update_partial_result(true);
+
     if (m_print_state_segmentation)
       print_state_history();
 
     return false;
   }
 
+  if (timed)
+    stats.acoustics_time = elapsed_seconds(start);
   propagate_tokens();
+  if (timed)
+    stats.propagate_time = elapsed_seconds(start);
   prune_tokens();
+  if (timed)
+    stats.prune_time = elapsed_seconds(start);
 #ifdef PRUNING_MEASUREMENT
   analyze_tokens();
 #endif
@@ -304,7 +367,10 @@ TokenPassSearch::run(void)
     save_token_statistics(filecount++);*/
   if (m_print_text_result)
     print_lm_history(stdout, false);
+  if (m_partial_result_callback)
+    update_partial_result(false);
   m_frame++;
+  m_statistics.finish_frame(m_frame);
   return true;
 }
 
@@ -424,8 +490,7 @@ TokenPassSearch::analyze_tokens(void)
 TokenPassSearch::token_range_type
 TokenPassSearch::get_sorted_tokens()
 {
-  sort(m_active_token_list.begin(),
-       m_active_token_list.end(),
+  m_active_token_list.sort(
        [](Token * token1, Token * token2) {
          if (token2 == nullptr)
            return true;  // token1 first
@@ -437,8 +502,8 @@ TokenPassSearch::get_sorted_tokens()
            return false;  // token2 first
          return token1->total_log_prob >= token2->total_log_prob;  // higher logprob first
        });
-  token_list_type::const_iterator first = m_active_token_list.begin();
-  token_list_type::const_iterator last = find(m_active_token_list.begin(),
+  TokenList::const_iterator first = m_active_token_list.begin();
+  TokenList::const_iterator last = find(m_active_token_list.begin(),
                                               m_active_token_list.end(),
                                               nullptr);
   return TokenPassSearch::token_range_type(first, last);
@@ -802,6 +867,8 @@ TokenPassSearch::move_token_to_node(Token *token,
   updated_token.word_count = token->word_count;
   updated_token.fsa_lm_node = token->fsa_lm_node;
   updated_token.lm_hist_code = token->lm_hist_code;
+  updated_token.lm_state = token->lm_state;
+  updated_token.rescoring_lm_state = token->rescoring_lm_state;
   updated_token.lm_history = token->lm_history;
   updated_token.word_history = token->word_history;
   updated_token.state_history = token->state_history;
@@ -880,6 +947,7 @@ TokenPassSearch::move_token_to_node(Token *token,
           updated_token.word_start_frame;
         updated_token.word_start_frame = -1;
         auto_lm_history.adopt(updated_token.lm_history, &m_lmh_pool);
+        m_statistics.current().words++;
 
         update_lm_log_prob(updated_token);
 
@@ -918,9 +986,25 @@ TokenPassSearch::move_token_to_node(Token *token,
                                NULL);
             }
           }
-          else
+          else {
             updated_token.lm_hist_code =
               compute_lm_hist_hash_code(updated_token.lm_history);
+            if (m_tree_gram) {
+              updated_token.lm_state = sentence_start_lm_state();
+              if (m_word_boundary_id > 0)
+                updated_token.lm_state = m_tree_gram->walk(
+                  updated_token.lm_state,
+                  m_word_repository[m_word_boundary_id].lm_id());
+            }
+            if (m_rescoring_ngram) {
+              updated_token.rescoring_lm_state =
+                sentence_start_rescoring_state();
+              if (m_word_boundary_id > 0)
+                updated_token.rescoring_lm_state = rescoring_walk(
+                  updated_token.rescoring_lm_state,
+                  m_rescoring_lm_ids[m_word_boundary_id], NULL);
+            }
+          }
         }
       }
       else {
@@ -942,9 +1026,10 @@ TokenPassSearch::move_token_to_node(Token *token,
 
     if (m_keep_state_segmentation && updated_token.node->state != NULL) {
       updated_token.state_history =
-        new Token::StateHistory(updated_token.node->state->model,
-                                          m_frame, token->state_history);
-      auto_state_history.adopt(updated_token.state_history);
+        m_state_history_pool.acquire(updated_token.node->state->model,
+                                     m_frame, token->state_history);
+      auto_state_history.adopt(updated_token.state_history,
+                               &m_state_history_pool);
     }
 
     // Update duration probability
@@ -964,12 +1049,13 @@ TokenPassSearch::move_token_to_node(Token *token,
     if (m_generate_word_graph
         && (updated_token.node->flags & NODE_FIRST_STATE_OF_WORD)) {
       // Add symbol from the LMHistory
-      updated_token.word_history = 
-        new Token::WordHistory(old_lm_history_word_id, m_frame,
-                               updated_token.word_history);
+      updated_token.word_history =
+        m_word_history_pool.acquire(old_lm_history_word_id, m_frame,
+                                    updated_token.word_history);
       updated_token.word_history->lex_node_id =
         updated_token.node->node_id;
-      auto_word_history.adopt(updated_token.word_history);
+      auto_word_history.adopt(updated_token.word_history,
+                              &m_word_history_pool);
       updated_token.word_history->cum_am_log_prob = token->am_log_prob
         + m_transition_scale * transition_score + duration_log_prob;
       updated_token.word_history->cum_lm_log_prob = token->lm_log_prob;
@@ -1034,6 +1120,8 @@ TokenPassSearch::move_token_to_node(Token *token,
     temp_token.total_log_prob = updated_token.total_log_prob;
     temp_token.lm_history = updated_token.lm_history;
     temp_token.lm_hist_code = updated_token.lm_hist_code;
+    temp_token.lm_state = updated_token.lm_state;
+    temp_token.rescoring_lm_state = updated_token.rescoring_lm_state;
     temp_token.fsa_lm_node = updated_token.fsa_lm_node;
     temp_token.dur = 0;
     temp_token.word_count = updated_token.word_count;
@@ -1135,11 +1223,7 @@ TokenPassSearch::move_token_to_node(Token *token,
       new_token->node = updated_token.node;
       new_token->next_node_token = updated_token.node->token_list;
       updated_token.node->token_list = new_token;
-      // Add to the list of propagated tokens
-      if (updated_token.node->flags & NODE_USE_WORD_END_BEAM)
-        m_word_end_token_list.push_back(new_token);
-      else
-        m_new_token_list.push_back(new_token);
+      new_token->list_index = -1;
     }
     else {
       // Recombination of search paths that are identical up to
@@ -1162,11 +1246,7 @@ TokenPassSearch::move_token_to_node(Token *token,
         new_token->node = updated_token.node;
         new_token->next_node_token = updated_token.node->token_list;
         updated_token.node->token_list = new_token;
-        // Add to the list of propagated tokens
-        if (updated_token.node->flags & NODE_USE_WORD_END_BEAM)
-          m_word_end_token_list.push_back(new_token);
-        else
-          m_new_token_list.push_back(new_token);
+        new_token->list_index = -1;
       }
       else
       {
@@ -1176,8 +1256,8 @@ TokenPassSearch::move_token_to_node(Token *token,
           // Replace the previous token
           new_token = similar_lm_hist;
           hist::unlink(new_token->lm_history, &m_lmh_pool);
-          hist::unlink(new_token->word_history);
-          hist::unlink(new_token->state_history);
+          hist::unlink(new_token->word_history, &m_word_history_pool);
+          hist::unlink(new_token->state_history, &m_state_history_pool);
 
           //TPLexPrefixTree::PathHistory::unlink(new_token->token_path);
         }
@@ -1253,6 +1333,8 @@ TokenPassSearch::move_token_to_node(Token *token,
     if (new_token->lm_history != NULL)
       hist::link(new_token->lm_history);
     new_token->lm_hist_code = updated_token.lm_hist_code;
+    new_token->lm_state = updated_token.lm_state;
+    new_token->rescoring_lm_state = updated_token.rescoring_lm_state;
     new_token->fsa_lm_node = updated_token.fsa_lm_node;
     new_token->am_log_prob = updated_token.am_log_prob;
     new_token->cur_am_log_prob = updated_token.cur_am_log_prob;
@@ -1282,6 +1364,16 @@ TokenPassSearch::move_token_to_node(Token *token,
 #endif
 
     new_token->depth = updated_token.depth;
+
+    // Add to the list of propagated tokens, or refresh the copies of the
+    // pruning fields if an existing token was replaced.
+    TokenList & token_list =
+      (updated_token.node->flags & NODE_USE_WORD_END_BEAM) ?
+      m_word_end_token_list : m_new_token_list;
+    if (new_token->list_index < 0)
+      token_list.push_back(new_token);
+    else
+      token_list.update(new_token);
     //assert(token->token_path != NULL);
     /*new_token->token_path = new TPLexPrefixTree::PathHistory(
       updated_token.total_log_prob,
@@ -1314,14 +1406,21 @@ TokenPassSearch::find_similar_lm_history(LMHistory *wh, int lm_hist_code,
 {
   assert(!m_fsa_lm);
 
-  Token *cur_token = token_list;
-  for (; cur_token != NULL; cur_token = cur_token->next_node_token) {
-    if ((lm_hist_code == cur_token->lm_hist_code)
-        && (is_similar_lm_history(wh, cur_token->lm_history))) {
-      return cur_token;
+  if (token_list == NULL)
+    return NULL;
+
+  // All the tokens of a node are in the same list. Follow the chain of the
+  // node through the hash codes stored in the list, and touch the tokens only
+  // when the hash codes match.
+  const TokenList & list = (token_list->node->flags & NODE_USE_WORD_END_BEAM) ?
+    m_word_end_token_list : m_new_token_list;
+  for (int i = token_list->list_index; i >= 0; i = list.next_in_node(i)) {
+    if ((lm_hist_code == list.lm_hist_code(i))
+        && (is_similar_lm_history(wh, list[i]->lm_history))) {
+      return list[i];
     }
   }
-  return cur_token;  // NULL
+  return NULL;
 }
 
 inline bool TokenPassSearch::is_similar_lm_history(LMHistory *wh1,
@@ -1409,193 +1508,134 @@ int TokenPassSearch::compute_lm_hist_hash_code(LMHistory *wh) const
 void TokenPassSearch::prune_tokens()
 {
   int i;
-  int num_active_tokens;
   float beam_limit = m_best_log_prob - m_current_glob_beam; //m_global_beam;
   float we_beam_limit = m_best_we_log_prob - m_current_we_beam;
 
+  FrameStatistics &stats = m_statistics.current();
+  stats.new_tokens = m_new_token_list.size();
+  stats.word_end_tokens = m_word_end_token_list.size();
+  stats.best_log_prob = m_best_log_prob;
+
   if (m_verbose > 1)
     printf("%zd new tokens\n",
            m_new_token_list.size() + m_word_end_token_list.size());
 
   // At first, remove inactive tokens.
-  for (auto token : m_active_token_list) {
-    if (token != NULL)
-      release_token(token);
-  }
+  release_tokens(m_active_token_list.begin(), m_active_token_list.end());
   m_active_token_list.clear();
   m_active_token_list.swap(m_new_token_list);
 
   // Prune the word end tokens and add them to m_active_token_list
+  const float *we_scores = m_word_end_token_list.scores();
+  m_pruned_tokens.clear();
   for (i = 0; i < m_word_end_token_list.size(); i++) {
-    if (m_word_end_token_list[i]->total_log_prob < we_beam_limit)
-      release_token(m_word_end_token_list[i]);
+    if (we_scores[i] < we_beam_limit)
+      m_pruned_tokens.push_back(m_word_end_token_list[i]);
     else
-      m_active_token_list.push_back(m_word_end_token_list[i]);
+      m_active_token_list.push_back(m_word_end_token_list, i);
   }
   m_word_end_token_list.clear();
+  stats.word_end_tokens_after_beam =
+    m_active_token_list.size() - stats.new_tokens;
+  stats.tokens_before_beam = m_active_token_list.size();
 
-  // Fill the token path information
-  /*  TPLexPrefixTree::PathHistory *prev_path;
-      for (int i = 0; i < m_active_token_list.size(); i++)
-      {
-      //if (m_active_token_list[i] != NULL)
-      {
-      prev_path = m_active_token_list[i]->token_path;
-      assert( prev_path !=  NULL);
-      m_active_token_list[i]->token_path = new TPLexPrefixTree::PathHistory(
-      m_active_token_list[i]->total_log_prob,
-      m_best_log_prob,
-      m_active_token_list[i]->depth,
-      prev_path);
-      TPLexPrefixTree::PathHistory::unlink(prev_path);
-      m_active_token_list[i]->token_path->link();
-      }
-      }*/
-
-  // Then beam prune the active tokens and find the worst accepted log prob
-  // for histogram pruning.
+  // Compute a single threshold from the beam and the token limit, then beam
+  // and histogram prune the active tokens in one pass.
   // Note! After this, the token lists in the nodes are no longer valid.
-  num_active_tokens = 0;
-  if (m_active_token_list.size() > m_max_num_tokens &&
-      m_max_num_tokens > 0)
-  {
-    // Do also histogram pruning
-    // Approximate the worst log prob after beam pruning has been applied.
-    if (m_worst_log_prob < beam_limit)
-      m_worst_log_prob = beam_limit;
-    int bins[NUM_HISTOGRAM_BINS];
-    float bin_adv = (m_best_log_prob - m_worst_log_prob)
-      / (NUM_HISTOGRAM_BINS - 1);
-    float new_min_log_prob;
-    memset(bins, 0, NUM_HISTOGRAM_BINS * sizeof(int));
-
-    for (i = 0; i < m_active_token_list.size(); i++)
-    {
-      float total_log_prob = m_active_token_list[i]->total_log_prob;
-      if (total_log_prob
-          < beam_limit
-#ifdef PRUNING_EXTENSIONS
-          || ((flags&NODE_FAN_IN)?
-              (total_log_prob < m_fan_in_log_prob - m_fan_in_beam) :
-              ((!(flags&(NODE_FAN_IN|NODE_FAN_OUT)) &&
-                (total_log_prob < m_wc_llh[m_active_token_list[i]->word_count-m_min_word_count] - m_eq_wc_beam ||
-                 (!(flags&(NODE_AFTER_WORD_ID)) &&
-                  total_log_prob < m_depth_llh[m_active_token_list[i]->depth/2]-m_eq_depth_beam)))))
-#endif
-#ifdef FAN_IN_PRUNING
-          || ((flags&NODE_FAN_IN) &&
-              total_log_prob < m_fan_in_log_prob - m_fan_in_beam)
-#endif
-#ifdef EQ_WC_PRUNING
-          || (!(flags&(NODE_FAN_IN|NODE_FAN_OUT)) &&
-              (total_log_prob < m_wc_llh[m_active_token_list[i]->word_count-m_min_word_count] - m_eq_wc_beam))
-#endif
-#ifdef EQ_DEPTH_PRUNING
-          || (!(flags&(NODE_FAN_IN|NODE_FAN_OUT|NODE_AFTER_WORD_ID)) &&
-              total_log_prob < m_depth_llh[m_active_token_list[i]->depth/2]-m_eq_depth_beam)
-#endif
-#ifdef FAN_OUT_PRUNING
-          || ((flags&NODE_FAN_OUT) &&
-              total_log_prob < m_fan_out_log_prob - m_fan_out_beam)
-#endif
-        )
-      {
-        release_token(m_active_token_list[i]);
-      }
-      else
-      {
-        bins[(int) floorf((total_log_prob - m_worst_log_prob) / bin_adv)]++;
-        m_new_token_list.push_back(m_active_token_list[i]);
+  const float *scores = m_active_token_list.scores();
+  if (m_pruning_record != NULL) {
+    TokenPruner::write_record(m_pruning_record, scores,
+                              m_active_token_list.size(), beam_limit,
+                              m_best_log_prob, m_worst_log_prob,
+                              m_max_num_tokens);
+  }
+  TokenPruner::Result result = m_pruner.compute(
+    scores, m_active_token_list.size(), beam_limit,
+    m_best_log_prob, m_worst_log_prob, m_max_num_tokens);
+
+  m_best_token = NULL;
+  float best_score = 0;
+  for (i = 0; i < m_active_token_list.size(); i++) {
+    if (scores[i] < result.threshold
+        || is_pruned_by_extensions(m_active_token_list[i], scores[i]))
+      m_pruned_tokens.push_back(m_active_token_list[i]);
+    else {
+      if (m_best_token == NULL || scores[i] > best_score) {
+        m_best_token = m_active_token_list[i];
+        best_score = scores[i];
       }
+      m_new_token_list.push_back(m_active_token_list, i);
     }
-    m_active_token_list.clear();
-    m_active_token_list.swap(m_new_token_list);
-    if (m_verbose > 1)
-      printf("%zd tokens after beam pruning\n",
+  }
+  m_active_token_list.clear();
+  m_active_token_list.swap(m_new_token_list);
+  release_tokens(m_pruned_tokens.begin(), m_pruned_tokens.end());
+  stats.tokens_after_beam = result.num_in_beam;
+  stats.active_tokens = m_active_token_list.size();
+
+  if (m_verbose > 1) {
+    printf("%zd tokens after beam pruning\n", result.num_in_beam);
+    if (result.limited)
+      printf("%zd tokens after histogram pruning\n",
              m_active_token_list.size());
-    num_active_tokens = m_active_token_list.size();
-    if (num_active_tokens > m_max_num_tokens)
-    {
-      for (i = 0; i < NUM_HISTOGRAM_BINS - 1; i++) {
-        num_active_tokens -= bins[i];
-        if (num_active_tokens < m_max_num_tokens)
-          break;
-      }
-      int deleted = 0;
-      new_min_log_prob = m_worst_log_prob + (i + 1) * bin_adv;
-      for (i = 0; i < m_active_token_list.size(); i++) {
-        if (m_active_token_list[i]->total_log_prob
-            < new_min_log_prob) {
-          release_token(m_active_token_list[i]);
-          m_active_token_list[i] = NULL;
-          deleted++;
-        }
-      }
-      if (m_verbose > 1)
-        printf("%zd tokens after histogram pruning\n",
-               m_active_token_list.size() - deleted);
+  }
 
-      // Pass the new beam limit to next token propagation
-      m_current_glob_beam = std::min((m_best_log_prob - new_min_log_prob),
-                                     m_global_beam);
-      m_current_we_beam = m_current_glob_beam / m_global_beam
-        * m_word_end_beam;
-    }
+  if (result.limited) {
+    // Pass the new beam limit to next token propagation
+    m_current_glob_beam = std::min((m_best_log_prob - result.threshold),
+                                   m_global_beam);
+    m_current_we_beam = m_current_glob_beam / m_global_beam
+      * m_word_end_beam;
   }
-  else
-  {
-    // Only do the beam pruning
-    for (i = 0; i < m_active_token_list.size(); i++)
-    {
-      if (m_active_token_list[i]->total_log_prob < beam_limit
+  else if (!result.over_limit && m_current_glob_beam < m_global_beam) {
+    // Determine new beam
+    m_current_glob_beam = m_current_glob_beam * 1.1;
+    m_current_glob_beam = std::min(m_global_beam, m_current_glob_beam);
+    m_current_we_beam = m_current_glob_beam / m_global_beam
+      * m_word_end_beam;
+  }
+  stats.beam = m_current_glob_beam;
+  if (m_verbose > 1)
+    printf("Current beam: %.1f   Word end beam: %.1f\n",
+           m_current_glob_beam, m_current_we_beam);
+}
+
+inline bool
+TokenPassSearch::is_pruned_by_extensions(const Token *token,
+                                         float total_log_prob) const
+{
+#if (defined PRUNING_EXTENSIONS || defined FAN_IN_PRUNING || defined EQ_WC_PRUNING || defined EQ_DEPTH_PRUNING || defined FAN_OUT_PRUNING)
+  int flags = token->node->flags;
+#else
+  (void)token;
+  (void)total_log_prob;
+#endif
+  return false
 #ifdef PRUNING_EXTENSIONS
-          || ((flags&NODE_FAN_IN)?
-              (total_log_prob < m_fan_in_log_prob - m_fan_in_beam) :
-              ((!(flags&(NODE_FAN_IN|NODE_FAN_OUT)) &&
-                (total_log_prob < m_wc_llh[m_active_token_list[i]->word_count-m_min_word_count] - m_eq_wc_beam ||
-                 (!(flags&(NODE_AFTER_WORD_ID)) &&
-                  total_log_prob < m_depth_llh[m_active_token_list[i]->depth/2]-m_eq_depth_beam)))))
+    || ((flags&NODE_FAN_IN)?
+        (total_log_prob < m_fan_in_log_prob - m_fan_in_beam) :
+        ((!(flags&(NODE_FAN_IN|NODE_FAN_OUT)) &&
+          (total_log_prob < m_wc_llh[token->word_count-m_min_word_count] - m_eq_wc_beam ||
+           (!(flags&(NODE_AFTER_WORD_ID)) &&
+            total_log_prob < m_depth_llh[token->depth/2]-m_eq_depth_beam)))))
 #endif
 #ifdef FAN_IN_PRUNING
-          || ((flags&NODE_FAN_IN) &&
-              total_log_prob < m_fan_in_log_prob - m_fan_in_beam)
+    || ((flags&NODE_FAN_IN) &&
+        total_log_prob < m_fan_in_log_prob - m_fan_in_beam)
 #endif
 #ifdef EQ_WC_PRUNING
-          || (!(flags&(NODE_FAN_IN|NODE_FAN_OUT)) &&
-              (total_log_prob < m_wc_llh[m_active_token_list[i]->word_count-m_min_word_count] - m_eq_wc_beam))
+    || (!(flags&(NODE_FAN_IN|NODE_FAN_OUT)) &&
+        (total_log_prob < m_wc_llh[token->word_count-m_min_word_count] - m_eq_wc_beam))
 #endif
 #ifdef EQ_DEPTH_PRUNING
-          || (!(flags&(NODE_FAN_IN|NODE_FAN_OUT|NODE_AFTER_WORD_ID)) &&
-              total_log_prob < m_depth_llh[m_active_token_list[i]->depth/2]-m_eq_depth_beam)
+    || (!(flags&(NODE_FAN_IN|NODE_FAN_OUT|NODE_AFTER_WORD_ID)) &&
+        total_log_prob < m_depth_llh[token->depth/2]-m_eq_depth_beam)
 #endif
 #ifdef FAN_OUT_PRUNING
-          || ((flags&NODE_FAN_OUT) &&
-              total_log_prob < m_fan_out_log_prob - m_fan_out_beam)
+    || ((flags&NODE_FAN_OUT) &&
+        total_log_prob < m_fan_out_log_prob - m_fan_out_beam)
 #endif
-        )
-      {
-        release_token(m_active_token_list[i]);
-      }
-      else
-        m_new_token_list.push_back(m_active_token_list[i]);
-    }
-    m_active_token_list.clear();
-    m_active_token_list.swap(m_new_token_list);
-    if (m_verbose > 1)
-      printf("%zd tokens after beam pruning\n",
-             m_active_token_list.size());
-    if (m_current_glob_beam < m_global_beam)
-    {
-      // Determine new beam
-      m_current_glob_beam = m_current_glob_beam * 1.1;
-      m_current_glob_beam = std::min(m_global_beam, m_current_glob_beam);
-      m_current_we_beam = m_current_glob_beam / m_global_beam
-        * m_word_end_beam;
-    }
-  }
-  if (m_verbose > 1)
-    printf("Current beam: %.1f   Word end beam: %.1f\n",
-           m_current_glob_beam, m_current_we_beam);
+    ;
 }
 
 void TokenPassSearch::clear_active_node_token_lists(void)
@@ -1612,13 +1652,29 @@ void TokenPassSearch::set_word_classes(const WordClasses * x)
 
 #ifdef ENABLE_WORDCLASS_SUPPORT
   m_word_classes = x;
+  m_class_based_lm = x != NULL;
 #endif
+  m_lm_lookahead_initialized = false;
 }
 
 int TokenPassSearch::set_ngram(NGram *ngram)
 {
   assert(!m_fsa_lm);
   m_ngram = ngram;
+
+  // Back-off TreeGrams are scored incrementally from the LM state of each
+  // token. Other models fall back to computing full n-gram probabilities.
+  m_tree_gram = dynamic_cast<TreeGram *>(ngram);
+  if (m_tree_gram != NULL) {
+    if (m_tree_gram->get_type() == NGram::BACKOFF) {
+      if (!m_tree_gram->has_back_off_links())
+        m_tree_gram->compute_back_off_links();
+    }
+    else {
+      m_tree_gram = NULL;
+    }
+  }
+
   // Initialize LM lookahead caches again.
   m_lm_lookahead_initialized = false;
   return create_word_repository();
@@ -1631,123 +1687,194 @@ int TokenPassSearch::set_fsa_lm(fsalm::LM *lm)
   return create_word_repository();
 }
 
+int TokenPassSearch::set_rescoring_ngram(TreeGram *ngram)
+{
+  assert(ngram == NULL || m_tree_gram != NULL);
+  m_rescoring_ngram = ngram;
+  if (ngram != NULL) {
+    if (ngram->get_type() == NGram::INTERPOLATED)
+      ngram->convert_to_backoff();
+    if (!ngram->has_back_off_links())
+      ngram->compute_back_off_links();
+  }
+  set_rescoring_cache_size(m_rescoring_cache.size());
+  return create_word_repository();
+}
+
+void TokenPassSearch::set_rescoring_cache_size(int entries)
+{
+  int size = 1;
+  while (size < entries)
+    size <<= 1;
+  RescoringCacheEntry empty = { -2, -1, -1, 0 };
+  m_rescoring_cache.assign(size, empty);
+}
+
 int TokenPassSearch::set_lookahead_ngram(NGram *ngram)
 {
   assert( m_ngram != NULL || m_fsa_lm != NULL);
   m_lookahead_ngram = ngram;
+  m_lm_lookahead_initialized = false;
   return create_word_repository();
 }
 
+int TokenPassSearch::update_vocabulary()
+{
+  // The vocabulary only grows, so only the new words need entries.
+  int num_not_found = 0;
+  int first_new_word = m_word_repository.size();
+  m_word_repository.resize(m_vocabulary.num_words());
+  m_rescoring_lm_ids.resize(m_vocabulary.num_words(), -1);
+  for (int i = first_new_word; i < m_vocabulary.num_words(); ++i) {
+    if (!create_word_repository_entry(i))
+      ++num_not_found;
+  }
+  assert(m_vocabulary.num_words() == (int)m_word_repository.size());
+
+  // The lookahead lists of the changed nodes do not match their buffers any
+  // more. Setting the buffer size clears the buffer.
+  const TPLexPrefixTree::node_vector &nodes = m_lexicon.changed_nodes();
+  if (m_lm_lookahead_initialized) {
+    for (size_t i = 0; i < nodes.size(); i++) {
+      if (nodes[i]->possible_word_id_list.size() > 0)
+        nodes[i]->lm_lookahead_buffer.set_max_items(
+          m_max_node_lookahead_buffer_size);
+    }
+    if (m_class_based_lm) {
+      vector<int> lookahead_ids(m_word_repository.size());
+      for (size_t i = 0; i < m_word_repository.size(); i++)
+        lookahead_ids[i] = m_word_repository[i].lookahead_lm_id();
+      m_lexicon.set_possible_lookahead_ids(lookahead_ids, nodes);
+    }
+  }
+  m_lexicon.clear_changed_nodes();
+
+  return num_not_found;
+}
+
 int TokenPassSearch::create_word_repository()
 {
   m_word_repository.clear();
   m_word_repository.resize(m_vocabulary.num_words());
+  m_rescoring_lm_ids.assign(m_vocabulary.num_words(), -1);
 
   int num_not_found = 0;
 
   for (int i = 0; i < m_vocabulary.num_words(); ++i) {
-    string word = m_vocabulary.word(i);
+    if (!create_word_repository_entry(i))
+      ++num_not_found;
+  }
+
+  // We may have added words to the vocabulary along the way but I think the
+  // new words should have been added to the word repository in the end.
+  assert(m_vocabulary.num_words() == m_word_repository.size());
+
+  return num_not_found;
+}
 
-    if (m_remove_pronunciation_id) {
-      // Remove :[0-9]+ from the tail (pronunciation ID).
-      string::const_reverse_iterator iter = word.rbegin();
-      if (isdigit(*iter)) {
+bool TokenPassSearch::create_word_repository_entry(int i)
+{
+  string word = m_vocabulary.word(i);
+
+  if (m_remove_pronunciation_id) {
+    // Remove :[0-9]+ from the tail (pronunciation ID).
+    string::const_reverse_iterator iter = word.rbegin();
+    if (isdigit(*iter)) {
+      ++iter;
+      while (isdigit(*iter)) ++iter;
+      if (*iter == ':') {
         ++iter;
-        while (isdigit(*iter)) ++iter;
-        if (*iter == ':') {
-          ++iter;
-          int tail_size = iter - word.rbegin();
-          word.resize(word.size() - tail_size);
-        }
+        int tail_size = iter - word.rbegin();
+        word.resize(word.size() - tail_size);
       }
     }
+  }
 
-    if (word.size() == 0) {
-      if (m_verbose > 0) {
-        cerr
-          << "TokenPassSearch::create_word_repository: Ignoring empty word in vocabulary."
-          << endl;
-      }
-      continue;
+  if (word.size() == 0) {
+    if (m_verbose > 0) {
+      cerr
+        << "TokenPassSearch::create_word_repository: Ignoring empty word in vocabulary."
+        << endl;
     }
+    return true;
+  }
 
-    int lm_id;
-    float cm_log_prob;
-    find_word_from_lm(i, word, lm_id, cm_log_prob);
-    int lookahead_lm_id = find_word_from_lookahead_lm(i, word);
+  int lm_id;
+  float cm_log_prob;
+  find_word_from_lm(i, word, lm_id, cm_log_prob);
+  int lookahead_lm_id = find_word_from_lookahead_lm(i, word);
 
-    bool not_found = (lm_id < 0) && (i != 0);
-    if ((m_lookahead_ngram != NULL)
-        && ((lookahead_lm_id == 0) && (i != 0))) {
-      not_found = true;
-    }
+  bool not_found = (lm_id < 0) && (i != 0);
+  if ((m_lookahead_ngram != NULL)
+      && ((lookahead_lm_id == 0) && (i != 0))) {
+    not_found = true;
+  }
+  m_rescoring_lm_ids[i] = find_word_from_rescoring_lm(i, word);
+  if ((m_rescoring_ngram != NULL)
+      && ((m_rescoring_lm_ids[i] < 0) && (i != 0))) {
+    not_found = true;
+  }
 
-    m_word_repository.at(i).set_ids(i, lm_id, lookahead_lm_id);
+  m_word_repository.at(i).set_ids(i, lm_id, lookahead_lm_id);
 
 #ifdef ENABLE_MULTIWORD_SUPPORT
-    if (word[0] == '_') {
-      // Don't treat silences as multiwords.
-      m_word_repository[i].add_component(i, lm_id, lookahead_lm_id);
-    }
-    else {
-      cm_log_prob = 0;
-      string::iterator component_first = word.begin();
-      while (true) {
-        string::iterator component_last = find(component_first,
-                                               word.end(), '_');
-        string component(component_first, component_last);
-        if (component.size() == 0) {
-          if (m_verbose > 0) {
-            cerr
-              << "TokenPassSearch::create_word_repository: Ignoring empty multiword component in '"
-              << word << "'." << endl;
-          }
+  if (word[0] == '_') {
+    // Don't treat silences as multiwords.
+    m_word_repository[i].add_component(i, lm_id, lookahead_lm_id);
+  }
+  else {
+    cm_log_prob = 0;
+    string::iterator component_first = word.begin();
+    while (true) {
+      string::iterator component_last = find(component_first,
+                                             word.end(), '_');
+      string component(component_first, component_last);
+      if (component.size() == 0) {
+        if (m_verbose > 0) {
+          cerr
+            << "TokenPassSearch::create_word_repository: Ignoring empty multiword component in '"
+            << word << "'." << endl;
         }
-        else {
-          // In theory it's possible that multiword components are not found
-          // from the vocabulary as individual words. It won't prevent using
-          // them as long as they exist in the language model. Just make sure
-          // we have a word ID for every component.
-          int word_id = m_vocabulary.add_word(component);
-          m_word_repository.resize(m_vocabulary.num_words());
-
-          float component_cm_log_prob;
-          find_word_from_lm(word_id, component, lm_id,
-                            component_cm_log_prob);
-          lookahead_lm_id = find_word_from_lookahead_lm(word_id,
-                                                        component);
-          m_word_repository[i].add_component(word_id, lm_id,
-                                             lookahead_lm_id);
-          if ((lm_id < 0) && (i != 0)) {
-            not_found = true;
-          }
-          if ((m_lookahead_ngram != NULL)
-              && ((lookahead_lm_id == 0) && (i != 0))) {
-            not_found = true;
-          }
-          cm_log_prob += component_cm_log_prob;
+      }
+      else {
+        // In theory it's possible that multiword components are not found
+        // from the vocabulary as individual words. It won't prevent using
+        // them as long as they exist in the language model. Just make sure
+        // we have a word ID for every component.
+        int word_id = m_vocabulary.add_word(component);
+        m_word_repository.resize(m_vocabulary.num_words());
+        m_rescoring_lm_ids.resize(m_vocabulary.num_words(), -1);
+        m_rescoring_lm_ids[word_id] =
+          find_word_from_rescoring_lm(word_id, component);
+
+        float component_cm_log_prob;
+        find_word_from_lm(word_id, component, lm_id,
+                          component_cm_log_prob);
+        lookahead_lm_id = find_word_from_lookahead_lm(word_id,
+                                                      component);
+        m_word_repository[i].add_component(word_id, lm_id,
+                                           lookahead_lm_id);
+        if ((lm_id < 0) && (i != 0)) {
+          not_found = true;
         }
-
-        if (component_last == word.end())
-          break;
-        component_first = component_last;
-        ++component_first;  // Skip the underscore we found last time.
+        if ((m_lookahead_ngram != NULL)
+            && ((lookahead_lm_id == 0) && (i != 0))) {
+          not_found = true;
+        }
+        cm_log_prob += component_cm_log_prob;
       }
-    }
-#endif
-
-    m_word_repository[i].set_cm_log_prob(cm_log_prob);
 
-    if (not_found) {
-      ++num_not_found;
+      if (component_last == word.end())
+        break;
+      component_first = component_last;
+      ++component_first;  // Skip the underscore we found last time.
     }
   }
+#endif
 
-  // We may have added words to the vocabulary along the way but I think the
-  // new words should have been added to the word repository in the end.
-  assert(m_vocabulary.num_words() == m_word_repository.size());
+  m_word_repository[i].set_cm_log_prob(cm_log_prob);
 
-  return num_not_found;
+  return !not_found;
 }
 
 void TokenPassSearch::find_word_from_lm(int word_id, std::string word,
@@ -1814,6 +1941,34 @@ int TokenPassSearch::find_word_from_lookahead_lm(int word_id,
   return m_lookahead_ngram->word_index(word);
 }
 
+int TokenPassSearch::find_word_from_rescoring_lm(int word_id,
+                                                 std::string word) const
+{
+  if (m_rescoring_ngram == NULL)
+    return -1;
+
+#ifdef ENABLE_WORDCLASS_SUPPORT
+  if (m_word_classes != NULL) {
+    try {
+      const WordClasses::Membership & class_membership =
+        m_word_classes->get_membership(word_id);
+      word = m_word_classes->get_class_name(class_membership.class_id);
+    }
+    catch (out_of_range &) {
+      // The word does not exist in the class definitions. See if it
+      // exists in the rescoring model as it is.
+    }
+  }
+#endif
+
+  int lm_id = m_rescoring_ngram->word_index(word);
+  if (lm_id == 0) {
+    // Vocabulary::word_index() returns 0 for unknown words.
+    lm_id = -1;
+  }
+  return lm_id;
+}
+
 #ifdef ENABLE_MULTIWORD_SUPPORT
 float TokenPassSearch::split_and_compute_ngram_score(LMHistory * history)
 {
@@ -1896,7 +2051,7 @@ float TokenPassSearch::get_ngram_score(LMHistory *lm_hist, int lm_hist_code)
     // Check this is correct word history
     LMHistory *wh = lm_hist;
     for (int i = 0; i < info->lm_hist.size(); i++) {
-      if (wh->last().word_id() != info->lm_hist[i]) // Also handles 'word_id==-1' case
+      if (lm_score_cache_id(wh->last()) != info->lm_hist[i])
       {
         collision = true;
         goto get_ngram_score_no_cached;
@@ -1910,6 +2065,7 @@ float TokenPassSearch::get_ngram_score(LMHistory *lm_hist, int lm_hist_code)
         goto get_ngram_score_no_cached;
       }
     }
+    m_statistics.current().lm_cache_hits++;
     return info->lm_score;
   }
 get_ngram_score_no_cached: if (collision) {
@@ -1924,7 +2080,7 @@ get_ngram_score_no_cached: if (collision) {
   info->lm_score = score;
   LMHistory *wh = lm_hist;
   for (i = 0; i <= m_ngram->order() && wh->last().word_id() != -1; i++) {
-    info->lm_hist.push_back(wh->last().word_id());
+    info->lm_hist.push_back(lm_score_cache_id(wh->last()));
     if (wh->last().word_id() == m_sentence_start_id)
       break;
 
@@ -1962,6 +2118,97 @@ void TokenPassSearch::advance_fsa_lm(Token & token)
 #endif
 }
 
+float TokenPassSearch::advance_ngram_state(Token & token)
+{
+  const LMHistory::Word & word = token.lm_history->last();
+  float lm_score = 0;
+
+  if (m_tree_gram->order() <= 0)
+    return 0;
+
+#ifdef ENABLE_MULTIWORD_SUPPORT
+  if (m_split_multiwords) {
+    for (int i = 0; i < word.num_components(); ++i) {
+      token.lm_state = m_tree_gram->walk(token.lm_state,
+                                         word.component(i).lm_id, &lm_score);
+    }
+    return lm_score;
+  }
+#endif
+
+  token.lm_state = m_tree_gram->walk(token.lm_state, word.lm_id(),
+                                     &lm_score);
+  return lm_score;
+}
+
+int TokenPassSearch::sentence_start_lm_state()
+{
+  // An n-gram history is never extended over a sentence start.
+  int lm_id = m_word_repository[m_sentence_start_id].lm_id();
+  if (lm_id < 0)
+    return -1;
+  return m_tree_gram->walk(-1, lm_id);
+}
+
+int TokenPassSearch::sentence_start_rescoring_state()
+{
+  int lm_id = m_rescoring_lm_ids[m_sentence_start_id];
+  if (lm_id < 0)
+    return -1;
+  return rescoring_walk(-1, lm_id, NULL);
+}
+
+int TokenPassSearch::rescoring_walk(int state, int lm_id, float *log_prob)
+{
+  if (lm_id < 0)
+    return -1;
+
+  unsigned int hash = (unsigned int)state * 2654435761u
+    ^ (unsigned int)lm_id * 40503u;
+  RescoringCacheEntry &entry =
+    m_rescoring_cache[(hash ^ (hash >> 16)) & (m_rescoring_cache.size() - 1)];
+  if (entry.state == state && entry.lm_id == lm_id) {
+    m_statistics.current().rescoring_cache_hits++;
+  }
+  else {
+    entry.state = state;
+    entry.lm_id = lm_id;
+    entry.log_prob = 0;
+    entry.next_state = m_rescoring_ngram->walk(state, lm_id, &entry.log_prob);
+  }
+  if (log_prob != NULL)
+    *log_prob += entry.log_prob;
+  return entry.next_state;
+}
+
+float TokenPassSearch::advance_rescoring_state(Token & token,
+                                               float small_lm_score)
+{
+  const LMHistory::Word & word = token.lm_history->last();
+  float lm_score = 0;
+
+#ifdef ENABLE_MULTIWORD_SUPPORT
+  if (m_split_multiwords) {
+    bool found = true;
+    for (int i = 0; i < word.num_components(); ++i) {
+      int lm_id = m_rescoring_lm_ids[word.component(i).word_id];
+      if (lm_id < 0)
+        found = false;
+      token.rescoring_lm_state = rescoring_walk(token.rescoring_lm_state,
+                                                lm_id, &lm_score);
+    }
+    return found ? lm_score : small_lm_score;
+  }
+#endif
+
+  int lm_id = m_rescoring_lm_ids[word.word_id()];
+  token.rescoring_lm_state = rescoring_walk(token.rescoring_lm_state, lm_id,
+                                            &lm_score);
+  if (lm_id < 0)
+    return small_lm_score;
+  return lm_score;
+}
+
 void TokenPassSearch::update_lm_log_prob(Token & token)
 {
   const LMHistory::Word & word = token.lm_history->last();
@@ -1976,9 +2223,22 @@ void TokenPassSearch::update_lm_log_prob(Token & token)
   else {  // n-gram language model
     token.lm_hist_code = compute_lm_hist_hash_code(token.lm_history);
 
-    if (word.word_id() != m_sentence_start_id) {
-      float lm_score = get_ngram_score(token.lm_history,
-                                       token.lm_hist_code);
+    if (word.word_id() == m_sentence_start_id) {
+      if (m_tree_gram)
+        token.lm_state = sentence_start_lm_state();
+      if (m_rescoring_ngram)
+        token.rescoring_lm_state = sentence_start_rescoring_state();
+    }
+    else {
+      float lm_score;
+      m_statistics.current().lm_queries++;
+      if (m_tree_gram)
+        lm_score = advance_ngram_state(token);
+      else
+        lm_score = get_ngram_score(token.lm_history, token.lm_hist_code);
+      // The difference to the rescoring model is applied at the word end.
+      if (m_rescoring_ngram)
+        lm_score = advance_rescoring_state(token, lm_score);
       token.lm_log_prob += lm_score;
       token.lm_log_prob += word.cm_log_prob();
       token.lm_log_prob += m_insertion_penalty;
@@ -2026,9 +2286,16 @@ float TokenPassSearch::get_lm_bigram_lookahead(int prev_word_id,
   lm_la_cache_count[depth]++;
 #endif
 
+  m_statistics.current().lookahead_queries++;
+  if (m_class_based_lm)
+    return get_lm_bigram_class_lookahead(
+      m_word_repository[prev_word_id].lookahead_lm_id(), node);
+
   float score;
-  if (node->lm_lookahead_buffer.find(prev_word_id, &score))
+  if (node->lm_lookahead_buffer.find(prev_word_id, &score)) {
+    m_statistics.current().lookahead_cache_hits++;
     return score;
+  }
 
 #ifdef COUNT_LM_LA_CACHE_MISS
   lm_la_cache_miss[depth]++;
@@ -2088,10 +2355,21 @@ float TokenPassSearch::get_lm_trigram_lookahead(int w1, int w2,
   lm_la_cache_count[depth]++;
 #endif
 
-  int index = w1 * m_word_repository.size() + w2;
+  m_statistics.current().lookahead_queries++;
+  if (m_class_based_lm)
+    return get_lm_trigram_class_lookahead(
+      m_word_repository[w1].lookahead_lm_id(),
+      m_word_repository[w2].lookahead_lm_id(), node);
+
+  // The key is formed from the lookahead LM IDs, so that the buffers stay
+  // valid when words are added to the vocabulary.
+  int index = m_word_repository[w1].lookahead_lm_id() *
+    m_lookahead_ngram->num_words() + m_word_repository[w2].lookahead_lm_id();
   float score;
-  if (node->lm_lookahead_buffer.find(index, &score))
+  if (node->lm_lookahead_buffer.find(index, &score)) {
+    m_statistics.current().lookahead_cache_hits++;
     return score;
+  }
 
 #ifdef COUNT_LM_LA_CACHE_MISS
   lm_la_cache_miss[depth]++;
@@ -2144,6 +2422,71 @@ float TokenPassSearch::get_lm_trigram_lookahead(int w1, int w2,
   return score;
 }
 
+float TokenPassSearch::get_lm_bigram_class_lookahead(
+  int prev_la_id, TPLexPrefixTree::Node *node)
+{
+  float score;
+  if (node->lm_lookahead_buffer.find(prev_la_id, &score)) {
+    m_statistics.current().lookahead_cache_hits++;
+    return score;
+  }
+
+  // The score lists are indexed by lookahead LM ID, so they can be used as
+  // they are fetched from the model.
+  LMLookaheadScoreList * score_list = NULL;
+  if (!lm_lookahead_score_list.find(prev_la_id, &score_list)) {
+    score_list = new LMLookaheadScoreList;
+    LMLookaheadScoreList * old_score_list = NULL;
+    if (lm_lookahead_score_list.insert(prev_la_id, score_list,
+                                       &old_score_list))
+      delete old_score_list;
+    score_list->index = prev_la_id;
+    m_lookahead_ngram->fetch_bigram_list(prev_la_id, score_list->lm_scores);
+  }
+
+  score = max_lookahead_score(score_list->lm_scores, node);
+  node->lm_lookahead_buffer.insert(prev_la_id, score, NULL);
+  return score;
+}
+
+float TokenPassSearch::get_lm_trigram_class_lookahead(
+  int la_id1, int la_id2, TPLexPrefixTree::Node *node)
+{
+  int index = la_id1 * m_lookahead_ngram->num_words() + la_id2;
+  float score;
+  if (node->lm_lookahead_buffer.find(index, &score)) {
+    m_statistics.current().lookahead_cache_hits++;
+    return score;
+  }
+
+  LMLookaheadScoreList * score_list = NULL;
+  if (!lm_lookahead_score_list.find(index, &score_list)) {
+    score_list = new LMLookaheadScoreList;
+    LMLookaheadScoreList * old_score_list = NULL;
+    if (lm_lookahead_score_list.insert(index, score_list, &old_score_list))
+      delete old_score_list;
+    score_list->index = index;
+    m_lookahead_ngram->fetch_trigram_list(la_id1, la_id2,
+                                          score_list->lm_scores);
+  }
+
+  score = max_lookahead_score(score_list->lm_scores, node);
+  node->lm_lookahead_buffer.insert(index, score, NULL);
+  return score;
+}
+
+float TokenPassSearch::max_lookahead_score(
+  const std::vector<float> &lm_scores, const TPLexPrefixTree::Node *node)
+{
+  float score = -1e10;
+  for (int i = 0; i < node->possible_lookahead_id_list.size(); i++) {
+    float class_score = lm_scores[node->possible_lookahead_id_list[i]];
+    if (class_score > score)
+      score = class_score;
+  }
+  return score;
+}
+
 Token*
 TokenPassSearch::acquire_token(void)
 {
@@ -2163,22 +2506,7 @@ TokenPassSearch::acquire_token(void)
 
 LMHistory *
 TokenPassSearch::acquire_lmhist(const LMHistory::Word * last_word, LMHistory * previous) {
-  if (m_lmh_pool.size() == 0) {
-    LMHistory * lmh_block = new LMHistory[TOKEN_RESERVE_BLOCK];
-    m_lmhist_dealloc_table.push_back(lmh_block);
-    for (int i = 0; i < TOKEN_RESERVE_BLOCK; i++)
-      m_lmh_pool.push_back(&lmh_block[i]);
-  }
-  LMHistory *lmh = m_lmh_pool.back();
-  m_lmh_pool.pop_back();
-  lmh->last_word = last_word;
-  lmh->previous = previous;
-  lmh->reference_count = 0;
-  lmh->printed = false;
-  lmh->word_start_frame = 0;
-  lmh->word_first_silence_frame=-1;
-  if (previous) hist::link(lmh->previous);
-  return lmh;
+  return m_lmh_pool.acquire(last_word, previous);
 }
 
 void TokenPassSearch::release_token(Token *token)
@@ -2187,18 +2515,110 @@ void TokenPassSearch::release_token(Token *token)
     word_graph.unlink(token->recent_word_graph_node);
   token->recent_word_graph_node = -1;
   hist::unlink(token->lm_history, &m_lmh_pool);
-  hist::unlink(token->word_history);
-  hist::unlink(token->state_history);
+  hist::unlink(token->word_history, &m_word_history_pool);
+  hist::unlink(token->state_history, &m_state_history_pool);
   //TPLexPrefixTree::PathHistory::unlink(token->token_path);
   m_token_pool.push_back(token);
 }
 
+void TokenPassSearch::release_tokens(TokenList::const_iterator begin,
+                                     TokenList::const_iterator end)
+{
+  m_token_pool.reserve(m_token_pool.size() + (end - begin));
+  for (TokenList::const_iterator it = begin; it != end; ++it) {
+    if (*it != NULL)
+      release_token(*it);
+  }
+}
+
 void TokenPassSearch::release_lmhist(LMHistory *lmhist) {
-  lmhist->last_word=NULL;
-  lmhist->previous=NULL;
-  m_lmh_pool.push_back(lmhist);
+  m_lmh_pool.release(lmhist);
+}
+
+
+void TokenPassSearch::add_partial_word(int index, bool stable)
+{
+  const LMHistory *hist = m_partial_path[index];
+  PartialResultWord word;
+  word.word = m_vocabulary.word(hist->last().word_id());
+  word.start_frame = hist->word_start_frame;
+  if (index + 1 < (int)m_partial_path.size())
+    word.end_frame = m_partial_path[index + 1]->word_start_frame;
+  else
+    word.end_frame = m_frame;
+  word.stable = stable;
+  m_partial_words.push_back(word);
 }
 
+void TokenPassSearch::update_partial_result(bool final)
+{
+  if (!final && m_best_token == NULL)
+    return;
+  const Token &best_token = final ? get_best_final_token() : *m_best_token;
+
+  // Trace back the words of the best token after the common history.
+  m_partial_path.clear();
+  for (LMHistory *hist = best_token.lm_history; hist != m_stable_history;
+       hist = hist->previous)
+  {
+    assert(hist != NULL);
+    m_partial_path.push_back(hist);
+  }
+  std::reverse(m_partial_path.begin(), m_partial_path.end());
+  int path_length = m_partial_path.size();
+  m_partial_words.clear();
+
+  // If the common history has only one reference, all the tokens continue
+  // with the next word of the best path. The words are reported only after
+  // the next word has started, so that their end frames are known.
+  int next = 0;
+  while (next + 1 < path_length && m_stable_history->reference_count == 1) {
+    if (m_num_forced_stable_words > 0)
+      m_num_forced_stable_words--;
+    else
+      add_partial_word(next, true);
+    m_stable_history = m_partial_path[next++];
+  }
+
+  // Words that have ended long enough ago are reported stable without
+  // advancing the common history.
+  int first_unstable = next + m_num_forced_stable_words;
+  while (first_unstable < path_length) {
+    if (!final) {
+      if (m_partial_result_max_latency <= 0 ||
+          first_unstable + 1 >= path_length ||
+          m_partial_path[first_unstable + 1]->word_start_frame >
+          m_frame - m_partial_result_max_latency)
+        break;
+    }
+    add_partial_word(first_unstable++, true);
+    m_num_forced_stable_words++;
+  }
+  bool changed = !m_partial_words.empty();
+
+  // Report the rest of the best path if it has changed.
+  int num_unstable = std::max(0, path_length - first_unstable);
+  if (num_unstable != (int)m_partial_unstable_words.size())
+    changed = true;
+  for (int i = 0; i < num_unstable; i++) {
+    add_partial_word(first_unstable + i, false);
+    if (changed)
+      continue;
+    const PartialResultWord &word = m_partial_words.back();
+    const PartialResultWord &old_word = m_partial_unstable_words[i];
+    if (word.word != old_word.word || word.start_frame != old_word.start_frame)
+      changed = true;
+  }
+  if (!changed)
+    return;
+  m_partial_unstable_words.assign(m_partial_words.end() - num_unstable,
+                                  m_partial_words.end());
+  if (final) {
+    m_stable_history = best_token.lm_history;
+    m_num_forced_stable_words = 0;
+  }
+  m_partial_result_callback(m_partial_words);
+}
 
 void TokenPassSearch::save_token_statistics(int count)
 {
@@ -2283,7 +2703,7 @@ void TokenPassSearch::update_final_tokens()
     // word. Thus, tokens that are in a final node do not have the current
     // word in their word histories.
     if (m_generate_word_graph && token->node->flags & NODE_FINAL) {
-      token->word_history = new Token::WordHistory(
+      token->word_history = m_word_history_pool.acquire(
         token->lm_history->last().word_id(), m_frame,
         token->word_history);
       token->word_history->lex_node_id = token->node->node_id;
@@ -2311,6 +2731,7 @@ void TokenPassSearch::update_final_tokens()
     token->word_count++;
     token->total_log_prob = get_token_log_prob(token->am_log_prob,
                                                token->lm_log_prob);
+    m_active_token_list.update(token);
 
     // For tokens in a final node, add sentence end also in WordHistory.
     if (m_generate_word_graph && token->node->flags & NODE_FINAL) {
@@ -2319,7 +2740,7 @@ void TokenPassSearch::update_final_tokens()
           > m_best_final_token->total_log_prob)
         m_best_final_token = token;
 
-      token->word_history = new Token::WordHistory(
+      token->word_history = m_word_history_pool.acquire(
         token->lm_history->last().word_id(), m_frame,
         token->word_history);
       token->word_history->lex_node_id = token->node->node_id;
@@ -2533,6 +2954,69 @@ void TokenPassSearch::write_word_graph(FILE *file)
   }
 }
 
+void TokenPassSearch::write_binary_word_graph(const std::string &file_name)
+{
+  if (!m_generate_word_graph) {
+    throw WordGraphNotGenerated();
+  }
+
+  FILE *file = fopen(file_name.c_str(), "wb");
+  if (!file) {
+    throw IOError("Could not open word graph file for writing.");
+  }
+  try {
+    write_binary_word_graph(file);
+  }
+  catch (BinaryLatticeWriter::WriteError &) {
+    fclose(file);
+    throw IOError("Could not write word graph file.");
+  }
+  if (fclose(file) != 0) {
+    throw IOError("Could not write word graph file.");
+  }
+}
+
+void TokenPassSearch::write_binary_word_graph(FILE *file)
+{
+  const Token & best_token = get_best_final_token();
+  word_graph.reset_reachability();
+  word_graph.mark_reachable_nodes(best_token.recent_word_graph_node);
+
+  BinaryLatticeWriter writer(file, m_lm_scale, m_insertion_penalty);
+  for (int n = 0; n < word_graph.nodes.size(); n++) {
+    WordGraph::Node &node = word_graph.nodes[n];
+    if (!node.reachable)
+      continue;
+    writer.node(n, node.frame);
+
+    int a = node.first_arc;
+    if (a < 0)
+      continue;
+    int symbol = node.symbol;
+    const std::string &word = m_vocabulary.word(symbol);
+    if (word == "<s>" || word == "</s>")
+      symbol = -1;
+    while (a >= 0) {
+      WordGraph::Arc &arc = word_graph.arcs[a];
+      float lm_log_prob = arc.lm_weight / m_lm_scale - m_insertion_penalty;
+      writer.arc(arc.source_node_id, symbol, word, arc.am_weight, lm_log_prob);
+      a = arc.sibling_arc;
+    }
+  }
+  writer.finish(0, best_token.recent_word_graph_node);
+}
+
+void TokenPassSearch::analyze_word_graph(WordGraphAnalyzer &analyzer)
+{
+  if (!m_generate_word_graph) {
+    throw WordGraphNotGenerated();
+  }
+
+  const Token & best_token = get_best_final_token();
+  analyzer.set_graph(word_graph, best_token.recent_word_graph_node,
+                     m_vocabulary, m_lm_scale, m_insertion_penalty);
+}
+
 // void
 // TokenPassSearch::write_word_graph(FILE *file)
 // {
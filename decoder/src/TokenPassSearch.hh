@@ -1,7 +1,9 @@
 #ifndef TOKENPASSSEARCH_HH
 #define TOKENPASSSEARCH_HH
 
+#include <functional>
 #include <stdexcept>
+#include <string>
 #include <vector>
 #include <cmath>
 #include <utility>
@@ -9,9 +11,15 @@
 #include "config.hh"
 #include "fsalm/LM.hh"
 #include "WordGraph.hh"
+#include "WordGraphAnalyzer.hh"
+#include "BinaryLatticeWriter.hh"
 #include "TPLexPrefixTree.hh"
 #include "Token.hh"
+#include "TokenList.hh"
+#include "TokenPruner.hh"
+#include "SearchStatistics.hh"
 #include "NGram.hh"
+#include "TreeGram.hh"
 #include "Acoustics.hh"
 #include "LMHistory.hh"
 #include "IteratorRange.hh"
@@ -62,8 +70,27 @@ public:
     }
   };
 
+  /// \brief A word of an incremental partial result.
+  struct PartialResultWord
+  {
+    std::string word;
+    int start_frame;
+    int end_frame; //!< Start frame of the next word, or the current frame.
+    bool stable; //!< True if the word will not be reported again.
+  };
+
+  /// \brief Receives the partial result words that have changed since the
+  /// previous call.
+  ///
+  /// The stable words come first and continue the stable words of the
+  /// previous calls. The unstable words are the rest of the current best
+  /// path, and replace the unstable words of the previous call.
+  ///
+  typedef std::function<void(const std::vector<PartialResultWord> &)>
+  PartialResultCallback;
+
   typedef std::vector<Token *> token_list_type;
-  typedef IteratorRange<token_list_type::const_iterator> token_range_type;
+  typedef IteratorRange<TokenList::const_iterator> token_range_type;
 
   TokenPassSearch(TPLexPrefixTree &lex, Vocabulary &vocab,
                   Acoustics *acoustics);
@@ -151,6 +178,21 @@ public:
   void set_transition_scale(float trans_scale) { m_transition_scale = trans_scale; }
   void set_max_num_tokens(int tokens) { m_max_num_tokens = tokens; }
 
+  /// \brief Applies the token limit exactly by selecting the best tokens,
+  /// instead of the histogram approximation.
+  void set_exact_token_limit(bool exact) { m_pruner.set_exact(exact); }
+
+  /// \brief Writes the token scores and pruning limits of each frame into
+  /// \a file, which can be replayed with prune_bench. NULL disables the
+  /// recording. The file is not closed by the search.
+  void set_pruning_record(FILE *file) { m_pruning_record = file; }
+
+  /// \brief Per-frame token counts, cache hit rates and timing. Frames are
+  /// stored only after statistics().set_enabled(true), and cleared by
+  /// reset_search().
+  SearchStatistics & statistics() { return m_statistics; }
+  const SearchStatistics & statistics() const { return m_statistics; }
+
 #ifdef ENABLE_MULTIWORD_SUPPORT
   void set_split_multiwords(bool value)
   {
@@ -209,6 +251,18 @@ public:
 
   /// \brief Sets the word classes for class-based language models.
   ///
+  /// The language model and the lookahead model are then assumed to be based
+  /// on classes, and the search runs in class space: the LM lookahead score
+  /// lists and node buffers, and the LM score cache are indexed by class
+  /// instead of by word, so their size depends on the number of classes
+  /// instead of the vocabulary size. The class membership log probability is
+  /// added when a word ends.
+  ///
+  /// Only those structures are in class space. The word repository and the
+  /// rescoring LM IDs are still one entry per vocabulary word, because the
+  /// lexicon and the LM histories refer to words and need the class of each
+  /// word. The lexicon nodes also keep their lists of possible word IDs.
+  ///
   /// This function has to be called before calling set_ngram() or
   /// set_fsa_lm().
   ///
@@ -240,6 +294,47 @@ public:
   ///
   int set_lookahead_ngram(NGram *ngram);
 
+  /// \brief Sets a large n-gram model for rescoring at word ends.
+  ///
+  /// The search and the lookahead run on the model given to set_ngram(),
+  /// which has to be a small back-off TreeGram. Each token also walks a
+  /// context state in the rescoring model, and when a word ends, the
+  /// difference of the rescoring model score to the small model score is
+  /// added, so the LM scores of the hypotheses are those of the rescoring
+  /// model. The transitions of the rescoring model are cached by context
+  /// state and word, so that most word ends do not touch the large model.
+  /// Words that are not in the rescoring model are scored with the small
+  /// model, and reset the rescoring context.
+  ///
+  /// Tokens are still recombined by their history in the small model, so
+  /// set_similar_lm_history_span() should cover the order of the rescoring
+  /// model. Interpolated models are converted to back-off models.
+  ///
+  /// \param ngram The rescoring model, or NULL to disable rescoring.
+  /// \return The number of vocabulary entries that were not found in the
+  /// search, lookahead or rescoring model.
+  ///
+  int set_rescoring_ngram(TreeGram *ngram);
+
+  /// \brief Updates the search after words have been added to or removed
+  /// from the lexicon of a running decoder.
+  ///
+  /// Adds the new vocabulary entries to the word repository, and clears the
+  /// LM lookahead buffers of the lexicon nodes whose lists of possible words
+  /// changed. The histories of the previous utterance may refer to the old
+  /// repository, so this has to be called between utterances, and the
+  /// results of the previous utterance are not available after it.
+  ///
+  /// \return The number of new vocabulary entries that were not found in
+  /// the language model.
+  ///
+  int update_vocabulary();
+
+  /// \brief Sets the number of entries in the rescoring cache (rounded up
+  /// to a power of two) and clears it.
+  ///
+  void set_rescoring_cache_size(int entries);
+
   /// \brief If set to true, generates a word graph of the hypotheses during
   /// decoding (requires memory).
   ///
@@ -248,6 +343,29 @@ public:
     m_generate_word_graph = value;
   }
 
+  /// \brief Reports the best path incrementally to \a callback after each
+  /// frame, or disables the reports if \a callback is empty.
+  ///
+  /// The search keeps a pointer to the deepest LM history that is common to
+  /// all the active tokens. A word becomes stable when the history is
+  /// advanced over it, which is checked from the reference count of the
+  /// history in constant time. Only the words of the best token after the
+  /// common history are traced back, and the callback is called only when
+  /// the words change. At the end of the utterance, the words of
+  /// the best final token are reported stable.
+  ///
+  /// \param max_latency If positive, a word of the best path is reported
+  /// stable when the next word started at least this many frames ago, even
+  /// if some tokens do not share it yet. The stable words are not revised,
+  /// so in rare cases they differ from the final best path.
+  ///
+  void set_partial_result_callback(PartialResultCallback callback,
+                                   int max_latency = 0)
+  {
+    m_partial_result_callback = callback;
+    m_partial_result_max_latency = max_latency;
+  }
+
   /// \brief Returns the value of the word graph generation flag.
   ///
   bool get_generate_word_graph() const
@@ -265,6 +383,11 @@ public:
     m_use_word_pair_approximation = value;
   }
 
+  /// \brief Enables or disables the n-gram score cache.
+  ///
+  /// The cache is not used with back-off TreeGram models, since they are
+  /// scored by walking from the LM state of the token.
+  ///
   void set_use_lm_cache(bool value)
   {
     m_use_lm_cache = value;
@@ -284,6 +407,26 @@ public:
   void write_word_graph(const std::string &file_name);
   void write_word_graph(FILE *file);
 
+  /// \brief Writes the same nodes and arcs as write_word_graph() in the
+  /// binary format of BinaryLatticeWriter.
+  ///
+  /// The file is written in one pass over the nodes, and is typically several
+  /// times smaller than the SLF file.
+  ///
+  /// \exception WordGraphNotGenerated If word graph has not been generated.
+  /// \exception IOError If unable to write the file.
+  ///
+  void write_binary_word_graph(const std::string &file_name);
+  void write_binary_word_graph(FILE *file);
+
+  /// \brief Gives the part of word_graph that leads to the best final token
+  /// to \a analyzer, for computing posteriors, n-best lists and confusion
+  /// networks without writing the graph to a file.
+  ///
+  /// \exception WordGraphNotGenerated If word graph has not been generated.
+  ///
+  void analyze_word_graph(WordGraphAnalyzer &analyzer);
+
   void debug_ensure_all_paths_contain_history(LMHistory *limit);
 
   /// \brief Returns the logarithmic AM probability of an active token.
@@ -346,6 +489,12 @@ private:
   ///
   int create_word_repository();
 
+  /// \brief Fills the word repository entry of vocabulary word \a i.
+  ///
+  /// \return False if the word was not found in the language model.
+  ///
+  bool create_word_repository_entry(int i);
+
   /// \brief Finds out the language model ID and class membership log
   /// probability of a word.
   ///
@@ -380,6 +529,13 @@ private:
   ///
   int find_word_from_lookahead_lm(int word_id, std::string word) const;
 
+  /// \brief Finds out the ID of a word (or its class) in the rescoring LM.
+  ///
+  /// \return The rescoring LM ID, or -1 if the word or class does not exist
+  /// in the rescoring LM.
+  ///
+  int find_word_from_rescoring_lm(int word_id, std::string word) const;
+
   void add_sentence_end_to_hypotheses(void);
 
   /// \brief Propagates all the tokens in the active token list to the
@@ -439,6 +595,10 @@ private:
   ///
   void prune_tokens(void);
 
+  /// \brief Checks the additional pruning criteria enabled at compile time
+  /// (PRUNING_EXTENSIONS, FAN_IN_PRUNING etc.).
+  bool is_pruned_by_extensions(const Token *token, float total_log_prob) const;
+
 #ifdef PRUNING_MEASUREMENT
   void analyze_tokens(void);
 #endif
@@ -508,6 +668,35 @@ private:
   ///
   void advance_fsa_lm(Token & token);
 
+  /// \brief Moves a token to the next n-gram context state through the last
+  /// word of its LM history, and returns the n-gram log probability.
+  ///
+  /// Used instead of get_ngram_score() when the language model is a back-off
+  /// TreeGram.
+  ///
+  float advance_ngram_state(Token & token);
+
+  /// \brief Returns the n-gram context state after a sentence start.
+  ///
+  int sentence_start_lm_state();
+
+  /// \brief Advances the rescoring LM state of \a token by the last word of
+  /// its LM history, and returns the rescoring log probability.
+  ///
+  /// \param small_lm_score The score of the word in the search LM, used for
+  /// words that are not in the rescoring model.
+  ///
+  float advance_rescoring_state(Token & token, float small_lm_score);
+
+  /// \brief Walks the rescoring LM from \a state through \a lm_id using
+  /// the rescoring cache, and adds the log probability to \a log_prob.
+  ///
+  int rescoring_walk(int state, int lm_id, float *log_prob);
+
+  /// \brief Returns the rescoring LM state after a sentence start.
+  ///
+  int sentence_start_rescoring_state();
+
   /// \brief Updated lm_log_prob and lm_hist_code on token after adding a new
   /// word to the end of its lm_history.
   ///
@@ -534,6 +723,44 @@ private:
   float get_lm_trigram_lookahead(int w1, int w2,
                                  TPLexPrefixTree::Node *node, int depth);
 
+  /// \brief Bigram lookahead in class space, keyed by the lookahead LM ID
+  /// of the previous word.
+  ///
+  float get_lm_bigram_class_lookahead(int prev_la_id,
+                                      TPLexPrefixTree::Node *node);
+
+  /// \brief Trigram lookahead in class space, keyed by the lookahead LM IDs
+  /// of the previous two words.
+  ///
+  float get_lm_trigram_class_lookahead(int la_id1, int la_id2,
+                                       TPLexPrefixTree::Node *node);
+
+  /// \brief Returns the maximum of \a lm_scores (indexed by lookahead LM ID)
+  /// over the classes that can end after \a node.
+  ///
+  float max_lookahead_score(const std::vector<float> &lm_scores,
+                            const TPLexPrefixTree::Node *node);
+
+  /// \brief Returns the ID of a word in the LM score cache.
+  ///
+  /// In class space this is the LM ID of the word, so that the words of a
+  /// class share the cached scores. Words that are not in the LM, and words
+  /// scored by components, are identified by word ID, mapped to negative
+  /// numbers so that the null word stays -1.
+  ///
+  int lm_score_cache_id(const LMHistory::Word &word) const
+  {
+#ifdef ENABLE_MULTIWORD_SUPPORT
+    if (m_split_multiwords)
+      return word.word_id();
+#endif
+    if (!m_class_based_lm)
+      return word.word_id();
+    if (word.lm_id() >= 0)
+      return word.lm_id();
+    return -2 - word.word_id();
+  }
+
   void clear_active_node_token_lists(void);
 
   inline float get_token_log_prob(float am_score, float lm_score)
@@ -544,15 +771,30 @@ private:
   Token* acquire_token(void);
   LMHistory* acquire_lmhist(const LMHistory::Word *, LMHistory *);
   void release_token(Token *token);
+
+  /// \brief Releases a range of tokens one by one with release_token()
+  /// (NULL elements are skipped). Each token still unlinks its own
+  /// histories; only the pool is grown once for the whole range.
+  void release_tokens(TokenList::const_iterator begin,
+                      TokenList::const_iterator end);
   void release_lmhist(LMHistory *);
 
+  /// \brief Reports the changes of the partial result after a frame.
+  ///
+  /// \param final If true, reports the path of the best final token as
+  /// stable.
+  ///
+  void update_partial_result(bool final);
+
+  /// \brief Adds the word of m_partial_path[index] to m_partial_words.
+  void add_partial_word(int index, bool stable);
+
   void save_token_statistics(int count);
   //void print_token_path(TPLexPrefixTree::PathHistory *hist);
 
   // Help variables to cope with memory leaks
   // Vector of pointers to memory blocks for m_token_pool, this is only for freeing up memory at the destructor
   std::vector<Token *> m_token_dealloc_table;
-  std::vector<LMHistory *> m_lmhist_dealloc_table;
 
 public:
 
@@ -567,11 +809,21 @@ private:
 #endif
   Acoustics *m_acoustics;
 
-  token_list_type m_active_token_list;
-  token_list_type m_new_token_list;
-  token_list_type m_word_end_token_list;
+  TokenList m_active_token_list;
+  TokenList m_new_token_list;
+  TokenList m_word_end_token_list;
   token_list_type m_token_pool;
-  std::vector<LMHistory*> m_lmh_pool;
+  token_list_type m_pruned_tokens; // Released after the pruning pass
+
+  TokenPruner m_pruner;
+  FILE *m_pruning_record;
+  SearchStatistics m_statistics;
+
+  /// History structures are allocated from per-search pools, and released
+  /// all at once in reset_search().
+  hist::Pool<LMHistory> m_lmh_pool;
+  hist::Pool<Token::WordHistory> m_word_history_pool;
+  hist::Pool<Token::StateHistory> m_state_history_pool;
 
   std::vector<TPLexPrefixTree::Node*> m_active_node_list;
 
@@ -618,17 +870,47 @@ private:
 
   Token *m_best_final_token;
 
+  /// The active token with the highest total_log_prob after pruning.
+  Token *m_best_token;
+
+  PartialResultCallback m_partial_result_callback;
+  int m_partial_result_max_latency;
+
+  /// The deepest LM history common to all active tokens. It is not linked,
+  /// since all the active tokens keep it alive.
+  LMHistory *m_stable_history;
+
+  /// The number of words after m_stable_history that have been reported
+  /// stable because of the latency limit.
+  int m_num_forced_stable_words;
+
+  /// The histories of the best token after m_stable_history.
+  std::vector<LMHistory*> m_partial_path;
+  std::vector<PartialResultWord> m_partial_words;
+
+  /// The unstable words of the previous partial result.
+  std::vector<PartialResultWord> m_partial_unstable_words;
+
   /// The language model.
   NGram *m_ngram;
   fsalm::LM *m_fsa_lm;
 
+  /// The language model, if it is a back-off TreeGram that can be scored by
+  /// walking the context states, otherwise NULL.
+  TreeGram *m_tree_gram;
+
   /// This is a repository of LMHistory::Word structures, indexed by
-  /// dictionary word ID.
+  /// dictionary word ID. It has an entry for every vocabulary word also with
+  /// word classes, where each entry holds the LM IDs of the word's class.
   std::vector<LMHistory::Word> m_word_repository;
 
   /// A null word (IDs -1) starts every LM history.
   LMHistory::Word m_null_word;
 
+  /// True if word classes are set and the LM scores are computed in class
+  /// space.
+  bool m_class_based_lm;
+
 #ifdef ENABLE_MULTIWORD_SUPPORT
   /// Should the decoder split multiwords into their components before
   /// computing LM probabilities?
@@ -638,6 +920,25 @@ private:
   NGram::Gram m_history_ngram; // Temporary variable used by compute_ngram_score().
   NGram *m_lookahead_ngram;
 
+  /// A large model for rescoring at word ends, or NULL.
+  TreeGram *m_rescoring_ngram;
+
+  /// The ID of each dictionary word (or its class) in the rescoring model,
+  /// or -1. Like the word repository, this is sized by the vocabulary.
+  std::vector<int> m_rescoring_lm_ids;
+
+  /// \brief A cached transition of the rescoring model.
+  struct RescoringCacheEntry {
+    int state; //!< Context state before the word, or -2 if the entry is empty.
+    int lm_id;
+    int next_state;
+    float log_prob;
+  };
+
+  /// Direct-mapped cache of rescoring model transitions, indexed by a hash
+  /// of the state and the word. The size is a power of two.
+  std::vector<RescoringCacheEntry> m_rescoring_cache;
+
   // Options
   float m_print_probs;
   int m_print_text_result;
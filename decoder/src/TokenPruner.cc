@@ -0,0 +1,111 @@
+#include <algorithm>
+#include <functional>
+#include <math.h>
+#include <string.h>
+
+#include "TokenPruner.hh"
+
+TokenPruner::Result
+TokenPruner::compute(const float * scores, size_t num_scores, float beam_limit,
+                     float best_log_prob, float worst_log_prob,
+                     int max_num_tokens)
+{
+  Result result;
+  result.threshold = beam_limit;
+
+  if (max_num_tokens <= 0 || num_scores <= (size_t)max_num_tokens) {
+    // Only the beam is applied. The count is branch-free so that the
+    // compiler can vectorize it.
+    size_t count = 0;
+    for (size_t i = 0; i < num_scores; i++)
+      count += (scores[i] >= beam_limit);
+    result.num_in_beam = count;
+    return result;
+  }
+
+  result.over_limit = true;
+
+  if (m_exact) {
+    m_candidates.clear();
+    for (size_t i = 0; i < num_scores; i++) {
+      if (scores[i] >= beam_limit)
+        m_candidates.push_back(scores[i]);
+    }
+    result.num_in_beam = m_candidates.size();
+    if (result.num_in_beam > (size_t)max_num_tokens) {
+      std::nth_element(m_candidates.begin(),
+                       m_candidates.begin() + (max_num_tokens - 1),
+                       m_candidates.end(), std::greater<float>());
+      result.threshold = m_candidates[max_num_tokens - 1];
+      result.limited = true;
+    }
+    return result;
+  }
+
+  // Histogram of the scores inside the beam. The bins span from the worst
+  // score inside the beam to the best score.
+  if (worst_log_prob < beam_limit)
+    worst_log_prob = beam_limit;
+  float bin_adv = (best_log_prob - worst_log_prob) / (NUM_BINS - 1);
+  int bins[NUM_BINS];
+  memset(bins, 0, NUM_BINS * sizeof(int));
+
+  size_t count = 0;
+  for (size_t i = 0; i < num_scores; i++) {
+    if (scores[i] >= beam_limit) {
+      bins[(int) floorf((scores[i] - worst_log_prob) / bin_adv)]++;
+      count++;
+    }
+  }
+  result.num_in_beam = count;
+
+  if (count > (size_t)max_num_tokens) {
+    // Find the lowest bin that leaves fewer tokens than the limit above it.
+    int i;
+    for (i = 0; i < NUM_BINS - 1; i++) {
+      count -= bins[i];
+      if (count < (size_t)max_num_tokens)
+        break;
+    }
+    result.threshold = worst_log_prob + (i + 1) * bin_adv;
+    result.limited = true;
+  }
+  return result;
+}
+
+void
+TokenPruner::write_record(FILE * file, const float * scores,
+                          size_t num_scores, float beam_limit,
+                          float best_log_prob, float worst_log_prob,
+                          int max_num_tokens)
+{
+  int size = num_scores;
+  float limits[3] = { beam_limit, best_log_prob, worst_log_prob };
+  fwrite(&size, sizeof(int), 1, file);
+  fwrite(limits, sizeof(float), 3, file);
+  fwrite(&max_num_tokens, sizeof(int), 1, file);
+  fwrite(scores, sizeof(float), num_scores, file);
+}
+
+bool
+TokenPruner::read_record(FILE * file, Record & record)
+{
+  int size;
+  if (fread(&size, sizeof(int), 1, file) != 1)
+    return false;
+
+  float limits[3];
+  if (size < 0 ||
+      fread(limits, sizeof(float), 3, file) != 3 ||
+      fread(&record.max_num_tokens, sizeof(int), 1, file) != 1)
+    throw RecordError("TokenPruner::read_record(): truncated frame header");
+  record.beam_limit = limits[0];
+  record.best_log_prob = limits[1];
+  record.worst_log_prob = limits[2];
+
+  record.scores.resize(size);
+  if (size > 0 &&
+      fread(&record.scores[0], sizeof(float), size, file) != (size_t)size)
+    throw RecordError("TokenPruner::read_record(): truncated scores");
+  return true;
+}
@@ -0,0 +1,106 @@
+#ifndef TOKENPRUNER_HH
+#define TOKENPRUNER_HH
+
+#include <cstddef>
+#include <cstdio>
+#include <stdexcept>
+#include <vector>
+
+/// \brief Computes the global pruning threshold of a frame from a dense array
+/// of token scores.
+///
+/// The threshold combines the beam and the limit on the number of active
+/// tokens. The scores are scanned once to count the tokens inside the beam and
+/// to collect the histogram (or the candidates for exact selection), so that
+/// the caller can release the pruned tokens in a single pass.
+///
+/// The limit on the number of tokens is applied either with a histogram of
+/// NUM_BINS bins between the worst and the best score, which may leave a few
+/// more tokens than the limit, or exactly by selecting the Kth best score with
+/// std::nth_element().
+///
+class TokenPruner {
+public:
+  struct RecordError : public std::runtime_error {
+    RecordError(const std::string & message)
+      : std::runtime_error(message) { }
+  };
+
+  static const int NUM_BINS = 100;
+
+  /// \brief The outcome of compute().
+  struct Result {
+    Result() : threshold(0), num_in_beam(0), over_limit(false),
+               limited(false) { }
+
+    /// Tokens whose score is below the threshold are pruned.
+    float threshold;
+
+    /// Number of tokens inside the beam.
+    size_t num_in_beam;
+
+    /// True if there were more tokens than the limit before beam pruning.
+    bool over_limit;
+
+    /// True if the limit cut tokens that were inside the beam. The threshold
+    /// is then higher than the beam limit.
+    bool limited;
+  };
+
+  /// \brief One frame of a pruning record, see write_record().
+  struct Record {
+    float beam_limit;
+    float best_log_prob;
+    float worst_log_prob;
+    int max_num_tokens;
+    std::vector<float> scores;
+  };
+
+  TokenPruner() : m_exact(false) { }
+
+  /// \brief Selects whether the token limit is applied exactly or with a
+  /// histogram (the default).
+  void set_exact(bool exact) { m_exact = exact; }
+  bool exact() const { return m_exact; }
+
+  /// \brief Computes the pruning threshold.
+  ///
+  /// \param scores Total log probabilities of the tokens.
+  /// \param num_scores Number of elements in \a scores.
+  /// \param beam_limit Scores below this are outside the beam.
+  /// \param best_log_prob The best score in \a scores.
+  /// \param worst_log_prob The worst score in \a scores (the histogram
+  /// starts from the beam limit if it is higher).
+  /// \param max_num_tokens Maximum number of tokens to keep, or 0 for no
+  /// limit.
+  ///
+  Result compute(const float * scores, size_t num_scores, float beam_limit,
+                 float best_log_prob, float worst_log_prob,
+                 int max_num_tokens);
+
+  /// \brief Appends one frame to a pruning record.
+  ///
+  /// A record consists of the arguments of compute() for consecutive frames,
+  /// in native byte order: the number of scores (int), the beam limit, the
+  /// best and the worst score (floats), the token limit (int), and the scores.
+  ///
+  static void write_record(FILE * file, const float * scores,
+                           size_t num_scores, float beam_limit,
+                           float best_log_prob, float worst_log_prob,
+                           int max_num_tokens);
+
+  /// \brief Reads the next frame of a pruning record.
+  ///
+  /// \return false at the end of the file.
+  /// \exception RecordError If the file ends in the middle of a frame.
+  ///
+  static bool read_record(FILE * file, Record & record);
+
+private:
+  bool m_exact;
+
+  /// Scores inside the beam, used for exact selection.
+  std::vector<float> m_candidates;
+};
+
+#endif
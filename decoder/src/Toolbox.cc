@@ -3,6 +3,7 @@
 #include <iostream>
 #include <assert.h>
 #include <errno.h>
+#include <memory>
 
 #include "InterTreeGram.hh"
 #include "Toolbox.hh"
@@ -29,6 +30,10 @@ Toolbox::Toolbox(const char * hmm_path, const char * dur_path)
     m_one_frame_acoustics(),
     m_fsa_lm(NULL),
     m_lookahead_ngram(NULL),
+    m_ngram_is_lookahead(false),
+    m_rescoring_ngram(NULL),
+    m_pending_ngram(NULL),
+    m_pending_ngram_quiet(false),
 
     m_last_guaranteed_history(NULL)
 {
@@ -48,6 +53,8 @@ Toolbox::~Toolbox()
   if (m_lookahead_ngram) {
     delete m_lookahead_ngram;
   }
+  delete m_rescoring_ngram;
+  delete m_pending_ngram;
 
   if (m_fsa_lm) {
     delete m_fsa_lm;
@@ -151,6 +158,31 @@ Toolbox::lex_read(const char *filename)
   m_lexicon_read = true;
 }
 
+void
+Toolbox::lex_add_words(const char *filename)
+{
+  FILE *file = fopen(filename, "r");
+  if (!file)
+    throw OpenError();
+  try {
+    m_tp_lexicon_reader->add_words(file);
+  }
+  catch (...) {
+    fclose(file);
+    m_tp_search->update_vocabulary();
+    throw;
+  }
+  fclose(file);
+  m_tp_search->update_vocabulary();
+}
+
+void
+Toolbox::lex_remove_added_words()
+{
+  m_tp_lexicon->remove_dynamic_words();
+  m_tp_search->update_vocabulary();
+}
+
 
 void
 Toolbox::interpolated_ngram_read(const std::vector<std::string> lmnames, 
@@ -195,6 +227,59 @@ Toolbox::ngram_read(const char *file, const bool binary, bool quiet)
   return m_ngrams.back()->order();
 }
 
+void
+Toolbox::swap_ngram(const char *file, bool binary, bool quiet)
+{
+  if (m_fsa_lm) {
+    fprintf(stderr, "Toolbox::swap_ngram() cannot replace an FSA LM\n");
+    throw logic_error("Toolbox::swap_ngram");
+  }
+
+  io::Stream in(file,"r");
+  if (!in.file) {
+    throw OpenError();
+  }
+
+  // The back-off links are computed here, so that the swap itself is fast.
+  std::unique_ptr<TreeGram> ngram(new TreeGram());
+  ngram->read(in.file, binary);
+  if (ngram->get_type() == NGram::BACKOFF && !ngram->has_back_off_links())
+    ngram->compute_back_off_links();
+
+  std::lock_guard<std::mutex> lock(m_pending_ngram_mutex);
+  delete m_pending_ngram;
+  m_pending_ngram = ngram.release();
+  m_pending_ngram_quiet = quiet;
+}
+
+void
+Toolbox::install_pending_ngram()
+{
+  TreeGram *ngram;
+  bool quiet;
+  {
+    std::lock_guard<std::mutex> lock(m_pending_ngram_mutex);
+    ngram = m_pending_ngram;
+    quiet = m_pending_ngram_quiet;
+    m_pending_ngram = NULL;
+  }
+  if (ngram == NULL)
+    return;
+
+  int num_oolm = m_tp_search->set_ngram(ngram);
+  if (m_ngram_is_lookahead)
+    m_tp_search->set_lookahead_ngram(ngram);
+  while (!m_ngrams.empty()) {
+    delete m_ngrams.back();
+    m_ngrams.pop_back();
+  }
+  m_ngrams.push_back(ngram);
+
+  if ((num_oolm > 0) && !quiet) {
+    cerr << num_oolm << " words in the vocabulary were not found in the LM." << endl;
+  }
+}
+
 void
 Toolbox::htk_lattice_grammar_read(const char *file, bool quiet)
 {
@@ -239,6 +324,13 @@ Toolbox::fsa_lm_read(const char *file, bool bin, bool quiet)
 
   int num_oolm = m_tp_search->set_fsa_lm(m_fsa_lm);
 
+  // An n-gram model waiting for reset() could not replace the FSA LM.
+  {
+    std::lock_guard<std::mutex> lock(m_pending_ngram_mutex);
+    delete m_pending_ngram;
+    m_pending_ngram = NULL;
+  }
+
   if ((num_oolm > 0) && !quiet) {
     cerr << num_oolm << " words in the vocabulary were not found in the FSA LM." << endl;
   }
@@ -251,8 +343,10 @@ Toolbox::read_lookahead_ngram(const char *file, const bool binary, bool quiet)
 
   if (strlen(file) == 0)
   {
-    if (m_ngrams.size() > 0)
+    if (m_ngrams.size() > 0) {
       num_oolm = m_tp_search->set_lookahead_ngram(m_ngrams.back());
+      m_ngram_is_lookahead = true;
+    }
   }
   else
   {
@@ -267,6 +361,7 @@ Toolbox::read_lookahead_ngram(const char *file, const bool binary, bool quiet)
     m_lookahead_ngram->read(in.file, binary);
     assert(m_lookahead_ngram->get_type()==TreeGram::BACKOFF);
     num_oolm = m_tp_search->set_lookahead_ngram(m_lookahead_ngram);
+    m_ngram_is_lookahead = false;
   }
 
   if ((num_oolm > 0) && !quiet) {
@@ -274,12 +369,32 @@ Toolbox::read_lookahead_ngram(const char *file, const bool binary, bool quiet)
   }
 }
 
+void
+Toolbox::read_rescoring_ngram(const char *file, const bool binary, bool quiet)
+{
+  io::Stream in(file,"r");
+  if (!in.file) {
+    throw OpenError();
+  }
+
+  TreeGram *ngram = new TreeGram();
+  ngram->read(in.file, binary);
+  int num_oolm = m_tp_search->set_rescoring_ngram(ngram);
+  delete m_rescoring_ngram;
+  m_rescoring_ngram = ngram;
+
+  if ((num_oolm > 0) && !quiet) {
+    cerr << num_oolm << " words in the vocabulary were missing from some of the LMs." << endl;
+  }
+}
+
 void Toolbox::interpolated_lookahead_ngram_read(const std::vector<std::string> lmnames, const std::vector<float> weights) {
   if (m_lookahead_ngram) {
     delete m_lookahead_ngram;
   }
   //FIXME: Not checking that the type is BACKOFF
   m_lookahead_ngram = new InterTreeGram(lmnames, weights);
+  m_ngram_is_lookahead = false;
   m_tp_search->set_lookahead_ngram(m_lookahead_ngram);;
 }
 
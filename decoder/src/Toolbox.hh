@@ -2,9 +2,11 @@
 #define TOOLBOX_HH
 
 #include <deque>
+#include <mutex>
 
 #include "io.hh"
 #include "WordGraph.hh"
+#include "WordGraphAnalyzer.hh"
 #include "NowayHmmReader.hh"
 #include "TPNowayLexReader.hh"
 #include "WordClasses.hh"
@@ -41,6 +43,33 @@ public:
   ///
   void lex_read(const char * file);
 
+  /// \brief Allows adding words to the lexicon after it has been read.
+  ///
+  /// Has to be called before lex_read(), see
+  /// TPLexPrefixTree::set_dynamic_vocabulary().
+  ///
+  void set_dynamic_vocabulary(bool dynamic)
+  { m_tp_lexicon->set_dynamic_vocabulary(dynamic); }
+
+  /// \brief Adds the words of a dictionary file to the lexicon of a running
+  /// decoder.
+  ///
+  /// Each word is inserted into the finished prefix tree, so that the result
+  /// is the same as reading them all with lex_read(). Only the branches and
+  /// the parts of the cross word network that lead to the new words are
+  /// processed again. Has to be called between utterances, before reset().
+  ///
+  /// \exception OpenError If unable to open the file.
+  ///
+  void lex_add_words(const char * file);
+
+  /// \brief Removes the words added with lex_add_words() since lex_read().
+  ///
+  /// The words stay in the vocabulary, but they are not recognized any more.
+  /// Has to be called between utterances.
+  ///
+  void lex_remove_added_words();
+
   const std::string & lex_word() const
   { return m_tp_lexicon_reader->word(); }
 
@@ -63,6 +92,24 @@ public:
   ///
   int ngram_read(const char * file, bool binary=true, bool quiet=false);
 
+  /// \brief Reads an n-gram model that replaces the current model at the
+  /// next reset().
+  ///
+  /// The current utterance can be decoded while the new model is read, also
+  /// in another thread. The models are swapped between utterances, so that
+  /// the tokens of an utterance never mix the states of two models. If the
+  /// lookahead model is the search model, it is replaced as well. If reading
+  /// fails, the current model stays in use. An FSA LM read with fsa_lm_read()
+  /// cannot be replaced, and reading one discards a model that is waiting
+  /// for reset().
+  ///
+  /// \param binary If false, the file is expected to be in ARPA file format.
+  /// \param quiet If true, doesn't print warnings to stderr.
+  ///
+  /// \exception logic_error If the decoder uses an FSA LM.
+  ///
+  void swap_ngram(const char * file, bool binary=true, bool quiet=false);
+
   /// \brief Reads a language model in HTK lattice format
   void htk_lattice_grammar_read(const char * file, bool quiet);
 
@@ -73,6 +120,21 @@ public:
   ///
   void read_lookahead_ngram(const char * file, bool binary=true, bool quiet=false);
 
+  /// \brief Reads a large n-gram model for rescoring at word ends.
+  ///
+  /// The model given to ngram_read() is used in the search, and its scores
+  /// are replaced by the scores of this model when words end (see
+  /// TokenPassSearch::set_rescoring_ngram()).
+  ///
+  /// \param binary If false, the file is expected to be in ARPA file format.
+  /// \param quiet If true, doesn't print warnings to stderr.
+  ///
+  void read_rescoring_ngram(const char * file, bool binary=true, bool quiet=false);
+
+  /// \brief Sets the number of transitions in the rescoring cache.
+  void set_rescoring_cache_size(int entries)
+  { m_tp_search->set_rescoring_cache_size(entries); }
+
   /// \brief Reads several lookahead n-gram models for interpolation
   void interpolated_lookahead_ngram_read(const std::vector<std::string>, const std::vector<float>);
 
@@ -133,7 +195,11 @@ public:
   }
 
   void reset(int frame)
-  { m_tp_search->reset_search(frame); m_last_guaranteed_history=NULL;}
+  {
+    install_pending_ngram();
+    m_tp_search->reset_search(frame);
+    m_last_guaranteed_history=NULL;
+  }
 
   void set_end(int frame)
   { m_tp_search->set_end_frame(frame); }
@@ -153,6 +219,42 @@ public:
   void write_word_graph(const std::string & file_name)
   { m_tp_search->write_word_graph(file_name); }
 
+  void write_binary_word_graph(const std::string & file_name)
+  { m_tp_search->write_binary_word_graph(file_name); }
+
+  /// \brief Reports the best path incrementally after each frame.
+  ///
+  /// \see TokenPassSearch::set_partial_result_callback()
+  ///
+  void set_partial_result_callback(
+    TokenPassSearch::PartialResultCallback callback, int max_latency = 0)
+  { m_tp_search->set_partial_result_callback(callback, max_latency); }
+
+  /// \brief Computes the word posteriors from the current word graph.
+  ///
+  /// \param posterior_scale Scale of the path scores, typically the inverse
+  /// of the LM scale.
+  ///
+  std::vector<WordPosterior> word_posteriors(float posterior_scale)
+  {
+    m_tp_search->analyze_word_graph(m_word_graph_analyzer);
+    return m_word_graph_analyzer.word_posteriors(posterior_scale);
+  }
+
+  /// \brief Finds the \a n best word sequences from the current word graph.
+  std::vector<NbestHypothesis> nbest(int n)
+  {
+    m_tp_search->analyze_word_graph(m_word_graph_analyzer);
+    return m_word_graph_analyzer.nbest(n);
+  }
+
+  /// \brief Builds a confusion network from the current word graph.
+  std::vector<ConfusionSlot> confusion_network(float posterior_scale)
+  {
+    m_tp_search->analyze_word_graph(m_word_graph_analyzer);
+    return m_word_graph_analyzer.confusion_network(posterior_scale);
+  }
+
   void print_best_lm_history(FILE * out=stdout)
   { m_tp_search->print_lm_history(out, true); }
 
@@ -164,6 +266,27 @@ public:
   TokenPassSearch & tp_search()
   { return *m_tp_search; }
 
+  /// \brief Stores token counts, cache hit rates and timing of every frame
+  /// from the next reset() on.
+  ///
+  void set_collect_statistics(bool value)
+  { m_tp_search->statistics().set_enabled(value); }
+
+  const SearchStatistics & search_statistics()
+  { return m_tp_search->statistics(); }
+
+  void write_search_statistics_json(const std::string & file_name)
+  {
+    io::Stream out(file_name, "w");
+    m_tp_search->statistics().write_json(out.file);
+  }
+
+  void write_search_statistics_csv(const std::string & file_name)
+  {
+    io::Stream out(file_name, "w");
+    m_tp_search->statistics().write_csv(out.file);
+  }
+
   int frame()
   { return m_tp_search->frame(); }
 
@@ -193,6 +316,26 @@ public:
   void set_token_limit(int limit)
   { m_tp_search->set_max_num_tokens(limit); }
 
+  /// \brief Keeps exactly the best tokens when the token limit is reached,
+  /// instead of approximating the limit with a histogram.
+  ///
+  void set_exact_token_limit(bool exact)
+  { m_tp_search->set_exact_token_limit(exact); }
+
+  /// \brief Records the token scores of each frame for prune_bench.
+  ///
+  /// An empty file name stops the recording.
+  ///
+  void record_pruning(const std::string & file_name)
+  {
+    m_tp_search->set_pruning_record(NULL);
+    m_pruning_record.close();
+    if (file_name.empty())
+      return;
+    m_pruning_record.open(file_name, "w");
+    m_tp_search->set_pruning_record(m_pruning_record.file);
+  }
+
   void set_duration_scale(float scale)
   { m_tp_search->set_duration_scale(scale); }
 
@@ -293,6 +436,11 @@ public:
   void set_remove_pronunciation_id(bool remove)
   { m_tp_search->set_remove_pronunciation_id(remove); }
 
+  /// \brief Removes LM lookahead lists that differ little from the lists
+  /// closer to the root.
+  ///
+  /// Cannot be used with set_dynamic_vocabulary().
+  ///
   void prune_lm_lookahead_buffers(int min_delta, int max_depth)
   { m_tp_lexicon->prune_lookahead_buffers(min_delta, max_depth); }
 
@@ -371,6 +519,7 @@ private:
   bool m_lexicon_read;
   Vocabulary *m_tp_vocabulary;
   TokenPassSearch *m_tp_search;
+  WordGraphAnalyzer m_word_graph_analyzer;
   
   Acoustics *m_acoustics;
   LnaReaderCircular *m_lna_reader;
@@ -382,9 +531,17 @@ private:
   fsalm::LM *m_fsa_lm;
   std::deque<int> m_history;
   NGram *m_lookahead_ngram;
+  bool m_ngram_is_lookahead; //!< The search model is the lookahead model.
+  TreeGram *m_rescoring_ngram;
+
+  TreeGram *m_pending_ngram; //!< Installed at the next reset().
+  bool m_pending_ngram_quiet;
+  std::mutex m_pending_ngram_mutex;
 
   LMHistory *m_last_guaranteed_history;
 
+  io::Stream m_pruning_record;
+
   /// \brief Reads the acoustic model from a file.
   ///
   void hmm_read(const char *file);
@@ -397,6 +554,9 @@ private:
 
   /// \brief Has to be called after reading acoustic model.
   void reinitialize_search();
+
+  /// \brief Replaces the search model with the one read by swap_ngram().
+  void install_pending_ngram();
 };
 
 #endif /* TOOLBOX_HH */
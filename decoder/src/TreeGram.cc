@@ -35,6 +35,7 @@ TreeGram::reserve_nodes(int nodes)
   m_nodes.clear();
   m_nodes.reserve(nodes);
   m_nodes.push_back(Node(0, -99, 0, -1));
+  m_back_off_links.clear();
   m_order_count.clear();
   m_order_count.push_back(1);
   m_order = 1;
@@ -469,6 +470,7 @@ TreeGram::read(FILE *file, bool binary)
   }
 
   // Read the nodes
+  m_back_off_links.clear();
   m_nodes.clear();
   m_nodes.resize(number_of_nodes);
   size_t block_size = number_of_nodes * sizeof(TreeGram::Node);
@@ -627,6 +629,58 @@ TreeGram::log_prob_bo(const Gram &gram)
   return log_prob;
 }
 
+void
+TreeGram::compute_back_off_links()
+{
+  assert(m_type == BACKOFF);
+
+  m_back_off_links.clear();
+  m_back_off_links.resize(m_nodes.size(), -1);
+
+  m_highest_order_first = 0;
+  for (int i = 0; i < m_order - 1; i++)
+    m_highest_order_first += m_order_count[i];
+
+  // The link of an n-gram (w1 ... wN) is a child of the link of its prefix
+  // (w1 ... wN-1), or of its link, and so on, because every prefix of an
+  // existing n-gram exists.  The iterator visits the parents before their
+  // children.
+  Iterator iter(this);
+  while (iter.next()) {
+    int order = iter.order();
+    if (order < 2)
+      continue;
+    int index = iter.m_index_stack.back();
+    int word = m_nodes[index].word;
+    int state = m_back_off_links[iter.m_index_stack[order - 2]];
+    int link;
+    while ((link = find_child(word, state)) < 0)
+      state = m_back_off_links[state];
+    m_back_off_links[index] = link;
+  }
+}
+
+int
+TreeGram::walk(int state, int word, float *log_prob)
+{
+  assert(has_back_off_links());
+
+  float score = 0;
+  int node;
+  while ((node = find_child(word, state)) < 0) {
+    score += m_nodes[state].back_off;
+    state = m_back_off_links[state];
+  }
+  score += m_nodes[node].log_prob;
+  if (log_prob != NULL)
+    *log_prob += score;
+
+  // The highest order grams can not be contexts.
+  if (node >= m_highest_order_first)
+    node = m_back_off_links[node];
+  return node;
+}
+
 float
 TreeGram::log_prob_i(const Gram &gram) {
   float prob=0.0;
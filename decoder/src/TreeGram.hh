@@ -130,6 +130,34 @@ public:
 
   int gram_count(int order) { return m_order_count.at(order-1); }
 
+  /// \brief Computes the back-off link of every node, i.e. the index of the
+  /// node that represents the longest proper suffix of its n-gram.
+  ///
+  /// Has to be called before walk(). Only valid for back-off models.
+  ///
+  void compute_back_off_links();
+
+  /// \brief Returns true if compute_back_off_links() has been called after
+  /// the model was last modified.
+  bool has_back_off_links() const
+  { return !m_nodes.empty() && m_back_off_links.size() == m_nodes.size(); }
+
+  /// \brief Moves from a context state to the next one through \a word by
+  /// backing off if necessary.
+  ///
+  /// A context state is the index of the node that represents the longest
+  /// suffix of the history (at most order-1 words) that exists in the model,
+  /// or -1 for an empty history. Scoring a word is thus a single walk from
+  /// the previous state instead of a lookup of the whole n-gram from the
+  /// root. The result equals log_prob_bo() of the corresponding n-gram.
+  ///
+  /// \param state The state to start from, -1 for an empty history.
+  /// \param word The word to traverse through.
+  /// \param log_prob Float pointer to which the log probability is ADDED.
+  /// \return The resulting state.
+  ///
+  int walk(int state, int word, float *log_prob = NULL);
+
   /* Don't use this function, unles you really need to*/
   int find_child(int word, int node_index);
 
@@ -171,6 +199,8 @@ private:
   std::vector<int> m_order_count;	// number of grams in each order
   std::vector<Node> m_nodes;		// storage for the nodes
   std::vector<int> m_fetch_stack;	// indices of the gram requested
+  std::vector<int> m_back_off_links;	// longest existing suffix of each node
+  int m_highest_order_first;		// index of the first highest order node
   //int m_last_order;			// order of the last hit
 
   // For creating the model
@@ -0,0 +1,461 @@
+#include <assert.h>
+#include <float.h>
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <queue>
+#include <set>
+
+#include "WordGraphAnalyzer.hh"
+
+namespace {
+  double log_add(double a, double b)
+  {
+    if (a < b)
+      std::swap(a, b);
+    if (b == -HUGE_VAL)
+      return a;
+    return a + log1p(exp(b - a));
+  }
+
+  int overlap(int start1, int end1, int start2, int end2)
+  {
+    return std::min(end1, end2) - std::max(start1, start2);
+  }
+
+  struct WordInstance {
+    int word;
+    int start_frame;
+    int end_frame;
+    double posterior;
+
+    bool operator<(const WordInstance &other) const
+    {
+      if (start_frame != other.start_frame)
+        return start_frame < other.start_frame;
+      if (end_frame != other.end_frame)
+        return end_frame < other.end_frame;
+      return word < other.word;
+    }
+  };
+
+  bool greater_posterior(const WordInstance &a, const WordInstance &b)
+  {
+    return a.posterior > b.posterior;
+  }
+}
+
+WordGraphAnalyzer::WordGraphAnalyzer()
+{
+}
+
+void
+WordGraphAnalyzer::set_graph(const WordGraph &graph, int final_node,
+                             const Vocabulary &vocabulary, float lm_scale,
+                             float insertion_penalty)
+{
+  m_nodes.clear();
+  m_arcs.clear();
+  m_words.clear();
+
+  // Find the nodes from which the final node can be reached
+  std::vector<int> new_index(graph.nodes.size(), -1);
+  std::vector<int> reachable;
+  std::vector<int> stack(1, final_node);
+  new_index[final_node] = 0;
+  while (!stack.empty()) {
+    int node = stack.back();
+    stack.pop_back();
+    reachable.push_back(node);
+    for (int a = graph.nodes[node].first_arc; a >= 0;
+         a = graph.arcs[a].sibling_arc) {
+      int source = graph.arcs[a].source_node_id;
+      if (new_index[source] < 0) {
+        new_index[source] = 0;
+        stack.push_back(source);
+      }
+    }
+  }
+
+  // Sort the nodes topologically. The final node can be reached from all
+  // nodes, so it is the last.
+  std::vector<int> num_children(graph.nodes.size(), 0);
+  for (size_t i = 0; i < reachable.size(); i++) {
+    const WordGraph::Node &node = graph.nodes[reachable[i]];
+    for (int a = node.first_arc; a >= 0; a = graph.arcs[a].sibling_arc)
+      num_children[graph.arcs[a].source_node_id]++;
+  }
+  std::vector<int> order;
+  order.reserve(reachable.size());
+  order.push_back(final_node);
+  for (size_t i = 0; i < order.size(); i++) {
+    const WordGraph::Node &node = graph.nodes[order[i]];
+    for (int a = node.first_arc; a >= 0; a = graph.arcs[a].sibling_arc) {
+      int source = graph.arcs[a].source_node_id;
+      if (--num_children[source] == 0)
+        order.push_back(source);
+    }
+  }
+  assert(order.size() == reachable.size());
+  std::reverse(order.begin(), order.end());
+  for (size_t i = 0; i < order.size(); i++)
+    new_index[order[i]] = i;
+
+  // Copy the nodes and map the symbols to words
+  std::vector<int> symbol_words;
+  m_nodes.resize(order.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    const WordGraph::Node &node = graph.nodes[order[i]];
+    m_nodes[i].frame = node.frame;
+    m_nodes[i].word = -1;
+    if (node.symbol < 0)
+      continue;
+    if (node.symbol >= (int)symbol_words.size())
+      symbol_words.resize(node.symbol + 1, -2);
+    int &word = symbol_words[node.symbol];
+    if (word == -2) {
+      const std::string &str = vocabulary.word(node.symbol);
+      if (str == "<s>" || str == "</s>")
+        word = -1;
+      else {
+        word = m_words.size();
+        m_words.push_back(str);
+      }
+    }
+    m_nodes[i].word = word;
+  }
+
+  // Copy the arcs sorted by the source node
+  m_out_offsets.assign(m_nodes.size() + 1, 0);
+  m_in_offsets.assign(m_nodes.size() + 1, 0);
+  for (size_t i = 0; i < order.size(); i++) {
+    const WordGraph::Node &node = graph.nodes[order[i]];
+    for (int a = node.first_arc; a >= 0; a = graph.arcs[a].sibling_arc) {
+      m_out_offsets[new_index[graph.arcs[a].source_node_id] + 1]++;
+      m_in_offsets[i + 1]++;
+    }
+  }
+  for (size_t i = 0; i < m_nodes.size(); i++) {
+    m_out_offsets[i + 1] += m_out_offsets[i];
+    m_in_offsets[i + 1] += m_in_offsets[i];
+  }
+  m_arcs.resize(m_out_offsets.back());
+  m_in_arcs.resize(m_arcs.size());
+  std::vector<int> next_arc(m_out_offsets.begin(), m_out_offsets.end() - 1);
+  for (size_t i = 0; i < order.size(); i++) {
+    const WordGraph::Node &node = graph.nodes[order[i]];
+    int next_in_arc = m_in_offsets[i];
+    for (int a = node.first_arc; a >= 0; a = graph.arcs[a].sibling_arc) {
+      const WordGraph::Arc &graph_arc = graph.arcs[a];
+      int source = new_index[graph_arc.source_node_id];
+      Arc &arc = m_arcs[next_arc[source]];
+      arc.source = source;
+      arc.target = i;
+      arc.log_prob = graph_arc.am_weight + graph_arc.lm_weight;
+      arc.am_log_prob = graph_arc.am_weight;
+      arc.lm_log_prob = graph_arc.lm_weight / lm_scale - insertion_penalty;
+      m_in_arcs[next_in_arc++] = next_arc[source]++;
+    }
+  }
+}
+
+void
+WordGraphAnalyzer::forward_backward(float posterior_scale)
+{
+  int num_nodes = m_nodes.size();
+  m_forward.assign(num_nodes, -HUGE_VAL);
+  m_backward.assign(num_nodes, -HUGE_VAL);
+  for (int n = 0; n < num_nodes; n++) {
+    if (m_in_offsets[n] == m_in_offsets[n + 1]) {
+      m_forward[n] = 0;
+      continue;
+    }
+    for (int i = m_in_offsets[n]; i < m_in_offsets[n + 1]; i++) {
+      const Arc &arc = m_arcs[m_in_arcs[i]];
+      m_forward[n] = log_add(m_forward[n], m_forward[arc.source] +
+                             posterior_scale * arc.log_prob);
+    }
+  }
+  m_backward[num_nodes - 1] = 0;
+  for (int n = num_nodes - 2; n >= 0; n--) {
+    for (int a = m_out_offsets[n]; a < m_out_offsets[n + 1]; a++) {
+      const Arc &arc = m_arcs[a];
+      m_backward[n] = log_add(m_backward[n], m_backward[arc.target] +
+                              posterior_scale * arc.log_prob);
+    }
+  }
+}
+
+void
+WordGraphAnalyzer::compute_best_to_final()
+{
+  int num_nodes = m_nodes.size();
+  m_best_to_final.assign(num_nodes, -FLT_MAX);
+  m_best_to_final[num_nodes - 1] = 0;
+  for (int n = num_nodes - 2; n >= 0; n--) {
+    for (int a = m_out_offsets[n]; a < m_out_offsets[n + 1]; a++) {
+      float score = m_arcs[a].log_prob + m_best_to_final[m_arcs[a].target];
+      if (score > m_best_to_final[n])
+        m_best_to_final[n] = score;
+    }
+  }
+}
+
+std::vector<int>
+WordGraphAnalyzer::best_path()
+{
+  compute_best_to_final();
+
+  // Start from the best initial node
+  int node = -1;
+  for (int n = 0; n < (int)m_nodes.size(); n++) {
+    if (m_in_offsets[n] == m_in_offsets[n + 1] &&
+        (node < 0 || m_best_to_final[n] > m_best_to_final[node]))
+      node = n;
+  }
+
+  std::vector<int> path;
+  while (node >= 0 && node != (int)m_nodes.size() - 1) {
+    int best_arc = m_out_offsets[node];
+    for (int a = best_arc + 1; a < m_out_offsets[node + 1]; a++) {
+      if (m_arcs[a].log_prob + m_best_to_final[m_arcs[a].target] >
+          m_arcs[best_arc].log_prob + m_best_to_final[m_arcs[best_arc].target])
+        best_arc = a;
+    }
+    path.push_back(best_arc);
+    node = m_arcs[best_arc].target;
+  }
+  return path;
+}
+
+std::vector<WordPosterior>
+WordGraphAnalyzer::word_posteriors(float posterior_scale)
+{
+  std::vector<WordPosterior> result;
+  if (m_nodes.empty())
+    return result;
+  forward_backward(posterior_scale);
+  double total = m_forward.back();
+
+  // Sum the posteriors of the arcs with the same word and frames
+  std::vector<WordInstance> instances;
+  for (size_t a = 0; a < m_arcs.size(); a++) {
+    const Arc &arc = m_arcs[a];
+    const Node &target = m_nodes[arc.target];
+    if (target.word < 0)
+      continue;
+    WordInstance instance;
+    instance.word = target.word;
+    instance.start_frame = m_nodes[arc.source].frame;
+    instance.end_frame = target.frame;
+    instance.posterior = exp(m_forward[arc.source] +
+                             posterior_scale * arc.log_prob +
+                             m_backward[arc.target] - total);
+    instances.push_back(instance);
+  }
+  std::sort(instances.begin(), instances.end());
+
+  for (size_t i = 0; i < instances.size(); i++) {
+    const WordInstance &instance = instances[i];
+    if (!result.empty() && result.back().word == m_words[instance.word] &&
+        result.back().start_frame == instance.start_frame &&
+        result.back().end_frame == instance.end_frame)
+    {
+      result.back().posterior += instance.posterior;
+      continue;
+    }
+    WordPosterior posterior;
+    posterior.word = m_words[instance.word];
+    posterior.start_frame = instance.start_frame;
+    posterior.end_frame = instance.end_frame;
+    posterior.posterior = instance.posterior;
+    result.push_back(posterior);
+  }
+  return result;
+}
+
+std::vector<NbestHypothesis>
+WordGraphAnalyzer::nbest(int n, int max_paths)
+{
+  std::vector<NbestHypothesis> result;
+  if (m_nodes.empty() || n <= 0)
+    return result;
+  compute_best_to_final();
+
+  // Partial paths form a tree through the parent indices.
+  struct Path {
+    int node;
+    int arc; //!< The last arc, -1 for an initial node.
+    int parent;
+    float log_prob;
+  };
+  std::vector<Path> paths;
+  typedef std::pair<float, int> QueueItem; // (log_prob + heuristic, path)
+  std::priority_queue<QueueItem> queue;
+  for (int i = 0; i < (int)m_nodes.size(); i++) {
+    if (m_in_offsets[i] != m_in_offsets[i + 1])
+      continue;
+    Path path = { i, -1, -1, 0 };
+    queue.push(QueueItem(m_best_to_final[i], paths.size()));
+    paths.push_back(path);
+  }
+
+  int final_node = m_nodes.size() - 1;
+  int num_complete = 0;
+  std::set<std::vector<int> > word_sequences;
+  std::vector<int> words;
+  while (!queue.empty() && (int)result.size() < n &&
+         num_complete < max_paths)
+  {
+    int path_index = queue.top().second;
+    queue.pop();
+    Path path = paths[path_index];
+
+    if (path.node != final_node) {
+      for (int a = m_out_offsets[path.node]; a < m_out_offsets[path.node + 1];
+           a++)
+      {
+        const Arc &arc = m_arcs[a];
+        Path new_path = { arc.target, a, path_index,
+                          path.log_prob + arc.log_prob };
+        queue.push(QueueItem(new_path.log_prob +
+                             m_best_to_final[arc.target], paths.size()));
+        paths.push_back(new_path);
+      }
+      continue;
+    }
+
+    // A complete path.  Skip it if the words are the same as on a better
+    // path.
+    num_complete++;
+    NbestHypothesis hypothesis;
+    hypothesis.am_log_prob = 0;
+    hypothesis.lm_log_prob = 0;
+    hypothesis.log_prob = path.log_prob;
+    words.clear();
+    for (int p = path_index; paths[p].arc >= 0; p = paths[p].parent) {
+      const Arc &arc = m_arcs[paths[p].arc];
+      hypothesis.am_log_prob += arc.am_log_prob;
+      hypothesis.lm_log_prob += arc.lm_log_prob;
+      if (m_nodes[arc.target].word >= 0)
+        words.push_back(m_nodes[arc.target].word);
+    }
+    std::reverse(words.begin(), words.end());
+    if (!word_sequences.insert(words).second)
+      continue;
+    for (size_t i = 0; i < words.size(); i++)
+      hypothesis.words.push_back(m_words[words[i]]);
+    result.push_back(hypothesis);
+  }
+  return result;
+}
+
+std::vector<ConfusionSlot>
+WordGraphAnalyzer::confusion_network(float posterior_scale)
+{
+  struct Slot {
+    int start_frame;
+    int end_frame;
+    std::vector<int> words;
+    std::vector<double> posteriors;
+  };
+
+  std::vector<ConfusionSlot> result;
+  if (m_nodes.empty())
+    return result;
+
+  // The words of the best path define the first slots
+  std::vector<Slot> slots;
+  std::vector<int> path = best_path();
+  for (size_t i = 0; i < path.size(); i++) {
+    const Arc &arc = m_arcs[path[i]];
+    if (m_nodes[arc.target].word < 0)
+      continue;
+    Slot slot;
+    slot.start_frame = m_nodes[arc.source].frame;
+    slot.end_frame = m_nodes[arc.target].frame;
+    slots.push_back(slot);
+  }
+
+  // Add the words to the slots in the order of decreasing posterior
+  std::vector<WordPosterior> posteriors = word_posteriors(posterior_scale);
+  std::vector<WordInstance> instances(posteriors.size());
+  {
+    std::map<std::string, int> word_index;
+    for (size_t i = 0; i < m_words.size(); i++)
+      word_index[m_words[i]] = i;
+    for (size_t i = 0; i < posteriors.size(); i++) {
+      instances[i].word = word_index[posteriors[i].word];
+      instances[i].start_frame = posteriors[i].start_frame;
+      instances[i].end_frame = posteriors[i].end_frame;
+      instances[i].posterior = posteriors[i].posterior;
+    }
+  }
+  std::stable_sort(instances.begin(), instances.end(), greater_posterior);
+  for (size_t i = 0; i < instances.size(); i++) {
+    const WordInstance &instance = instances[i];
+    int best_slot = -1;
+    int best_overlap = 0;
+    int insert_pos = 0;
+    for (int s = 0; s < (int)slots.size(); s++) {
+      int o = overlap(slots[s].start_frame, slots[s].end_frame,
+                      instance.start_frame, instance.end_frame);
+      if (o > best_overlap) {
+        best_overlap = o;
+        best_slot = s;
+      }
+      if (slots[s].start_frame < instance.start_frame)
+        insert_pos = s + 1;
+    }
+    if (best_slot < 0) {
+      Slot slot;
+      slot.start_frame = instance.start_frame;
+      slot.end_frame = instance.end_frame;
+      slots.insert(slots.begin() + insert_pos, slot);
+      best_slot = insert_pos;
+    }
+
+    Slot &slot = slots[best_slot];
+    size_t w = std::find(slot.words.begin(), slot.words.end(), instance.word) -
+      slot.words.begin();
+    if (w == slot.words.size()) {
+      slot.words.push_back(instance.word);
+      slot.posteriors.push_back(0);
+    }
+    slot.posteriors[w] += instance.posterior;
+  }
+
+  // Sort the words of the slots and add the probability of no word
+  result.resize(slots.size());
+  for (size_t s = 0; s < slots.size(); s++) {
+    Slot &slot = slots[s];
+    std::vector<WordInstance> entries(slot.words.size());
+    double sum = 0;
+    for (size_t w = 0; w < slot.words.size(); w++) {
+      entries[w].word = slot.words[w];
+      entries[w].posterior = slot.posteriors[w];
+      sum += slot.posteriors[w];
+    }
+    if (sum > 1) {
+      for (size_t w = 0; w < entries.size(); w++)
+        entries[w].posterior /= sum;
+    }
+    else if (sum < 1) {
+      WordInstance empty;
+      empty.word = -1;
+      empty.posterior = 1 - sum;
+      entries.push_back(empty);
+    }
+    std::stable_sort(entries.begin(), entries.end(), greater_posterior);
+
+    ConfusionSlot &result_slot = result[s];
+    result_slot.start_frame = slot.start_frame;
+    result_slot.end_frame = slot.end_frame;
+    for (size_t w = 0; w < entries.size(); w++) {
+      result_slot.words.push_back(entries[w].word < 0 ? std::string() :
+                                  m_words[entries[w].word]);
+      result_slot.posteriors.push_back(entries[w].posterior);
+    }
+  }
+  return result;
+}
@@ -0,0 +1,132 @@
+#ifndef WORDGRAPHANALYZER_HH
+#define WORDGRAPHANALYZER_HH
+
+#include <string>
+#include <vector>
+
+#include "WordGraph.hh"
+#include "Vocabulary.hh"
+
+/// \brief Posterior probability of a word between two frames, summed over
+/// all the word graph arcs with the same word and frames.
+struct WordPosterior {
+  std::string word;
+  int start_frame; //!< The end frame of the previous word.
+  int end_frame;
+  float posterior;
+};
+
+/// \brief A hypothesis of an n-best list.
+struct NbestHypothesis {
+  std::vector<std::string> words;
+  float am_log_prob; //!< Sum of the acoustic log probabilities.
+  float lm_log_prob; //!< Sum of the unscaled LM log probabilities.
+  float log_prob; //!< Total score of the path as in the search.
+};
+
+/// \brief A slot of a confusion network, i.e. the competing words between
+/// two points of time, sorted by decreasing posterior probability. An empty
+/// word means that there is no word in the slot.
+struct ConfusionSlot {
+  int start_frame;
+  int end_frame;
+  std::vector<std::string> words;
+  std::vector<float> posteriors;
+};
+
+/// \brief Computes word posteriors, n-best lists and confusion networks from
+/// a WordGraph in memory.
+///
+/// set_graph() copies the part of the graph that leads to the final node into
+/// a compact topologically sorted form, so that the graph used by the search
+/// is not modified. The path scores are the scores of the search, i.e. sums
+/// of the acoustic and scaled LM arc weights. The posteriors are computed
+/// from the path scores multiplied by a posterior scale, typically the
+/// inverse of the LM scale.
+///
+/// The words "<s>" and "</s>" are not output, like in the SLF lattices
+/// written by TokenPassSearch::write_word_graph().
+///
+class WordGraphAnalyzer {
+public:
+  WordGraphAnalyzer();
+
+  /// \brief Copies the nodes of \a graph from which \a final_node can be
+  /// reached.
+  ///
+  /// \param lm_scale The LM scale used in the search. Only used for
+  /// reporting the unscaled LM log probabilities.
+  /// \param insertion_penalty The word insertion penalty used in the search.
+  ///
+  void set_graph(const WordGraph &graph, int final_node,
+                 const Vocabulary &vocabulary, float lm_scale,
+                 float insertion_penalty);
+
+  /// \brief Computes the posterior probabilities of the words with the
+  /// forward-backward algorithm.
+  ///
+  /// \return The words sorted by start and end frame.
+  ///
+  std::vector<WordPosterior> word_posteriors(float posterior_scale);
+
+  /// \brief Finds the \a n best paths with different word sequences.
+  ///
+  /// The paths are searched with A* from the initial node. The exact Viterbi
+  /// scores to the final node are used as the heuristic, so the paths are
+  /// found in the order of their scores.
+  ///
+  /// \param max_paths Stop after this many complete paths, even if fewer
+  /// than \a n different word sequences have been found. Paths that differ
+  /// only in the segmentation or the ignored words are counted, too.
+  ///
+  std::vector<NbestHypothesis> nbest(int n, int max_paths = 10000);
+
+  /// \brief Builds a confusion network by aligning the words to the best
+  /// path.
+  ///
+  /// The words of the best path define the slots. The other words, in the
+  /// order of decreasing posterior probability, are added to the slot that
+  /// they overlap most in time, or to a new slot if they do not overlap any
+  /// slot. The probability of no word in a slot is the remaining
+  /// probability mass.
+  ///
+  std::vector<ConfusionSlot> confusion_network(float posterior_scale);
+
+private:
+  struct Arc {
+    int source;
+    int target;
+    float log_prob; //!< Score of the arc in the search.
+    float am_log_prob;
+    float lm_log_prob; //!< Unscaled LM log probability.
+  };
+
+  struct Node {
+    int frame;
+    int word; //!< Index to m_words of the word ending here, -1 if ignored.
+  };
+
+  /// \brief Computes the forward and backward log probabilities of the
+  /// nodes with the given posterior scale.
+  void forward_backward(float posterior_scale);
+
+  /// \brief Computes the Viterbi scores of the best paths from each node to
+  /// the final node to \ref m_best_to_final.
+  void compute_best_to_final();
+
+  /// \brief Returns the arcs of the best path in order.
+  std::vector<int> best_path();
+
+  std::vector<Node> m_nodes; //!< Nodes in topological order, final last.
+  std::vector<Arc> m_arcs; //!< Arcs sorted by the source node.
+  std::vector<int> m_out_offsets; //!< First arc leaving each node, and the end.
+  std::vector<int> m_in_arcs; //!< Indices to m_arcs sorted by the target node.
+  std::vector<int> m_in_offsets; //!< First index to m_in_arcs of each node.
+  std::vector<std::string> m_words; //!< The words of the graph.
+
+  std::vector<double> m_forward; //!< Forward log probabilities of the nodes.
+  std::vector<double> m_backward; //!< Backward log probabilities.
+  std::vector<float> m_best_to_final; //!< Viterbi scores to the final node.
+};
+
+#endif /* WORDGRAPHANALYZER_HH */
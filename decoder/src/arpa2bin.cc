@@ -1,15 +1,42 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
-#include "TreeGram.hh"
-#include "TreeGramArpaReader.hh"
+#include "ArpaBinaryConverter.hh"
 
-int main(int argc, char *argv[]) 
+int main(int argc, char *argv[])
 {
-  TreeGramArpaReader reader;
-  TreeGram gram;
+  ArpaBinaryConverter converter;
+  const char *temp_dir = getenv("TMPDIR");
+  if (temp_dir != NULL)
+    converter.set_temp_dir(temp_dir);
+
+  for (int arg = 1; arg < argc; arg++) {
+    if (arg + 1 < argc && strcmp(argv[arg], "-t") == 0)
+      converter.set_num_threads(atoi(argv[++arg]));
+    else if (arg + 1 < argc && strcmp(argv[arg], "-m") == 0)
+      converter.set_memory_budget((size_t)atol(argv[++arg]) << 20);
+    else if (arg + 1 < argc && strcmp(argv[arg], "-T") == 0)
+      converter.set_temp_dir(argv[++arg]);
+    else {
+      fprintf(stderr, "Use: %s [-t threads] [-m megabytes] [-T tmpdir] "
+              "< in.arpa > out.bin\n"
+              "  -t  threads that parse and sort the grams (default 1)\n"
+              "  -m  memory for the grams before spilling them to "
+              "temporary files (default 1024)\n"
+              "  -T  directory of the temporary files (default $TMPDIR "
+              "or /tmp)\n", argv[0]);
+      exit(-1);
+    }
+  }
 
   fputs("reading arpa from stdin, writing binary to stdout\n", stderr);
 
-  reader.read(stdin, &gram);
-  gram.write(stdout, true);
+  try {
+    converter.convert(stdin, stdout);
+  }
+  catch (ArpaBinaryConverter::Error &e) {
+    fprintf(stderr, "%s\n", e.what());
+    exit(1);
+  }
 }
@@ -0,0 +1,738 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "Toolbox.hh"
+#include "misc/conf.hh"
+#include "misc/str.hh"
+
+conf::Config config;
+
+typedef std::chrono::steady_clock Clock;
+
+static double
+seconds_since(Clock::time_point start)
+{
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+/// A small generator whose output does not depend on the standard library,
+/// so that the same seed gives the same models everywhere.
+class Random {
+public:
+  Random(uint64_t seed) : m_state(seed) { }
+
+  uint64_t next()
+  {
+    uint64_t z = (m_state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+  }
+
+  /// Returns a number in [0, 1).
+  double uniform() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+
+  /// Returns an integer in [0, n).
+  int integer(int n) { return (int)(next() % (uint64_t)n); }
+
+private:
+  uint64_t m_state;
+};
+
+/// The synthetic task: triphone HMMs with tied states, a lexicon, a back-off
+/// n-gram model and LNA files that follow random sentences, and the decoder
+/// settings that a reference is only valid for.
+struct Setup {
+  int num_phones;
+  int num_words;
+  int order;
+  int grams_per_word;
+  int num_utterances;
+  int words_per_utterance;
+  uint64_t seed;
+
+  // Decoder settings that change the results
+  int lookahead;
+  bool cross_word;
+  int token_limit;
+
+  std::string dir;
+  std::vector<std::vector<int> > pronunciations;
+  std::vector<int> num_grams;
+  int num_hmms;
+  int num_frames;
+
+  std::string path(const std::string &name) const { return dir + "/" + name; }
+  std::string lna_path(int utterance) const
+  { return path(str::fmt(64, "u%d.lna", utterance)); }
+
+  std::string description() const
+  {
+    return str::fmt(256, "seed=%llu phones=%d words=%d order=%d grams=%d "
+                    "utterances=%d utterance-words=%d lookahead=%d "
+                    "cross-word=%d tokens=%d",
+                    (unsigned long long)seed, num_phones, num_words, order,
+                    grams_per_word, num_utterances, words_per_utterance,
+                    lookahead, cross_word, token_limit);
+  }
+
+  int num_models() const { return 3 + num_phones * 5; }
+
+  std::string phone(int p) const
+  { return p == num_phones ? "_" : std::string(1, 'a' + p); }
+
+  /// The state model of the triphone (left, center, right). The first and
+  /// the last state are shared by the contexts of the same parity.
+  int model(int left, int center, int right, int state) const
+  {
+    int base = 3 + center * 5;
+    if (state == 0)
+      return base + left % 2;
+    if (state == 1)
+      return base + 2;
+    return base + 3 + right % 2;
+  }
+
+  void generate();
+  void generate_dynamic();
+  void write_hmms();
+  void write_lexicon(const std::string &name, const std::vector<int> &words,
+                     bool boundaries);
+  std::vector<int> write_lm(Random &random, const std::string &name);
+  void write_lna(Random &random);
+};
+
+static FILE *
+open_output(const std::string &name)
+{
+  FILE *file = fopen(name.c_str(), "w");
+  if (!file) {
+    fprintf(stderr, "could not write %s\n", name.c_str());
+    exit(1);
+  }
+  return file;
+}
+
+void
+Setup::generate()
+{
+  if (mkdir(dir.c_str(), 0777) < 0 && errno != EEXIST) {
+    fprintf(stderr, "could not create %s\n", dir.c_str());
+    exit(1);
+  }
+
+  Random random(seed);
+  pronunciations.resize(num_words);
+  for (int w = 0; w < num_words; w++) {
+    int length = random.integer(10) == 0 ? 1 : 2 + random.integer(5);
+    for (int i = 0; i < length; i++)
+      pronunciations[w].push_back(random.integer(num_phones));
+  }
+
+  std::vector<int> words;
+  for (int w = 0; w < num_words; w++)
+    words.push_back(w);
+
+  write_hmms();
+  write_lexicon("bench.lex", words, true);
+  num_grams = write_lm(random, "bench.arpa");
+  write_lna(random);
+}
+
+/// Writes the files for checking words that are added at runtime: the base
+/// lexicon without one fifth of the words, two batches of the missing words,
+/// the lexicons with the batches appended, and another n-gram model. The
+/// models of generate() do not change.
+void
+Setup::generate_dynamic()
+{
+  std::vector<int> base, batch1, batch2;
+  for (int w = 0; w < num_words; w++) {
+    if (w % 10 == 1)
+      batch1.push_back(w);
+    else if (w % 10 == 6)
+      batch2.push_back(w);
+    else
+      base.push_back(w);
+  }
+  write_lexicon("dynamic_base.lex", base, true);
+  write_lexicon("dynamic_add1.lex", batch1, false);
+  write_lexicon("dynamic_add2.lex", batch2, false);
+  base.insert(base.end(), batch1.begin(), batch1.end());
+  write_lexicon("dynamic_base_add1.lex", base, true);
+  base.insert(base.end(), batch2.begin(), batch2.end());
+  write_lexicon("dynamic_all.lex", base, true);
+
+  Random random(~seed);
+  write_lm(random, "dynamic_swap.arpa");
+}
+
+void
+Setup::write_hmms()
+{
+  FILE *file = open_output(path("bench.ph"));
+  num_hmms = 2 + (num_phones + 1) * num_phones * (num_phones + 1);
+  fprintf(file, "PHONE\n%d\n", num_hmms);
+  fputs("1 3 _\n-1 -2 1\n0 1 2 1\n1 0\n2 2 2 0.6 1 0.4\n", file);
+  fputs("2 5 __\n-1 -2 0 1 2\n0 1 2 1\n1 0\n", file);
+  fputs("2 2 2 0.6 3 0.4\n3 2 3 0.6 4 0.4\n4 2 4 0.6 1 0.4\n", file);
+  int id = 3;
+  for (int l = 0; l <= num_phones; l++) {
+    for (int c = 0; c < num_phones; c++) {
+      for (int r = 0; r <= num_phones; r++) {
+        fprintf(file, "%d 5 %s-%s+%s\n-1 -2 %d %d %d\n0 1 2 1\n1 0\n", id++,
+                phone(l).c_str(), phone(c).c_str(), phone(r).c_str(),
+                model(l, c, r, 0), model(l, c, r, 1), model(l, c, r, 2));
+        fputs("2 2 2 0.6 3 0.4\n3 2 3 0.6 4 0.4\n4 2 4 0.6 1 0.4\n", file);
+      }
+    }
+  }
+  fclose(file);
+}
+
+/// Writes the pronunciations of \a words in this order, after the word
+/// boundary and the sentence boundaries if \a boundaries is set.
+void
+Setup::write_lexicon(const std::string &name, const std::vector<int> &words,
+                     bool boundaries)
+{
+  FILE *file = open_output(path(name));
+  if (boundaries)
+    fputs("<w>(1.0) _\n<w>(1.0) __\n<s>(1.0)\n</s>(1.0)\n", file);
+  for (size_t i = 0; i < words.size(); i++) {
+    const std::vector<int> &pron = pronunciations[words[i]];
+    fprintf(file, "w%d(1.0)", words[i]);
+    for (size_t i = 0; i < pron.size(); i++) {
+      int left = i > 0 ? pron[i - 1] : num_phones;
+      int right = i + 1 < pron.size() ? pron[i + 1] : num_phones;
+      fprintf(file, " %s-%s+%s", phone(left).c_str(), phone(pron[i]).c_str(),
+              phone(right).c_str());
+    }
+    fputs("\n", file);
+  }
+  fclose(file);
+}
+
+/// Writes a random n-gram model over the whole vocabulary, and returns the
+/// number of n-grams of each order.
+std::vector<int>
+Setup::write_lm(Random &random, const std::string &name)
+{
+  std::vector<std::string> vocabulary;
+  vocabulary.push_back("<s>");
+  vocabulary.push_back("</s>");
+  vocabulary.push_back("<w>");
+  for (int w = 0; w < num_words; w++)
+    vocabulary.push_back(str::fmt(16, "w%d", w));
+
+  // Each n-gram extends an existing (n-1)-gram, so that all prefixes are in
+  // the model. Sentence starts only begin and sentence ends only end grams.
+  typedef std::set<std::vector<std::string> > GramSet;
+  std::vector<GramSet> grams(order);
+  for (size_t w = 0; w < vocabulary.size(); w++)
+    grams[0].insert(std::vector<std::string>(1, vocabulary[w]));
+  for (int n = 1; n < order; n++) {
+    std::vector<std::vector<std::string> > contexts(grams[n - 1].begin(),
+                                                    grams[n - 1].end());
+    for (int i = 0; i < num_words * grams_per_word; i++) {
+      std::vector<std::string> gram = contexts[random.integer(contexts.size())];
+      if (gram.back() == "</s>")
+        continue;
+      gram.push_back(vocabulary[1 + random.integer(vocabulary.size() - 1)]);
+      grams[n].insert(gram);
+    }
+  }
+
+  FILE *file = open_output(path(name));
+  fputs("\\data\\\n", file);
+  std::vector<int> counts;
+  for (int n = 0; n < order; n++) {
+    counts.push_back(grams[n].size());
+    fprintf(file, "ngram %d=%zd\n", n + 1, grams[n].size());
+  }
+  for (int n = 0; n < order; n++) {
+    fprintf(file, "\n\\%d-grams:\n", n + 1);
+    for (GramSet::iterator it = grams[n].begin(); it != grams[n].end(); ++it) {
+      fprintf(file, "%.4f\t%s", -3 * random.uniform(), (*it)[0].c_str());
+      for (size_t i = 1; i < it->size(); i++)
+        fprintf(file, " %s", (*it)[i].c_str());
+      if (n + 1 < order)
+        fprintf(file, "\t%.4f", -random.uniform());
+      fputs("\n", file);
+    }
+  }
+  fputs("\n\\end\\\n", file);
+  fclose(file);
+  return counts;
+}
+
+void
+Setup::write_lna(Random &random)
+{
+  int models = num_models();
+  num_frames = 0;
+  for (int u = 0; u < num_utterances; u++) {
+    // The state models of the sentence with cross-word contexts between
+    // silences, each lasting one to three frames.
+    std::vector<int> phones;
+    int length = words_per_utterance / 2 + random.integer(words_per_utterance);
+    for (int i = 0; i < length; i++) {
+      const std::vector<int> &pron = pronunciations[random.integer(num_words)];
+      phones.insert(phones.end(), pron.begin(), pron.end());
+    }
+    std::vector<int> states;
+    for (int s = 0; s < 3; s++)
+      states.push_back(s);
+    for (size_t i = 0; i < phones.size(); i++) {
+      int left = i > 0 ? phones[i - 1] : num_phones;
+      int right = i + 1 < phones.size() ? phones[i + 1] : num_phones;
+      for (int s = 0; s < 3; s++)
+        states.push_back(model(left, phones[i], right, s));
+    }
+    for (int s = 0; s < 3; s++)
+      states.push_back(s);
+
+    FILE *file = open_output(lna_path(u));
+    unsigned char header[5] = { (unsigned char)(models >> 24),
+                                (unsigned char)(models >> 16),
+                                (unsigned char)(models >> 8),
+                                (unsigned char)models, 4 };
+    fwrite(header, 5, 1, file);
+
+    // The right model is likely but not always the best, and a random
+    // competitor gets a plausible score in every frame.
+    std::vector<float> log_probs(models);
+    for (size_t i = 0; i < states.size(); i++) {
+      int duration = 1 + random.integer(3);
+      for (int d = 0; d < duration; d++) {
+        for (int m = 0; m < models; m++)
+          log_probs[m] = -12 - 6 * random.uniform();
+        log_probs[states[i]] = -0.3 * random.uniform();
+        int other = random.integer(models);
+        log_probs[other] = std::max(log_probs[other],
+                                    (float)(-2 - 2 * random.uniform()));
+        fwrite(&log_probs[0], sizeof(float), models, file);
+        num_frames++;
+      }
+    }
+    fclose(file);
+  }
+}
+
+/// 64-bit FNV-1a hash of a file.
+static uint64_t
+hash_file(const std::string &name)
+{
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  FILE *file = fopen(name.c_str(), "r");
+  if (!file)
+    return 0;
+  int c;
+  while ((c = fgetc(file)) != EOF)
+    hash = (hash ^ (unsigned char)c) * 0x100000001b3ULL;
+  fclose(file);
+  return hash;
+}
+
+/// Timings and result digests of decoding all utterances with one beam.
+struct BeamRun {
+  float beam;
+  int frames;
+  double run_seconds;
+  double word_graph_seconds;
+  double frame_mean_us;
+  double frame_median_us;
+  double frame_p95_us;
+  double frame_max_us;
+  std::vector<std::string> digests; //!< One line per utterance.
+};
+
+static std::string
+digest_key(float beam, int utterance)
+{
+  return str::fmt(64, "%g %d", beam, utterance);
+}
+
+static BeamRun
+decode(Toolbox &t, const Setup &setup, float beam)
+{
+  BeamRun result;
+  result.beam = beam;
+  result.frames = 0;
+  result.run_seconds = 0;
+  result.word_graph_seconds = 0;
+  t.set_global_beam(beam);
+  t.set_word_end_beam(beam * 2 / 3);
+
+  std::vector<double> frame_us;
+  std::string graph_file = setup.path("bench.wg");
+  for (int u = 0; u < setup.num_utterances; u++) {
+    t.lna_open(setup.lna_path(u).c_str(), 1024);
+    t.reset(0);
+    while (true) {
+      Clock::time_point start = Clock::now();
+      bool more = t.run();
+      double seconds = seconds_since(start);
+      result.run_seconds += seconds;
+      if (!more)
+        break;
+      frame_us.push_back(1e6 * seconds);
+      result.frames++;
+    }
+
+    Clock::time_point start = Clock::now();
+    t.write_word_graph(graph_file);
+    result.word_graph_seconds += seconds_since(start);
+
+    // The log probability is written in hexadecimal so that the comparison
+    // is exact.
+    std::string hypothesis = t.best_hypo_string(false, false);
+    str::clean(hypothesis, " \n");
+    result.digests.push_back(
+      digest_key(beam, u) +
+      str::fmt(256, " %a %016llx ",
+               (double)t.tp_search().get_total_log_prob(true),
+               (unsigned long long)hash_file(graph_file)) +
+      hypothesis);
+    t.lna_close();
+  }
+
+  std::sort(frame_us.begin(), frame_us.end());
+  double sum = 0;
+  for (size_t i = 0; i < frame_us.size(); i++)
+    sum += frame_us[i];
+  size_t n = frame_us.size();
+  result.frame_mean_us = n > 0 ? sum / n : 0;
+  result.frame_median_us = n > 0 ? frame_us[n / 2] : 0;
+  result.frame_p95_us = n > 0 ? frame_us[std::min(n - 1, n * 95 / 100)] : 0;
+  result.frame_max_us = n > 0 ? frame_us.back() : 0;
+  return result;
+}
+
+/// Compares the digests against a reference written with
+/// --write-reference, and returns the number of differences. Results
+/// without a reference and reference entries that were not decoded count as
+/// differences, so that a check never passes without comparing.
+static int
+check_reference(const std::string &file_name, const Setup &setup,
+                const std::vector<BeamRun> &runs)
+{
+  io::Stream in(file_name, "r");
+  if (!in.file) {
+    fprintf(stderr, "could not open %s\n", file_name.c_str());
+    exit(1);
+  }
+  std::string line;
+  if (!str::read_line(line, in.file, true) ||
+      line != "setup " + setup.description())
+  {
+    fprintf(stderr, "%s: the reference was written with a different setup\n",
+            file_name.c_str());
+    return 1;
+  }
+
+  std::map<std::string, std::string> reference;
+  while (str::read_line(line, in.file, true)) {
+    std::vector<std::string> fields = str::split(line, " ", false, 3);
+    if (fields.size() < 3)
+      continue;
+    reference[fields[0] + " " + fields[1]] = line;
+  }
+
+  int num_differences = 0;
+  for (size_t r = 0; r < runs.size(); r++) {
+    for (size_t u = 0; u < runs[r].digests.size(); u++) {
+      const std::string &digest = runs[r].digests[u];
+      std::map<std::string, std::string>::iterator it =
+        reference.find(digest_key(runs[r].beam, u));
+      if (it == reference.end()) {
+        fprintf(stderr, "no reference for beam %g utterance %zd\n",
+                runs[r].beam, u);
+        num_differences++;
+        continue;
+      }
+      if (it->second != digest) {
+        fprintf(stderr, "beam %g utterance %zd differs:\n  reference %s\n"
+                "  current   %s\n", runs[r].beam, u, it->second.c_str(),
+                digest.c_str());
+        num_differences++;
+      }
+      reference.erase(it);
+    }
+  }
+  for (std::map<std::string, std::string>::iterator it = reference.begin();
+       it != reference.end(); ++it)
+  {
+    std::vector<std::string> key = str::split(it->first, " ", false);
+    fprintf(stderr, "beam %s utterance %s of the reference was not decoded\n",
+            key[0].c_str(), key[1].c_str());
+    num_differences++;
+  }
+  return num_differences;
+}
+
+/// Sets the options that have to be set before reading the lexicon.
+static void
+set_lexicon_options(Toolbox &t, const Setup &setup)
+{
+  t.set_cross_word_triphones(setup.cross_word);
+  t.set_lm_lookahead(setup.lookahead);
+  t.set_word_boundary("<w>");
+  t.set_lm_scale(10);
+}
+
+/// Reads the n-gram model \a name, which is also the lookahead model.
+static void
+read_lm(Toolbox &t, const Setup &setup, const std::string &name)
+{
+  t.ngram_read(setup.path(name).c_str(), false, true);
+  if (setup.lookahead > 0)
+    t.read_lookahead_ngram("", false, true);
+}
+
+static void
+set_search_options(Toolbox &t, const Setup &setup)
+{
+  t.set_token_limit(setup.token_limit);
+  t.set_prune_similar(3);
+  t.set_generate_word_graph(true);
+  t.set_print_text_result(0);
+}
+
+/// Decodes with the lexicon and the n-gram model read at startup.
+static BeamRun
+decode_static(const Setup &setup, const std::string &lexicon,
+              const std::string &lm, float beam)
+{
+  Toolbox t(setup.path("bench.ph").c_str());
+  set_lexicon_options(t, setup);
+  t.lex_read(setup.path(lexicon).c_str());
+  t.set_sentence_boundary("<s>", "</s>");
+  read_lm(t, setup, lm);
+  set_search_options(t, setup);
+  return decode(t, setup, beam);
+}
+
+static int
+compare_runs(const char *step, const BeamRun &expected, const BeamRun &result)
+{
+  int num_differences = 0;
+  for (size_t u = 0; u < expected.digests.size(); u++) {
+    if (result.digests[u] != expected.digests[u]) {
+      fprintf(stderr, "%s: utterance %zd differs:\n  expected %s\n"
+              "  current  %s\n", step, u, expected.digests[u].c_str(),
+              result.digests[u].c_str());
+      num_differences++;
+    }
+  }
+  return num_differences;
+}
+
+/// Adds words to a running decoder in two batches, removes them, adds them
+/// again and swaps the n-gram model. After each step the results have to be
+/// identical to decoding with the same lexicon and model read at startup.
+/// Returns the number of differences.
+static int
+check_dynamic(const Setup &setup, float beam)
+{
+  Toolbox t(setup.path("bench.ph").c_str());
+  set_lexicon_options(t, setup);
+  t.set_dynamic_vocabulary(true);
+  t.lex_read(setup.path("dynamic_base.lex").c_str());
+  t.set_sentence_boundary("<s>", "</s>");
+  read_lm(t, setup, "bench.arpa");
+  set_search_options(t, setup);
+
+  BeamRun base = decode_static(setup, "dynamic_base.lex", "bench.arpa", beam);
+  BeamRun add1 = decode_static(setup, "dynamic_base_add1.lex", "bench.arpa",
+                               beam);
+  BeamRun all = decode_static(setup, "dynamic_all.lex", "bench.arpa", beam);
+
+  int num_differences = 0;
+  t.lex_add_words(setup.path("dynamic_add1.lex").c_str());
+  num_differences += compare_runs("add", add1, decode(t, setup, beam));
+  t.lex_add_words(setup.path("dynamic_add2.lex").c_str());
+  num_differences += compare_runs("second batch", all, decode(t, setup, beam));
+  t.lex_remove_added_words();
+  num_differences += compare_runs("remove", base, decode(t, setup, beam));
+  t.lex_add_words(setup.path("dynamic_add1.lex").c_str());
+  t.lex_add_words(setup.path("dynamic_add2.lex").c_str());
+  num_differences += compare_runs("add again", all, decode(t, setup, beam));
+  t.swap_ngram(setup.path("dynamic_swap.arpa").c_str(), false, true);
+  num_differences += compare_runs(
+    "swap", decode_static(setup, "dynamic_all.lex", "dynamic_swap.arpa", beam),
+    decode(t, setup, beam));
+  return num_differences;
+}
+
+static void
+write_json(FILE *file, const Setup &setup, double hmm_seconds,
+           double lexicon_seconds, double lm_seconds,
+           const std::vector<BeamRun> &runs, int num_differences,
+           int dynamic_differences)
+{
+  fputs("{\n", file);
+  fprintf(file, "  \"setup\": {\"seed\": %llu, \"phones\": %d, \"words\": %d, "
+          "\"order\": %d, \"utterances\": %d, \"frames\": %d, \"hmms\": %d, "
+          "\"ngrams\": [", (unsigned long long)setup.seed, setup.num_phones,
+          setup.num_words, setup.order, setup.num_utterances,
+          setup.num_frames, setup.num_hmms);
+  for (size_t n = 0; n < setup.num_grams.size(); n++)
+    fprintf(file, "%s%d", n > 0 ? ", " : "", setup.num_grams[n]);
+  fprintf(file, "], \"lookahead\": %d, \"cross_word\": %s, "
+          "\"tokens\": %d},\n", setup.lookahead, setup.cross_word ? "true" : "false",
+          setup.token_limit);
+  fprintf(file, "  \"load\": {\"hmm_seconds\": %.6g, \"lexicon_seconds\": "
+          "%.6g, \"lm_seconds\": %.6g},\n", hmm_seconds, lexicon_seconds,
+          lm_seconds);
+  fputs("  \"runs\": [\n", file);
+  for (size_t r = 0; r < runs.size(); r++) {
+    const BeamRun &run = runs[r];
+    fprintf(file, "    {\"beam\": %g, \"frames\": %d, \"run_seconds\": %.6g, "
+            "\"real_time_factor\": %.6g, \"frame_mean_us\": %.6g, "
+            "\"frame_median_us\": %.6g, \"frame_p95_us\": %.6g, "
+            "\"frame_max_us\": %.6g, \"word_graph_seconds\": %.6g}%s\n",
+            run.beam, run.frames, run.run_seconds,
+            run.frames > 0 ? run.run_seconds / (run.frames * 0.01) : 0,
+            run.frame_mean_us, run.frame_median_us, run.frame_p95_us,
+            run.frame_max_us, run.word_graph_seconds,
+            r + 1 < runs.size() ? "," : "");
+  }
+  fputs("  ]", file);
+  if (num_differences >= 0)
+    fprintf(file, ",\n  \"reference_differences\": %d", num_differences);
+  if (dynamic_differences >= 0)
+    fprintf(file, ",\n  \"dynamic_differences\": %d", dynamic_differences);
+  fputs("\n}\n", file);
+}
+
+/// Generates a synthetic recognition task in DIR, decodes it with the given
+/// beams, and writes the load times, the per-frame run() times and the word
+/// graph writing times as JSON. The decoding results can be written to a
+/// reference file and later checked against it bit for bit, so that speed
+/// work can be validated without real models. With --dynamic, adding words
+/// and swapping the n-gram model at runtime are checked against decoding
+/// with the same models read at startup.
+int
+main(int argc, char *argv[])
+{
+  config("usage: decoder_bench [OPTION...] DIR\n")
+    ('h', "help", "", "", "display help")
+    ('s', "seed=INT", "arg", "1", "seed of the synthetic models")
+    ('p', "phones=INT", "arg", "12", "number of phones (at most 26)")
+    ('w', "words=INT", "arg", "1000", "number of words in the lexicon")
+    ('n', "order=INT", "arg", "3", "order of the n-gram model")
+    ('g', "grams=INT", "arg", "5", "sampled n-grams per word for each order")
+    ('u', "utterances=INT", "arg", "5", "number of utterances")
+    ('l', "utterance-words=INT", "arg", "20", "average words per utterance")
+    ('b', "beams=LIST", "arg", "30,40,50", "comma-separated global beams, "
+     "the word end beam is 2/3 of the global beam")
+    ('t', "tokens=INT", "arg", "30000", "token limit")
+    ('a', "lookahead=INT", "arg", "1", "LM lookahead level (0-3)")
+    ('c', "cross-word", "", "", "use cross-word triphones")
+    ('j', "json=FILE", "arg", "-", "file of the JSON results")
+    ('W', "write-reference=FILE", "arg", "", "write the decoding results")
+    ('C', "check-reference=FILE", "arg", "", "compare the decoding results "
+     "and exit with failure on any difference")
+    ('D', "dynamic", "", "", "check adding words and swapping the n-gram "
+     "model at runtime with the first beam, and exit with failure on any "
+     "difference")
+    ;
+  config.default_parse(argc, argv);
+  if (config.arguments.size() != 1)
+    config.print_help(stderr, 1);
+
+  Setup setup;
+  setup.dir = config.arguments[0];
+  setup.seed = config["seed"].get_int();
+  setup.num_phones = config["phones"].get_int();
+  setup.num_words = config["words"].get_int();
+  setup.order = config["order"].get_int();
+  setup.grams_per_word = config["grams"].get_int();
+  setup.num_utterances = config["utterances"].get_int();
+  setup.words_per_utterance = config["utterance-words"].get_int();
+  setup.lookahead = config["lookahead"].get_int();
+  setup.cross_word = config["cross-word"].specified;
+  setup.token_limit = config["tokens"].get_int();
+  if (setup.num_phones < 1 || setup.num_phones > 26 || setup.num_words < 1 ||
+      setup.order < 1 || setup.words_per_utterance < 1)
+  {
+    fprintf(stderr, "invalid setup\n");
+    exit(1);
+  }
+
+  std::vector<float> beams;
+  std::vector<std::string> fields =
+    str::split(config["beams"].get_str(), ",", true);
+  for (size_t i = 0; i < fields.size(); i++)
+    beams.push_back(str::str2float(fields[i]));
+
+  fprintf(stderr, "generating %s\n", setup.description().c_str());
+  setup.generate();
+  if (config["dynamic"].specified)
+    setup.generate_dynamic();
+
+  Clock::time_point start = Clock::now();
+  Toolbox t(setup.path("bench.ph").c_str());
+  double hmm_seconds = seconds_since(start);
+
+  set_lexicon_options(t, setup);
+  start = Clock::now();
+  t.lex_read(setup.path("bench.lex").c_str());
+  double lexicon_seconds = seconds_since(start);
+
+  t.set_sentence_boundary("<s>", "</s>");
+  start = Clock::now();
+  read_lm(t, setup, "bench.arpa");
+  double lm_seconds = seconds_since(start);
+  set_search_options(t, setup);
+
+  std::vector<BeamRun> runs;
+  for (size_t b = 0; b < beams.size(); b++) {
+    runs.push_back(decode(t, setup, beams[b]));
+    fprintf(stderr, "beam %g: %d frames, %.3f s\n", beams[b],
+            runs.back().frames, runs.back().run_seconds);
+  }
+
+  if (config["write-reference"].specified) {
+    FILE *file = open_output(config["write-reference"].get_str());
+    fprintf(file, "setup %s\n", setup.description().c_str());
+    for (size_t r = 0; r < runs.size(); r++)
+      for (size_t u = 0; u < runs[r].digests.size(); u++)
+        fprintf(file, "%s\n", runs[r].digests[u].c_str());
+    fclose(file);
+  }
+
+  int num_differences = -1;
+  if (config["check-reference"].specified) {
+    num_differences = check_reference(config["check-reference"].get_str(),
+                                      setup, runs);
+    fprintf(stderr, "%d differences to the reference\n", num_differences);
+  }
+
+  int dynamic_differences = -1;
+  if (config["dynamic"].specified && !beams.empty()) {
+    dynamic_differences = check_dynamic(setup, beams[0]);
+    fprintf(stderr, "%d differences with a dynamic vocabulary\n",
+            dynamic_differences);
+  }
+
+  std::string json = config["json"].get_str();
+  FILE *file = json == "-" ? stdout : open_output(json);
+  write_json(file, setup, hmm_seconds, lexicon_seconds, lm_seconds, runs,
+             num_differences, dynamic_differences);
+  if (file != stdout)
+    fclose(file);
+
+  return num_differences > 0 || dynamic_differences > 0 ? 1 : 0;
+}
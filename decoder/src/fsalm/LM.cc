@@ -103,15 +103,20 @@ void LM::reset()
     m_start_symbol = -1;
     m_end_symbol = -1;
     m_final_score = 0;
+    m_quantization_bits = 0;
 
     m_symbol_map.clear();
     m_non_event.clear();
     m_nodes.bo_score.clear();
     m_nodes.bo_target.clear();
     m_nodes.limit_arc.clear();
+    m_nodes.bo_codebook.clear();
+    m_nodes.bo_score_index.clear();
     m_arcs.symbol.clear();
     m_arcs.target.clear();
     m_arcs.score.clear();
+    m_arcs.codebook.clear();
+    m_arcs.score_index.clear();
     m_cache.ctx_vec.clear();
     m_cache.ctx_node_id = -1;
 }
@@ -176,7 +181,7 @@ int LM::walk_no_bo(int node_id, int symbol, float *score) const
             if (arc_id != limit && *lower_b == symbol) {
                 // The search found such an arc.
                 if (score != NULL)
-                    *score += m_arcs.score.at(arc_id);
+                    *score += arc_score(arc_id);
                 return m_arcs.target.at(arc_id);
             }
         }
@@ -214,7 +219,7 @@ int LM::walk(int node_id, int symbol, float *score) const
         int new_node_id = walk_no_bo(node_id, symbol, score);
         if (new_node_id < 0) {
             if (score != NULL)
-                *score += m_nodes.bo_score.at(node_id);
+                *score += bo_score(node_id);
             node_id = m_nodes.bo_target.at(node_id);
             continue;
         }
@@ -310,6 +315,7 @@ void LM::new_ngram(const vector<int> &vec, float score, float bo_score)
 
 int LM::new_node()
 {
+    check_not_quantized("LM::new_node()");
     int node_id = num_nodes();
     vec_resize(m_nodes.bo_target, node_id + 1);
     m_nodes.bo_target.at(node_id) = 0;
@@ -322,6 +328,7 @@ int LM::new_node()
 
 void LM::set_arc(int arc_id, int symbol, int target, float score)
 {
+    check_not_quantized("LM::set_arc()");
     vec_resize(m_arcs.symbol, arc_id + 1);
     m_arcs.symbol.at(arc_id) = symbol;
     vec_resize(m_arcs.target, arc_id + 1);
@@ -332,6 +339,8 @@ void LM::set_arc(int arc_id, int symbol, int target, float score)
 
 void LM::trim()
 {
+    check_not_quantized("LM::trim()");
+
     // Find childless nodes and compute new node indices by not
     // counting childless nodes and backoffing for removed nodes.
     //
@@ -380,16 +389,168 @@ void LM::trim()
     m_initial_node_id = walk(m_empty_node_id, m_start_symbol);
 }
 
-/** Apply linear quantization to log probability values.
+void LM::pack_index(const vector<unsigned short> &values,
+                    vector<unsigned char> &index) const
+{
+    if (m_quantization_bits <= 8) {
+        index.assign(values.begin(), values.end());
+        return;
+    }
+    index.resize(2 * values.size());
+    for (size_t i = 0; i < values.size(); i++) {
+        index[2 * i] = values[i] & 0xff;
+        index[2 * i + 1] = values[i] >> 8;
+    }
+}
+
+void LM::check_index(const vector<unsigned char> &index, int num_elems,
+                     int codebook_size) const
+{
+    int bytes = (m_quantization_bits <= 8) ? 1 : 2;
+    if ((int)index.size() != num_elems * bytes)
+        throw runtime_error("LM::read() wrong number of quantized scores");
+    for (int i = 0; i < num_elems; i++)
+        if (codebook_index(index, i) >= codebook_size)
+            throw runtime_error("LM::read() codebook index out of range");
+}
+
+void LM::check_not_quantized(const char *function) const
+{
+    if (m_quantization_bits > 0)
+        throw runtime_error(string(function) +
+                            ": the model is quantized and can not be modified");
+}
+
+/** Compute a codebook of at most 2^bits values for the given values
+ * with k-means clustering, and the index of the nearest codebook
+ * value for each value.
  *
- * \param bits = number of bits to use for floats (remember that
- * sign occupies on bit from the given number)
+ * The clustering is computed on the distinct values weighted by their
+ * counts.  Since the values are one-dimensional, the clusters are
+ * consecutive ranges of the sorted values.  Zero is kept exact, since
+ * backoff scores are zero for many nodes.
+ *
+ * \return the maximum absolute quantization error
  */
-void LM::quantize(int bits)
-{
-    assert(false);
-//    m_nodes.bo_score.linear_quantization_bits(bits);
-//    m_arcs.score.linear_quantization_bits(bits);
+static float quantize_values(const vector<float> &values, int bits,
+                             vector<float> &codebook,
+                             vector<unsigned short> &index)
+{
+    // Find the distinct values and their counts.
+    vector<float> distinct(values);
+    sort(distinct.begin(), distinct.end());
+    vector<double> count;
+    int num_distinct = 0;
+    for (size_t i = 0; i < distinct.size(); i++) {
+        if (num_distinct > 0 && distinct[num_distinct - 1] == distinct[i]) {
+            count.back()++;
+            continue;
+        }
+        distinct[num_distinct++] = distinct[i];
+        count.push_back(1);
+    }
+    distinct.resize(num_distinct);
+
+    int num_levels = 1 << bits;
+    if (num_distinct <= num_levels)
+        codebook = distinct;
+    else {
+        // Initialize the centroids at the quantiles of the values,
+        // taking care that the initial clusters are not empty.
+        vector<double> centroid(num_levels);
+        double cumulative = 0;
+        int d = 0;
+        int prev_d = -1;
+        for (int k = 0; k < num_levels; k++) {
+            double quantile = (k + 0.5) * values.size() / num_levels;
+            while (d < num_distinct - 1 && cumulative + count[d] < quantile)
+                cumulative += count[d++];
+            prev_d = max(prev_d + 1, min(d, num_distinct - num_levels + k));
+            centroid[k] = distinct[prev_d];
+        }
+
+        // Replace the centroid nearest to zero by zero.  This keeps the
+        // centroids sorted.
+        bool keep_zero = binary_search(distinct.begin(), distinct.end(), 0.0f);
+        if (keep_zero) {
+            int zero_k = 0;
+            for (int k = 1; k < num_levels; k++)
+                if (fabs(centroid[k]) < fabs(centroid[zero_k]))
+                    zero_k = k;
+            centroid[zero_k] = 0;
+        }
+
+        // Lloyd iterations.  The nearest centroid of the sorted values
+        // does not decrease.
+        vector<double> sum(num_levels);
+        vector<double> weight(num_levels);
+        for (int iter = 0; iter < 100; iter++) {
+            fill(sum.begin(), sum.end(), 0);
+            fill(weight.begin(), weight.end(), 0);
+            int k = 0;
+            for (d = 0; d < num_distinct; d++) {
+                while (k + 1 < num_levels &&
+                       fabs(distinct[d] - centroid[k + 1]) <=
+                       fabs(distinct[d] - centroid[k]))
+                    k++;
+                sum[k] += count[d] * distinct[d];
+                weight[k] += count[d];
+            }
+            bool changed = false;
+            for (k = 0; k < num_levels; k++) {
+                if (weight[k] == 0 || (keep_zero && centroid[k] == 0))
+                    continue;
+                double new_centroid = sum[k] / weight[k];
+                if (fabs(new_centroid - centroid[k]) > 1e-7)
+                    changed = true;
+                centroid[k] = new_centroid;
+            }
+            if (!changed)
+                break;
+            sort(centroid.begin(), centroid.end());
+        }
+        codebook.assign(centroid.begin(), centroid.end());
+        sort(codebook.begin(), codebook.end());
+        codebook.erase(unique(codebook.begin(), codebook.end()),
+                       codebook.end());
+    }
+
+    // Map the values to the nearest codebook values.
+    float max_error = 0;
+    index.resize(values.size());
+    for (size_t i = 0; i < values.size(); i++) {
+        int k = lower_bound(codebook.begin(), codebook.end(), values[i]) -
+            codebook.begin();
+        if (k == (int)codebook.size() ||
+            (k > 0 && values[i] - codebook[k - 1] < codebook[k] - values[i]))
+            k--;
+        index[i] = k;
+        max_error = max(max_error, fabsf(values[i] - codebook[k]));
+    }
+    return max_error;
+}
+
+LM::QuantizationStats LM::quantize(int bits)
+{
+    if (bits < 1 || bits > 16)
+        throw runtime_error(str::fmt(256, "LM::quantize(): invalid number "
+                                     "of bits %d", bits));
+    check_not_quantized("LM::quantize()");
+
+    QuantizationStats stats;
+    vector<unsigned short> index;
+    stats.arc_max_error = quantize_values(m_arcs.score, bits,
+                                          m_arcs.codebook, index);
+    m_quantization_bits = bits;
+    pack_index(index, m_arcs.score_index);
+    stats.bo_max_error = quantize_values(m_nodes.bo_score, bits,
+                                         m_nodes.bo_codebook, index);
+    pack_index(index, m_nodes.bo_score_index);
+    vector<float>().swap(m_arcs.score);
+    vector<float>().swap(m_nodes.bo_score);
+    stats.arc_codebook_size = m_arcs.codebook.size();
+    stats.bo_codebook_size = m_nodes.bo_codebook.size();
+    return stats;
 }
 
 void LM::compute_potential(vector<float> &d)
@@ -446,9 +607,9 @@ void LM::compute_potential(vector<float> &d)
 
             float score = 0;
             if (in_arc.arc_id < 0)
-                score = m_nodes.bo_score.at(n);
+                score = bo_score(n);
             else
-                score = m_arcs.score.at(in_arc.arc_id);
+                score = arc_score(in_arc.arc_id);
 
             float R_times_a = semiring->times(R, score);
             float new_d = semiring->plus(d[n], R_times_a);
@@ -466,6 +627,7 @@ void LM::compute_potential(vector<float> &d)
 
 void LM::push()
 {
+    check_not_quantized("LM::push()");
     vector<float> potential;
     compute_potential(potential);
 
@@ -577,21 +739,41 @@ void LM::read_arpa(FILE *file, bool show_progress)
 
 void LM::read(FILE *file)
 {
+    reset();
     int version;
     int ret = fscanf(file, "LM%d:%d:%d:%d:%d:%g:",
                      &version, &m_order, &m_empty_node_id, &m_initial_node_id,
                      &m_final_node_id, &m_final_score);
-    if (ret != 6 || version != 1)
+    if (ret != 6 || (version != 1 && version != 2))
         throw runtime_error("LM::read() error while reading header");
+    if (version == 2) {
+        ret = fscanf(file, "%d:", &m_quantization_bits);
+        if (ret != 1 || m_quantization_bits < 1 || m_quantization_bits > 16)
+            throw runtime_error("LM::read() error while reading header");
+    }
     str::read_line(start_str, file, true);
     str::read_line(end_str, file, true);
     m_symbol_map.read(file);
     vec_read(m_arcs.symbol, file);
     vec_read(m_arcs.target, file);
-    vec_read(m_arcs.score, file);
-    vec_read(m_nodes.bo_score, file);
+    if (m_quantization_bits > 0) {
+        vec_read(m_arcs.codebook, file);
+        vec_read(m_arcs.score_index, file);
+        vec_read(m_nodes.bo_codebook, file);
+        vec_read(m_nodes.bo_score_index, file);
+    }
+    else {
+        vec_read(m_arcs.score, file);
+        vec_read(m_nodes.bo_score, file);
+    }
     vec_read(m_nodes.bo_target, file);
     vec_read(m_nodes.limit_arc, file);
+    if (m_quantization_bits > 0) {
+        check_index(m_arcs.score_index, m_arcs.symbol.size(),
+                    m_arcs.codebook.size());
+        check_index(m_nodes.bo_score_index, m_nodes.bo_target.size(),
+                    m_nodes.bo_codebook.size());
+    }
 
     m_start_symbol = m_symbol_map.index(start_str);
     m_end_symbol = m_symbol_map.index(end_str);
@@ -610,14 +792,29 @@ void LM::read(FILE *file)
 
 void LM::write(FILE *file) const
 {
-    fprintf(file, "LM1:%d:%d:%d:%d:%g:",
-            m_order, m_empty_node_id, m_initial_node_id, m_final_node_id, m_final_score);
+    // Version 2 is quantized and has the number of bits in the header.
+    if (m_quantization_bits > 0)
+        fprintf(file, "LM2:%d:%d:%d:%d:%g:%d:",
+                m_order, m_empty_node_id, m_initial_node_id, m_final_node_id,
+                m_final_score, m_quantization_bits);
+    else
+        fprintf(file, "LM1:%d:%d:%d:%d:%g:",
+                m_order, m_empty_node_id, m_initial_node_id, m_final_node_id,
+                m_final_score);
     fprintf(file, "%s\n%s\n", start_str.c_str(), end_str.c_str());
     m_symbol_map.write(file);
     vec_write(m_arcs.symbol, file);
     vec_write(m_arcs.target, file);
-    vec_write(m_arcs.score, file);
-    vec_write(m_nodes.bo_score, file);
+    if (m_quantization_bits > 0) {
+        vec_write(m_arcs.codebook, file);
+        vec_write(m_arcs.score_index, file);
+        vec_write(m_nodes.bo_codebook, file);
+        vec_write(m_nodes.bo_score_index, file);
+    }
+    else {
+        vec_write(m_arcs.score, file);
+        vec_write(m_nodes.bo_score, file);
+    }
     vec_write(m_nodes.bo_target, file);
     vec_write(m_nodes.limit_arc, file);
 }
@@ -633,7 +830,7 @@ void LM::write_fst(FILE *file, string bo_symbol) const
         int bo_tgt = m_nodes.bo_target.at(n);
         if (bo_tgt > 0)
             fprintf(file, "T %d %d %s %s %g\n", n, bo_tgt, bo_symbol.c_str(),
-                    bo_symbol.c_str(), m_nodes.bo_score.at(n));
+                    bo_symbol.c_str(), bo_score(n));
         int limit = m_nodes.limit_arc.at(n);
         if (limit == 0)
             continue;
@@ -642,7 +839,7 @@ void LM::write_fst(FILE *file, string bo_symbol) const
         for (int a = first; a < limit; a++) {
             int tgt = m_arcs.target.at(a);
             string symbol = m_symbol_map.at(m_arcs.symbol.at(a));
-            float score = m_arcs.score.at(a);
+            float score = arc_score(a);
             fprintf(file, "T %d %d %s %s %g\n", n, tgt,
                     symbol.c_str(), symbol.c_str(), score);
         }
@@ -654,7 +851,7 @@ void LM::write_fsmt_node(FILE *file, int n, string bo_symbol) const
     int bo_tgt = m_nodes.bo_target.at(n);
     if (bo_tgt > 0)
         fprintf(file, "%d %d %s %g\n", n, bo_tgt,
-                bo_symbol.c_str(), -log10_to_ln(m_nodes.bo_score.at(n)));
+                bo_symbol.c_str(), -log10_to_ln(bo_score(n)));
     int limit = m_nodes.limit_arc.at(n);
     if (limit == 0)
         return;
@@ -667,7 +864,7 @@ void LM::write_fsmt_node(FILE *file, int n, string bo_symbol) const
             continue;
         }
         string symbol = m_symbol_map.at(m_arcs.symbol.at(a));
-        float score = -log10_to_ln(m_arcs.score.at(a));
+        float score = -log10_to_ln(arc_score(a));
         fprintf(file, "%d %d %s %g\n", n, tgt, symbol.c_str(), score);
     }
 }
@@ -700,12 +897,12 @@ void LM::fetch_probs(int node_id, vector<float> &vec)
                 continue;
             if (vec[symbol] < FLT_MAX)
                 continue;
-            float score = m_arcs.score.at(a) + bo_score;
+            float score = arc_score(a) + bo_score;
             vec[symbol] = score;
         }
         if (node_id == m_empty_node_id)
             break;
-        bo_score += m_nodes.bo_score.at(node_id);
+        bo_score += this->bo_score(node_id);
         node_id = m_nodes.bo_target.at(node_id);
     }
 }
@@ -715,12 +912,12 @@ string LM::debug_str() const
     string str;
     for (int n = 0; n < num_nodes(); n++) {
         str.append(str::fmt(256, "%d bs=%g bt=%d l=%d\n",
-                            n, m_nodes.bo_score.at(n),
+                            n, bo_score(n),
                             m_nodes.bo_target.at(n), m_nodes.limit_arc.at(n)));
     }
     for (int a = 0; a < num_arcs(); a++) {
         str.append(str::fmt(256, "%d s=%d t=%d s=%g\n", a, m_arcs.symbol.at(a),
-                            m_arcs.target.at(a), m_arcs.score.at(a)));
+                            m_arcs.target.at(a), arc_score(a)));
     }
     return str;
 }
@@ -755,10 +952,10 @@ bool LM::debug_check_zero_bo() const
     for (int n = 0; n < num_nodes(); n++) {
         if (num_children(n) > 0)
             continue;
-        float bo_score = m_nodes.bo_score.at(n);
-        if (bo_score != 0) {
+        float score = bo_score(n);
+        if (score != 0) {
             fprintf(stderr, "WARNING: node %d has no children but bo_score = %g\n",
-                    n, bo_score);
+                    n, score);
             ok = false;
         }
     }
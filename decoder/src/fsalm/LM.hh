@@ -60,6 +60,13 @@ public:
  * ASSUMES:
  * - children of a context are inserted in sorted chunk
  * - lower order is inserted before higher order
+ *
+ * QUANTIZATION:
+ *
+ * - quantize() replaces the arc scores and the backoff scores by indices
+ * to codebooks, one byte per index up to 8 bits and two bytes up to 16
+ * bits.  The model can not be modified after that.  The scores are
+ * dequantized when they are read.
  */
 class LM {
 public:
@@ -101,6 +108,12 @@ public:
         return m_final_score;
     }
 
+    /** Return the number of bits of the score codebooks, or 0 if the
+     * scores are not quantized. */
+    int quantization_bits() const {
+        return m_quantization_bits;
+    }
+
     /** Return the number of explicit children of node. */
     int num_children(int node_id) const;
 
@@ -179,7 +192,26 @@ public:
     int new_node();
     void set_arc(int arc_id, int symbol, int target, float score);
     void trim();
-    void quantize(int bits);
+
+    /** Codebook sizes and maximum errors of quantize(). */
+    struct QuantizationStats {
+        int arc_codebook_size;
+        float arc_max_error;
+        int bo_codebook_size;
+        float bo_max_error;
+    };
+
+    /** Quantize the arc scores and the backoff scores.
+     *
+     * Separate codebooks of at most 2^bits scores are computed for the
+     * arcs and the backoff scores with k-means clustering, so that zero
+     * scores are kept exact.  The scores are then stored as indices to
+     * the codebooks.
+     *
+     * \param bits = number of bits in the codebook indices (1-16)
+     * \return the sizes of the codebooks and the maximum absolute errors
+     */
+    QuantizationStats quantize(int bits);
 
     /** Compute potential of each node (used by push). */
     void compute_potential(std::vector<float> &d);
@@ -211,6 +243,42 @@ public:
 
 private:
 
+    /** Return element \a i of a vector of codebook indices. */
+    int codebook_index(const std::vector<unsigned char> &index, int i) const {
+        if (m_quantization_bits <= 8)
+            return index.at(i);
+        return index.at(2 * i) | (index.at(2 * i + 1) << 8);
+    }
+
+    /** Return the score of an arc. */
+    float arc_score(int arc_id) const {
+        if (m_quantization_bits > 0)
+            return m_arcs.codebook[codebook_index(m_arcs.score_index, arc_id)];
+        return m_arcs.score.at(arc_id);
+    }
+
+    /** Return the backoff score of a node. */
+    float bo_score(int node_id) const {
+        if (m_quantization_bits > 0)
+            return m_nodes.bo_codebook[
+                codebook_index(m_nodes.bo_score_index, node_id)];
+        return m_nodes.bo_score.at(node_id);
+    }
+
+    /** Store \a values as codebook indices of the current number of
+     * bits. */
+    void pack_index(const std::vector<unsigned short> &values,
+                    std::vector<unsigned char> &index) const;
+
+    /** Check that the codebook indices of \a num_elems elements are
+     * valid after reading. */
+    void check_index(const std::vector<unsigned char> &index, int num_elems,
+                     int codebook_size) const;
+
+    /** Throw runtime_error if the model is quantized and can not be
+     * modified. */
+    void check_not_quantized(const char *function) const;
+
     /** Incoming arc used temporarily by compute_potential() */
     struct InArc {
         InArc() : source(-1), arc_id(-1) { }
@@ -224,6 +292,8 @@ private:
         std::vector<float> bo_score;
         std::vector<int> bo_target;
         std::vector<int> limit_arc;  //!< Index to one past the last arc that starts from this node.
+        std::vector<float> bo_codebook;  //!< Backoff scores of a quantized model.
+        std::vector<unsigned char> bo_score_index;  //!< Indices to bo_codebook.
     } m_nodes;
 
     /** Arc information */
@@ -231,6 +301,8 @@ private:
         std::vector<int> symbol;  //!< The symbol assigned to the arc.
         std::vector<int> target;  //!< The target node.
         std::vector<float> score;  //!< Possible score of the arc.
+        std::vector<float> codebook;  //!< Arc scores of a quantized model.
+        std::vector<unsigned char> score_index;  //!< Indices to codebook.
     } m_arcs;
 
     /** Cache containing information about the last ngram inserted in
@@ -253,6 +325,7 @@ private:
     int m_start_symbol;
     int m_end_symbol;
     float m_final_score;
+    int m_quantization_bits;
 };
 
 };
@@ -17,6 +17,7 @@ main(int argc, char *argv[])
       ('\0', "arpa=FILE", "arg", "", "read ARPA language model")
       ('\0', "bin=FILE", "arg", "", "read binary fsa model")
       ('\0', "out-bin", "arg", "", "write binary fsa model")
+      ('\0', "quantize=BITS", "arg", "0", "quantize the scores to codebooks of 2^BITS values (1-16)")
       ;
     config.default_parse(argc, argv);
     if (config.arguments.size() != 0)
@@ -41,6 +42,13 @@ main(int argc, char *argv[])
     }
     fprintf(stderr, "model order %d\n", lm.order());
 
+    if (config["quantize"].get_int() > 0) {
+      LM::QuantizationStats stats = lm.quantize(config["quantize"].get_int());
+      fprintf(stderr, "quantized to %d arc scores (max error %g) and "
+              "%d backoff scores (max error %g)\n", stats.arc_codebook_size,
+              stats.arc_max_error, stats.bo_codebook_size, stats.bo_max_error);
+    }
+
     // Write models
     //
     if (config["out-bin"].specified) {
@@ -0,0 +1,18 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "Fst.hh"
+
+// Compiles a text format fst to the binary format that FstSearch can map to memory
+int main(int argc, char *argv[]) {
+  if (argc != 3) {
+    fprintf(stderr, "Use: %s in.fst out.fstb\n", argv[0]);
+    exit(-1);
+  }
+
+  Fst fst;
+  fst.read(argv[1]);
+  fst.write_binary(argv[2]);
+  fprintf(stderr, "%d nodes, %d arcs, %d symbols\n",
+          fst.num_nodes(), fst.num_arcs(), (int)fst.symbols.size());
+}
@@ -3,9 +3,74 @@
 
 #include <cstddef>  // NULL
 #include <cassert>
+#include <new>
+#include <utility>
+#include <vector>
 
 namespace hist {
 
+  /** Block allocator for reference countable structures.  The
+   * structures are allocated in blocks, and released structures are
+   * kept in a free list, so that the history chains of an utterance
+   * stay close to each other in memory.  All the structures can be
+   * released at once with reset(), without following the reference
+   * counts.  The structures must not need destructors. */
+  template <class T>
+  class Pool {
+  public:
+    /** Constructor.
+     * \param block_size = the number of structures allocated at once */
+    Pool(int block_size = 1024) : m_block_size(block_size), m_num_used(0) { }
+
+    /** Destructor.  Frees all the blocks. */
+    ~Pool() {
+      for (size_t i = 0; i < m_blocks.size(); i++)
+	::operator delete(m_blocks[i]);
+    }
+
+    /** Constructs a structure in unused memory. */
+    template <typename... Args>
+    T *acquire(Args&&... args) {
+      if (m_free.empty())
+	allocate_block();
+      T *t = m_free.back();
+      m_free.pop_back();
+      return new (t) T(std::forward<Args>(args)...);
+    }
+
+    /** Returns a structure to the free list. */
+    void release(T *t) { m_free.push_back(t); }
+
+    /** Returns all the structures to the free list.  Any pointers to
+     * them become invalid.  The blocks are taken back in use one at a
+     * time, so resetting a pool that is mostly unused is cheap. */
+    void reset() {
+      m_free.clear();
+      m_num_used = 0;
+    }
+
+    /** The free list, for passing to unlink(). */
+    std::vector<T*> *free_list() { return &m_free; }
+
+  private:
+    Pool(const Pool &);
+    Pool &operator=(const Pool &);
+
+    void allocate_block() {
+      if (m_num_used == m_blocks.size())
+	m_blocks.push_back(
+	  static_cast<T*>(::operator new(m_block_size * sizeof(T))));
+      T *block = m_blocks[m_num_used++];
+      for (int i = m_block_size - 1; i >= 0; i--)
+	m_free.push_back(block + i);
+    }
+
+    int m_block_size; //!< Number of structures in a block.
+    std::vector<T*> m_blocks; //!< Allocated blocks.
+    size_t m_num_used; //!< Blocks in use since the last reset().
+    std::vector<T*> m_free; //!< Unused structures.
+  };
+
   /** Decrease the reference count of the structure and unlink the
    * structures recursively if reference count becomes zero. */ 
   template <class T>
@@ -33,6 +98,13 @@ namespace hist {
     t->reference_count--;
   }
 
+  /** Unlink the structure, and return released structures to the pool. */
+  template <class T>
+  void unlink(T *orig, Pool<T> *pool)
+  {
+    unlink(orig, pool->free_list());
+  }
+
   /** Increase the reference count of the structure. */
   template <class T>
   void link(T *t) {
@@ -53,6 +125,8 @@ namespace hist {
 
     Auto(T *obj, std::vector<T *> *pool) : m_obj(obj), m_pool(pool) { link(obj); }
 
+    Auto(T *obj, Pool<T> *pool) : m_obj(obj), m_pool(pool->free_list()) { link(obj); }
+
     /** Destructor */
     ~Auto() { if (m_obj) unlink(m_obj, m_pool); }
 
@@ -73,6 +147,11 @@ namespace hist {
       hist::link(obj);
     }
 
+    /** Link */
+    void adopt(T *obj, Pool<T> *pool) {
+      adopt(obj, pool->free_list());
+    }
+
 
   private:
     T *m_obj; //!< Pointer to the object.
@@ -0,0 +1,39 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "io.hh"
+#include "InterTreeGram.hh"
+
+// Merges ARPA models with interpolation weights into a single back-off model
+int main(int argc, char *argv[]) {
+  bool binary = false;
+  int arg = 1;
+  if (arg < argc && strcmp(argv[arg], "-b") == 0) {
+    binary = true;
+    arg++;
+  }
+  if (argc - arg < 3 || (argc - arg) % 2 != 1) {
+    fprintf(stderr, "Use: %s [-b] out.arpa in1.arpa weight1 "
+            "[in2.arpa weight2 ...]\n"
+            "  -b  write the binary format of arpa2bin\n", argv[0]);
+    exit(-1);
+  }
+
+  std::string out_name = argv[arg++];
+  std::vector<std::string> names;
+  std::vector<float> weights;
+  for (; arg < argc; arg += 2) {
+    names.push_back(argv[arg]);
+    weights.push_back(atof(argv[arg + 1]));
+  }
+
+  InterTreeGram models(names, weights);
+  TreeGram merged;
+  models.merge(&merged);
+
+  io::Stream out(out_name, "w");
+  merged.write(out.file, binary);
+  for (int o = 1; o <= merged.order(); o++)
+    fprintf(stderr, "%d-grams: %d\n", o, merged.gram_count(o));
+}
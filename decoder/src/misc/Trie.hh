@@ -72,6 +72,15 @@ namespace misc {
         return it;
       }
 
+      typename ArcVec::const_iterator find(Sym sym) const
+      {
+        typename ArcVec::const_iterator it = 
+          std::lower_bound(arcs.begin(), arcs.end(), Arc(sym));
+        if (it == arcs.end() || it->sym != sym)
+          return arcs.end();
+        return it;
+      }
+
     };
 
     Trie() 
@@ -108,10 +117,10 @@ namespace misc {
      * \param sym = symbol to search
      * \return target node index or negative if not found
      */
-    int find(int n, Sym sym)
+    int find(int n, Sym sym) const
     {
-      Node &node = m_nodes.at(n);
-      typename ArcVec::iterator it = node.find(sym);
+      const Node &node = m_nodes.at(n);
+      typename ArcVec::const_iterator it = node.find(sym);
       if (it == node.arcs.end())
         return -1;
       return it->tgt;
@@ -129,6 +138,11 @@ namespace misc {
       return m_nodes.at(n);
     }
 
+    const Node &node(int n) const
+    {
+      return m_nodes.at(n);
+    }
+
   private:
     
     std::vector<Node> m_nodes;
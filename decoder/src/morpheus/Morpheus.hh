@@ -8,6 +8,7 @@
 #include <vector>
 
 #include "misc/Trie.hh"
+#include "history.hh"
 #include "misc/util.hh"
 #include "fsalm/LM.hh"
 
@@ -29,26 +30,27 @@ public:
 };
 
 
+/** A node of the morph history of a token.  The histories are
+ * allocated from the pool of the Morpheus instance, and they all are
+ * released when the next sentence is started. */
 class Path {
 public:
 
-    Path() { };
+    Path() : sym(-1), path(NULL) { };
 
-    Path(string morph, shared_ptr<Path> path)
-        : morph(morph), path(path) { }
+    Path(int sym, const Path *path)
+        : sym(sym), path(path) { }
 
-    string str() const
+    string str(const LM &lm) const
     {
         vector<const Path*> stack;
         stack.push_back(this);
         while (stack.back()->path != NULL)
-            stack.push_back(stack.back()->path.get());
-        if (stack.empty())
-            return "";
+            stack.push_back(stack.back()->path);
 
         string str;
         while (1) {
-            str.append(stack.back()->morph);
+            str.append(lm.symbol_map().at(stack.back()->sym));
             stack.pop_back();
             if (stack.empty())
                 break;
@@ -58,13 +60,13 @@ public:
         return str;
     }
 
-    string morph;
-    shared_ptr<Path> path;
+    int sym;
+    const Path *path;
 };
 
 class Token {
 public:
-    Token() : pos(0), lm_node(0), score(0), soft_score(0)
+    Token() : pos(0), lm_node(0), score(0), soft_score(0), path(NULL)
     {
     }
 
@@ -76,9 +78,6 @@ public:
         assert(false);
     }
 
-    ~Token() {
-    }
-
     void clone(const Token &t)
     {
         pos = t.pos;
@@ -92,11 +91,41 @@ public:
     int lm_node;
     float score;
     float soft_score;
-    shared_ptr<Path> path;
+    const Path *path;
 };
 
 
-typedef vector<shared_ptr<Token> > TokenPtrVec;
+typedef vector<Token*> TokenPtrVec;
+
+
+/** The language model and the character trie of its morphs.  Built once
+ * and shared read-only by Morpheus instances in different threads. */
+class MorphLexicon {
+public:
+
+    MorphLexicon(const LM *lm) : m_lm(lm)
+    {
+        const misc::SymbolMap<std::string,int> &syms = lm->symbol_map();
+        for (int s = 0; s < syms.size(); s++) {
+            string morph = syms.at(s);
+            int n = m_trie.root();
+            for (int i=0; i<morph.size(); i++) n = m_trie.insert(n, morph[i]);
+            m_trie.node(n).value = s;
+        }
+    }
+
+    const LM *lm() const { return m_lm; }
+
+    const misc::Trie<unsigned char, int, -1> &trie() const { return m_trie; }
+
+private:
+
+    const LM *m_lm;
+
+    /** Character trie mapping the morphs to morph indices. */
+    misc::Trie<unsigned char, int, -1> m_trie;
+
+};
 
 
 class Morpheus {
@@ -113,28 +142,32 @@ public:
         set_lm(lm);
     }
 
-    void set_lm(LM *lm)
+    /** Segments with a lexicon shared with other instances. */
+    Morpheus(const MorphLexicon *lexicon)
     {
-        m_lm = lm;
-        m_trie.clear();
-        if (lm == NULL)
-            return;
+        defaults();
+        set_lexicon(lexicon);
+    }
 
-        // Build character trie for the morphs.
-        const misc::SymbolMap<std::string,int> &syms = lm->symbol_map();
-        for (int s = 0; s < syms.size(); s++) {
-            string morph = syms.at(s);
-            int n = m_trie.root();
-            for (int i=0; i<morph.size(); i++) n = m_trie.insert(n, morph[i]);
-            m_trie.node(n).value = s;
-        }
+    void set_lm(LM *lm)
+    {
+        m_own_lexicon.reset(lm == NULL ? NULL : new MorphLexicon(lm));
+        set_lexicon(m_own_lexicon.get());
+    }
 
+    void set_lexicon(const MorphLexicon *lexicon)
+    {
+        m_lexicon = lexicon;
+        m_lm = lexicon == NULL ? NULL : lexicon->lm();
+        if (m_lm == NULL)
+            return;
         reset();
     }
 
     void defaults()
     {
-        set_lm(NULL);
+        m_lexicon = NULL;
+        m_lm = NULL;
         sentence_start_str = "<s>";
         sentence_end_str = "</s>";
         word_boundary_str = "<w>";
@@ -150,10 +183,12 @@ public:
     void reset()
     {
         assert(m_lm != NULL);
+        m_token_pool.reset();
+        m_path_pool.reset();
         m_string = "";
         m_active_tokens.clear();
         m_active_tokens.resize(1);
-        auto token = make_shared<Token>();
+        Token *token = m_token_pool.acquire();
         token->lm_node = m_lm->initial_node_id();
         m_active_tokens[0].push_back(token);
     }
@@ -163,9 +198,9 @@ public:
         TokenPtrVec tokens;
         tokens.swap(m_active_tokens.at(0));
 
+        int sym = m_lm->symbol_map().index(str);
         for (auto token = tokens.begin(); token != tokens.end(); ++token) {
             if (str != sentence_start_str) {
-                int sym = m_lm->symbol_map().index(str);
                 if (cumulate_score) {
                     float curr_prob = 0.0;
                     (*token)->lm_node = m_lm->walk((*token)->lm_node, sym, &curr_prob);
@@ -175,7 +210,7 @@ public:
                 else
                     (*token)->lm_node = m_lm->walk((*token)->lm_node, sym, NULL);
             }
-            (*token)->path = make_shared<Path>(str, (*token)->path);
+            (*token)->path = m_path_pool.acquire(sym, (*token)->path);
             p_activate_token(*token);
         }
     }
@@ -197,7 +232,7 @@ public:
         assert(m_active_tokens.size() == 1);
         TokenPtrVec &vec = m_active_tokens.at(0);
         assert(vec.size() == 1);
-        return vec.back()->path->str();
+        return vec.back()->path->str(*m_lm);
     }
 
     float score()
@@ -224,6 +259,9 @@ public:
 
 private:
 
+    Morpheus(const Morpheus&);
+    Morpheus &operator=(const Morpheus&);
+
     void p_collapse_active_tokens()
     {
         swap(m_active_tokens.at(0), m_active_tokens.back());
@@ -233,7 +271,7 @@ private:
             (*token)->pos = 0;
     }
 
-    void p_activate_token(shared_ptr<Token> token)
+    void p_activate_token(Token *token)
     {
         assert(token->pos < m_active_tokens.size());
         TokenPtrVec &vec = m_active_tokens.at(token->pos);
@@ -244,8 +282,11 @@ private:
                     float soft_score = util::log10addf(token->soft_score, (*tokenit)->soft_score);
                     token->soft_score = soft_score;
                     (*tokenit)->soft_score = soft_score;
-                    if ((*tokenit)->score > token->score)
+                    if ((*tokenit)->score > token->score) {
+                        m_token_pool.release(token);
                         return;
+                    }
+                    m_token_pool.release(*tokenit);
                     (*tokenit) = token;
                     return;
                 }
@@ -255,12 +296,12 @@ private:
         vec.push_back(token);
     }
 
-    void p_propagate_token(shared_ptr<Token> token, const vector<Morph> &morphs)
+    void p_propagate_token(const Token *token, const vector<Morph> &morphs)
     {
         assert(token != NULL);
 
         for (auto morph = morphs.begin(); morph != morphs.end(); ++morph) {
-            auto new_token = make_shared<Token>();
+            Token *new_token = m_token_pool.acquire();
             new_token->clone(*token);
             float curr_prob = 0.0;
             new_token->lm_node = m_lm->walk(new_token->lm_node, (*morph).sym, &curr_prob);
@@ -268,7 +309,7 @@ private:
             new_token->soft_score += curr_prob;
             new_token->pos += (*morph).str.length();
             assert(new_token->pos > token->pos);
-            new_token->path = make_shared<Path>((*morph).str, new_token->path);
+            new_token->path = m_path_pool.acquire((*morph).sym, new_token->path);
             p_activate_token(new_token);
         }
     }
@@ -276,16 +317,17 @@ private:
     void p_generate_morphs(int pos, vector<Morph> &morphs)
     {
         morphs.clear();
-        int n = m_trie.root();
+        const misc::Trie<unsigned char, int, -1> &trie = m_lexicon->trie();
+        int n = trie.root();
         string morph_str;
         for (int p = pos; p <= m_string.length(); p++) {
 
-            n = m_trie.find(n, m_string[p]);
+            n = trie.find(n, m_string[p]);
             if (n < 0)
                 return;
             morph_str.push_back(m_string[p]);
 
-            int sym = m_trie.node(n).value;
+            int sym = trie.node(n).value;
             if (sym < 0)
                 continue;
 
@@ -298,11 +340,13 @@ private:
         assert(pos < m_string.length());
         if (m_active_tokens[pos].empty())
             return;
-        vector<Morph> morphs;
-        p_generate_morphs(pos, morphs);
-        for (auto tokenit = m_active_tokens[pos].begin(); tokenit != m_active_tokens[pos].end(); ++tokenit)
-            p_propagate_token(*tokenit, morphs);
-        m_active_tokens[pos].clear();
+        p_generate_morphs(pos, m_morphs);
+        TokenPtrVec &vec = m_active_tokens[pos];
+        for (auto tokenit = vec.begin(); tokenit != vec.end(); ++tokenit) {
+            p_propagate_token(*tokenit, m_morphs);
+            m_token_pool.release(*tokenit);
+        }
+        vec.clear();
     }
 
     void p_set_string(string str)
@@ -314,14 +358,26 @@ private:
     }
 
     /** Language model used in segmentation. */
-    LM *m_lm;
+    const LM *m_lm;
 
-    /** Character trie mapping the morphs to morph indices. */
-    misc::Trie<unsigned char, int, -1> m_trie;
+    /** The language model and the morph trie. */
+    const MorphLexicon *m_lexicon;
+
+    /** The lexicon created by set_lm(). */
+    unique_ptr<MorphLexicon> m_own_lexicon;
+
+    /** Tokens of the current sentence. */
+    hist::Pool<Token> m_token_pool;
+
+    /** Morph histories of the current sentence. */
+    hist::Pool<Path> m_path_pool;
 
     /** Active tokens for each position in the sentence. */
     vector<TokenPtrVec> m_active_tokens;
 
+    /** Morphs starting at the current position. */
+    vector<Morph> m_morphs;
+
     /** Current string to be segmented. */
     string m_string;
 
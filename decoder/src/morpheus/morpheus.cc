@@ -1,3 +1,5 @@
+#include <thread>
+
 #include "misc/conf.hh"
 #include "misc/io.hh"
 #include "misc/str.hh"
@@ -9,6 +11,72 @@ using namespace fsalm;
 conf::Config config;
 LM lm;
 
+/** Options of the output that are shared by all threads. */
+struct Options {
+    bool preserve_id;
+    bool prob;
+    bool soft_prob;
+    bool no_wb;
+};
+
+/** Segments one line and returns the output line. */
+string
+segment(mrf::Morpheus &m, const string &line, const Options &opt)
+{
+    try {
+        vector<string> words = str::split(line, " \t", true);
+
+        string id;
+        if (opt.preserve_id && words.back()[0] == '(') {
+            id = words.back();
+            words.pop_back();
+        }
+
+        m.reset();
+        m.add_symbol(m.sentence_start_str, false);
+        if (!opt.no_wb) m.add_symbol(m.word_boundary_str, false);
+        for (auto wit = words.begin(); wit != words.end(); ++wit) {
+            m.add_string(*wit);
+            if (!opt.no_wb) m.add_symbol(m.word_boundary_str);
+        }
+        m.add_symbol(m.sentence_end_str);
+
+        string out;
+        if (opt.prob)
+            out.append(str::fmt(64, "%.6f ", m.score()));
+        if (opt.soft_prob)
+            out.append(str::fmt(64, "%.6f ", m.soft_score()));
+        out.append(m.str());
+        if (opt.preserve_id && !id.empty())
+            out.append(" " + id);
+        out.append("\n");
+        return out;
+    }
+    catch (mrf::NoSeg &e) {
+        return "NO SEGMENTATION: " + line + "\n";
+    }
+}
+
+/** Segments lines [begin, end) of a batch in one thread.  An exception
+ * is stored in \a error, because it can not be passed to the main
+ * thread. */
+void
+segment_lines(mrf::Morpheus *m, const vector<string> *lines,
+              int begin, int end, const Options *opt,
+              vector<string> *outputs, string *error)
+{
+    try {
+        for (int i = begin; i < end; i++)
+            (*outputs)[i] = segment(*m, (*lines)[i], *opt);
+    }
+    catch (string &str) {
+        *error = str;
+    }
+    catch (exception &e) {
+        *error = e.what();
+    }
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -23,6 +91,7 @@ main(int argc, char *argv[])
         ('s', "start=INT", "arg", "1", "start from line (1 = first)")
         ('e', "end=INT", "arg", "0", "end after line")
         ('\0', "no-wb", "", "", "do not add word boundary morphs <w>")
+        ('t', "threads=INT", "arg", "1", "number of threads")
         ;
         config.default_parse(argc, argv);
         if (config.arguments.size() != 0)
@@ -51,52 +120,83 @@ main(int argc, char *argv[])
         int end = config["end"].get_int();
         bool no_wb = config["no-wb"].specified;
 
-        mrf::Morpheus m(&lm);
+        int num_threads = config["threads"].get_int();
+        if (num_threads < 1) {
+            fprintf(stderr, "invalid number of threads\n");
+            exit(1);
+        }
+        Options opt;
+        opt.preserve_id = config["preserve-id"].specified;
+        opt.prob = config["prob"].specified;
+        opt.soft_prob = config["soft-prob"].specified;
+        opt.no_wb = no_wb;
+
+        // The model and the morph trie are shared by the threads, and
+        // each thread has its own search with its own token pools.
+        //
+        mrf::MorphLexicon lexicon(&lm);
+        vector<unique_ptr<mrf::Morpheus> > morpheus;
+        for (int t = 0; t < num_threads; t++)
+            morpheus.push_back(unique_ptr<mrf::Morpheus>(
+                                   new mrf::Morpheus(&lexicon)));
+
+        // Lines are read in batches and divided in contiguous ranges
+        // between the threads, so that the output is in input order.
+        //
+        const size_t batch_size = 1000 * num_threads;
+        vector<string> lines;
+        vector<string> outputs;
+        vector<string> errors(num_threads);
         string line;
-        int line_no = 1;
-        while (str::read_line(line, stdin, true)) {
-            str::clean(line);
-            if (line.empty())
-                continue;
-
-            if (line_no < start)
-                continue;
-            if (end > 0 && line_no > end)
-                break;
-            line_no++;
-
-            try {
-                vector<string> words = str::split(line, " \t", true);
-
-                string id;
-                if (config["preserve-id"].specified &&
-                        words.back()[0] == '(')
-                {
-                    id = words.back();
-                    words.pop_back();
+        int line_no = 0;
+        bool end_of_input = false;
+        while (!end_of_input) {
+            lines.clear();
+            while (lines.size() < batch_size) {
+                if (!str::read_line(line, stdin, true)) {
+                    end_of_input = true;
+                    break;
                 }
+                str::clean(line);
+                if (line.empty())
+                    continue;
+                line_no++;
+                if (line_no < start)
+                    continue;
+                if (end > 0 && line_no > end) {
+                    end_of_input = true;
+                    break;
+                }
+                lines.push_back(line);
+            }
 
-                m.reset();
-                m.add_symbol(m.sentence_start_str, false);
-                if (!no_wb) m.add_symbol(m.word_boundary_str, false);
-                for (auto wit = words.begin(); wit != words.end(); ++wit) {
-                    m.add_string(*wit);
-                    if (!no_wb) m.add_symbol(m.word_boundary_str);
+            int num_lines = lines.size();
+            outputs.clear();
+            outputs.resize(num_lines);
+            if (num_threads == 1 || num_lines < num_threads)
+                segment_lines(morpheus[0].get(), &lines, 0, num_lines,
+                              &opt, &outputs, &errors[0]);
+            else {
+                vector<thread> threads;
+                for (int t = 0; t < num_threads; t++) {
+                    int begin = (long)num_lines * t / num_threads;
+                    int end = (long)num_lines * (t + 1) / num_threads;
+                    threads.push_back(
+                        thread(segment_lines, morpheus[t].get(), &lines,
+                               begin, end, &opt, &outputs, &errors[t]));
                 }
-                m.add_symbol(m.sentence_end_str);
-
-                if (config["prob"].specified)
-                    printf("%.6f ", m.score());
-                if (config["soft-prob"].specified)
-                    printf("%.6f ", m.soft_score());
-                printf("%s", m.str().c_str());
-                if (config["preserve-id"].specified && !id.empty())
-                    printf(" %s", id.c_str());
-                fputs("\n", stdout);
+                for (int t = 0; t < num_threads; t++)
+                    threads[t].join();
             }
-            catch (mrf::NoSeg &e) {
-                printf("NO SEGMENTATION: %s\n", line.c_str());
+
+            for (int i = 0; i < num_lines; i++) {
+                if (outputs[i].empty())
+                    break;
+                fputs(outputs[i].c_str(), stdout);
             }
+            for (int t = 0; t < num_threads; t++)
+                if (!errors[t].empty())
+                    throw errors[t];
         }
     }
     catch (string &str) {
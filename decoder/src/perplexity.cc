@@ -1,37 +1,63 @@
-#include <math.h>
-#include "tools.hh"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "io.hh"
+#include "LMScorer.hh"
 #include "TreeGram.hh"
-#include "TreeGramArpaReader.hh"
+#include "fsalm/LM.hh"
 
+// Computes the perplexity of text from stdin, one sentence per line
 int
 main(int argc, char *argv[])
 {
-  TreeGram tree_gram;
-  TreeGramArpaReader reader;
-  
-  std::string name(argv[1]);
-
-  FILE *file = fopen(name.c_str(), "r");
-  if (!file) {
-    fprintf(stderr, "could not open %s\n", name.c_str());
+  bool binary = false;
+  bool fsa = false;
+  bool print_words = false;
+  int num_threads = 1;
+  int arg = 1;
+  for (; arg < argc - 1 && argv[arg][0] == '-'; arg++) {
+    if (strcmp(argv[arg], "-b") == 0)
+      binary = true;
+    else if (strcmp(argv[arg], "-f") == 0)
+      fsa = true;
+    else if (strcmp(argv[arg], "-w") == 0)
+      print_words = true;
+    else if (strcmp(argv[arg], "-t") == 0 && arg + 2 < argc)
+      num_threads = atoi(argv[++arg]);
+    else
+      break;
+  }
+  if (arg != argc - 1) {
+    fprintf(stderr, "Use: %s [-b] [-f] [-w] [-t threads] lm < text\n"
+            "  -b  the model is a binary TreeGram\n"
+            "  -f  the model is a binary fsalm model\n"
+            "  -w  print the probability of each word to stdout\n"
+            "  -t  number of threads (default 1)\n", argv[0]);
     exit(1);
   }
 
-//  tree_gram.read(file);
-  reader.read(file, &tree_gram);
-
-  TreeGram::Gram gram;
-  std::string line;
-  std::vector<std::string> words;
-  while (read_line(&line, stdin)) {
-    chomp(&line);
-    split(line, " \t", true, &words);
-
-    for (int i = 0; i < words.size(); i++) {
-      if (gram.size() >= tree_gram.order())
-	gram.pop_front();
-      gram.push_back(tree_gram.word_index(words[i]));
-      printf("%s %g\n", words[i].c_str(), pow(10, tree_gram.log_prob(gram)));
+  TreeGram tree_gram;
+  fsalm::LM fsa_lm;
+  LMScorer *scorer;
+  {
+    io::Stream in(argv[arg], "r");
+    if (!in.file) {
+      fprintf(stderr, "could not open %s\n", argv[arg]);
+      exit(1);
+    }
+    if (fsa) {
+      fsa_lm.read(in.file);
+      scorer = new LMScorer(&fsa_lm);
+    }
+    else {
+      tree_gram.read(in.file, binary);
+      scorer = new LMScorer(&tree_gram);
     }
   }
+  scorer->set_num_threads(num_threads);
+
+  LMScoreStatistics stats = scorer->score(stdin, print_words ? stdout : NULL);
+  stats.write(stderr);
+  delete scorer;
 }
@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <vector>
+
+#include "TokenPruner.hh"
+#include "io.hh"
+#include "misc/Timer.hh"
+#include "misc/conf.hh"
+
+conf::Config config;
+
+/// Replays the frames of a pruning record (see
+/// TokenPassSearch::set_pruning_record()) through TokenPruner, and reports the
+/// time spent and the number of tokens kept with histogram and exact token
+/// limits.
+int
+main(int argc, char *argv[])
+{
+  config("usage: prune_bench [OPTION...] RECORD\n")
+    ('h', "help", "", "", "display help")
+    ('r', "repeat=INT", "arg", "100", "number of times to replay the record")
+    ('t', "tokens=INT", "arg", "0", "override the recorded token limit")
+    ;
+  config.default_parse(argc, argv);
+  if (config.arguments.size() != 1)
+    config.print_help(stderr, 1);
+
+  std::vector<TokenPruner::Record> records;
+  {
+    io::Stream in(config.arguments[0], "r");
+    if (!in.file) {
+      fprintf(stderr, "could not open %s\n", config.arguments[0].c_str());
+      exit(1);
+    }
+    TokenPruner::Record record;
+    while (TokenPruner::read_record(in.file, record))
+      records.push_back(record);
+  }
+  if (config["tokens"].specified) {
+    for (size_t f = 0; f < records.size(); f++)
+      records[f].max_num_tokens = config["tokens"].get_int();
+  }
+
+  int repeat = config["repeat"].get_int();
+  size_t num_scores = 0;
+  for (size_t f = 0; f < records.size(); f++)
+    num_scores += records[f].scores.size();
+  fprintf(stderr, "%zd frames, %zd token scores, %d repeats\n",
+          records.size(), num_scores, repeat);
+
+  for (int exact = 0; exact < 2; exact++) {
+    TokenPruner pruner;
+    pruner.set_exact(exact);
+    size_t num_kept = 0;
+    int num_limited = 0;
+    Timer timer;
+    timer.start();
+    for (int r = 0; r < repeat; r++) {
+      for (size_t f = 0; f < records.size(); f++) {
+        const TokenPruner::Record & record = records[f];
+        const float *scores = record.scores.empty() ? NULL : &record.scores[0];
+        TokenPruner::Result result = pruner.compute(
+          scores, record.scores.size(), record.beam_limit,
+          record.best_log_prob, record.worst_log_prob, record.max_num_tokens);
+
+        // Count the survivors like the search does when compacting the list.
+        size_t kept = 0;
+        for (size_t i = 0; i < record.scores.size(); i++)
+          kept += (scores[i] >= result.threshold);
+        if (r == 0) {
+          num_kept += kept;
+          num_limited += result.limited;
+        }
+      }
+    }
+    timer.stop();
+    printf("%s: %.3f s, %.1f ns/token, %zd tokens kept, "
+           "%d frames limited\n",
+           exact ? "exact" : "histogram", timer.user_sec(),
+           1e9 * timer.user_sec() / ((double)num_scores * repeat),
+           num_kept, num_limited);
+  }
+}
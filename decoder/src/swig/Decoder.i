@@ -92,6 +92,61 @@ public:
 	int sym(const std::string &str) { return self->symbol_map().index(str); }
 }
 
+struct FrameStatistics {
+  int frame;
+  int new_tokens;
+  int word_end_tokens;
+  int word_end_tokens_after_beam;
+  int tokens_before_beam;
+  int tokens_after_beam;
+  int active_tokens;
+  int words;
+  int lm_queries;
+  int lm_cache_hits;
+  int lookahead_queries;
+  int lookahead_cache_hits;
+  float beam;
+  float best_log_prob;
+  double acoustics_time;
+  double propagate_time;
+  double prune_time;
+};
+
+struct WordPosterior {
+  std::string word;
+  int start_frame;
+  int end_frame;
+  float posterior;
+};
+
+struct NbestHypothesis {
+  std::vector<std::string> words;
+  float am_log_prob;
+  float lm_log_prob;
+  float log_prob;
+};
+
+struct ConfusionSlot {
+  int start_frame;
+  int end_frame;
+  std::vector<std::string> words;
+  std::vector<float> posteriors;
+};
+
+#ifdef SWIGPYTHON
+%template(WordPosteriorVector) std::vector<WordPosterior>;
+%template(NbestHypothesisVector) std::vector<NbestHypothesis>;
+%template(ConfusionSlotVector) std::vector<ConfusionSlot>;
+#endif
+
+class SearchStatistics {
+public:
+  bool enabled() const;
+  size_t num_frames() const;
+  const FrameStatistics &frame(size_t index) const;
+  FrameStatistics total() const;
+};
+
 class Toolbox {
 public:
   Toolbox(const char *hmm_path, const char *dur_path);
@@ -99,6 +154,9 @@ public:
 
   const std::vector<Hmm> &hmms();
   void lex_read(const char *file);
+  void set_dynamic_vocabulary(bool dynamic);
+  void lex_add_words(const char *file);
+  void lex_remove_added_words();
   const std::string &lex_word();
   const std::string &lex_phone();
 
@@ -108,6 +166,9 @@ public:
   int ngram_read(const char *file, const bool binary, const bool quiet);
   int ngram_read(const char *file, const bool binary);
   int ngram_read(const char *file);
+  void swap_ngram(const char *file, const bool binary, const bool quiet);
+  void swap_ngram(const char *file, const bool binary);
+  void swap_ngram(const char *file);
   void htk_lattice_grammar_read(const char *file, bool quiet);
   void fsa_lm_read(const char *file, bool binary, bool quiet);
   void fsa_lm_read(const char *file, bool binary);
@@ -115,6 +176,9 @@ public:
   void read_lookahead_ngram(const char *file, const bool binary, bool quiet);
   void read_lookahead_ngram(const char *file, const bool binary);
   void read_lookahead_ngram(const char *file);
+  void read_rescoring_ngram(const char *file, const bool binary, bool quiet);
+  void read_rescoring_ngram(const char *file, const bool binary);
+  void read_rescoring_ngram(const char *file);
 
   // lna
   void lna_open(const char *file, int size);
@@ -131,6 +195,10 @@ public:
   int frame();
 
   void write_word_graph(const std::string &file_name);
+  void write_binary_word_graph(const std::string &file_name);
+  std::vector<WordPosterior> word_posteriors(float posterior_scale);
+  std::vector<NbestHypothesis> nbest(int n);
+  std::vector<ConfusionSlot> confusion_network(float posterior_scale);
   void print_best_lm_history();
   void print_best_lm_history_to_file(FILE *out);
   const bytestype &best_hypo_string(bool print_all, bool output_time);
@@ -140,6 +208,8 @@ public:
   void set_prune_similar(int prune_similar);
   void set_lm_scale(float lm_scale);
   void set_token_limit(int limit);
+  void set_exact_token_limit(bool exact);
+  void record_pruning(const std::string &file_name);
   void set_duration_scale(float scale);
   void set_transition_scale(float scale);
   void set_global_beam(float beam);
@@ -178,5 +248,10 @@ public:
   void print_tp_lex_node(int node);
   void print_tp_lex_lookahead(int node);
 
+  void set_collect_statistics(bool value);
+  const SearchStatistics &search_statistics();
+  void write_search_statistics_json(const std::string &file_name);
+  void write_search_statistics_csv(const std::string &file_name);
+
   void debug_print_best_lm_history();
 };
@@ -1,5 +1,6 @@
 #include <map>
 #include <stdlib.h>
+#include <string.h>
 #include "str.hh"
 #include "Lattice.hh"
 
@@ -42,9 +43,58 @@ Lattice::new_arc(int S, int E, std::string W, float a, float l)
 
 
 
+namespace {
+  /** Read an unsigned varint of the binary format. */
+  bool read_varint(FILE *file, unsigned int *value)
+  {
+    *value = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+      int c = fgetc(file);
+      if (c == EOF)
+	return false;
+      *value |= (unsigned int)(c & 0x7f) << shift;
+      if (!(c & 0x80))
+	return true;
+    }
+    return false;
+  }
+
+  /** Read a zigzag coded signed varint of the binary format. */
+  bool read_zigzag(FILE *file, int *value)
+  {
+    unsigned int u;
+    if (!read_varint(file, &u))
+      return false;
+    *value = (int)(u >> 1) ^ -(int)(u & 1);
+    return true;
+  }
+
+  /** Read a little-endian float of the binary format. */
+  bool read_float(FILE *file, float *value)
+  {
+    unsigned char buf[4];
+    if (fread(buf, 1, 4, file) != 4)
+      return false;
+    unsigned int bits = buf[0] | (buf[1] << 8) | (buf[2] << 16) |
+      ((unsigned int)buf[3] << 24);
+    memcpy(value, &bits, 4);
+    return true;
+  }
+
+  const char binary_magic[] = "\x89LATBIN\n";
+}
+
 void
 Lattice::read(FILE *file)
 {
+  int c = fgetc(file);
+  if (c != EOF)
+    ungetc(c, file);
+  if (c == (unsigned char)binary_magic[0]) {
+    read_binary(file);
+    return;
+  }
+
   m_nodes.clear();
   m_num_arcs = 0;
   final_node_id = -1;
@@ -130,6 +180,109 @@ Lattice::read(FILE *file)
   final_node_id = label_map[final_node_id];
 }
 
+void
+Lattice::read_binary(FILE *file)
+{
+  clear();
+
+  char magic[8];
+  float lm_scale, insertion_penalty;
+  if (fread(magic, 1, 8, file) != 8 || memcmp(magic, binary_magic, 8) != 0 ||
+      !read_float(file, &lm_scale) || !read_float(file, &insertion_penalty)) 
+  {
+    fprintf(stderr, "ERROR: invalid binary lattice header\n");
+    exit(1);
+  }
+
+  // The arcs may refer to nodes defined later, so they are created at the end.
+  struct PendingArc {
+    int source_label;
+    int target_node_id;
+    int word;
+    float a;
+    float l;
+  };
+  std::vector<PendingArc> arcs;
+  std::vector<std::string> words;
+  std::map<int, int> label_map;
+  int node_label = -1;
+  int node_frame;
+  bool ok = true;
+  while (ok) {
+    unsigned int type;
+    if (!read_varint(file, &type))
+      break;
+
+    if (type == 0) {
+      // End
+      unsigned int start, end;
+      ok = read_varint(file, &start) && read_varint(file, &end);
+      if (!ok)
+	break;
+      initial_node_id = start;
+      final_node_id = end;
+      break;
+    }
+    else if (type == 1) {
+      // Word
+      unsigned int length = 0;
+      ok = read_varint(file, &length);
+      if (!ok)
+	break;
+      std::string word(length, ' ');
+      ok = length == 0 || fread(&word[0], 1, length, file) == length;
+      if (ok)
+	words.push_back(word);
+    }
+    else if (type == 2) {
+      // Node
+      unsigned int delta = 0;
+      ok = read_varint(file, &delta) && read_zigzag(file, &node_frame);
+      if (ok) {
+	node_label += delta;
+	label_map[node_label] = new_node().id;
+      }
+    }
+    else if (type == 3) {
+      // Arc to the previous node
+      PendingArc arc;
+      int delta = 0;
+      unsigned int word = 0;
+      ok = (m_nodes.size() > 0 && read_zigzag(file, &delta) && 
+	    read_varint(file, &word) && word <= words.size() &&
+	    read_float(file, &arc.a) && read_float(file, &arc.l));
+      if (ok) {
+	arc.source_label = node_label - delta;
+	arc.target_node_id = m_nodes.size() - 1;
+	arc.word = (int)word - 1;
+	arcs.push_back(arc);
+      }
+    }
+    else
+      ok = false;
+  }
+
+  if (!ok || initial_node_id < 0 || final_node_id < 0) {
+    fprintf(stderr, "ERROR: invalid or truncated binary lattice\n");
+    exit(1);
+  }
+
+  for (int i = 0; i < (int)arcs.size(); i++) {
+    const PendingArc &arc = arcs[i];
+    std::map<int, int>::iterator it = label_map.find(arc.source_label);
+    if (it == label_map.end()) {
+      fprintf(stderr, "ERROR: arc from an undefined node %d in binary lattice\n",
+	      arc.source_label);
+      exit(1);
+    }
+    new_arc(it->second, arc.target_node_id, 
+	    arc.word < 0 ? std::string("!NULL") : words[arc.word], arc.a, arc.l);
+  }
+
+  initial_node_id = label_map[initial_node_id];
+  final_node_id = label_map[final_node_id];
+}
+
 void
 Lattice::write(FILE *file)
 {
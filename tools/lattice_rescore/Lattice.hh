@@ -48,8 +48,13 @@ public:
   /** Create an arc. */
   void new_arc(int S, int E, std::string W, float a, float l);
 
-  /** Read lattice from file in HTK format */
+  /** Read lattice from file in HTK format, or in the binary format if the
+   * file starts with the binary header */
   void read(FILE *file);
+
+  /** Read lattice in the binary format written by the decoder (see
+   * BinaryLatticeWriter in the decoder for the format) */
+  void read_binary(FILE *file);
   
   /** Write lattice in HTK format */
   void write(FILE *file);
@@ -1,82 +1,205 @@
 #include <assert.h>
+#include <stdlib.h>
+#include <algorithm>
 #include "Rescore.hh"
+#include "fsalm/LM.hh"
 
 Rescore::Rescore()
   : m_tree_gram(NULL),
+    m_fsa_lm(NULL),
     m_src_lattice(NULL),
     m_sentence_start_label("<s>"),
     m_sentence_end_label("</s>"),
-    m_null_label("!NULL")
+    m_null_label("!NULL"),
+    m_max_context_length(0)
 {
 }
 
+// The contexts of a source node are indexed in a hash table when
+// there are at least this many.
+static const int min_indexed_contexts = 16;
+
+size_t // private
+Rescore::context_hash(const Context &context)
+{
+  size_t hash = context.lm_node_id + 1;
+  for (int i = 0; i < (int)context.gram.size(); i++)
+    hash = hash * 1000003 + context.gram[i];
+  return hash;
+}
+
+void // private
+Rescore::index_context(int node_id, int index)
+{
+  size_t key = index_key(node_id, m_node_contexts[node_id][index].hash);
+  m_context_index.insert(std::make_pair(key, std::make_pair(node_id, index)));
+}
+
 Lattice::Node& // private
 Rescore::find_or_create_node(int node_id, Context &context)
 {
+  std::vector<Context> &contexts = m_node_contexts[node_id];
+  context.hash = context_hash(context);
+
   // Check if the context is defined already
-  for (int c = 0; c < (int)m_node_contexts[node_id].size(); c++) {
-    Context &old_context = m_node_contexts[node_id][c];
-    if (old_context == context)
-      return m_rescored_lattice.node(old_context.node_id);
+  if ((int)contexts.size() < min_indexed_contexts) {
+    for (int c = 0; c < (int)contexts.size(); c++) {
+      Context &old_context = contexts[c];
+      if (old_context == context)
+	return m_rescored_lattice.node(old_context.node_id);
+    }
+  }
+  else {
+    typedef std::unordered_multimap<size_t, std::pair<int, int> >::iterator
+      IndexIterator;
+    std::pair<IndexIterator, IndexIterator> range = 
+      m_context_index.equal_range(index_key(node_id, context.hash));
+    for (IndexIterator it = range.first; it != range.second; ++it) {
+      if (it->second.first != node_id)
+	continue;
+      Context &old_context = contexts[it->second.second];
+      if (old_context == context)
+	return m_rescored_lattice.node(old_context.node_id);
+    }
   }
 
   // Context not found, create a new node and context
   Lattice::Node &node = m_rescored_lattice.new_node();
-  Context new_context = context;
-  new_context.node_id = node.id;
-  m_node_contexts[node_id].push_back(new_context);
+  contexts.push_back(context);
+  contexts.back().node_id = node.id;
+  if ((int)contexts.size() == min_indexed_contexts) {
+    for (int c = 0; c < (int)contexts.size(); c++)
+      index_context(node_id, c);
+  }
+  else if ((int)contexts.size() > min_indexed_contexts)
+    index_context(node_id, contexts.size() - 1);
   return node;
 }
 
 void
 Rescore::sort_nodes()
 {
-  // Initialize
-  std::vector<bool> flagged(m_src_lattice->num_nodes(), false);
-  flagged[m_src_lattice->final_node_id] = true;
-  std::vector<int> stack;
-  for (int i = 0; i < m_src_lattice->num_nodes(); i++)
-    if (!flagged[i])
-      stack.push_back(i);
-  m_sorted_nodes.resize(m_src_lattice->num_nodes());
-  m_sorted_nodes.back() = m_src_lattice->final_node_id;
-  int next_sorted_index = m_sorted_nodes.size() - 2;
-
-  // Traverse through lattice
-  while (!stack.empty()) {
-    int node_id = stack.back();
-    stack.pop_back();
-    assert(!flagged[node_id]);
-
-    // Check if all children are flagged
-    Lattice::Node &node = m_src_lattice->node(node_id);
-    bool children_flagged = true;
-    for (int i = 0; i < (int)node.arcs.size(); i++) {
-      int tgt_node_id = node.arcs[i].target_node_id;
-      if (!flagged[tgt_node_id]) {
-	children_flagged = false;
-	break;
-      }
-    }
+  // The nodes are sorted in the same order as by the earlier sort,
+  // which scanned the nodes repeatedly from the largest id to the
+  // smallest, and placed a node before the already placed nodes when
+  // all its children were placed.  Instead of scanning, Kahn's
+  // algorithm on the reversed arcs computes the round of the scan in
+  // which each node would be placed, and the nodes are then sorted by
+  // the rounds.
+  int num_nodes = m_src_lattice->num_nodes();
+  int final_id = m_src_lattice->final_node_id;
 
-    // Postpone node if some child is not flagged
-    if (!children_flagged) {
-      stack.insert(stack.begin(), node_id);
+  // Collect the parents of each node.  The arcs of the final node are
+  // ignored like before.
+  std::vector<int> parent_offsets(num_nodes + 1, 0);
+  std::vector<int> num_children(num_nodes, 0);
+  for (int i = 0; i < num_nodes; i++) {
+    if (i == final_id)
       continue;
+    Lattice::Node &node = m_src_lattice->node(i);
+    for (int a = 0; a < (int)node.arcs.size(); a++)
+      parent_offsets[node.arcs[a].target_node_id + 1]++;
+    num_children[i] = node.arcs.size();
+  }
+  for (int i = 0; i < num_nodes; i++)
+    parent_offsets[i + 1] += parent_offsets[i];
+  std::vector<int> parents(parent_offsets.back());
+  {
+    std::vector<int> next(parent_offsets.begin(), parent_offsets.end() - 1);
+    for (int i = 0; i < num_nodes; i++) {
+      if (i == final_id)
+	continue;
+      Lattice::Node &node = m_src_lattice->node(i);
+      for (int a = 0; a < (int)node.arcs.size(); a++)
+	parents[next[node.arcs[a].target_node_id]++] = i;
+    }
+  }
+
+  // Place the nodes whose children are all placed.  In the same round,
+  // a parent is scanned after its child only if its id is smaller.
+  std::vector<int> round(num_nodes, 0);
+  std::vector<int> queue;
+  queue.reserve(num_nodes);
+  for (int i = 0; i < num_nodes; i++)
+    if (num_children[i] == 0)
+      queue.push_back(i);
+  for (int q = 0; q < (int)queue.size(); q++) {
+    int node_id = queue[q];
+    for (int p = parent_offsets[node_id]; p < parent_offsets[node_id + 1]; p++) {
+      int parent_id = parents[p];
+      int parent_round = round[node_id];
+      if (node_id != final_id && node_id < parent_id)
+	parent_round++;
+      if (parent_round > round[parent_id])
+	round[parent_id] = parent_round;
+      if (--num_children[parent_id] == 0)
+	queue.push_back(parent_id);
     }
+  }
+  if ((int)queue.size() != num_nodes) {
+    fprintf(stderr, "Rescore::sort_nodes(): the lattice contains a cycle\n");
+    exit(1);
+  }
+
+  // Sort by the rounds, the last round first and the smallest id first
+  // within a round.  The final node is the last.
+  int max_round = 0;
+  for (int i = 0; i < num_nodes; i++)
+    if (round[i] > max_round)
+      max_round = round[i];
+  std::vector<int> round_offsets(max_round + 2, 0);
+  for (int i = 0; i < num_nodes; i++)
+    if (i != final_id)
+      round_offsets[max_round - round[i] + 1]++;
+  for (int r = 0; r <= max_round; r++)
+    round_offsets[r + 1] += round_offsets[r];
+  m_sorted_nodes.resize(num_nodes);
+  for (int i = 0; i < num_nodes; i++)
+    if (i != final_id)
+      m_sorted_nodes[round_offsets[max_round - round[i]]++] = i;
+  m_sorted_nodes.back() = final_id;
+}
 
-    flagged[node_id] = true;
-    m_sorted_nodes[next_sorted_index--] = node_id;
+int // private
+Rescore::word_index(const std::string &word) const
+{
+  if (m_tree_gram)
+    return m_tree_gram->word_index(word);
+  int index = m_fsa_lm->symbol_map().index_nothrow(word);
+  if (index < 0) {
+    fprintf(stderr, "Rescore::word_index(): word %s not in the language "
+	    "model\n", word.c_str());
+    exit(1);
   }
+  return index;
 }
 
 void
-Rescore::rescore(Lattice *src_lattice, TreeGram *tree_gram, bool quiet)
+Rescore::rescore(Lattice *src_lattice, const TreeGram *tree_gram, bool quiet)
 {
-  m_src_lattice = src_lattice;
   m_tree_gram = tree_gram;
+  m_fsa_lm = NULL;
+  Context context;
+  context.gram.push_back(word_index(m_sentence_start_label));
+  expand(src_lattice, context, quiet);
+}
+
+void
+Rescore::rescore(Lattice *src_lattice, const fsalm::LM *fsa_lm, bool quiet)
+{
+  m_tree_gram = NULL;
+  m_fsa_lm = fsa_lm;
+  Context context;
+  context.lm_node_id = fsa_lm->initial_node_id();
+  expand(src_lattice, context, quiet);
+}
+
+void // private
+Rescore::expand(Lattice *src_lattice, Context &initial_context, bool quiet)
+{
+  m_src_lattice = src_lattice;
   m_rescored_lattice.clear();
-  m_sentence_end_id = tree_gram->word_index(m_sentence_end_label);
+  m_sentence_end_id = word_index(m_sentence_end_label);
 
   // Create a new final node for source lattice and add sentence end
   // arc.
@@ -93,10 +216,10 @@ Rescore::rescore(Lattice *src_lattice, TreeGram *tree_gram, bool quiet)
     m_rescored_lattice.initial_node_id = node.id;
     m_node_contexts.clear();
     m_node_contexts.resize(src_lattice->num_nodes());
-    Context context;
-    context.gram.push_back(tree_gram->word_index(m_sentence_start_label));
-    context.node_id = node.id;
-    m_node_contexts[src_lattice->initial_node_id].push_back(context);
+    m_context_index.clear();
+    initial_context.node_id = node.id;
+    initial_context.hash = context_hash(initial_context);
+    m_node_contexts[src_lattice->initial_node_id].push_back(initial_context);
   }
 
   // Traverse source lattice in topological order
@@ -105,6 +228,7 @@ Rescore::rescore(Lattice *src_lattice, TreeGram *tree_gram, bool quiet)
   sort_nodes();
   if (!quiet)
     fprintf(stderr, "rescoring...");
+  Context tgt_context;
   for (int s = 0; s < (int)m_sorted_nodes.size(); s++) {
     int src_id = m_sorted_nodes[s];
     Lattice::Node &src_node = m_src_lattice->node(src_id);
@@ -113,6 +237,8 @@ Rescore::rescore(Lattice *src_lattice, TreeGram *tree_gram, bool quiet)
     for (int a = 0; a < (int)src_node.arcs.size(); a++) {
       Lattice::Arc &arc = src_node.arcs[a];
       int tgt_id = arc.target_node_id;
+      bool null_arc = (arc.label == m_null_label);
+      int word_id = null_arc ? -1 : word_index(arc.label);
 
       // Process all contexts of the source node
       for (int c = 0; c < (int)m_node_contexts[src_id].size(); c++) {
@@ -120,16 +246,31 @@ Rescore::rescore(Lattice *src_lattice, TreeGram *tree_gram, bool quiet)
 	// Compute the language model probability and cut the context
 	// to the maximum length needed by the model.
 	Context &src_context = m_node_contexts[src_id][c];
-	Context tgt_context = src_context;
 	float lm_log_prob = 0;
-	if (arc.label != m_null_label) {
-	  int word_id = tree_gram->word_index(arc.label);
-	  tgt_context.gram.push_back(word_id);
-	  lm_log_prob = tree_gram->log_prob(tgt_context.gram);
-
-	  while (((int)tgt_context.gram.size() > tree_gram->last_history_length())
-	          && (tgt_context.gram.size() > 0))
-	    tgt_context.gram.pop_front();
+	if (null_arc) {
+	  tgt_context.gram = src_context.gram;
+	  tgt_context.lm_node_id = src_context.lm_node_id;
+	}
+	else if (m_fsa_lm) {
+	  // After a sentence end, continue without context like the
+	  // n-gram model does after backing off from </s>.
+	  int lm_node_id = src_context.lm_node_id;
+	  if (lm_node_id == m_fsa_lm->final_node_id())
+	    lm_node_id = m_fsa_lm->empty_node_id();
+	  tgt_context.lm_node_id = m_fsa_lm->walk(lm_node_id, word_id, 
+						  &lm_log_prob);
+	}
+	else {
+	  m_query_gram.assign(src_context.gram.begin(), src_context.gram.end());
+	  m_query_gram.push_back(word_id);
+	  lm_log_prob = m_tree_gram->log_prob(m_query_gram, m_lm_state);
+
+	  int length = m_lm_state.last_history_length;
+	  if (m_max_context_length > 0 && length > m_max_context_length)
+	    length = m_max_context_length;
+	  length = std::max(0, std::min(length, (int)m_query_gram.size()));
+	  tgt_context.gram.assign(m_query_gram.end() - length,
+				  m_query_gram.end());
 	}
 
 	// Create the resulting lattice (final state has </s> context)
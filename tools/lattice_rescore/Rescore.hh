@@ -1,24 +1,48 @@
 #ifndef RESCORE_HH
 #define RESCORE_HH
 
+#include <unordered_map>
 #include "TreeGram.hh"
 #include "Lattice.hh"
 
+namespace fsalm { class LM; }
+
 /** A class for expanding and rescoring lattices. */
 class Rescore {
 public:
   /** Context structure for expanding lattices. */
   struct Context {
-    TreeGram::Gram gram; //!< Gram specifying the context
+    Context() : lm_node_id(-1), node_id(-1), hash(0) { }
+    std::vector<int> gram; //!< Gram specifying the context (n-gram model)
+    int lm_node_id; //!< Node of the FSA model specifying the context
     int node_id; //!< Node id in the rescored lattice corresponding to context
-    bool operator==(const Context &c) { return gram == c.gram; } //!< Compare
+    size_t hash; //!< Hash of the context, set by find_or_create_node()
+    bool operator==(const Context &c) 
+    { return hash == c.hash && lm_node_id == c.lm_node_id && 
+	gram == c.gram; } //!< Compare
   };
 
   /** Default constructor. */
   Rescore();
 
-  /** Expand and rescore the lattice with a language model. */
-  void rescore(Lattice *src_lattice, TreeGram *tree_gram, bool quiet=false);
+  /** Limit the number of words in the expanded contexts.  Contexts
+   * that differ only in the words beyond the limit are recombined, so
+   * the lattice grows as if the language model was of order \a
+   * length + 1.  Zero (the default) keeps all the words the model
+   * uses.  Applies only to the n-gram model. */
+  void set_max_context_length(int length) { m_max_context_length = length; }
+
+  /** Expand and rescore the lattice with a language model.  The
+   * model is only read, so several Rescore objects may use the same
+   * model in parallel threads. */
+  void rescore(Lattice *src_lattice, const TreeGram *tree_gram,
+	       bool quiet=false);
+
+  /** Expand and rescore the lattice with a language model in the FSA
+   * format.  Each context is a single node of the model, and the
+   * score of an arc is one LM::walk(). */
+  void rescore(Lattice *src_lattice, const fsalm::LM *fsa_lm,
+	       bool quiet=false);
 
   /** Get the rescored lattice. */
   Lattice &rescored_lattice() { return m_rescored_lattice; }
@@ -28,11 +52,30 @@ private:
   /** Sort nodes of the source lattice topologically. */
   void sort_nodes();
 
+  /** Expand and rescore the source lattice starting from the context
+   * of the initial node, using the model set by rescore(). */
+  void expand(Lattice *src_lattice, Context &initial_context, bool quiet);
+
+  /** Index of the word in the language model. */
+  int word_index(const std::string &word) const;
+
+  /** Hash of a context. */
+  static size_t context_hash(const Context &context);
+
+  /** Key of a context of a source node in \ref m_context_index. */
+  static size_t index_key(int node_id, size_t hash)
+  { return hash ^ ((size_t)node_id * 0x9e3779b97f4a7c15ULL); }
+
+  /** Add a context of a source node to \ref m_context_index. */
+  void index_context(int node_id, int index);
+
   /** Create a new node corresponding to the context for the rescored
       lattice if necessary, and return the corresponding node. */
   Lattice::Node &find_or_create_node(int node_id, Context &context);
 
-  TreeGram *m_tree_gram; //!< Language model used in rescoring
+  const TreeGram *m_tree_gram; //!< Language model used in rescoring
+  const fsalm::LM *m_fsa_lm; //!< FSA model used instead of \ref m_tree_gram
+  TreeGram::QueryState m_lm_state; //!< State of the language model queries
   Lattice *m_src_lattice; //!< The lattice to be rescored
   Lattice m_rescored_lattice; //!< The result lattice of the rescoring
   std::string m_sentence_start_label; //!< Sentence start label in LM
@@ -45,6 +88,15 @@ private:
 
   //!< A vector containing a context vector for each source lattice node.
   std::vector<std::vector<Context> > m_node_contexts;
+
+  //!< Source node id and index in \ref m_node_contexts of the
+  //!< contexts of the nodes with many contexts, by index_key().  The
+  //!< few contexts of the other nodes are faster to search directly.
+  std::unordered_multimap<size_t, std::pair<int, int> > m_context_index;
+
+  TreeGram::Gram m_query_gram; //!< The gram of the current LM query
+
+  int m_max_context_length; //!< Maximum context length, 0 for no limit
 };
 
 
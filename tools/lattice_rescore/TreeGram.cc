@@ -28,9 +28,7 @@ TreeGram::TreeGram()
     clmap(NULL),
 #endif
     m_type(BACKOFF),
-    m_order(0),
-    m_last_order(0),
-    m_last_history_length(0)
+    m_order(0)
 {
 }
 
@@ -118,7 +116,7 @@ TreeGram::check_order(const Gram &gram)
 
 // Note that 'last' is not included in the range.
 int
-TreeGram::binary_search(int word, int first, int last)
+TreeGram::binary_search(int word, int first, int last) const
 {
   int middle;
   int half;
@@ -157,7 +155,7 @@ TreeGram::binary_search(int word, int first, int last)
 
 // Returns unigram if node_index < 0
 int
-TreeGram::find_child(int word, int node_index)
+TreeGram::find_child(int word, int node_index) const
 {
   if (word < 0 || word >= (int)m_words.size()) {
     fprintf(stderr, "TreeGram::find_child(): "
@@ -187,8 +185,7 @@ TreeGram::iterator(const Gram &gram)
 {
   Iterator iterator;
 
-  fetch_gram(gram, 0);
-  iterator.m_index_stack = m_fetch_stack;
+  fetch_gram(gram, 0, iterator.m_index_stack);
   iterator.m_gram = this;
 
   return iterator;
@@ -447,22 +444,22 @@ TreeGram::flip_endian()
   }
 }
 
-// Fetch the node indices of the requested gram to m_fetch_stack as
-// far as found in the tree structure.
+// Fetch the node indices of the requested gram to the stack as far
+// as found in the tree structure.
 void
-TreeGram::fetch_gram(const Gram &gram, int first)
+TreeGram::fetch_gram(const Gram &gram, int first, std::vector<int> &stack) const
 {
   assert(first >= 0 && first < (int)gram.size());
 
   int prev = -1;
-  m_fetch_stack.clear();
+  stack.clear();
   
   int i = first;
-  while (m_fetch_stack.size() < gram.size() - first) {
+  while (stack.size() < gram.size() - first) {
     int node = find_child(gram[i], prev);
     if (node < 0)
       break;
-    m_fetch_stack.push_back(node);
+    stack.push_back(node);
     i++;
     prev = node;
   }
@@ -553,7 +550,7 @@ TreeGram::fetch_trigram_list(int w1, int w2, std::vector<int> &next_word_id,
 }
 
 float
-TreeGram::log_prob(const Gram &gram_in)
+TreeGram::log_prob(const Gram &gram_in, QueryState &state) const
 {
   assert(gram_in.size() > 0);
 
@@ -570,7 +567,7 @@ TreeGram::log_prob(const Gram &gram_in)
   const Gram &gram=gram_in;
 #endif
 
-  m_last_history_length = -1; // FIXME: computed only for backoff model
+  state.last_history_length = -1; // FIXME: computed only for backoff model
   if (m_type==BACKOFF) {
     float log_prob = 0.0;
   // Denote by (w(1) w(2) ... w(N)) the ngram that was requested.  The
@@ -582,23 +579,23 @@ TreeGram::log_prob(const Gram &gram_in)
     int n = 0;
     while (1) {
       assert(n < (int)gram.size());
-      fetch_gram(gram, n);
-      assert(m_fetch_stack.size() > 0);
+      fetch_gram(gram, n, state.fetch_stack);
+      assert(state.fetch_stack.size() > 0);
       
       // Full gram found?
-      if (m_fetch_stack.size() == gram.size() - n) {
-	log_prob += m_nodes[m_fetch_stack.back()].log_prob;
-	m_last_order = gram.size() - n;
-	if (m_last_history_length < 0)
-	  m_last_history_length = m_last_order;
+      if (state.fetch_stack.size() == gram.size() - n) {
+	log_prob += m_nodes[state.fetch_stack.back()].log_prob;
+	state.last_order = gram.size() - n;
+	if (state.last_history_length < 0)
+	  state.last_history_length = state.last_order;
 	break;
       }
       
       // Back-off found?
-      if (m_fetch_stack.size() == gram.size() - n - 1) {
-	log_prob += m_nodes[m_fetch_stack.back()].back_off;
-	if (m_last_history_length < 0)
-	  m_last_history_length = gram.size() - n - 1;
+      if (state.fetch_stack.size() == gram.size() - n - 1) {
+	log_prob += m_nodes[state.fetch_stack.back()].back_off;
+	if (state.last_history_length < 0)
+	  state.last_history_length = gram.size() - n - 1;
       }
       
       n++;
@@ -608,27 +605,27 @@ TreeGram::log_prob(const Gram &gram_in)
   if (m_type==INTERPOLATED) {
     float prob=0.0;
     float bo;
-    m_last_order=0;
+    state.last_order=0;
 
     const int looptill=std::min(gram.size(),(size_t) m_order);
     for (int n=1;n<=looptill;n++) {
-      fetch_gram(gram,gram.size()-n);
-      if ((int)m_fetch_stack.size() < n-1 || n>m_order) {
+      fetch_gram(gram,gram.size()-n,state.fetch_stack);
+      if ((int)state.fetch_stack.size() < n-1 || n>m_order) {
 	return(safelogprob(prob)); 
       }
       
-      if ((int)m_fetch_stack.size()==n-1) {
-	bo = pow(10,m_nodes[m_fetch_stack.back()].back_off);
+      if ((int)state.fetch_stack.size()==n-1) {
+	bo = pow(10,m_nodes[state.fetch_stack.back()].back_off);
 	prob*=bo;
 	continue;
       }
       
       if (n>1) {
-	bo = pow(10,m_nodes[m_fetch_stack[m_fetch_stack.size()-2]].back_off);
+	bo = pow(10,m_nodes[state.fetch_stack[state.fetch_stack.size()-2]].back_off);
 	prob=bo*prob;
       }
-      prob += pow(10,m_nodes[m_fetch_stack.back()].log_prob);
-      m_last_order++;
+      prob += pow(10,m_nodes[state.fetch_stack.back()].log_prob);
+      state.last_order++;
     }
     return(safelogprob(prob));
   }
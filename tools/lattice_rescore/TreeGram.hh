@@ -60,6 +60,18 @@ public:
 
   enum Type { BACKOFF=0, INTERPOLATED=1 };
 
+  /// State of a log_prob() query.
+  //
+  // The model itself is not modified by the queries, so several
+  // threads can share one model as long as each thread passes its own
+  // state to log_prob().
+  struct QueryState {
+    QueryState() : last_order(0), last_history_length(0) {}
+    std::vector<int> fetch_stack;	// indices of the gram requested
+    int last_order;			// order of the last hit
+    int last_history_length;		// see last_history_length()
+  };
+
   TreeGram();
   void set_type(Type type) { m_type = type; }
   Type get_type() { return(m_type); }
@@ -80,9 +92,10 @@ public:
   void fetch_trigram_list(int w1, int w2, std::vector<int> &next_word_id,
                           std::vector<float> &result_buffer);
   
-  float log_prob(const Gram &gram);
+  float log_prob(const Gram &gram) { return log_prob(gram, m_query); }
+  float log_prob(const Gram &gram, QueryState &state) const;
   int order() { return m_order; }
-  int last_order() { return m_last_order; }
+  int last_order() { return m_query.last_order; }
 
   // The history length used in the last log_prob() call, used by
   // Rescore class.  Actually, it is not exactly the history length,
@@ -93,11 +106,11 @@ public:
   // * (a b c d) asked and (a b c d) found: length = 4
   // * (a b c d) asked and backoff (a b c) found: length = 3
   // * (a b c d) asked, (a b c) not found, (b c d) found: length 3
-  int last_history_length() { return m_last_history_length; }
+  int last_history_length() { return m_query.last_history_length; }
   int gram_count(int order) { return m_order_count.at(order-1); }
 
   /* Don't use this function, unles you really need to*/
-  int find_child(int word, int node_index);
+  int find_child(int word, int node_index) const;
 
   // Returns an iterator for given gram.
   Iterator iterator(const Gram &gram);
@@ -107,22 +120,19 @@ public:
 #endif
 
 private:
-  int binary_search(int word, int first, int last);
+  int binary_search(int word, int first, int last) const;
   void print_gram(FILE *file, const Gram &gram);
   void find_path(const Gram &gram);
   void check_order(const Gram &gram);
   void flip_endian();
-  void fetch_gram(const Gram &gram, int first);
+  void fetch_gram(const Gram &gram, int first, std::vector<int> &stack) const;
 
   Type m_type;
   int m_order;
   std::vector<int> m_order_count;	// number of grams in each order
   std::vector<float> m_interpolation;	// interpolation weights
   std::vector<Node> m_nodes;		// storage for the nodes
-  std::vector<int> m_fetch_stack;	// indices of the gram requested
-  int m_last_order;			// order of the last hit
-  int m_last_history_length;		// length of the history used in
-					// hit or backoff
+  QueryState m_query;			// state of log_prob(gram) queries
 
   // For creating the model
   std::vector<int> m_insert_stack;	// indices of the last gram inserted
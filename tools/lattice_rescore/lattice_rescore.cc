@@ -1,6 +1,11 @@
 #include <errno.h>
 #include <sys/stat.h>
+#include <condition_variable>
+#include <mutex>
+#include <set>
+#include <thread>
 #include "TreeGram.hh"
+#include "fsalm/LM.hh"
 #include "Lattice.hh"
 #include "Rescore.hh"
 #include "conf.hh"
@@ -48,15 +53,123 @@ file_exists(std::string file)
   return true;
 }
 
+/** A lattice to rescore. */
+struct Job {
+  std::string input_file;
+  std::string output_file;
+};
+
+/** Rescores lattices in parallel threads.  Each thread has its own
+ * lattice and Rescore object, and the language model is shared.  The
+ * threads take the next job from the list when they are free, but
+ * the results are written, post-processors run and messages printed
+ * in the order of the list. */
+class ParallelRescore {
+public:
+  /** Rescore with \a tree_gram, or with \a fsa_lm if \a tree_gram is
+   * NULL. */
+  ParallelRescore(const std::vector<Job> &jobs, const TreeGram *tree_gram,
+		  const fsalm::LM *fsa_lm, bool quiet)
+    : m_jobs(jobs), m_tree_gram(tree_gram), m_fsa_lm(fsa_lm), m_quiet(quiet),
+      m_serial(true), m_next_job(0), m_next_output(0) { }
+
+  /** Process all jobs.  With one thread, the jobs are processed in
+   * the calling thread, and the progress is reported as before. */
+  void run(int num_threads)
+  {
+    m_serial = num_threads <= 1;
+    if (m_serial) {
+      worker();
+      return;
+    }
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; t++)
+      threads.push_back(std::thread(&ParallelRescore::worker, this));
+    for (int t = 0; t < num_threads; t++)
+      threads[t].join();
+  }
+
+private:
+  void worker()
+  {
+    Rescore rescore;
+    rescore.set_max_context_length(config["context-length"].get_int());
+    Lattice src_lattice;
+    while (1) {
+      int i;
+      {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	i = m_next_job++;
+      }
+      if (i >= (int)m_jobs.size())
+	break;
+      const Job &job = m_jobs[i];
+
+      if (!m_quiet && m_serial)
+	fprintf(stderr, "processing %s...", job.input_file.c_str());
+      src_lattice.read(io::Stream(job.input_file, "r").file);
+      if (m_tree_gram)
+	rescore.rescore(&src_lattice, m_tree_gram, m_quiet || !m_serial);
+      else
+	rescore.rescore(&src_lattice, m_fsa_lm, m_quiet || !m_serial);
+
+      // Wait for the previous jobs to be written
+      std::unique_lock<std::mutex> lock(m_mutex);
+      while (m_next_output != i)
+	m_output_turn.wait(lock);
+      if (!m_quiet && !m_serial)
+	fprintf(stderr, "processing %s...", job.input_file.c_str());
+      write_output(job, rescore);
+      m_next_output++;
+      m_output_turn.notify_all();
+    }
+  }
+
+  void write_output(const Job &job, Rescore &rescore)
+  {
+    if (!m_quiet)
+      fprintf(stderr, "writing %s...", job.output_file.c_str());
+    rescore.rescored_lattice().write(io::Stream(job.output_file, "w").file);
+    if (!m_quiet)
+      fprintf(stderr, "\n");
+
+    if (config["post-process"].specified) {
+      std::string cmd = config["post-process"].get_str() + 
+        " \"" + job.output_file + "\"";
+      if (!m_quiet)
+        fprintf(stderr, "running post-processor: %s\n", cmd.c_str());
+      int ret = system(cmd.c_str());
+      if ((ret < 0) && !m_quiet) {
+        fprintf(stderr, "WARNING: command failed\n");
+      }
+    }
+  }
+
+  const std::vector<Job> &m_jobs;
+  const TreeGram *m_tree_gram;
+  const fsalm::LM *m_fsa_lm;
+  bool m_quiet;
+  bool m_serial; //!< Jobs are processed in the main thread
+  std::mutex m_mutex; //!< Protects the job counters
+  std::condition_variable m_output_turn; //!< Signaled after each output
+  int m_next_job; //!< Index of the next job to rescore
+  int m_next_output; //!< Index of the next job to write
+};
+
 /** The good old main. */
 int
 main(int argc, char *argv[])
 {
   config("usage: lattice_rescore [OPTION...]\n")
     ('C', "config=FILE", "arg", "", "configuration file")
+    ('c', "context-length=INT", "arg", "0", 
+     "maximum number of words in the expanded contexts (0 = no limit)")
     ('f', "force", "", "", "force overwriting existing files")
+    ('F', "fsa-lm=FILE", "arg", "", 
+     "language model in the binary FSA format of fsalm-convert, used "
+     "instead of --lm")
     ('h', "help", "", "", "display help")
-    ('l', "lm=FILE", "arg must", "", "language model used in rescoring")
+    ('l', "lm=FILE", "arg", "", "language model used in rescoring")
     ('i', "in=FILE", "arg", "", "input lattice")
     ('I', "in-list=FILE", "arg", "", "input list of lattices")
     ('o', "out=FILE", "arg", "", "output lattice file")
@@ -64,6 +177,7 @@ main(int argc, char *argv[])
     ('p', "post-process=FILE", "arg", "", 
      "run a post-processor for each output file")
     ('q', "quiet", "", "", "suppress all output on standard error")
+    ('t', "threads=INT", "arg", "1", "number of lattices rescored in parallel")
     ;
   config.parse(argc, argv);
   if (config["help"].specified) {
@@ -83,9 +197,25 @@ main(int argc, char *argv[])
   // Read the language model
   if (!quiet)
     fprintf(stderr, "reading the language model...");
+  if (config["lm"].specified == config["fsa-lm"].specified) {
+    if (!quiet)
+      fprintf(stderr, "\nERROR: specify either --lm or --fsa-lm\n");
+    exit(1);
+  }
   TreeGram tree_gram;
+  fsalm::LM fsa_lm;
   if (config["lm"].specified)
     tree_gram.read(io::Stream(config["lm"].get_str(), "r").file);
+  else {
+    try {
+      fsa_lm.read(io::Stream(config["fsa-lm"].get_str(), "r").file);
+    }
+    catch (std::exception &e) {
+      if (!quiet)
+	fprintf(stderr, "\nERROR: %s\n", e.what());
+      exit(1);
+    }
+  }
   if (!quiet)
     fprintf(stderr, "\n");
 
@@ -111,9 +241,17 @@ main(int argc, char *argv[])
   if (config["out-dir"].specified)
     mkdir(config["out-dir"].get_c_str(), 0777);
 
-  // Rescore lattices
-  Rescore rescore;
-  Lattice src_lattice;
+  int num_threads = config["threads"].get_int();
+  if (num_threads < 1) {
+    if (!quiet)
+      fprintf(stderr, "ERROR: invalid number of threads %d\n", num_threads);
+    exit(1);
+  }
+
+  // Decide the output files.  An output file is skipped if it exists
+  // already or is written by an earlier lattice.
+  std::vector<Job> jobs;
+  std::set<std::string> written_files;
   for (int i = 0; i < (int)input_files.size(); i++) {
     std::string output_file;
     if (config["out"].specified)
@@ -121,32 +259,22 @@ main(int argc, char *argv[])
     else if (config["out-dir"].specified)
       output_file = 
         config["out-dir"].get_str() + "/" + strip_dir(input_files[i]);
-    if (file_exists(output_file) && !config["force"].specified) {
+    if ((written_files.count(output_file) > 0 || file_exists(output_file))
+	&& !config["force"].specified) {
       if (!quiet)
         fprintf(stderr, "skipped existing file %s\n", output_file.c_str());
       continue;
     }
+    written_files.insert(output_file);
 
-    if (!quiet)
-      fprintf(stderr, "processing %s...", input_files[i].c_str());
-    src_lattice.read(io::Stream(input_files[i], "r").file);
-    rescore.rescore(&src_lattice, &tree_gram, quiet);
-
-    if (!quiet)
-      fprintf(stderr, "writing %s...", output_file.c_str());
-    rescore.rescored_lattice().write(io::Stream(output_file, "w").file);
-    if (!quiet)
-      fprintf(stderr, "\n");
-
-    if (config["post-process"].specified) {
-      std::string cmd = config["post-process"].get_str() + 
-        " \"" + output_file + "\"";
-      if (!quiet)
-        fprintf(stderr, "running post-processor: %s\n", cmd.c_str());
-      int ret = system(cmd.c_str());
-      if ((ret < 0) && !quiet) {
-        fprintf(stderr, "WARNING: command failed\n");
-      }
-    }
+    Job job;
+    job.input_file = input_files[i];
+    job.output_file = output_file;
+    jobs.push_back(job);
   }
+
+  // Rescore lattices
+  ParallelRescore parallel_rescore(
+    jobs, config["lm"].specified ? &tree_gram : NULL, &fsa_lm, quiet);
+  parallel_rescore.run(num_threads);
 }
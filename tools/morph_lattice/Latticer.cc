@@ -1,57 +1,84 @@
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
-#include "str.hh"
 #include "Latticer.hh"
 
 Latticer::Latticer() : 
   morph_set(NULL), 
-  word_boundary_label("<w>") 
+  word_boundary_label("<w>"),
+  binary(false),
+  m_text_begin(0),
+  m_text_end(0),
+  m_output(NULL),
+  m_source_node(0),
+  m_word_boundary_id(-1)
 { 
 }
 
+bool
+Latticer::fill_text(FILE *input)
+{
+  // Move the unprocessed text to the beginning of the buffer
+  size_t length = m_text_end - m_text_begin;
+  memmove(&m_text[0], &m_text[m_text_begin], length);
+  m_text_begin = 0;
+  m_text_end = length;
+
+  size_t ret = fread(&m_text[m_text_end], 1, m_text.size() - m_text_end,
+		     input);
+  if (ret == 0 && ferror(input)) {
+    perror("ERROR: Latticer::create_lattice(): read failed");
+    exit(1);
+  }
+  m_text_end += ret;
+  return ret > 0;
+}
+
 void
 Latticer::create_lattice(FILE *input, FILE *output)
 {
-  text.reserve(morph_set->max_morph_length * 2);
+  // The buffer always holds at least the longest morph, when there is
+  // text left, so that all the morphs at a position can be found.
+  size_t lookahead = morph_set->max_morph_length + 1;
+  m_text.resize(lookahead + 65536);
+  m_text_begin = 0;
+  m_text_end = 0;
+  m_output = output;
+  m_source_node = 0;
+  m_word_boundary_id = morph_set->num_morphs();
 
   int src_node_pos = 1;
   int last_pos = 0;
   bool eof_reached = false;
   bool was_word_boundary = false;
 
-  fprintf(output, "0 1 %s\n", word_boundary_label.c_str());
+  write_header();
+  write_arc(0, 1, m_word_boundary_id);
 
   while (1) {
 
     // Ensure that we have enough text in the text buffer
-    if (!eof_reached && (int)text.length() <= morph_set->max_morph_length) {
-      bool ok = str::read_string(&text, morph_set->max_morph_length, 
-				 input, true);
-
-      // Error or end of file?
-      if (!ok) {
-	if (ferror(input)) {
-	  perror("ERROR: Latticer::create_lattice(): read failed");
-	  exit(1);
-	}
+    if (!eof_reached && m_text_end - m_text_begin <= lookahead) {
+      if (!fill_text(input)) {
 	eof_reached = true;
-	text.append(" ");
+	m_text[m_text_end++] = ' ';
       }
     }
     
     // Everything processed
-    if (text.length() == 0) {
+    if (m_text_begin == m_text_end) {
       assert(eof_reached);
       break;
     }
 
+    const char *text = &m_text[m_text_begin];
+    size_t text_length = m_text_end - m_text_begin;
+
     // Insert a single word boundary on whitespace
     if (strchr(" \n\r\t", text[0]) != NULL) {
-      text.erase(text.begin());
+      m_text_begin++;
       if (!was_word_boundary) {
-	fprintf(output, "%d %d %s\n", src_node_pos, src_node_pos + 1,
-		word_boundary_label.c_str());
+	write_arc(src_node_pos, src_node_pos + 1, m_word_boundary_id);
 	src_node_pos++;
 	if (src_node_pos > last_pos)
 	  last_pos = src_node_pos;
@@ -65,16 +92,15 @@ Latticer::create_lattice(FILE *input, FILE *output)
     // Output all morphs in the morph set that match the text
     MorphSet::Node *src_node = &morph_set->root_node;
     size_t pos = 0;
-    while (src_node != NULL && pos < text.length()) {
+    while (src_node != NULL && pos < text_length) {
       MorphSet::Arc *arc = morph_set->find_arc(text[pos], src_node);
       if (arc == NULL)
 	break;
 
       // Output a possible morph 
-      if (arc->morph.length() > 0) {
+      if (arc->morph_id >= 0) {
 	int tgt_node_pos = src_node_pos + pos + 1;
-	fprintf(output, "%d %d %s\n", src_node_pos, tgt_node_pos,
-		arc->morph.c_str());
+	write_arc(src_node_pos, tgt_node_pos, arc->morph_id);
 	if (tgt_node_pos > last_pos)
 	  last_pos = tgt_node_pos;
       }
@@ -85,7 +111,78 @@ Latticer::create_lattice(FILE *input, FILE *output)
 
     // Move one character forward
     src_node_pos++;
-    text.erase(text.begin());
+    m_text_begin++;
+  }
+  write_end(last_pos);
+}
+
+void
+Latticer::write_header()
+{
+  if (!binary)
+    return;
+  fwrite("\x89MORLAT\n", 1, 8, m_output);
+  m_out_buffer.clear();
+  put_varint(m_word_boundary_id + 1);
+  for (int i = 0; i <= m_word_boundary_id; i++) {
+    const std::string &symbol = i < m_word_boundary_id ? 
+      morph_set->morphs[i] : word_boundary_label;
+    put_varint(symbol.length());
+    m_out_buffer.insert(m_out_buffer.end(), symbol.begin(), symbol.end());
+  }
+}
+
+void
+Latticer::write_arc(int source_node, int target_node, int symbol)
+{
+  if (!binary) {
+    const std::string &label = symbol < m_word_boundary_id ?
+      morph_set->morphs[symbol] : word_boundary_label;
+    fprintf(m_output, "%d %d %s\n", source_node, target_node, label.c_str());
+    return;
+  }
+
+  assert(source_node >= m_source_node && target_node > source_node);
+  put_varint(1);
+  put_varint(source_node - m_source_node);
+  put_varint(target_node - source_node);
+  put_varint(symbol);
+  m_source_node = source_node;
+  if (m_out_buffer.size() >= 65536)
+    flush();
+}
+
+void
+Latticer::write_end(int final_node)
+{
+  if (!binary) {
+    fprintf(m_output, "%d\n", final_node);
+    return;
+  }
+  put_varint(0);
+  put_varint(final_node);
+  flush();
+}
+
+void
+Latticer::flush()
+{
+  if (!m_out_buffer.empty() &&
+      fwrite(&m_out_buffer[0], 1, m_out_buffer.size(), m_output) != 
+      m_out_buffer.size())
+  {
+    perror("ERROR: Latticer::create_lattice(): write failed");
+    exit(1);
+  }
+  m_out_buffer.clear();
+}
+
+void
+Latticer::put_varint(unsigned int value)
+{
+  while (value >= 0x80) {
+    m_out_buffer.push_back((value & 0x7f) | 0x80);
+    value >>= 7;
   }
-  fprintf(output, "%d\n", last_pos);
+  m_out_buffer.push_back(value);
 }
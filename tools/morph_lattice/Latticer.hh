@@ -2,11 +2,33 @@
 #define LATTICER_HH
 
 #include <string>
+#include <vector>
 #include <stdio.h>
 #include "MorphSet.hh"
 
 /** A class for segmenting a text corpus into a morph lattice that
- * contains all possible morph paths through the text. */ 
+ * contains all possible morph paths through the text. 
+ *
+ * The lattice is written while the text is read, one arc at a time,
+ * so the memory used does not depend on the size of the corpus.  The
+ * text format has a line "SOURCE TARGET MORPH" for each arc and the
+ * final node on the last line.
+ *
+ * The binary format starts with the 8 bytes "\x89MORLAT\n" and a
+ * symbol table: varint number of symbols, and for each symbol varint
+ * length and the characters.  The symbols are the morphs of the morph
+ * set in their order, followed by the word boundary label.  Then
+ * follows a sequence of records, each starting with a varint type:
+ *
+ * - 1 (arc): varint difference of the source node to the source node
+ *   of the previous arc (the first one to 0), varint difference of the
+ *   target node to the source node, and varint symbol index.  The
+ *   source nodes do not decrease.
+ * - 0 (end): varint final node.  Ends the lattice.
+ *
+ * Varints are unsigned integers in groups of 7 bits, least significant
+ * group first, with the high bit set in all but the last byte.
+ */ 
 class Latticer {
 public:
   /** Default constructor. */
@@ -19,7 +41,27 @@ public:
   FILE *input; //!< The file from which the text corpus is read
 
   std::string word_boundary_label; //!< Label for word boundary symbol
-  std::string text; //!< A buffer containing part of the text
+  bool binary; //!< Write the lattice in the binary format
+
+private:
+  /** Read more text to the buffer, keeping the unprocessed text.
+   * \return false if the end of file was reached */
+  bool fill_text(FILE *input);
+
+  void write_header();
+  void write_arc(int source_node, int target_node, int symbol);
+  void write_end(int final_node);
+  void flush();
+  void put_varint(unsigned int value);
+
+  std::vector<char> m_text; //!< A buffer containing part of the text
+  size_t m_text_begin; //!< The first unprocessed character in the buffer
+  size_t m_text_end; //!< The end of the text in the buffer
+
+  FILE *m_output; //!< The file to which the lattice is written
+  std::vector<unsigned char> m_out_buffer; //!< Binary output not yet written
+  int m_source_node; //!< The source node of the previous binary arc
+  int m_word_boundary_id; //!< Symbol index of the word boundary
 };
 
 #endif /* LATTICER_HH */
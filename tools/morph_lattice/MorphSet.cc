@@ -3,10 +3,14 @@
 #include "MorphSet.hh"
 #include "str.hh"
 
-MorphSet::MorphSet() : max_morph_length(0) { }
+MorphSet::MorphSet() : max_morph_length(0)
+{
+  for (int i = 0; i < 256; i++)
+    m_root_arcs[i] = NULL;
+}
 
 MorphSet::Node*
-MorphSet::insert(char letter, const std::string &morph, Node *node)
+MorphSet::insert(char letter, int morph_id, Node *node)
 {
   // Find a possible existing arc with the letter
   Arc *arc = node->first_arc;
@@ -18,40 +22,32 @@ MorphSet::insert(char letter, const std::string &morph, Node *node)
 
   // No existing arc: create a new arc
   if (arc == NULL) {
-    node->first_arc = new Arc(letter, morph, new Node(NULL), node->first_arc);
-    arc = node->first_arc;
+    m_nodes.push_back(Node(NULL));
+    m_arcs.push_back(Arc(letter, morph_id, &m_nodes.back(), node->first_arc));
+    arc = &m_arcs.back();
+    node->first_arc = arc;
+    if (node == &root_node)
+      m_root_arcs[(unsigned char)letter] = arc;
   }
 
   // Update the existing arc if morph was set 
-  else if (morph.length() > 0) {
-    if (arc->morph.length() > 0) {
+  else if (morph_id >= 0) {
+    if (arc->morph_id >= 0) {
       fprintf(stderr, 
 	      "ERROR: MorphSet::insert(): trying to redefine morph %s\n", 
-	      morph.c_str());
+	      morphs.at(morph_id).c_str());
       exit(1);
     }
-    arc->morph = morph;
+    arc->morph_id = morph_id;
   }
 
   // Maintain the length of the longest morph
-  if ((int)morph.length() > max_morph_length)
-    max_morph_length = morph.length();
+  if (morph_id >= 0 && (int)morphs.at(morph_id).length() > max_morph_length)
+    max_morph_length = morphs[morph_id].length();
 
   return arc->target_node;
 }
 
-MorphSet::Arc*
-MorphSet::find_arc(char letter, const Node *node)
-{
-  Arc *arc = node->first_arc;
-  while (arc != NULL) {
-    if (arc->letter == letter)
-      break;
-    arc = arc->sibling_arc;
-  }
-  return arc;
-}
-
 void
 MorphSet::read(FILE *file)
 {
@@ -64,9 +60,11 @@ MorphSet::read(FILE *file)
       continue;
 
     // Create arcs
+    int morph_id = morphs.size();
+    morphs.push_back(line);
     Node *node = &root_node;
     for (int i = 0; i < (int)line.length(); i++)
-      node = insert(line[i], i < (int)line.length() - 1 ? "" : line, node);
+      node = insert(line[i], i < (int)line.length() - 1 ? -1 : morph_id, node);
   }
 }
 
@@ -95,9 +93,9 @@ MorphSet::write(FILE *file)
       // Label of the arc
       label = arc->letter;
       color = "black";
-      if (arc->morph.length() > 0) {
+      if (arc->morph_id >= 0) {
 	label.append("\\n");
-	label.append(arc->morph);
+	label.append(morphs[arc->morph_id]);
 	color = "blue";
       }
 
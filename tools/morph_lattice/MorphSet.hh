@@ -1,11 +1,15 @@
 #ifndef MORPHSET_HH
 #define MORPHSET_HH
 
+#include <deque>
 #include <string>
+#include <vector>
 
 /** A structure containing a set of morphs in a letter-tree format.
  * Input letters and output morphs are stored in arcs.  Nodes are just
- * placeholders for arcs. */
+ * placeholders for arcs.  The morphs are numbered in the order they
+ * are read, and the arcs refer to them by the numbers.  The nodes and
+ * arcs are allocated from arenas owned by the set. */
 class MorphSet {
 public:
 
@@ -14,12 +18,12 @@ public:
   /** Arc of a morph tree. */
   class Arc {
   public:
-    Arc(char letter, std::string morph, Node *target_node, Arc *sibling_arc)
-      : letter(letter), morph(morph), target_node(target_node), 
+    Arc(char letter, int morph_id, Node *target_node, Arc *sibling_arc)
+      : letter(letter), morph_id(morph_id), target_node(target_node), 
 	sibling_arc(sibling_arc) { }
 
     char letter; //!< Letter of the morph
-    std::string morph; //!< Non-zero if complete morph
+    int morph_id; //!< Index of a complete morph, or -1
     Node *target_node; //!< Target node
     Arc *sibling_arc; //!< Pointer to another arc from the source node.
   };
@@ -37,18 +41,29 @@ public:
   
   /** Insert a letter to a node (or follow an existing arc). 
    * \param letter = a letter to insert to the node
-   * \param morph = a possible morph corresponding to this node (can be empty)
+   * \param morph_id = index of a morph ending at this letter, or -1
    * \param node = a node to which the letter is inserted
    * \return pointer to the created or existing node
    */
-  Node *insert(char letter, const std::string &morph, Node *node);
+  Node *insert(char letter, int morph_id, Node *node);
 
   /** Find an arc with the given letter from the given node. 
    * \param letter = the letter to search
    * \param node = the source node 
    * \return the arc containing the letter or NULL if no such arc exists
    */
-  Arc *find_arc(char letter, const Node *node);
+  Arc *find_arc(char letter, const Node *node)
+  {
+    if (node == &root_node)
+      return m_root_arcs[(unsigned char)letter];
+    Arc *arc = node->first_arc;
+    while (arc != NULL) {
+      if (arc->letter == letter)
+	break;
+      arc = arc->sibling_arc;
+    }
+    return arc;
+  }
 
   /** Read a morph set (one morph per line) */
   void read(FILE *file);
@@ -56,8 +71,20 @@ public:
   /** Print the contents of the tree. */
   void write(FILE *file);
 
+  /** The number of morphs in the set. */
+  int num_morphs() const { return morphs.size(); }
+
   Node root_node; //!< The root of the morph tree
   int max_morph_length; //!< The length of the longest morph in the set
+  std::vector<std::string> morphs; //!< The morphs indexed by their numbers
+
+private:
+  MorphSet(const MorphSet&);
+  MorphSet &operator=(const MorphSet&);
+
+  std::deque<Node> m_nodes; //!< Arena of the nodes below the root
+  std::deque<Arc> m_arcs; //!< Arena of the arcs
+  Arc *m_root_arcs[256]; //!< The arcs of the root node by letter
 };
 
 #endif /* MORPHSET_HH */
@@ -10,6 +10,7 @@ main(int argc, char *argv[])
   conf::Config config;
   config("usage: morph-lattice MORPHSET [INPUT [OUTPUT]]\n")
     ('h', "help", "", "", "display help")
+    ('b', "binary", "", "", "write the lattice in the binary format")
     ('v', "verbosity=INT", "arg", "0", "verbosity level (default 0)")
     ('C', "config=FILE", "arg", "", "configuration file");
   config.parse(argc, argv);
@@ -44,6 +45,7 @@ main(int argc, char *argv[])
 
     Latticer latticer;
     latticer.morph_set = &morph_set;
+    latticer.binary = config["binary"].specified;
     io::Stream input_stream(input, "r");
     io::Stream output_stream(output, "w");
     latticer.create_lattice(input_stream.file, output_stream.file);